@@ -552,6 +552,10 @@ class apsw_build_ext(beparent):
 
         if self.enable_all_extensions:
             exts=["fts4", "fts3", "fts3_parenthesis", "rtree", "stat4", "json1", "fts5", "rbu"]
+            # the session extension has to be compiled into SQLite so
+            # a system library most likely doesn't have it
+            if findamalgamation():
+                exts.append("session")
             if find_in_path("icu-config"):
                 exts.append("icu")
             if not self.enable:
@@ -624,6 +628,9 @@ class apsw_build_ext(beparent):
                 ext.define_macros.append( ("SQLITE_ENABLE_"+e.upper(), 1) )
                 if e.upper()=="ICU":
                     addicuinclib=True
+                if e.upper()=="SESSION":
+                    # the session extension is built on the preupdate hook
+                    ext.define_macros.append( ("SQLITE_ENABLE_PREUPDATE_HOOK", 1) )
                 os.putenv("APSW_TEST_"+e.upper(), "1")
                 # See issue #55 where I had left off the 3 in fts3.  This code
                 # tries to catch misspelling the name of an extension.
@@ -635,7 +642,7 @@ class apsw_build_ext(beparent):
                        "memsys" not in e.lower() and \
                        e.lower() not in ("fts4", "fts3", "rtree", "icu", "iotrace",
                                          "stat2", "stat3", "stat4", "dbstat_vtab",
-                                         "fts5", "json1", "rbu"):
+                                         "fts5", "json1", "rbu", "session"):
                     write("Unknown enable "+e, sys.stderr)
                     raise ValueError("Bad enable "+e)
 
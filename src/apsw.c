@@ -66,6 +66,11 @@ API Reference
 /* system headers */
 #include <assert.h>
 #include <stdarg.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 /* Get the version number */
 #include "apswversion.h"
@@ -137,6 +142,9 @@ static PyObject *apswmodule;
 /* The statement cache */
 #include "statementcache.c"
 
+/* query deadlines and cancellation */
+#include "cancel.c"
+
 /* connections */
 #include "connection.c"
 
@@ -146,9 +154,38 @@ static PyObject *apswmodule;
 /* Zeroblob and blob */
 #include "blob.c"
 
+/* columnar results */
+#include "columnbuffer.c"
+
+/* prepared statements */
+#include "prepared.c"
+
+/* connection pool */
+#include "pool.c"
+
+/* background wal checkpointing */
+#if PY_VERSION_HEX >= 0x03020000
+#include "checkpointer.c"
+#endif
+
 /* cursors */
 #include "cursor.c"
 
+/* asyncio integration */
+#if PY_VERSION_HEX >= 0x03050000
+#include "async.c"
+#endif
+
+/* group commit */
+#if PY_VERSION_HEX >= 0x03020000
+#include "groupcommit.c"
+#endif
+
+/* session extension */
+#ifdef SQLITE_ENABLE_SESSION
+#include "session.c"
+#endif
+
 /* virtual tables */
 #include "vtable.c"
 
@@ -478,6 +515,37 @@ softheaplimit(APSW_ARGUNUSED PyObject *self, PyObject *args)
   return PyLong_FromLongLong(oldlimit);
 }
 
+/** .. method:: statementcachelimit(bytes) -> oldlimit
+
+  Limits the memory used by the compiled statements in the
+  :ref:`statement cache <statementcache>` of all connections combined
+  and returns the previous setting.  Use zero (the default) for no
+  limit.  When a connection adds a statement to its cache and the
+  total is over the limit, it evicts from its own cache until the
+  total is under the limit again.  This lets a process with many
+  connections bound how much memory their caches use.
+
+  .. seealso::
+
+    * :meth:`Connection.cache_stats`
+*/
+static PyObject*
+statementcachelimit(APSW_ARGUNUSED PyObject *self, PyObject *args)
+{
+  long long limit, oldlimit;
+
+  if(!PyArg_ParseTuple(args, "L:statementcachelimit(bytes)", &limit))
+    return NULL;
+
+  if(limit<0)
+    return PyErr_Format(PyExc_ValueError, "The limit must be zero or more");
+
+  oldlimit=sc_memorylimit;
+  sc_memorylimit=limit;
+
+  return PyLong_FromLongLong(oldlimit);
+}
+
 /** .. method:: randomness(bytes)  -> data
 
   Gets random data from SQLite's random number generator.
@@ -1166,6 +1234,8 @@ static PyMethodDef module_methods[] = {
    "Gets various SQLite counters"},
   {"softheaplimit", (PyCFunction)softheaplimit, METH_VARARGS,
    "Sets soft limit on SQLite memory usage"},
+  {"statementcachelimit", (PyCFunction)statementcachelimit, METH_VARARGS,
+   "Sets limit on memory used by all statement caches"},
   {"releasememory", (PyCFunction)releasememory, METH_VARARGS,
    "Attempts to free specified amount of memory"},
   {"randomness", (PyCFunction)randomness, METH_VARARGS,
@@ -1174,6 +1244,12 @@ static PyMethodDef module_methods[] = {
    "Returns exception instance corresponding to supplied sqlite error code"},
   {"complete", (PyCFunction)apswcomplete, METH_VARARGS,
    "Tests if a complete SQLite statement has been supplied (ie ends with ;)"},
+#ifdef SQLITE_ENABLE_SESSION
+  {"changeset_invert", (PyCFunction)changeset_invert, METH_O,
+   "Returns a changeset that undoes a changeset"},
+  {"changeset_concat", (PyCFunction)changeset_concat, METH_VARARGS,
+   "Combines two changesets into one"},
+#endif
 #if defined(APSW_TESTFIXTURES) && defined(APSW_USE_SQLITE_AMALGAMATION)
   {"test_reset_rng", (PyCFunction)apsw_test_reset_rng, METH_NOARGS,
    "Resets random number generator so we can test vfs xRandomness"},
@@ -1238,8 +1314,26 @@ PyInit_apsw(void)
         || PyType_Ready(&APSWVFSFileType) <0
 	|| PyType_Ready(&APSWURIFilenameType) <0
         || PyType_Ready(&APSWStatementType) <0
+        || PyType_Ready(&APSWPreparedType) <0
+        || PyType_Ready(&ConnectionPoolType) <0
         || PyType_Ready(&APSWBufferType) <0
         || PyType_Ready(&FunctionCBInfoType) <0
+        || PyType_Ready(&CancellationTokenType) <0
+#if PY_VERSION_HEX >= 0x02060000
+        || PyType_Ready(&ColumnBufferType) <0
+#endif
+#if PY_VERSION_HEX >= 0x03050000
+        || PyType_Ready(&AsyncConnectionType) <0
+        || PyType_Ready(&AsyncCursorType) <0
+        || PyType_Ready(&AsyncValueType) <0
+#endif
+#if PY_VERSION_HEX >= 0x03020000
+        || PyType_Ready(&GroupCommitType) <0
+        || PyType_Ready(&CheckpointerType) <0
+#endif
+#ifdef SQLITE_ENABLE_SESSION
+        || PyType_Ready(&APSWSessionType) <0
+#endif
 #ifdef EXPERIMENTAL
         || PyType_Ready(&APSWBackupType) <0
 #endif
@@ -1265,7 +1359,26 @@ PyInit_apsw(void)
     Py_INCREF(&ConnectionType);
     PyModule_AddObject(m, "Connection", (PyObject *)&ConnectionType);
 
-    /* we don't add cursor, blob or backup to the module since users shouldn't be able to instantiate them directly */
+    Py_INCREF(&ConnectionPoolType);
+    PyModule_AddObject(m, "ConnectionPool", (PyObject *)&ConnectionPoolType);
+
+    Py_INCREF(&CancellationTokenType);
+    PyModule_AddObject(m, "CancellationToken", (PyObject *)&CancellationTokenType);
+
+#if PY_VERSION_HEX >= 0x03050000
+    Py_INCREF(&AsyncConnectionType);
+    PyModule_AddObject(m, "AsyncConnection", (PyObject *)&AsyncConnectionType);
+#endif
+
+#if PY_VERSION_HEX >= 0x03020000
+    Py_INCREF(&GroupCommitType);
+    PyModule_AddObject(m, "GroupCommit", (PyObject *)&GroupCommitType);
+
+    Py_INCREF(&CheckpointerType);
+    PyModule_AddObject(m, "Checkpointer", (PyObject *)&CheckpointerType);
+#endif
+
+    /* we don't add cursor, blob, backup, prepared statement or session to the module since users shouldn't be able to instantiate them directly */
 
     Py_INCREF(&ZeroBlobBindType);
     PyModule_AddObject(m, "zeroblob", (PyObject *)&ZeroBlobBindType);
@@ -1744,6 +1857,22 @@ modules etc. For example::
       ADDINT(SQLITE_SHM_UNLOCK),
       END,
 
+#ifdef SQLITE_ENABLE_SESSION
+      DICT("mapping_changeset_conflict"),
+      ADDINT(SQLITE_CHANGESET_DATA),
+      ADDINT(SQLITE_CHANGESET_NOTFOUND),
+      ADDINT(SQLITE_CHANGESET_CONFLICT),
+      ADDINT(SQLITE_CHANGESET_CONSTRAINT),
+      ADDINT(SQLITE_CHANGESET_FOREIGN_KEY),
+      END,
+
+      DICT("mapping_changeset_result"),
+      ADDINT(SQLITE_CHANGESET_OMIT),
+      ADDINT(SQLITE_CHANGESET_REPLACE),
+      ADDINT(SQLITE_CHANGESET_ABORT),
+      END,
+#endif
+
       DICT("mapping_virtual_table_scan_flags"),
       ADDINT(SQLITE_INDEX_SCAN_UNIQUE),
       END
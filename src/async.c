@@ -0,0 +1,1026 @@
+/*
+  Asyncio integration code
+
+  See the accompanying LICENSE file.
+*/
+
+/**
+
+.. _async:
+
+Asyncio
+*******
+
+An `asyncio <https://docs.python.org/3/library/asyncio.html>`__
+program can't call SQLite directly since every query would block the
+event loop.  Pushing each call through :meth:`run_in_executor
+<asyncio.AbstractEventLoop.run_in_executor>` works but costs a thread
+handoff for every row when iterating over results.
+
+:class:`AsyncConnection` wraps a :class:`Connection` with a dedicated
+worker thread started in C.  :class:`AsyncCursor` methods queue the
+work for that thread and return awaitables.  All use of the
+connection then happens on the worker thread, so the usual
+:ref:`multi-threading <executionmodel>` rules are met.  When iterating, rows
+are fetched :attr:`AsyncCursor.batchsize` at a time using
+:meth:`Cursor.fetchmany`, and only the first row of each batch needs a
+wakeup of the event loop::
+
+  acon=apsw.AsyncConnection(apsw.Connection("database.db"))
+
+  async def handler(request):
+      cursor=acon.cursor()
+      await cursor.execute("select * from items where owner=?", (request.user,))
+      async for row in cursor:
+          ...
+      await acon.run(acon.connection.changes)
+
+Once a connection has been wrapped, only use it through the
+:class:`AsyncConnection` methods and :meth:`AsyncConnection.run`.
+Otherwise you will get a :exc:`ThreadingViolationError` when both the
+event loop and the worker use the connection at the same time.
+
+Asyncio integration is only available for Python 3.5 onwards.
+
+*/
+
+/** .. class:: AsyncConnection(connection, loop=None)
+
+  Starts a worker thread that runs all the work for *connection*.
+  Results are delivered to *loop*, which defaults to
+  :func:`asyncio.get_event_loop`.  The worker thread keeps running
+  until :meth:`close` is called.
+
+  The wrapped :class:`Connection` isn't closed by this object so you
+  can close it when finished, for example with
+  ``await acon.run(acon.connection.close)``.
+*/
+
+/** .. class:: AsyncCursor
+
+  Returned by :meth:`AsyncConnection.cursor`.  The methods return
+  awaitables whose results are the same as the corresponding
+  :class:`Cursor` method.  The underlying :class:`Cursor` is created
+  on the worker thread the first time it is needed.
+*/
+
+/* job operations for the worker thread */
+enum { ASYNC_CALL, ASYNC_EXECUTE, ASYNC_EXECUTEMANY, ASYNC_FETCHMANY,
+       ASYNC_FETCHALL, ASYNC_BATCH, ASYNC_CLOSE, ASYNC_DROP };
+
+typedef struct AsyncConnection {
+  PyObject_HEAD
+  Connection *connection;
+  PyObject *loop;                 /* event loop results are delivered to */
+  PyObject *deliver;              /* callable run in the event loop with results */
+  PyObject *queue;                /* list of jobs for the worker */
+  PyThread_type_lock wakeup;      /* held except when the worker is signalled */
+  PyThread_type_lock done;        /* held while the worker thread runs */
+  long thread;                    /* worker thread ident */
+  int running;                    /* worker thread has been started and not exited */
+  int waiting, signalled;
+  int closed;
+  PyObject *weakreflist;          /* weak reference tracking */
+} AsyncConnection;
+
+typedef struct AsyncCursor {
+  PyObject_HEAD
+  AsyncConnection *aconnection;
+  APSWCursor *cursor;             /* NULL until the worker makes it */
+  PyObject *rows;                 /* rows already fetched for iteration */
+  Py_ssize_t rowspos;             /* next of rows to return */
+  int exhausted;                  /* no more rows until the next execute */
+  unsigned generation;            /* incremented on each execute so stale batches are ignored */
+  Py_ssize_t batchsize;
+  PyObject *weakreflist;          /* weak reference tracking */
+} AsyncCursor;
+
+/* an already available result */
+typedef struct AsyncValue {
+  PyObject_HEAD
+  PyObject *value;
+} AsyncValue;
+
+static PyTypeObject AsyncConnectionType;
+static PyTypeObject AsyncCursorType;
+static PyTypeObject AsyncValueType;
+
+#define CHECK_ASYNC_CLOSED(e)                                           \
+  do { if(self->closed)                                                 \
+      { PyErr_Format(ExcConnectionClosed, "The AsyncConnection has been closed"); return e; } \
+  } while(0)
+
+static PyObject *
+AsyncValue_new(PyObject *value)
+{
+  AsyncValue *av=PyObject_New(AsyncValue, &AsyncValueType);
+  if(av)
+    {
+      Py_INCREF(value);
+      av->value=value;
+    }
+  return (PyObject*)av;
+}
+
+static void
+AsyncValue_dealloc(AsyncValue *self)
+{
+  Py_CLEAR(self->value);
+  PyObject_Del(self);
+}
+
+static PyObject *
+AsyncValue_await(AsyncValue *self)
+{
+  Py_INCREF(self);
+  return (PyObject*)self;
+}
+
+/* finishes the await by raising StopIteration with the value */
+static PyObject *
+AsyncValue_next(AsyncValue *self)
+{
+  PyObject *exc;
+
+  if(!self->value)
+    return NULL;
+
+  /* tuples would be taken as the exception arguments so always make
+     an instance */
+  exc=PyObject_CallFunctionObjArgs(PyExc_StopIteration, self->value, NULL);
+  Py_CLEAR(self->value);
+  if(exc)
+    {
+      PyErr_SetObject(PyExc_StopIteration, exc);
+      Py_DECREF(exc);
+    }
+  return NULL;
+}
+
+/* Called in the event loop with the result of a job.  Arguments are
+   the future, if it succeeded, the result or exception, and for
+   ASYNC_BATCH the AsyncCursor, generation and if it is exhausted. */
+static PyObject *
+AsyncConnection_deliver(APSW_ARGUNUSED PyObject *self, PyObject *args)
+{
+  PyObject *future, *value, *cursor, *res=NULL, *done;
+  int ok, exhausted;
+  unsigned generation;
+
+  if(!PyArg_ParseTuple(args, "OiOOIi", &future, &ok, &value, &cursor, &generation, &exhausted))
+    return NULL;
+
+  if(cursor!=Py_None && ok)
+    {
+      AsyncCursor *acur=(AsyncCursor*)cursor;
+      assert(Py_TYPE(cursor)==&AsyncCursorType);
+      if(acur->generation==generation)
+        {
+          if(acur->rows && acur->rowspos<PyList_GET_SIZE(acur->rows))
+            {
+              if(PyList_SetSlice(value, 0, 0, acur->rows) || PyList_SetSlice(value, 0, acur->rowspos, NULL))
+                return NULL;
+            }
+          Py_INCREF(value);
+          Py_XDECREF(acur->rows);
+          acur->rows=value;
+          acur->rowspos=0;
+          acur->exhausted=exhausted;
+        }
+    }
+
+  /* cancelled futures are done */
+  done=PyObject_CallMethod(future, "done", NULL);
+  if(!done)
+    return NULL;
+  ok=ok?1:-1;
+  if(PyObject_IsTrue(done))
+    ok=0;
+  Py_DECREF(done);
+  if(!ok)
+    Py_RETURN_NONE;
+
+  if(ok<0)
+    res=PyObject_CallMethod(future, "set_exception", "(O)", value);
+  else if(cursor==Py_None)
+    res=PyObject_CallMethod(future, "set_result", "(O)", value);
+  else
+    {
+      AsyncCursor *acur=(AsyncCursor*)cursor;
+      if(acur->rows && acur->rowspos<PyList_GET_SIZE(acur->rows))
+        res=PyObject_CallMethod(future, "set_result", "(O)", PyList_GET_ITEM(acur->rows, acur->rowspos++));
+      else
+        {
+          PyObject *exc=PyObject_CallObject(PyExc_StopAsyncIteration, NULL);
+          if(exc)
+            {
+              res=PyObject_CallMethod(future, "set_exception", "(O)", exc);
+              Py_DECREF(exc);
+            }
+        }
+    }
+  return res;
+}
+
+static PyMethodDef asyncdeliver_def =
+  {"deliver", (PyCFunction)AsyncConnection_deliver, METH_VARARGS, "Delivers a result to a future"};
+
+/* Does the job for an AsyncCursor, returning the result */
+static PyObject *
+AsyncCursor_dojob(AsyncCursor *self, int op, PyObject *args, PyObject *prefix, int *exhausted)
+{
+  PyObject *res;
+
+  if(!self->cursor)
+    {
+      self->cursor=(APSWCursor*)Connection_cursor(self->aconnection->connection);
+      if(!self->cursor)
+        return NULL;
+    }
+
+  switch(op)
+    {
+    case ASYNC_EXECUTE:
+    case ASYNC_EXECUTEMANY:
+      res=(op==ASYNC_EXECUTE)?APSWCursor_execute(self->cursor, args, NULL):APSWCursor_executemany(self->cursor, args, NULL);
+      if(!res)
+        return NULL;
+      Py_DECREF(res);
+      Py_INCREF(self);
+      return (PyObject*)self;
+
+    case ASYNC_FETCHMANY:
+    case ASYNC_FETCHALL:
+    case ASYNC_BATCH:
+      res=(op==ASYNC_FETCHALL)?APSWCursor_fetchall(self->cursor):APSWCursor_fetchmany(self->cursor, args);
+      if(!res)
+        return NULL;
+      if(prefix!=Py_None && PyList_SetSlice(res, 0, 0, prefix))
+        {
+          Py_DECREF(res);
+          return NULL;
+        }
+      *exhausted=(self->cursor->status==C_DONE);
+      return res;
+
+    default:
+      assert(op==ASYNC_CLOSE);
+      return APSWCursor_close(self->cursor, args);
+    }
+}
+
+/* Runs a job on the worker thread and arranges for the result to be
+   delivered */
+static void
+AsyncConnection_dojob(AsyncConnection *self, PyObject *job)
+{
+  PyObject *future, *target, *args, *prefix, *res, *value, *etype=NULL, *etb=NULL, *r;
+  int op, exhausted=0;
+  unsigned generation;
+
+  if(!PyArg_ParseTuple(job, "iOOOOI", &op, &future, &target, &args, &prefix, &generation))
+    {
+      apsw_write_unraiseable(NULL);
+      return;
+    }
+  if(op==ASYNC_DROP)
+    return;
+
+  if(op==ASYNC_CALL)
+    res=PyObject_Call(target, args, NULL);
+  else
+    res=AsyncCursor_dojob((AsyncCursor*)target, op, args, prefix, &exhausted);
+
+  value=res;
+  if(!res)
+    {
+      PyErr_Fetch(&etype, &value, &etb);
+      PyErr_NormalizeException(&etype, &value, &etb);
+      if(etb)
+        PyException_SetTraceback(value, etb);
+    }
+
+  r=PyObject_CallMethod(self->loop, "call_soon_threadsafe", "OOiOOIi", self->deliver, future, !!res, value,
+                        (op==ASYNC_BATCH)?target:Py_None, generation, exhausted);
+  if(!r)
+    /* typically the event loop has been closed */
+    apsw_write_unraiseable(NULL);
+  Py_XDECREF(r);
+  Py_XDECREF(value);
+  Py_XDECREF(etype);
+  Py_XDECREF(etb);
+}
+
+/* The worker thread.  It has a reference to the AsyncConnection until
+   it exits. */
+static void
+AsyncConnection_worker(void *arg)
+{
+  AsyncConnection *self=(AsyncConnection*)arg;
+  PyGILState_STATE gilstate=PyGILState_Ensure();
+
+  self->thread=PyThread_get_thread_ident();
+
+  for(;;)
+    {
+      PyObject *job;
+
+      if(!PyList_GET_SIZE(self->queue))
+        {
+          if(self->closed)
+            break;
+          self->waiting=1;
+          Py_BEGIN_ALLOW_THREADS
+            PyThread_acquire_lock(self->wakeup, WAIT_LOCK);
+          Py_END_ALLOW_THREADS;
+          self->waiting=0;
+          self->signalled=0;
+          continue;
+        }
+
+      job=PyList_GET_ITEM(self->queue, 0);
+      Py_INCREF(job);
+      if(PyList_SetSlice(self->queue, 0, 1, NULL))
+        apsw_write_unraiseable(NULL);
+      AsyncConnection_dojob(self, job);
+      Py_DECREF(job);
+    }
+
+  self->running=0;
+  PyThread_release_lock(self->done);
+  Py_DECREF(self);
+  PyGILState_Release(gilstate);
+}
+
+/* Queues a job returning the future for the result, or NULL with an
+   exception.  future is None for jobs without results. */
+static PyObject *
+AsyncConnection_submit(AsyncConnection *self, int op, PyObject *target, PyObject *args, PyObject *prefix, unsigned generation)
+{
+  PyObject *future, *job;
+
+  CHECK_ASYNC_CLOSED(NULL);
+
+  if(op==ASYNC_DROP)
+    {
+      future=Py_None;
+      Py_INCREF(future);
+    }
+  else
+    {
+      future=PyObject_CallMethod(self->loop, "create_future", NULL);
+      if(!future)
+        return NULL;
+    }
+
+  job=Py_BuildValue("(iOOOOI)", op, future, target, args, prefix, generation);
+  if(!job || PyList_Append(self->queue, job))
+    {
+      Py_XDECREF(job);
+      Py_DECREF(future);
+      return NULL;
+    }
+  Py_DECREF(job);
+
+  if(self->waiting && !self->signalled)
+    {
+      self->signalled=1;
+      PyThread_release_lock(self->wakeup);
+    }
+  return future;
+}
+
+static PyObject *
+AsyncConnection_new(PyTypeObject *type, APSW_ARGUNUSED PyObject *args, APSW_ARGUNUSED PyObject *kwds)
+{
+  AsyncConnection *self;
+
+  self=(AsyncConnection*)type->tp_alloc(type, 0);
+  if(self)
+    {
+      self->connection=0;
+      self->loop=0;
+      self->deliver=0;
+      self->queue=0;
+      self->wakeup=0;
+      self->done=0;
+      self->thread=0;
+      self->running=0;
+      self->waiting=self->signalled=0;
+      self->closed=1;
+      self->weakreflist=0;
+    }
+
+  return (PyObject*)self;
+}
+
+static int
+AsyncConnection_init(AsyncConnection *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[]={"connection", "loop", NULL};
+  PyObject *connection=NULL, *loop=Py_None;
+  long thread;
+
+  if(self->queue)
+    {
+      PyErr_Format(PyExc_RuntimeError, "The AsyncConnection has already been initialized");
+      return -1;
+    }
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O:AsyncConnection(connection, loop=None)", kwlist, &ConnectionType, &connection, &loop))
+    return -1;
+
+  if(loop==Py_None)
+    {
+      PyObject *asyncio=PyImport_ImportModule("asyncio");
+      if(!asyncio)
+        return -1;
+      self->loop=PyObject_CallMethod(asyncio, "get_event_loop", NULL);
+      Py_DECREF(asyncio);
+      if(!self->loop)
+        return -1;
+    }
+  else
+    {
+      Py_INCREF(loop);
+      self->loop=loop;
+    }
+
+  Py_INCREF(connection);
+  self->connection=(Connection*)connection;
+  self->deliver=PyCFunction_New(&asyncdeliver_def, NULL);
+  self->queue=PyList_New(0);
+  if(!self->deliver || !self->queue)
+    return -1;
+
+  APSW_FAULT_INJECT(AsyncLockAllocFails,
+                    (self->wakeup=PyThread_allocate_lock(), self->done=PyThread_allocate_lock()),
+                    (self->wakeup=self->done=NULL));
+  if(!self->wakeup || !self->done)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+  /* held until the worker is signalled or exits */
+  PyThread_acquire_lock(self->wakeup, WAIT_LOCK);
+  PyThread_acquire_lock(self->done, WAIT_LOCK);
+
+  Py_INCREF(self);
+  APSW_FAULT_INJECT(AsyncThreadFails, thread=(long)PyThread_start_new_thread(AsyncConnection_worker, self), thread=-1);
+  if(thread==-1)
+    {
+      Py_DECREF(self);
+      PyErr_Format(PyExc_RuntimeError, "Unable to start the AsyncConnection worker thread");
+      return -1;
+    }
+  self->running=1;
+  self->closed=0;
+  return 0;
+}
+
+static void
+AsyncConnection_dealloc(AsyncConnection *self)
+{
+  /* the worker has a reference so it has exited */
+  assert(!self->running);
+  APSW_CLEAR_WEAKREFS;
+
+  if(self->wakeup)
+    {
+      if(!self->signalled)
+        PyThread_release_lock(self->wakeup);
+      PyThread_free_lock(self->wakeup);
+    }
+  if(self->done)
+    {
+      PyThread_acquire_lock(self->done, NOWAIT_LOCK);
+      PyThread_release_lock(self->done);
+      PyThread_free_lock(self->done);
+    }
+
+  Py_CLEAR(self->queue);
+  Py_CLEAR(self->deliver);
+  Py_CLEAR(self->loop);
+  Py_CLEAR(self->connection);
+
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/** .. method:: cursor() -> AsyncCursor
+
+  Returns a new :class:`AsyncCursor`.
+*/
+static PyObject *
+AsyncConnection_cursor(AsyncConnection *self)
+{
+  AsyncCursor *acur;
+
+  CHECK_ASYNC_CLOSED(NULL);
+
+  acur=PyObject_New(AsyncCursor, &AsyncCursorType);
+  if(!acur)
+    return NULL;
+
+  Py_INCREF(self);
+  acur->aconnection=self;
+  acur->cursor=NULL;
+  acur->rows=NULL;
+  acur->rowspos=0;
+  acur->exhausted=0;
+  acur->generation=0;
+  acur->batchsize=256;
+  acur->weakreflist=NULL;
+
+  return (PyObject*)acur;
+}
+
+/** .. method:: run(callable, *args) -> awaitable
+
+  Calls *callable* with *args* on the worker thread, with the awaitable
+  giving the return value.  Use this for anything else needing the
+  connection such as transaction control::
+
+    await acon.run(acon.connection.setbusytimeout, 1000)
+*/
+static PyObject *
+AsyncConnection_run(AsyncConnection *self, PyObject *args)
+{
+  PyObject *callable, *callargs, *future;
+
+  CHECK_ASYNC_CLOSED(NULL);
+
+  if(PyTuple_GET_SIZE(args)<1 || !PyCallable_Check(PyTuple_GET_ITEM(args, 0)))
+    return PyErr_Format(PyExc_TypeError, "run(callable, *args) needs a callable");
+
+  callable=PyTuple_GET_ITEM(args, 0);
+  callargs=PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+  if(!callargs)
+    return NULL;
+  future=AsyncConnection_submit(self, ASYNC_CALL, callable, callargs, Py_None, 0);
+  Py_DECREF(callargs);
+  return future;
+}
+
+/** .. method:: close()
+
+  Stops the worker thread after it has finished the work already
+  queued, waiting for it to do so unless called from the worker
+  thread itself.  Further use of this object raises
+  :exc:`ConnectionClosedError`.  You can call this method multiple
+  times.
+*/
+static PyObject *
+AsyncConnection_close(AsyncConnection *self)
+{
+  if(self->closed)
+    Py_RETURN_NONE;
+
+  self->closed=1;
+  if(self->waiting && !self->signalled)
+    {
+      self->signalled=1;
+      PyThread_release_lock(self->wakeup);
+    }
+
+  if(self->running && self->thread!=(long)PyThread_get_thread_ident())
+    {
+      Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->done, WAIT_LOCK);
+      Py_END_ALLOW_THREADS;
+      /* the worker released it */
+      PyThread_release_lock(self->done);
+    }
+
+  Py_RETURN_NONE;
+}
+
+/** .. attribute:: connection
+
+  The :class:`Connection` this object wraps.
+*/
+static PyObject *
+AsyncConnection_getconnection(AsyncConnection *self)
+{
+  Py_INCREF(self->connection);
+  return (PyObject*)self->connection;
+}
+
+static void
+AsyncCursor_dealloc(AsyncCursor *self)
+{
+  APSW_CLEAR_WEAKREFS;
+
+  /* the worker may be using the connection so it drops the cursor */
+  if(self->cursor && !self->aconnection->closed)
+    {
+      PyObject *res=AsyncConnection_submit(self->aconnection, ASYNC_DROP, (PyObject*)self->cursor, Py_None, Py_None, 0);
+      if(!res)
+        apsw_write_unraiseable(NULL);
+      Py_XDECREF(res);
+    }
+  Py_CLEAR(self->cursor);
+  Py_CLEAR(self->rows);
+  Py_CLEAR(self->aconnection);
+
+  PyObject_Del(self);
+}
+
+/* forgets rows from a previous execution */
+static void
+AsyncCursor_reset(AsyncCursor *self)
+{
+  self->generation++;
+  Py_CLEAR(self->rows);
+  self->rowspos=0;
+  self->exhausted=0;
+}
+
+/* returns a list of the buffered rows (Py_None if there are none),
+   leaving none buffered */
+static PyObject *
+AsyncCursor_takerows(AsyncCursor *self, Py_ssize_t size)
+{
+  PyObject *res;
+  Py_ssize_t avail=self->rows?PyList_GET_SIZE(self->rows)-self->rowspos:0;
+
+  if(!avail)
+    {
+      Py_INCREF(Py_None);
+      return Py_None;
+    }
+  if(size<0 || size>avail)
+    size=avail;
+  res=PyList_GetSlice(self->rows, self->rowspos, self->rowspos+size);
+  if(res)
+    self->rowspos+=size;
+  return res;
+}
+
+/** .. method:: execute(statements, bindings=None) -> awaitable
+
+  Runs :meth:`Cursor.execute` on the worker thread.  The awaitable
+  gives this cursor which you can then iterate with ``async for``.
+*/
+static PyObject *
+AsyncCursor_execute(AsyncCursor *self, PyObject *args)
+{
+  AsyncCursor_reset(self);
+  return AsyncConnection_submit(self->aconnection, ASYNC_EXECUTE, (PyObject*)self, args, Py_None, self->generation);
+}
+
+/** .. method:: executemany(statements, sequenceofbindings) -> awaitable
+
+  Runs :meth:`Cursor.executemany` on the worker thread.  The
+  awaitable gives this cursor.
+*/
+static PyObject *
+AsyncCursor_executemany(AsyncCursor *self, PyObject *args)
+{
+  AsyncCursor_reset(self);
+  return AsyncConnection_submit(self->aconnection, ASYNC_EXECUTEMANY, (PyObject*)self, args, Py_None, self->generation);
+}
+
+/** .. method:: fetchmany(size=None) -> awaitable
+
+  Gives a list of up to *size* (default :attr:`batchsize`) of the
+  remaining result rows.  An empty list is given when there are no
+  more rows.  Rows already fetched for iteration are returned first.
+*/
+static PyObject *
+AsyncCursor_fetchmany(AsyncCursor *self, PyObject *args)
+{
+  Py_ssize_t size=self->batchsize;
+  PyObject *prefix, *sizeargs, *res;
+
+  if(!PyArg_ParseTuple(args, "|n:fetchmany(size=None)", &size))
+    return NULL;
+  if(size<0)
+    return PyErr_Format(PyExc_ValueError, "fetchmany size must be zero or positive");
+
+  prefix=AsyncCursor_takerows(self, size);
+  if(!prefix)
+    return NULL;
+
+  if(prefix!=Py_None && PyList_GET_SIZE(prefix)==size)
+    {
+      res=AsyncValue_new(prefix);
+      Py_DECREF(prefix);
+      return res;
+    }
+
+  sizeargs=Py_BuildValue("(n)", size-((prefix==Py_None)?0:PyList_GET_SIZE(prefix)));
+  if(!sizeargs)
+    {
+      Py_DECREF(prefix);
+      return NULL;
+    }
+  res=AsyncConnection_submit(self->aconnection, ASYNC_FETCHMANY, (PyObject*)self, sizeargs, prefix, self->generation);
+  Py_DECREF(sizeargs);
+  Py_DECREF(prefix);
+  return res;
+}
+
+/** .. method:: fetchall() -> awaitable
+
+  Gives a list of all the remaining result rows.
+*/
+static PyObject *
+AsyncCursor_fetchall(AsyncCursor *self)
+{
+  PyObject *prefix, *res;
+
+  prefix=AsyncCursor_takerows(self, -1);
+  if(!prefix)
+    return NULL;
+
+  res=AsyncConnection_submit(self->aconnection, ASYNC_FETCHALL, (PyObject*)self, Py_None, prefix, self->generation);
+  Py_DECREF(prefix);
+  return res;
+}
+
+/** .. method:: close(force=False) -> awaitable
+
+  Runs :meth:`Cursor.close` on the worker thread.
+*/
+static PyObject *
+AsyncCursor_close(AsyncCursor *self, PyObject *args)
+{
+  AsyncCursor_reset(self);
+  return AsyncConnection_submit(self->aconnection, ASYNC_CLOSE, (PyObject*)self, args, Py_None, self->generation);
+}
+
+static PyObject *
+AsyncCursor_aiter(AsyncCursor *self)
+{
+  Py_INCREF(self);
+  return (PyObject*)self;
+}
+
+/* Rows already fetched are returned without involving the worker.
+   Otherwise the next batch is fetched. */
+static PyObject *
+AsyncCursor_anext(AsyncCursor *self)
+{
+  PyObject *sizeargs, *res;
+
+  if(self->rows && self->rowspos<PyList_GET_SIZE(self->rows))
+    return AsyncValue_new(PyList_GET_ITEM(self->rows, self->rowspos++));
+
+  if(self->exhausted)
+    {
+      PyErr_SetNone(PyExc_StopAsyncIteration);
+      return NULL;
+    }
+
+  sizeargs=Py_BuildValue("(n)", self->batchsize);
+  if(!sizeargs)
+    return NULL;
+  res=AsyncConnection_submit(self->aconnection, ASYNC_BATCH, (PyObject*)self, sizeargs, Py_None, self->generation);
+  Py_DECREF(sizeargs);
+  return res;
+}
+
+/** .. attribute:: batchsize
+
+  How many rows are fetched at a time when iterating with ``async
+  for``, and the default for :meth:`fetchmany`.  Larger values mean
+  fewer wakeups of the event loop but more memory.  The default is
+  256.
+*/
+static PyObject *
+AsyncCursor_getbatchsize(AsyncCursor *self)
+{
+  return PyLong_FromSsize_t(self->batchsize);
+}
+
+static int
+AsyncCursor_setbatchsize(AsyncCursor *self, PyObject *value)
+{
+  Py_ssize_t size;
+
+  if(!value)
+    {
+      PyErr_Format(PyExc_TypeError, "batchsize can't be deleted");
+      return -1;
+    }
+  size=PyNumber_AsSsize_t(value, PyExc_OverflowError);
+  if(size==-1 && PyErr_Occurred())
+    return -1;
+  if(size<1)
+    {
+      PyErr_Format(PyExc_ValueError, "batchsize must be at least 1");
+      return -1;
+    }
+  self->batchsize=size;
+  return 0;
+}
+
+/** .. attribute:: connection
+
+  The :class:`AsyncConnection` this cursor belongs to.
+*/
+static PyObject *
+AsyncCursor_getconnection(AsyncCursor *self)
+{
+  Py_INCREF(self->aconnection);
+  return (PyObject*)self->aconnection;
+}
+
+static PyMethodDef AsyncConnection_methods[] = {
+  {"cursor", (PyCFunction)AsyncConnection_cursor, METH_NOARGS,
+   "Returns a new AsyncCursor"},
+  {"run", (PyCFunction)AsyncConnection_run, METH_VARARGS,
+   "Calls a function on the worker thread"},
+  {"close", (PyCFunction)AsyncConnection_close, METH_NOARGS,
+   "Stops the worker thread"},
+  {0,0,0,0}
+};
+
+static PyGetSetDef AsyncConnection_getset[] = {
+  /* name getter setter doc closure */
+  {"connection", (getter)AsyncConnection_getconnection, NULL, "The wrapped Connection", NULL},
+  {0,0,0,0,0}
+};
+
+static PyTypeObject AsyncConnectionType = {
+    APSW_PYTYPE_INIT
+    "apsw.AsyncConnection",    /*tp_name*/
+    sizeof(AsyncConnection),   /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)AsyncConnection_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_as_async*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "Asyncio connection",      /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    offsetof(AsyncConnection, weakreflist), /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    AsyncConnection_methods,   /* tp_methods */
+    0,                         /* tp_members */
+    AsyncConnection_getset,    /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)AsyncConnection_init, /* tp_init */
+    0,                         /* tp_alloc */
+    AsyncConnection_new,       /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+};
+
+static PyMethodDef AsyncCursor_methods[] = {
+  {"execute", (PyCFunction)AsyncCursor_execute, METH_VARARGS,
+   "Executes one or more statements"},
+  {"executemany", (PyCFunction)AsyncCursor_executemany, METH_VARARGS,
+   "Repeatedly executes statements on sequence"},
+  {"fetchmany", (PyCFunction)AsyncCursor_fetchmany, METH_VARARGS,
+   "Returns a list of some of the remaining result rows"},
+  {"fetchall", (PyCFunction)AsyncCursor_fetchall, METH_NOARGS,
+   "Returns a list of all the remaining result rows"},
+  {"close", (PyCFunction)AsyncCursor_close, METH_VARARGS,
+   "Closes the cursor"},
+  {0,0,0,0}
+};
+
+static PyGetSetDef AsyncCursor_getset[] = {
+  /* name getter setter doc closure */
+  {"batchsize", (getter)AsyncCursor_getbatchsize, (setter)AsyncCursor_setbatchsize, "Rows fetched at a time", NULL},
+  {"connection", (getter)AsyncCursor_getconnection, NULL, "The AsyncConnection", NULL},
+  {0,0,0,0,0}
+};
+
+static PyAsyncMethods AsyncCursor_asyncmethods = {
+  0,                           /* am_await */
+  (unaryfunc)AsyncCursor_aiter, /* am_aiter */
+  (unaryfunc)AsyncCursor_anext  /* am_anext */
+};
+
+static PyTypeObject AsyncCursorType = {
+    APSW_PYTYPE_INIT
+    "apsw.AsyncCursor",        /*tp_name*/
+    sizeof(AsyncCursor),       /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)AsyncCursor_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    &AsyncCursor_asyncmethods, /*tp_as_async*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "Asyncio cursor",          /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    offsetof(AsyncCursor, weakreflist), /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    AsyncCursor_methods,       /* tp_methods */
+    0,                         /* tp_members */
+    AsyncCursor_getset,        /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+};
+
+static PyAsyncMethods AsyncValue_asyncmethods = {
+  (unaryfunc)AsyncValue_await, /* am_await */
+  0,                           /* am_aiter */
+  0                            /* am_anext */
+};
+
+static PyTypeObject AsyncValueType = {
+    APSW_PYTYPE_INIT
+    "apsw.AsyncValue",         /*tp_name*/
+    sizeof(AsyncValue),        /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)AsyncValue_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    &AsyncValue_asyncmethods,  /*tp_as_async*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "Already available asyncio result", /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)AsyncValue_next, /* tp_iternext */
+    0,                         /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+};
@@ -0,0 +1,209 @@
+/*
+  Query deadlines and cancellation
+
+  See the accompanying LICENSE file.
+*/
+
+/**
+
+.. _cancellation:
+
+Deadlines and cancellation
+**************************
+
+:meth:`Cursor.execute` and :meth:`Cursor.executemany` take two
+keyword arguments that stop queries running too long.  *timeout* is
+how many seconds the statements may take, including stepping through
+the rows afterwards, while *cancel* is a :class:`CancellationToken`
+that any thread can use to stop the queries it was given to::
+
+  token=apsw.CancellationToken()
+
+  try:
+      for row in cursor.execute(sql, timeout=2.5, cancel=token):
+          process(row)
+  except apsw.QueryCancelledError:
+      ...
+
+  # in another thread
+  token.cancel()
+
+Both raise :exc:`QueryCancelledError`, which is a subclass of
+:exc:`InterruptError` since SQLite stops the statement the same way
+as :meth:`Connection.interrupt`.  The statement's changes are undone,
+and if it was in an explicit transaction SQLite may also have rolled
+back the transaction (check :meth:`Connection.getautocommit`).
+
+The checks are made by a `progress handler
+<https://sqlite.org/c3ref/progress_handler.html>`__ implemented in C
+every thousand virtual machine instructions.  It compares a monotonic
+clock and the token's flag without acquiring the GIL, so queries
+without a deadline or token are not measurably slowed.  The handler
+is installed on a connection the first time a timeout or token is
+used.  A handler set with :meth:`Connection.setprogresshandler` is
+still called as often as it asked for.
+
+Time spent waiting for locks (see :ref:`busy handling
+<busyhandling>`) and in user defined functions is not interrupted,
+although the query will be stopped at the next check after it.
+
+*/
+
+/* How many SQLite virtual machine instructions between checks */
+#define CANCEL_STEPS 1000
+
+/* Why the progress handler stopped a query */
+enum { QUERY_TIMEDOUT=1, QUERY_CANCELLED=2 };
+
+/** .. class:: CancellationToken()
+
+  A flag that can be set from any thread to stop the queries it was
+  given to as the *cancel* keyword argument.  One token can be shared
+  by many cursors across many connections, for example everything
+  done for one request.
+*/
+typedef struct CancellationToken {
+  PyObject_HEAD
+  volatile int cancelled;         /* read by progress handlers without the GIL */
+  PyObject *weakreflist;
+} CancellationToken;
+
+static PyTypeObject CancellationTokenType;
+
+/* Raises QueryCancelledError for the reason the query was stopped */
+static void
+cancel_raise(int stopped)
+{
+  PyObject *etype, *eval, *etb;
+
+  if(PyErr_Occurred())
+    return;
+
+  PyErr_Format(ExcQueryCancelled, "QueryCancelledError: %s",
+               (stopped==QUERY_TIMEDOUT)?"The timeout expired":"Cancelled by the token");
+  PyErr_Fetch(&etype, &eval, &etb);
+  PyErr_NormalizeException(&etype, &eval, &etb);
+  PyObject_SetAttrString(eval, "result", Py_BuildValue("i", SQLITE_INTERRUPT));
+  PyObject_SetAttrString(eval, "extendedresult", Py_BuildValue("i", SQLITE_INTERRUPT));
+  PyErr_Restore(etype, eval, etb);
+}
+
+static PyObject *
+CancellationToken_new(PyTypeObject *type, APSW_ARGUNUSED PyObject *args, APSW_ARGUNUSED PyObject *kwds)
+{
+  CancellationToken *self;
+
+  self=(CancellationToken*)type->tp_alloc(type, 0);
+  if(self)
+    {
+      self->cancelled=0;
+      self->weakreflist=0;
+    }
+  return (PyObject*)self;
+}
+
+static void
+CancellationToken_dealloc(CancellationToken *self)
+{
+  APSW_CLEAR_WEAKREFS;
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/** .. method:: cancel()
+
+  Stops queries currently running with this token, and any started
+  with it later, raising :exc:`QueryCancelledError`.  It can be called
+  from any thread.
+*/
+static PyObject *
+CancellationToken_cancel(CancellationToken *self)
+{
+  self->cancelled=1;
+  Py_RETURN_NONE;
+}
+
+/** .. method:: reset()
+
+  Clears the flag so queries using the token can run again.
+*/
+static PyObject *
+CancellationToken_reset(CancellationToken *self)
+{
+  self->cancelled=0;
+  Py_RETURN_NONE;
+}
+
+/** .. attribute:: cancelled
+
+  True if :meth:`cancel` has been called since the token was created
+  or :meth:`reset`.
+*/
+static PyObject *
+CancellationToken_getcancelled(CancellationToken *self)
+{
+  return PyBool_FromLong(self->cancelled);
+}
+
+static PyMethodDef CancellationToken_methods[] = {
+  {"cancel", (PyCFunction)CancellationToken_cancel, METH_NOARGS,
+   "Stops queries using the token"},
+  {"reset", (PyCFunction)CancellationToken_reset, METH_NOARGS,
+   "Clears the cancelled flag"},
+  {0,0,0,0}
+};
+
+static PyGetSetDef CancellationToken_getset[] = {
+  /* name getter setter doc closure */
+  {"cancelled", (getter)CancellationToken_getcancelled, NULL, "If cancel has been called", NULL},
+  {0,0,0,0,0}
+};
+
+static PyTypeObject CancellationTokenType = {
+    APSW_PYTYPE_INIT
+    "apsw.CancellationToken",  /*tp_name*/
+    sizeof(CancellationToken), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)CancellationToken_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "Query cancellation token", /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    offsetof(CancellationToken, weakreflist), /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    CancellationToken_methods, /* tp_methods */
+    0,                         /* tp_members */
+    CancellationToken_getset,  /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    CancellationToken_new,     /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+};
@@ -0,0 +1,728 @@
+/*
+  Background WAL checkpointing code
+
+  See the accompanying LICENSE file.
+*/
+
+/**
+
+.. _checkpointer:
+
+Background Checkpointing
+************************
+
+In `WAL mode <https://sqlite.org/wal.html>`__ committed changes are
+appended to the write ahead log, and a `checkpoint
+<https://sqlite.org/wal.html#checkpointing>`__ later copies them into
+the database file.  By default SQLite checkpoints on the thread that
+commits once the log reaches 1,000 pages (see
+:meth:`Connection.wal_autocheckpoint`), so every so often a commit
+takes far longer than the others.  The alternatives were to call
+:meth:`Connection.wal_checkpoint` yourself, or to have a Python thread
+do so from :meth:`Connection.setwalhook`.
+
+A :class:`Checkpointer` instead runs checkpoints on a thread started
+in C, using its own database connection, so commits never wait for
+them::
+
+  con=apsw.Connection("database.db")
+  con.cursor().execute("pragma journal_mode=wal")
+  checkpointer=apsw.Checkpointer(con, pages=1000, age=10, truncate=50000)
+
+Each commit tells the checkpointer how big the log is, without
+needing the GIL.  The worker does a `PASSIVE
+<https://sqlite.org/c3ref/wal_checkpoint_v2.html>`__ checkpoint, which
+never waits for readers or writers, once *pages* frames have been
+committed since the last one, or once the oldest change not yet
+checkpointed is *age* seconds old.  Readers still using older parts
+of the log can stop a passive checkpoint copying all of it, and the
+log file keeps its largest size even when it is all copied.  If the
+log is bigger than *restart* or *truncate* frames the checkpointer
+escalates to a RESTART or TRUNCATE checkpoint which waits up to
+*busytimeout* milliseconds for other connections, so the log starts
+again from the beginning (and is truncated to zero bytes for
+TRUNCATE).  Checkpoints that can't complete are retried after 100
+milliseconds.
+
+:meth:`Checkpointer.stats` returns how many frames have been
+checkpointed, the time spent, and how often the database was busy.
+
+The worker thread keeps the Checkpointer, its own database
+connection, and the source alive, so they are not garbage collected.
+Call :meth:`Checkpointer.close`, or close the source which does so,
+when you are done.
+
+Background checkpointing needs Python 3.2 or later.
+
+*/
+
+/** .. class:: Checkpointer(source, pages=1000, age=10.0, restart=0, truncate=0, busytimeout=0)
+
+  Opens a connection to the database of *source* and starts a worker
+  thread that checkpoints it.
+
+  :param source: A :class:`Connection` or :class:`ConnectionPool`
+    whose commits are tracked.  For a pool it is the writer
+    connection, including any opened in the future.  The connection's
+    automatic checkpointing is turned off.  Don't call
+    :meth:`Connection.wal_autocheckpoint` on it as that also stops
+    the commits being tracked.
+  :param pages: Checkpoint once this many frames have been committed
+    since the last checkpoint.
+  :param age: Checkpoint once the oldest change not yet checkpointed
+    is this many seconds old.  Zero only uses *pages*.
+  :param restart: Do a RESTART checkpoint when the log has at least
+    this many frames.  Zero never does.
+  :param truncate: Do a TRUNCATE checkpoint when the log has at least
+    this many frames.  Zero never does.  When both *restart* and
+    *truncate* are reached TRUNCATE is used.
+  :param busytimeout: The most milliseconds RESTART and TRUNCATE
+    checkpoints wait for other connections.
+
+  -* sqlite3_wal_checkpoint_v2
+*/
+
+/* nanoseconds before retrying a checkpoint that was busy or couldn't complete */
+#define CHECKPOINTER_RETRY 100000000
+
+typedef struct Checkpointer {
+  PyObject_HEAD
+  PyObject *source;               /* Connection or ConnectionPool */
+  Connection *attached;           /* connection whose wal hook notifies us */
+  sqlite3 *db;                    /* our own connection, only used by the worker */
+  int pages;
+  sqlite3_int64 age;              /* nanoseconds, zero for none */
+  int restart, truncate;
+  PyThread_type_lock wakeup;      /* held except when the worker is signalled */
+  PyThread_type_lock done;        /* held while the worker thread runs */
+  int running;                    /* worker thread has been started and not exited */
+  /* the GIL is not held by the wal hook or worker so the remaining
+     fields are protected by mutex */
+  PyThread_type_lock mutex;
+  int waiting;                    /* worker is waiting on wakeup */
+  int signalled;
+  int closed;
+  int walframes;                  /* frames in the log as last reported */
+  int backfilled;                 /* of those already checkpointed */
+  sqlite3_int64 dirtysince;       /* when the oldest commit not checkpointed was, zero for none */
+  sqlite3_int64 retryafter;       /* don't checkpoint again before this */
+  /* statistics */
+  sqlite3_int64 st_passive, st_restart, st_truncate, st_frames, st_busy, st_errors, st_time;
+  PyObject *weakreflist;          /* weak reference tracking */
+} Checkpointer;
+
+static PyTypeObject CheckpointerType;
+
+/* called with mutex held */
+static void
+Checkpointer_signal(Checkpointer *self)
+{
+  if(self->waiting && !self->signalled)
+    {
+      self->signalled=1;
+      PyThread_release_lock(self->wakeup);
+    }
+}
+
+/* Called from the wal hook of the attached connection after each
+   commit.  The GIL may not be held. */
+static void
+Checkpointer_walnotify(Checkpointer *self, int npages)
+{
+  PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+  /* a writer started the log again from the beginning */
+  if(npages<self->walframes)
+    self->backfilled=0;
+  self->walframes=npages;
+  if(!self->dirtysince)
+    {
+      self->dirtysince=apsw_now_ns();
+      /* the worker needs to know when the age is reached */
+      if(self->age)
+        Checkpointer_signal(self);
+    }
+  if(self->walframes-self->backfilled>=self->pages)
+    Checkpointer_signal(self);
+  PyThread_release_lock(self->mutex);
+}
+
+static void
+Checkpointer_detach(Checkpointer *self);
+
+/* Starts being notified of commits on connection instead of any
+   previous one */
+static void
+Checkpointer_attach(Checkpointer *self, Connection *connection)
+{
+  Checkpointer_detach(self);
+  if(!connection->db)
+    return;
+
+  /* the wal hook replaces automatic checkpointing on the committing thread */
+  APSW_DB_MUTEX_ENTER(connection->db);
+  connection->checkpointer=self;
+  PYSQLITE_HELD_CALL(sqlite3_wal_hook(connection->db, walhookcb, connection));
+  APSW_DB_MUTEX_LEAVE(connection->db);
+
+  Py_INCREF(connection);
+  self->attached=connection;
+}
+
+static void
+Checkpointer_detach(Checkpointer *self)
+{
+  Connection *connection=self->attached;
+
+  if(!connection)
+    return;
+  self->attached=0;
+
+  if(connection->checkpointer==self)
+    {
+      if(connection->db)
+        {
+          APSW_DB_MUTEX_ENTER(connection->db);
+          connection->checkpointer=0;
+          PYSQLITE_HELD_CALL(sqlite3_wal_hook(connection->db, connection->walhook?walhookcb:NULL, connection));
+          APSW_DB_MUTEX_LEAVE(connection->db);
+        }
+      else
+        connection->checkpointer=0;
+    }
+  Py_DECREF(connection);
+}
+
+/* Does a passive checkpoint, escalating if configured, and updates
+   the state and statistics.  The GIL is not held. */
+static void
+Checkpointer_checkpoint(Checkpointer *self)
+{
+  int res, mode, nlog=-1, nckpt=-1, base, frames=0, escalated=0;
+  sqlite3_int64 start=apsw_now_ns(), now;
+
+  PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+  base=self->backfilled;
+  PyThread_release_lock(self->mutex);
+
+  PYSQLITE_HELD_CALL(res=sqlite3_wal_checkpoint_v2(self->db, "main", SQLITE_CHECKPOINT_PASSIVE, &nlog, &nckpt));
+  /* our connection only finds out the database is in wal mode by reading it */
+  if(res==SQLITE_OK && nlog<0)
+    {
+      PYSQLITE_HELD_CALL(res=sqlite3_exec(self->db, "pragma schema_version", NULL, NULL, NULL));
+      if(res==SQLITE_OK)
+        PYSQLITE_HELD_CALL(res=sqlite3_wal_checkpoint_v2(self->db, "main", SQLITE_CHECKPOINT_PASSIVE, &nlog, &nckpt));
+    }
+  if(res==SQLITE_OK && nckpt>base)
+    frames=nckpt-base;
+
+  mode=(self->truncate && nlog>=self->truncate)?SQLITE_CHECKPOINT_TRUNCATE
+    :(self->restart && nlog>=self->restart)?SQLITE_CHECKPOINT_RESTART
+    :SQLITE_CHECKPOINT_PASSIVE;
+  if(res==SQLITE_OK && mode!=SQLITE_CHECKPOINT_PASSIVE)
+    {
+      int elog=-1, eckpt=-1;
+
+      escalated=1;
+      PYSQLITE_HELD_CALL(res=sqlite3_wal_checkpoint_v2(self->db, "main", mode, &elog, &eckpt));
+      if(res==SQLITE_OK)
+        {
+          /* TRUNCATE reports an empty log */
+          frames+=((mode==SQLITE_CHECKPOINT_RESTART)?eckpt:nlog)-nckpt;
+          /* the next writer starts the log from the beginning */
+          nlog=nckpt=0;
+        }
+      else if(eckpt>nckpt)
+        {
+          frames+=eckpt-nckpt;
+          nlog=elog;
+          nckpt=eckpt;
+        }
+    }
+  now=apsw_now_ns();
+
+  PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+  self->st_passive++;
+  if(escalated)
+    {
+      if(mode==SQLITE_CHECKPOINT_RESTART)
+        self->st_restart++;
+      else
+        self->st_truncate++;
+    }
+  self->st_frames+=frames;
+  self->st_time+=now-start;
+
+  if(nlog>=0)
+    {
+      if(escalated && res==SQLITE_OK)
+        self->walframes=0;
+      else if(nlog>self->walframes)
+        self->walframes=nlog;
+      self->backfilled=(nckpt<self->walframes)?nckpt:self->walframes;
+    }
+
+  if(res==SQLITE_OK && self->backfilled==self->walframes)
+    {
+      self->dirtysince=0;
+      self->retryafter=0;
+    }
+  else
+    {
+      if(res==SQLITE_BUSY)
+        self->st_busy++;
+      else if(res!=SQLITE_OK)
+        self->st_errors++;
+      self->retryafter=now+CHECKPOINTER_RETRY;
+    }
+  PyThread_release_lock(self->mutex);
+}
+
+/* The worker thread.  It doesn't hold the GIL, and has a reference to
+   the Checkpointer until it exits. */
+static void
+Checkpointer_worker(void *arg)
+{
+  Checkpointer *self=(Checkpointer*)arg;
+  PyGILState_STATE gilstate;
+
+  PYSQLITE_HELD_CALL(sqlite3_mutex_enter(sqlite3_db_mutex(self->db)));
+  PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+  while(!self->closed)
+    {
+      sqlite3_int64 now=apsw_now_ns(), wait=-1;
+      int acquired;
+
+      if(self->walframes-self->backfilled>=self->pages || (self->age && self->dirtysince && now>=self->dirtysince+self->age))
+        wait=(self->retryafter>now)?self->retryafter-now:0;
+      else if(self->age && self->dirtysince)
+        wait=self->dirtysince+self->age-now;
+
+      if(!wait)
+        {
+          PyThread_release_lock(self->mutex);
+          Checkpointer_checkpoint(self);
+          PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+          continue;
+        }
+
+      self->waiting=1;
+      PyThread_release_lock(self->mutex);
+      if(wait<0)
+        acquired=PyThread_acquire_lock(self->wakeup, WAIT_LOCK);
+      else
+        acquired=(PyThread_acquire_lock_timed(self->wakeup, (PY_TIMEOUT_T)(wait/1000), 0)==PY_LOCK_ACQUIRED);
+      PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+      /* signalled after the timeout expired so take the lock back */
+      if(!acquired && self->signalled)
+        PyThread_acquire_lock(self->wakeup, NOWAIT_LOCK);
+      self->waiting=0;
+      self->signalled=0;
+    }
+  PyThread_release_lock(self->mutex);
+  PYSQLITE_HELD_CALL(sqlite3_mutex_leave(sqlite3_db_mutex(self->db)));
+
+  gilstate=PyGILState_Ensure();
+  self->running=0;
+  PyThread_release_lock(self->done);
+  Py_DECREF(self);
+  PyGILState_Release(gilstate);
+}
+
+static PyObject *
+Checkpointer_new(PyTypeObject *type, APSW_ARGUNUSED PyObject *args, APSW_ARGUNUSED PyObject *kwds)
+{
+  Checkpointer *self;
+
+  self=(Checkpointer*)type->tp_alloc(type, 0);
+  if(self)
+    {
+      self->source=0;
+      self->attached=0;
+      self->db=0;
+      self->pages=0;
+      self->age=0;
+      self->restart=self->truncate=0;
+      self->wakeup=0;
+      self->done=0;
+      self->running=0;
+      self->mutex=0;
+      self->waiting=0;
+      self->signalled=0;
+      self->closed=1;
+      self->walframes=self->backfilled=0;
+      self->dirtysince=self->retryafter=0;
+      self->st_passive=self->st_restart=self->st_truncate=self->st_frames=self->st_busy=self->st_errors=self->st_time=0;
+      self->weakreflist=0;
+    }
+
+  return (PyObject*)self;
+}
+
+static int
+Checkpointer_init(Checkpointer *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[]={"source", "pages", "age", "restart", "truncate", "busytimeout", NULL};
+  PyObject *source=NULL, *filename=NULL, *vfs=NULL, *utf8filename=NULL, *utf8vfs=NULL;
+  Connection *connection=NULL;
+  ConnectionPool *pool=NULL;
+  int pages=1000, restart=0, truncate=0, busytimeout=0, flags=SQLITE_OPEN_READWRITE, res;
+  double age=10.0;
+  long thread;
+
+  if(self->source || self->db)
+    {
+      PyErr_Format(PyExc_RuntimeError, "The Checkpointer has already been initialized");
+      return -1;
+    }
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|idiii:Checkpointer(source, pages=1000, age=10.0, restart=0, truncate=0, busytimeout=0)", kwlist,
+                                  &source, &pages, &age, &restart, &truncate, &busytimeout))
+    return -1;
+
+  if(pages<1)
+    {
+      PyErr_Format(PyExc_ValueError, "pages must be at least 1");
+      return -1;
+    }
+  if(age<0 || age>3600)
+    {
+      PyErr_Format(PyExc_ValueError, "age must be between 0 and 3600 seconds");
+      return -1;
+    }
+  if(restart<0 || truncate<0 || busytimeout<0)
+    {
+      PyErr_Format(PyExc_ValueError, "restart, truncate and busytimeout can't be negative");
+      return -1;
+    }
+
+  if(PyObject_TypeCheck(source, &ConnectionType))
+    {
+      connection=(Connection*)source;
+      if(!connection->db)
+        {
+          PyErr_Format(ExcConnectionClosed, "The connection has been closed");
+          return -1;
+        }
+      if(connection->checkpointer)
+        {
+          PyErr_Format(PyExc_ValueError, "The connection already has a Checkpointer");
+          return -1;
+        }
+      /* this gives an empty string for memory and temp databases */
+      utf8filename=getutf8string(filename=convertutf8string(sqlite3_db_filename(connection->db, "main")));
+      Py_XDECREF(filename);
+      vfs=connection->open_vfs;
+    }
+  else if(PyObject_TypeCheck(source, &ConnectionPoolType))
+    {
+      pool=(ConnectionPool*)source;
+      if(pool->closed)
+        {
+          PyErr_Format(ExcConnectionClosed, "The ConnectionPool has been closed");
+          return -1;
+        }
+      if(pool->checkpointer)
+        {
+          PyErr_Format(PyExc_ValueError, "The ConnectionPool already has a Checkpointer");
+          return -1;
+        }
+      utf8filename=getutf8string(PyTuple_GET_ITEM(pool->connargs, 0));
+      vfs=PyDict_GetItemString(pool->writerkwargs, "vfs");
+      flags|=PyIntLong_AsLong(PyDict_GetItemString(pool->writerkwargs, "flags")) & SQLITE_OPEN_URI;
+    }
+  else
+    {
+      PyErr_Format(PyExc_TypeError, "source must be a Connection or ConnectionPool");
+      return -1;
+    }
+
+  if(utf8filename && vfs && vfs!=Py_None)
+    utf8vfs=getutf8string(vfs);
+  if(!utf8filename || (vfs && vfs!=Py_None && !utf8vfs))
+    goto error;
+  if(!PyBytes_GET_SIZE(utf8filename) || 0==strcmp(PyBytes_AS_STRING(utf8filename), ":memory:"))
+    {
+      PyErr_Format(PyExc_ValueError, "Only databases in files can be checkpointed");
+      goto error;
+    }
+  self->pages=pages;
+  self->age=(sqlite3_int64)(age*1000000000.0);
+  self->restart=restart;
+  self->truncate=truncate;
+
+  _PYSQLITE_CALL_V(
+    res=sqlite3_open_v2(PyBytes_AS_STRING(utf8filename), &self->db, flags, utf8vfs?PyBytes_AS_STRING(utf8vfs):NULL); if(res!=SQLITE_OK) apsw_set_errmsg(sqlite3_errmsg(self->db));
+    );
+  SET_EXC(res, self->db);
+  if(res!=SQLITE_OK)
+    goto error;
+  /* RESTART and TRUNCATE wait for other connections */
+  _PYSQLITE_CALL_V(sqlite3_busy_timeout(self->db, busytimeout));
+
+  APSW_FAULT_INJECT(CheckpointerLockAllocFails,
+                    (self->wakeup=PyThread_allocate_lock(), self->done=PyThread_allocate_lock(), self->mutex=PyThread_allocate_lock()),
+                    (self->wakeup=self->done=self->mutex=NULL));
+  if(!self->wakeup || !self->done || !self->mutex)
+    {
+      PyErr_NoMemory();
+      goto error;
+    }
+  /* held until the worker is signalled or exits */
+  PyThread_acquire_lock(self->wakeup, WAIT_LOCK);
+  PyThread_acquire_lock(self->done, WAIT_LOCK);
+
+  self->closed=0;
+  Py_INCREF(self);
+  APSW_FAULT_INJECT(CheckpointerThreadFails, thread=(long)PyThread_start_new_thread(Checkpointer_worker, self), thread=-1);
+  if(thread==-1)
+    {
+      self->closed=1;
+      Py_DECREF(self);
+      PyErr_Format(PyExc_RuntimeError, "Unable to start the Checkpointer worker thread");
+      goto error;
+    }
+  self->running=1;
+
+  Py_INCREF(source);
+  self->source=source;
+  if(pool)
+    {
+      pool->checkpointer=self;
+      if(pool->writer)
+        Checkpointer_attach(self, pool->writer);
+    }
+  else
+    Checkpointer_attach(self, connection);
+
+  Py_DECREF(utf8filename);
+  Py_XDECREF(utf8vfs);
+  return 0;
+
+ error:
+  Py_XDECREF(utf8filename);
+  Py_XDECREF(utf8vfs);
+  return -1;
+}
+
+static void
+Checkpointer_dealloc(Checkpointer *self)
+{
+  /* the worker has a reference so it has exited */
+  assert(!self->running);
+  assert(!self->attached);
+  APSW_CLEAR_WEAKREFS;
+
+  if(self->wakeup)
+    {
+      if(!self->signalled)
+        PyThread_release_lock(self->wakeup);
+      PyThread_free_lock(self->wakeup);
+    }
+  if(self->done)
+    {
+      PyThread_acquire_lock(self->done, NOWAIT_LOCK);
+      PyThread_release_lock(self->done);
+      PyThread_free_lock(self->done);
+    }
+  if(self->mutex)
+    PyThread_free_lock(self->mutex);
+
+  if(self->db)
+    {
+      _PYSQLITE_CALL_V(sqlite3_close(self->db));
+      self->db=0;
+    }
+
+  Py_CLEAR(self->source);
+
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/** .. method:: close()
+
+  Stops the worker thread, waiting for any checkpoint in progress to
+  finish, and closes its database connection.  Commits are no longer
+  tracked, and the source connection does not go back to automatic
+  checkpointing, so call :meth:`Connection.wal_autocheckpoint` if you
+  want that.  You can call this method multiple times.
+
+  Closing the source :class:`Connection` or :class:`ConnectionPool`
+  also calls this method.
+*/
+static PyObject *
+Checkpointer_close(Checkpointer *self)
+{
+  if(self->closed)
+    Py_RETURN_NONE;
+
+  PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+  self->closed=1;
+  Checkpointer_signal(self);
+  PyThread_release_lock(self->mutex);
+
+  if(self->running)
+    {
+      Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->done, WAIT_LOCK);
+      Py_END_ALLOW_THREADS;
+      /* the worker released it */
+      PyThread_release_lock(self->done);
+    }
+
+  Checkpointer_detach(self);
+  if(PyObject_TypeCheck(self->source, &ConnectionPoolType) && ((ConnectionPool*)self->source)->checkpointer==self)
+    ((ConnectionPool*)self->source)->checkpointer=0;
+
+  _PYSQLITE_CALL_V(sqlite3_close(self->db));
+  self->db=0;
+
+  Py_RETURN_NONE;
+}
+
+/* Called when source, or a writer connection of a source pool, is
+   closed.  A pool opens another writer when needed so that is only
+   detached, otherwise there is nothing left to checkpoint. */
+static void
+Checkpointer_sourceclosed(Checkpointer *self, PyObject *source)
+{
+  PyObject *res;
+
+  if(source!=self->source)
+    {
+      if(source==(PyObject*)self->attached)
+        Checkpointer_detach(self);
+      return;
+    }
+  res=Checkpointer_close(self);
+  assert(res);
+  Py_XDECREF(res);
+}
+
+/** .. method:: stats() -> dict
+
+  Returns counts since this object was created.
+
+    passive
+      Passive checkpoints, which are done first every time
+    restart
+      Checkpoints escalated to RESTART
+    truncate
+      Checkpoints escalated to TRUNCATE
+    frames
+      Frames copied from the log to the database
+    busy
+      Checkpoints not completed because the database was busy
+    errors
+      Checkpoints that failed for other reasons
+    time
+      Seconds spent checkpointing
+    wal
+      Frames in the log as last known
+*/
+static PyObject *
+Checkpointer_stats(Checkpointer *self)
+{
+  sqlite3_int64 passive, restart, truncate, frames, busy, errors, elapsed;
+  int walframes;
+
+  if(self->mutex)
+    PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+  passive=self->st_passive;
+  restart=self->st_restart;
+  truncate=self->st_truncate;
+  frames=self->st_frames;
+  busy=self->st_busy;
+  errors=self->st_errors;
+  elapsed=self->st_time;
+  walframes=self->walframes;
+  if(self->mutex)
+    PyThread_release_lock(self->mutex);
+
+  return Py_BuildValue("{s: L, s: L, s: L, s: L, s: L, s: L, s: d, s: i}",
+                       "passive", passive,
+                       "restart", restart,
+                       "truncate", truncate,
+                       "frames", frames,
+                       "busy", busy,
+                       "errors", errors,
+                       "time", elapsed/1000000000.0,
+                       "wal", walframes);
+}
+
+/** .. attribute:: source
+
+  The :class:`Connection` or :class:`ConnectionPool` whose commits are
+  tracked.
+*/
+static PyObject *
+Checkpointer_getsource(Checkpointer *self)
+{
+  if(!self->source)
+    Py_RETURN_NONE;
+  Py_INCREF(self->source);
+  return self->source;
+}
+
+static PyMethodDef Checkpointer_methods[] = {
+  {"close", (PyCFunction)Checkpointer_close, METH_NOARGS,
+   "Stops the worker thread"},
+  {"stats", (PyCFunction)Checkpointer_stats, METH_NOARGS,
+   "Returns checkpoint statistics"},
+  {0,0,0,0}
+};
+
+static PyGetSetDef Checkpointer_getset[] = {
+  /* name getter setter doc closure */
+  {"source", (getter)Checkpointer_getsource, NULL, "The tracked Connection or ConnectionPool", NULL},
+  {0,0,0,0,0}
+};
+
+static PyTypeObject CheckpointerType = {
+    APSW_PYTYPE_INIT
+    "apsw.Checkpointer",       /*tp_name*/
+    sizeof(Checkpointer),      /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Checkpointer_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "Background WAL checkpointer", /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    offsetof(Checkpointer, weakreflist), /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    Checkpointer_methods,      /* tp_methods */
+    0,                         /* tp_members */
+    Checkpointer_getset,       /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)Checkpointer_init, /* tp_init */
+    0,                         /* tp_alloc */
+    Checkpointer_new,          /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+};
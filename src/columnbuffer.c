@@ -0,0 +1,803 @@
+/*
+  Columnar result buffers
+
+  See the accompanying LICENSE file.
+*/
+
+/**
+
+.. _columnbuffers:
+
+Column Buffers
+**************
+
+:meth:`Cursor.fetchcolumns` gets the remaining rows of the current
+statement as one :class:`ColumnBuffer` per result column instead of a
+tuple per row.  The values are stored in contiguous native memory
+without creating a Python object for each one, which is considerably
+faster and smaller when the results are going to be processed by
+column anyway.
+
+Each buffer supports the `buffer protocol
+<https://docs.python.org/3/c-api/buffer.html>`__ so you can use
+:class:`memoryview` or libraries such as numpy without copying::
+
+  cursor.execute("select price, qty, name from orders")
+  price, qty, name=cursor.fetchcolumns()
+  import numpy
+  prices=numpy.frombuffer(price, dtype=numpy.float64)
+
+The :attr:`~ColumnBuffer.kind` of a column is decided by the first
+value that is not null:
+
+* **int** - 64 bit signed integers (buffer format ``q``).  If a float
+  is encountered later then the whole column becomes float.
+
+* **float** - 64 bit doubles (buffer format ``d``).  Integers are
+  converted to float.
+
+* **text** - The UTF-8 bytes of all the values concatenated together
+  (buffer format ``B``).  :attr:`~ColumnBuffer.offsets` gives where
+  each value starts and ends.  Integers and floats are converted to
+  text by SQLite.
+
+* **blob** - The same as text but with the bytes of blobs.  Values of
+  any other type are converted to bytes by SQLite.
+
+* **null** - Every value was null (or there were no rows).  The buffer
+  is empty.
+
+A text or blob value in an int or float column, or a blob in a text
+column is an error.  :class:`TypeError` is raised and the rows are
+not returned.
+
+Null values are recorded in :attr:`~ColumnBuffer.nulls` and have zero
+(or an empty string) in the buffer.
+
+Binding from columns
+====================
+
+:meth:`Cursor.executecolumns` goes the other way, running a statement
+once per row with the parameter values taken from one column per
+parameter.  All of the columns must have the same number of rows.
+Each column can be:
+
+* A :class:`ColumnBuffer`, for example from :meth:`Cursor.fetchcolumns`
+  on another database.  Its kind and nulls are used.
+
+* Any object supporting the buffer protocol with format ``q`` (64 bit
+  signed integers) or ``d`` (64 bit doubles) such as :class:`array`,
+  numpy arrays or :class:`memoryview`.
+
+* A tuple of ``(offsets, data)`` for text, or ``(offsets, data,
+  "blob")`` for blobs.  *offsets* is a buffer of 64 bit integers with
+  one more entry than there are rows and *data* is bytes (UTF-8 for
+  text).  The layout is the same as :attr:`ColumnBuffer.offsets`.
+
+* :const:`None` for a column that is null in every row.
+
+Column buffers are only available with Python 2.6 and later.
+*/
+
+#if PY_VERSION_HEX >= 0x02060000
+
+#define COLBUF_NULL  0
+#define COLBUF_INT   1
+#define COLBUF_FLOAT 2
+#define COLBUF_TEXT  3
+#define COLBUF_BLOB  4
+
+/** .. class:: ColumnBuffer
+
+  The values of one result column as returned by
+  :meth:`Cursor.fetchcolumns`.  ``len()`` gives the number of rows.
+  You cannot create instances of this class yourself.
+*/
+
+typedef struct ColumnBuffer {
+  PyObject_HEAD
+  int kind;                     /* COLBUF_* */
+  char *data;                   /* values or text/blob bytes */
+  Py_ssize_t datasize;          /* bytes used in data */
+  Py_ssize_t dataallocated;
+  Py_ssize_t nrows;
+  unsigned char *nulls;         /* bitmap - bit set means null */
+  Py_ssize_t nullsallocated;
+  Py_ssize_t nullcount;
+  sqlite3_int64 *offsets;       /* text/blob - nrows+1 entries */
+  Py_ssize_t offsetsallocated;
+  PyObject *name;
+  PyObject *base;               /* if set then we point into its memory */
+  Py_ssize_t shape;             /* used for buffer protocol */
+} ColumnBuffer;
+
+static PyTypeObject ColumnBufferType;
+
+/* returns a new empty buffer */
+static ColumnBuffer *
+ColumnBuffer_new(PyObject *name)
+{
+  ColumnBuffer *res=PyObject_New(ColumnBuffer, &ColumnBufferType);
+  if(!res) return NULL;
+
+  res->kind=COLBUF_NULL;
+  res->data=NULL;
+  res->datasize=res->dataallocated=0;
+  res->nrows=0;
+  res->nulls=NULL;
+  res->nullsallocated=0;
+  res->nullcount=0;
+  res->offsets=NULL;
+  res->offsetsallocated=0;
+  Py_XINCREF(name);
+  res->name=name;
+  res->base=NULL;
+  res->shape=0;
+  return res;
+}
+
+static void
+ColumnBuffer_dealloc(ColumnBuffer *self)
+{
+  if(!self->base)
+    {
+      PyMem_Free(self->data);
+      PyMem_Free(self->nulls);
+      PyMem_Free(self->offsets);
+    }
+  self->data=NULL;
+  self->nulls=NULL;
+  self->offsets=NULL;
+  Py_CLEAR(self->name);
+  Py_CLEAR(self->base);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* makes sure there is space for needed bytes, zero filling new
+   space */
+static int
+colbuf_reserve(void *ptr, Py_ssize_t *allocated, Py_ssize_t needed)
+{
+  char **buf=(char**)ptr;
+  char *newbuf;
+  Py_ssize_t newsize;
+
+  if(needed<=*allocated)
+    return 0;
+
+  newsize=(*allocated)?(*allocated):256;
+  while(newsize<needed)
+    newsize*=2;
+
+  APSW_FAULT_INJECT(ColumnBufferReallocFails,newbuf=PyMem_Realloc(*buf, newsize),newbuf=NULL);
+  if(!newbuf)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+  memset(newbuf+*allocated, 0, newsize-*allocated);
+  *buf=newbuf;
+  *allocated=newsize;
+  return 0;
+}
+
+static const char *
+colbuf_kindname(int kind)
+{
+  switch(kind)
+    {
+    case COLBUF_INT:   return "int";
+    case COLBUF_FLOAT: return "float";
+    case COLBUF_TEXT:  return "text";
+    case COLBUF_BLOB:  return "blob";
+    default:           return "null";
+    }
+}
+
+/* the column has only had nulls so far - make it the kind */
+static int
+ColumnBuffer_setkind(ColumnBuffer *self, int kind)
+{
+  assert(self->kind==COLBUF_NULL);
+  self->kind=kind;
+  if(kind==COLBUF_INT || kind==COLBUF_FLOAT)
+    {
+      if(colbuf_reserve(&self->data, &self->dataallocated, sizeof(sqlite3_int64)*(self->nrows+1)))
+        return -1;
+      /* the nulls so far are zeros which are already there */
+      self->datasize=sizeof(sqlite3_int64)*self->nrows;
+      return 0;
+    }
+  if(colbuf_reserve(&self->offsets, &self->offsetsallocated, sizeof(sqlite3_int64)*(self->nrows+2)))
+    return -1;
+  return 0;
+}
+
+/* Adds the value of the column in the current row.  The caller must
+   hold the database mutex. */
+static int
+ColumnBuffer_append(ColumnBuffer *self, sqlite3_stmt *stmt, int col)
+{
+  int coltype;
+  Py_ssize_t row=self->nrows;
+
+  assert(!self->base);
+
+  if(colbuf_reserve(&self->nulls, &self->nullsallocated, row/8+1))
+    return -1;
+
+  PYSQLITE_HELD_CALL(coltype=sqlite3_column_type(stmt, col));
+
+  APSW_FAULT_INJECT(UnknownColumnBufferType,,coltype=12348);
+
+  if(coltype==SQLITE_NULL)
+    {
+      self->nulls[row/8]|=1<<(row%8);
+      self->nullcount++;
+    }
+  else if(self->kind==COLBUF_NULL)
+    {
+      switch(coltype)
+        {
+        case SQLITE_INTEGER: if(ColumnBuffer_setkind(self, COLBUF_INT)) return -1; break;
+        case SQLITE_FLOAT:   if(ColumnBuffer_setkind(self, COLBUF_FLOAT)) return -1; break;
+        case SQLITE_TEXT:    if(ColumnBuffer_setkind(self, COLBUF_TEXT)) return -1; break;
+        case SQLITE_BLOB:    if(ColumnBuffer_setkind(self, COLBUF_BLOB)) return -1; break;
+        default:
+          PyErr_Format(APSWException, "Unknown sqlite column type %d!", coltype);
+          return -1;
+        }
+    }
+
+  switch(self->kind)
+    {
+    case COLBUF_NULL:
+      assert(coltype==SQLITE_NULL);
+      break;
+
+    case COLBUF_INT:
+      if(coltype==SQLITE_FLOAT)
+        {
+          /* promote the existing values */
+          Py_ssize_t i;
+          sqlite3_int64 *ivals=(sqlite3_int64*)self->data;
+          double *dvals=(double*)self->data;
+          for(i=0;i<row;i++)
+            dvals[i]=(double)ivals[i];
+          self->kind=COLBUF_FLOAT;
+        }
+      /* FALLTHRU */
+    case COLBUF_FLOAT:
+      if(coltype==SQLITE_TEXT || coltype==SQLITE_BLOB)
+        goto badtype;
+      if(colbuf_reserve(&self->data, &self->dataallocated, self->datasize+sizeof(sqlite3_int64)))
+        return -1;
+      if(coltype==SQLITE_INTEGER && self->kind==COLBUF_INT)
+        PYSQLITE_HELD_CALL(((sqlite3_int64*)self->data)[row]=sqlite3_column_int64(stmt, col));
+      else if(coltype!=SQLITE_NULL)
+        PYSQLITE_HELD_CALL(((double*)self->data)[row]=sqlite3_column_double(stmt, col));
+      self->datasize+=sizeof(sqlite3_int64);
+      break;
+
+    case COLBUF_TEXT:
+    case COLBUF_BLOB:
+      {
+        const char *data=NULL;
+        Py_ssize_t len=0;
+
+        if(self->kind==COLBUF_TEXT && coltype==SQLITE_BLOB)
+          goto badtype;
+        if(colbuf_reserve(&self->offsets, &self->offsetsallocated, sizeof(sqlite3_int64)*(row+2)))
+          return -1;
+        if(coltype!=SQLITE_NULL)
+          {
+            if(self->kind==COLBUF_TEXT)
+              PYSQLITE_HELD_CALL( (data=(const char*)sqlite3_column_text(stmt, col), len=sqlite3_column_bytes(stmt, col)) );
+            else
+              PYSQLITE_HELD_CALL( (data=sqlite3_column_blob(stmt, col), len=sqlite3_column_bytes(stmt, col)) );
+            if(len && colbuf_reserve(&self->data, &self->dataallocated, self->datasize+len))
+              return -1;
+            if(len)
+              memcpy(self->data+self->datasize, data, len);
+            self->datasize+=len;
+          }
+        self->offsets[row+1]=self->datasize;
+        break;
+      }
+    }
+
+  self->nrows++;
+  return 0;
+
+ badtype:
+  PyErr_Format(PyExc_TypeError, "Column %d has a %s value in row %d but is a %s column", col,
+               (coltype==SQLITE_TEXT)?"text":"blob", (int)row, colbuf_kindname(self->kind));
+  return -1;
+}
+
+/* A column of parameter values for Cursor.executecolumns.  The
+   memory is kept valid (via the buffer protocol or a reference to a
+   ColumnBuffer) until ColumnSource_release so it can be bound with
+   SQLITE_STATIC and used without the GIL. */
+typedef struct ColumnSource {
+  int kind;                     /* COLBUF_* */
+  const char *data;             /* values or text/blob bytes */
+  Py_ssize_t datasize;
+  const sqlite3_int64 *offsets; /* text/blob - nrows+1 entries */
+  const unsigned char *nulls;   /* bitmap - bit set means null.  Can be NULL */
+  Py_ssize_t nrows;
+  PyObject *colbuf;             /* ColumnBuffer we point into */
+  Py_buffer views[3];           /* data, offsets, nulls */
+  int nviews;
+} ColumnSource;
+
+static void
+ColumnSource_release(ColumnSource *src)
+{
+  while(src->nviews)
+    PyBuffer_Release(&src->views[--src->nviews]);
+  Py_CLEAR(src->colbuf);
+}
+
+/* gets a contiguous view of obj, returning the element kind
+   (COLBUF_INT/FLOAT for 8 byte q/d formats else COLBUF_BLOB for bytes) */
+static int
+colsrc_getview(ColumnSource *src, PyObject *obj, Py_buffer **pview)
+{
+  Py_buffer *view=&src->views[src->nviews];
+  const char *format;
+
+  assert(src->nviews<3);
+  if(PyObject_GetBuffer(obj, view, PyBUF_ND|PyBUF_FORMAT))
+    return -1;
+  src->nviews++;
+  *pview=view;
+
+  format=view->format?view->format:"B";
+  if(*format=='@' || *format=='=' || *format=='<')
+    format++;
+  if(view->itemsize==8 && (!strcmp(format, "q") || !strcmp(format, "l")))
+    return COLBUF_INT;
+  if(view->itemsize==8 && !strcmp(format, "d"))
+    return COLBUF_FLOAT;
+  return COLBUF_BLOB;
+}
+
+/* Sets up src from one entry in the columns passed to
+   executecolumns.  nulls is None or a bitmap.  Returns zero on
+   success. */
+static int
+ColumnSource_init(ColumnSource *src, PyObject *column, PyObject *nulls, int colnum)
+{
+  Py_buffer *view;
+  int kind;
+
+  memset(src, 0, sizeof(ColumnSource));
+  src->nrows=-1;
+
+  if(column==Py_None)
+    src->kind=COLBUF_NULL;
+  else if(PyObject_TypeCheck(column, &ColumnBufferType))
+    {
+      ColumnBuffer *cb=(ColumnBuffer*)column;
+      Py_INCREF(column);
+      src->colbuf=column;
+      src->kind=cb->kind;
+      src->data=cb->data;
+      src->datasize=cb->datasize;
+      src->offsets=cb->offsets;
+      src->nulls=cb->nulls;
+      src->nrows=cb->nrows;
+    }
+  else if(PyTuple_Check(column))
+    {
+      PyObject *offsets, *data;
+      const char *kindname="text";
+      Py_ssize_t i;
+
+      if(!PyArg_ParseTuple(column, "OO|s:executecolumns text or blob column (offsets, data, kind)", &offsets, &data, &kindname))
+        goto error;
+      if(!strcmp(kindname, "text"))
+        src->kind=COLBUF_TEXT;
+      else if(!strcmp(kindname, "blob"))
+        src->kind=COLBUF_BLOB;
+      else
+        {
+          PyErr_Format(PyExc_ValueError, "Column %d kind should be text or blob not %s", colnum, kindname);
+          goto error;
+        }
+      kind=colsrc_getview(src, offsets, &view);
+      if(kind<0) goto error;
+      if(kind!=COLBUF_INT)
+        {
+          PyErr_Format(PyExc_TypeError, "Column %d offsets must be 64 bit integers (buffer format q)", colnum);
+          goto error;
+        }
+      src->offsets=(const sqlite3_int64*)view->buf;
+      src->nrows=view->len/8-1;
+      if(src->nrows<0)
+        {
+          PyErr_Format(PyExc_ValueError, "Column %d offsets must have one more entry than there are rows", colnum);
+          goto error;
+        }
+      if(colsrc_getview(src, data, &view)<0) goto error;
+      src->data=view->buf;
+      src->datasize=view->len;
+      for(i=0;i<src->nrows;i++)
+        if(src->offsets[i]<0 || src->offsets[i]>src->offsets[i+1] || src->offsets[i+1]>src->datasize
+           || src->offsets[i+1]-src->offsets[i]>APSW_INT32_MAX)
+          {
+            PyErr_Format(PyExc_ValueError, "Column %d offsets for row %d are out of range", colnum, (int)i);
+            goto error;
+          }
+    }
+  else
+    {
+      src->kind=colsrc_getview(src, column, &view);
+      if(src->kind<0) goto error;
+      if(src->kind==COLBUF_BLOB)
+        {
+          PyErr_Format(PyExc_TypeError, "Column %d buffer must have format q or d with 8 byte items, or be a tuple of (offsets, data)", colnum);
+          goto error;
+        }
+      src->data=view->buf;
+      src->datasize=view->len;
+      src->nrows=view->len/8;
+    }
+
+  if(nulls && nulls!=Py_None)
+    {
+      if(colsrc_getview(src, nulls, &view)<0)
+        goto error;
+      if(src->nrows>=0 && view->len<(src->nrows+7)/8)
+        {
+          PyErr_Format(PyExc_ValueError, "Column %d nulls bitmap is too short", colnum);
+          goto error;
+        }
+      src->nulls=view->buf;
+    }
+  return 0;
+
+ error:
+  assert(PyErr_Occurred());
+  ColumnSource_release(src);
+  return -1;
+}
+
+/* Runs stmt once per row binding each parameter from sources.  This
+   is called with the GIL released and the database mutex held (by
+   PYSQLITE_CUR_CALL) so only SQLite calls can be made.  Returns the SQLite error code with
+   *row being where it stopped.  The statement is not reset on error
+   so the caller can get the error message.  Change capture records
+   of a failing row are discarded as for a cursor step. */
+static int
+ColumnSource_execute(sqlite3_stmt *stmt, ChangeCapture *cc, ColumnSource *sources, int nsources, Py_ssize_t nrows, Py_ssize_t *row)
+{
+  int res=SQLITE_OK, i;
+  Py_ssize_t r;
+  sqlite3_int64 ccmark;
+
+  for(r=0; r<nrows; r++)
+    {
+      for(i=0; i<nsources; i++)
+        {
+          ColumnSource *src=sources+i;
+
+          if(src->kind==COLBUF_NULL || (src->nulls && (src->nulls[r/8]&(1<<(r%8)))))
+            PYSQLITE_HELD_CALL(res=sqlite3_bind_null(stmt, i+1));
+          else switch(src->kind)
+            {
+            case COLBUF_INT:
+              PYSQLITE_HELD_CALL(res=sqlite3_bind_int64(stmt, i+1, ((const sqlite3_int64*)src->data)[r]));
+              break;
+            case COLBUF_FLOAT:
+              PYSQLITE_HELD_CALL(res=sqlite3_bind_double(stmt, i+1, ((const double*)src->data)[r]));
+              break;
+            default:
+              {
+                sqlite3_int64 start=src->offsets[r], end=src->offsets[r+1];
+                /* checked in ColumnSource_init but the buffers could
+                   have been changed by another thread since */
+                if(start<0 || start>end || end>src->datasize)
+                  res=SQLITE_RANGE;
+                else if(src->kind==COLBUF_TEXT)
+                  PYSQLITE_HELD_CALL(res=sqlite3_bind_text(stmt, i+1, src->data+start, (int)(end-start), SQLITE_STATIC));
+                else
+                  PYSQLITE_HELD_CALL(res=sqlite3_bind_blob(stmt, i+1, src->data+start, (int)(end-start), SQLITE_STATIC));
+                break;
+              }
+            }
+          if(res!=SQLITE_OK)
+            goto end;
+        }
+
+      ccmark=cc?cc->head:0;
+      do
+        PYSQLITE_HELD_CALL(res=sqlite3_step(stmt));
+      while(res==SQLITE_ROW);
+      if(res!=SQLITE_DONE)
+        {
+          if(cc)
+            changecapture_stepfailed(cc, ccmark);
+          goto end;
+        }
+      PYSQLITE_HELD_CALL(res=sqlite3_reset(stmt));
+      if(res!=SQLITE_OK)
+        goto end;
+    }
+
+ end:
+  *row=r;
+  /* SQLite must not point at the buffers once they are released */
+  PYSQLITE_HELD_CALL(sqlite3_clear_bindings(stmt));
+  return (res==SQLITE_DONE)?SQLITE_OK:res;
+}
+
+static Py_ssize_t
+ColumnBuffer_len(ColumnBuffer *self)
+{
+  return self->nrows;
+}
+
+static int
+ColumnBuffer_getbuffer(ColumnBuffer *self, Py_buffer *view, int flags)
+{
+  static char empty[1];
+  Py_ssize_t itemsize=1;
+  const char *format="B";
+
+  if(flags&PyBUF_WRITABLE)
+    {
+      PyErr_Format(PyExc_BufferError, "ColumnBuffer is read only");
+      view->obj=NULL;
+      return -1;
+    }
+
+  switch(self->kind)
+    {
+    case COLBUF_INT:
+      itemsize=sizeof(sqlite3_int64);
+      format="q";
+      break;
+    case COLBUF_FLOAT:
+      itemsize=sizeof(double);
+      format="d";
+      break;
+    }
+  self->shape=self->datasize/itemsize;
+
+  view->obj=(PyObject*)self;
+  Py_INCREF(self);
+  view->buf=self->data?self->data:empty;
+  view->len=self->datasize;
+  view->readonly=1;
+  view->itemsize=itemsize;
+  view->format=(flags&PyBUF_FORMAT)?(char*)format:NULL;
+  view->ndim=1;
+  view->shape=((flags&PyBUF_ND)==PyBUF_ND)?&self->shape:NULL;
+  view->strides=((flags&PyBUF_STRIDES)==PyBUF_STRIDES)?&view->itemsize:NULL;
+  view->suboffsets=NULL;
+  view->internal=NULL;
+  return 0;
+}
+
+/** .. attribute:: kind
+
+  One of ``int``, ``float``, ``text``, ``blob`` or ``null`` as
+  described :ref:`above <columnbuffers>`.
+*/
+static PyObject *
+ColumnBuffer_getkind(ColumnBuffer *self)
+{
+  return convertutf8string(colbuf_kindname(self->kind));
+}
+
+/** .. attribute:: nulls
+
+  A bytes giving which rows are null.  The bit for row *i* is ``1 <<
+  (i % 8)`` in byte ``i >> 3``.  This is the same layout used by
+  Apache Arrow except that a set bit means null rather than valid.
+*/
+static PyObject *
+ColumnBuffer_getnulls(ColumnBuffer *self)
+{
+  PyObject *res;
+  Py_ssize_t size=(self->nrows+7)/8;
+
+  if(self->nulls)
+    return PyBytes_FromStringAndSize((const char*)self->nulls, size);
+
+  res=PyBytes_FromStringAndSize(NULL, size);
+  if(res)
+    memset(PyBytes_AS_STRING(res), 0, size);
+  return res;
+}
+
+/** .. attribute:: offsets
+
+  For text and blob columns a :class:`ColumnBuffer` of kind ``int``
+  with one more entry than there are rows.  The bytes of row *i* are
+  from ``offsets[i]`` up to but not including ``offsets[i+1]``.  It is
+  :const:`None` for other kinds of column.
+*/
+static PyObject *
+ColumnBuffer_getoffsets(ColumnBuffer *self)
+{
+  ColumnBuffer *res;
+
+  if(self->kind!=COLBUF_TEXT && self->kind!=COLBUF_BLOB)
+    Py_RETURN_NONE;
+
+  res=ColumnBuffer_new(NULL);
+  if(!res) return NULL;
+
+  res->kind=COLBUF_INT;
+  res->data=(char*)self->offsets;
+  res->datasize=sizeof(sqlite3_int64)*(self->nrows+1);
+  res->nrows=self->nrows+1;
+  Py_INCREF(self);
+  res->base=(PyObject*)self;
+  return (PyObject*)res;
+}
+
+/** .. method:: tolist() -> list
+
+  Returns the values as a list of Python objects with :const:`None`
+  for nulls.  This is mainly useful for debugging since it creates
+  the per value objects that column buffers avoid.
+*/
+static PyObject *
+ColumnBuffer_tolist(ColumnBuffer *self)
+{
+  PyObject *res, *item=NULL;
+  Py_ssize_t i;
+
+  res=PyList_New(self->nrows);
+  if(!res) return NULL;
+
+  for(i=0;i<self->nrows;i++)
+    {
+      if(self->nulls && (self->nulls[i/8]&(1<<(i%8))))
+        {
+          Py_INCREF(Py_None);
+          item=Py_None;
+        }
+      else switch(self->kind)
+        {
+        case COLBUF_INT:
+          item=PyLong_FromLongLong(((sqlite3_int64*)self->data)[i]);
+          break;
+        case COLBUF_FLOAT:
+          item=PyFloat_FromDouble(((double*)self->data)[i]);
+          break;
+        case COLBUF_TEXT:
+          item=convertutf8stringsize(self->data+self->offsets[i], (Py_ssize_t)(self->offsets[i+1]-self->offsets[i]));
+          break;
+        case COLBUF_BLOB:
+          item=converttobytes(self->data+self->offsets[i], (Py_ssize_t)(self->offsets[i+1]-self->offsets[i]));
+          break;
+        default:
+          Py_INCREF(Py_None);
+          item=Py_None;
+          break;
+        }
+      if(!item)
+        {
+          Py_DECREF(res);
+          return NULL;
+        }
+      PyList_SET_ITEM(res, i, item);
+    }
+  return res;
+}
+
+/** .. attribute:: name
+
+  The column name as returned by :meth:`Cursor.getdescription`.
+  :const:`None` for :attr:`offsets`.
+
+.. attribute:: nullcount
+
+  How many rows are null.
+*/
+static PyMemberDef ColumnBuffer_members[] = {
+  /* name type offset flags doc */
+  {"name", T_OBJECT, offsetof(ColumnBuffer, name), READONLY, "Column name"},
+  {"nullcount", T_PYSSIZET, offsetof(ColumnBuffer, nullcount), READONLY, "Number of null values"},
+  {0,0,0,0,0}
+};
+
+static PyGetSetDef ColumnBuffer_getset[] = {
+  /* name getter setter doc closure */
+  {"kind", (getter)ColumnBuffer_getkind, NULL, "Type of the values", NULL},
+  {"nulls", (getter)ColumnBuffer_getnulls, NULL, "Bitmap of null values", NULL},
+  {"offsets", (getter)ColumnBuffer_getoffsets, NULL, "Text and blob value offsets", NULL},
+  {0,0,0,0,0}
+};
+
+static PyMethodDef ColumnBuffer_methods[] = {
+  {"tolist", (PyCFunction)ColumnBuffer_tolist, METH_NOARGS,
+   "Returns values as a list"},
+  {0,0,0,0}
+};
+
+static PySequenceMethods ColumnBuffer_as_sequence = {
+  (lenfunc)ColumnBuffer_len,   /* sq_length */
+  0,                           /* sq_concat */
+  0,                           /* sq_repeat */
+  0,                           /* sq_item */
+  0,                           /* was_sq_slice */
+  0,                           /* sq_ass_item */
+  0,                           /* was_sq_ass_slice */
+  0,                           /* sq_contains */
+  0,                           /* sq_inplace_concat */
+  0,                           /* sq_inplace_repeat */
+};
+
+static PyBufferProcs ColumnBuffer_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+  0,                           /* bf_getreadbuffer */
+  0,                           /* bf_getwritebuffer */
+  0,                           /* bf_getsegcount */
+  0,                           /* bf_getcharbuffer */
+#endif
+  (getbufferproc)ColumnBuffer_getbuffer, /* bf_getbuffer */
+  0                            /* bf_releasebuffer */
+};
+
+static PyTypeObject ColumnBufferType =
+  {
+    APSW_PYTYPE_INIT
+    "apsw.ColumnBuffer",       /*tp_name*/
+    sizeof(ColumnBuffer),      /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)ColumnBuffer_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &ColumnBuffer_as_sequence, /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    &ColumnBuffer_as_buffer,   /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VERSION_TAG
+#if PY_MAJOR_VERSION < 3
+    | Py_TPFLAGS_HAVE_NEWBUFFER
+#endif
+    ,                          /*tp_flags*/
+    "Column of result values", /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    ColumnBuffer_methods,      /* tp_methods */
+    ColumnBuffer_members,      /* tp_members */
+    ColumnBuffer_getset,       /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+  };
+
+#endif /* PY_VERSION_HEX >= 0x02060000 */
@@ -39,2969 +39,5886 @@ typedef struct _aggregatefunctioncontext
   PyObject *finalfunc;            /* final function */
 } aggregatefunctioncontext;
 
-/* CONNECTION TYPE */
-
-struct Connection {
-  PyObject_HEAD
-  sqlite3 *db;                    /* the actual database connection */
-  unsigned inuse;                 /* track if we are in use preventing concurrent thread mangling */
-
-  struct StatementCache *stmtcache;      /* prepared statement cache */
+/* Row factories.  Rows are built natively as one of these - see
+   Connection.setrowfactory */
+#define ROWFACTORY_TUPLE 0
+#define ROWFACTORY_NAMED 1
+#define ROWFACTORY_DICT  2
 
-  PyObject *dependents;           /* tracking cursors & blobs belonging to this connection */
-  PyObject *dependent_remove;     /* dependents.remove for weak ref processing */
-
-  /* registered hooks/handlers (NULL or callable) */
-  PyObject *busyhandler;
-  PyObject *rollbackhook;
-  PyObject *profile;
-  PyObject *updatehook;
-  PyObject *commithook;
-  PyObject *walhook;
-  PyObject *progresshandler;
-  PyObject *authorizer;
-  PyObject *collationneeded;
-  PyObject *exectrace;
-  PyObject *rowtrace;
+static const char *rowfactory_names[]={"tuple", "named", "dict"};
 
-  /* if we are using one of our VFS since sqlite doesn't reference count them */
-  PyObject *vfs;
+/* Returns the ROWFACTORY_* value for name, or -1 with an exception set */
+static int
+rowfactory_from_name(const char *name)
+{
+  int i;
+  for(i=0;i<(int)(sizeof(rowfactory_names)/sizeof(rowfactory_names[0]));i++)
+    if(0==strcmp(name, rowfactory_names[i]))
+      {
+#if PY_VERSION_HEX < 0x02070000
+        if(i==ROWFACTORY_NAMED)
+          {
+            PyErr_Format(PyExc_ValueError, "Named rows require Python 2.7 or later");
+            return -1;
+          }
+#endif
+        return i;
+      }
+  PyErr_Format(PyExc_ValueError, "Unknown row factory \"%s\" - should be tuple, named or dict", name);
+  return -1;
+}
 
-  /* used for nested with (contextmanager) statements */
-  long savepointlevel;
+/* Latency profile - see Connection.setlatencyprofile.  Each query
+   text gets a log-linear histogram of execution times: a power of two
+   is split into LP_SUB linear buckets so the error is at most 1/LP_SUB.
+   Everything is done in C with the database mutex held as SQLite
+   calls the trace callback. */
+#define LP_SUBBITS 4
+#define LP_SUB (1<<LP_SUBBITS)
+/* times are clamped to 2**LP_MAXBITS nanoseconds (about 18 minutes) */
+#define LP_MAXBITS 40
+#define LP_NBUCKETS ((LP_MAXBITS-LP_SUBBITS+1)*LP_SUB)
+/* how many different queries are tracked.  Others go in overflow */
+#define LP_MAXENTRIES 512
+#define LP_TABLESIZE (2*LP_MAXENTRIES)
+/* how many statements executing at the same time have their rows counted */
+#define LP_MAXACTIVE 8
+
+typedef struct LatencyEntry {
+  char *sql;                      /* query text, NULL for the overflow entry */
+  unsigned hash;
+  sqlite3_int64 count;            /* executions */
+  sqlite3_int64 rows;             /* rows returned */
+  sqlite3_int64 total;            /* total nanoseconds */
+  sqlite3_int64 max;              /* longest nanoseconds */
+  unsigned buckets[LP_NBUCKETS];
+} LatencyEntry;
+
+typedef struct LatencyProfile {
+  LatencyEntry *table[LP_TABLESIZE];     /* open addressing hash table of entries allocated with sqlite3_malloc */
+  unsigned nentries;
+  LatencyEntry overflow;                 /* queries once the table has LP_MAXENTRIES */
+  struct {
+    sqlite3_stmt *stmt;
+    sqlite3_int64 rows;
+    sqlite3_int64 start;                 /* apsw_now_ns() when it started, zero if not known */
+  } active[LP_MAXACTIVE];                /* executing statements */
+} LatencyProfile;
+
+/* Discards the recorded times, keeping the rows of statements
+   currently executing */
+static void
+latencyprofile_reset(LatencyProfile *lp)
+{
+  unsigned i;
 
-  /* informational attributes */
-  PyObject *open_flags;
-  PyObject *open_vfs;
+  for(i=0; i<LP_TABLESIZE; i++)
+    if(lp->table[i])
+      {
+        sqlite3_free(lp->table[i]->sql);
+        sqlite3_free(lp->table[i]);
+        lp->table[i]=0;
+      }
+  lp->nentries=0;
+  memset(&lp->overflow, 0, sizeof(lp->overflow));
+}
 
-  /* weak reference support */
-  PyObject *weakreflist;
+/* Result cache - see Connection.setresultcache.  Each table read by a
+   cached query has a version number which is incremented by the
+   update hook, and for every table of a database when PRAGMA
+   data_version shows another connection changed it.  An entry keeps
+   the versions of the tables it read so only entries whose tables
+   changed are invalidated.  The tables are recorded by the authorizer
+   while the query is prepared.  The hooks only use these C structures
+   and are called with the database mutex held. */
+#define RC_MAXTABLES 256
+#define RC_TABLESIZE (2*RC_MAXTABLES)
+#define RC_MAXSCHEMAS 10
+/* tables read by one query */
+#define RC_MAXCAPTURE 32
+/* queries whose tables are remembered */
+#define RC_MAXQUERIES 1024
+
+typedef struct ResultCacheTable {
+  char *name;                     /* table name allocated with sqlite3_malloc */
+  unsigned hash;
+  int schema;                     /* index into schemas */
+  sqlite3_int64 version;          /* incremented when the table changes */
+} ResultCacheTable;
+
+typedef struct ResultCacheSchema {
+  char *name;                     /* main, temp or an attached database */
+  int temp;                       /* only this connection can change it */
+  sqlite3_stmt *dataversion;      /* PRAGMA data_version for the database */
+  sqlite3_int64 version;          /* what it last returned */
+  int known;                      /* version is valid */
+  int failed;                     /* the pragma couldn't be prepared so results aren't cached */
+} ResultCacheSchema;
+
+typedef struct ResultCache {
+  ResultCacheTable *tables[RC_TABLESIZE];   /* open addressing hash table */
+  unsigned ntables;
+  ResultCacheSchema schemas[RC_MAXSCHEMAS];
+  int nschemas;
+  sqlite3_int64 generation;       /* incremented to invalidate every entry */
+  int reset;                      /* tables were created, dropped or altered */
+
+  int capturing;                  /* the authorizer is recording the tables read */
+  int captured[RC_MAXCAPTURE];    /* their slots in tables */
+  int ncaptured;
+  char *anyschema[RC_MAXCAPTURE]; /* tables read without a database name */
+  int nanyschema;
+  int uncacheable;                /* too many tables or a non-deterministic function */
+
+  sqlite3_int64 hookchanges;      /* rows the update hook was called for */
+  sqlite3_int64 lasthookchanges;
+  int lasttotalchanges;           /* sqlite3_total_changes when last checked */
+
+  PyObject *entries;              /* dict of key -> (rows, generation, (slot, version, ...)) */
+  PyObject *querytables;          /* dict of query -> (slot, ...) or None if it can't be cached */
+  int size;                       /* maximum entries */
+  sqlite3_int64 hits, misses, invalidations, evictions, uncached;
+} ResultCache;
+
+/* Built in functions whose results change between calls */
+static const char *resultcache_volatile[]={"random", "randomblob", "changes", "total_changes", "last_insert_rowid",
+                                           "date", "time", "datetime", "julianday", "strftime",
+                                           "current_date", "current_time", "current_timestamp"};
+
+/* Returns the index of the database, adding it if add is set, or -1 */
+static int
+resultcache_schema(ResultCache *rc, const char *name, int add)
+{
+  int i;
+  size_t len;
 
-};
+  for(i=0; i<rc->nschemas; i++)
+    if(0==strcmp(rc->schemas[i].name, name))
+      return i;
 
-typedef struct Connection Connection;
+  if(!add || rc->nschemas==RC_MAXSCHEMAS)
+    return -1;
 
-static PyTypeObject ConnectionType;
+  len=strlen(name);
+  memset(&rc->schemas[i], 0, sizeof(ResultCacheSchema));
+  PYSQLITE_HELD_CALL(rc->schemas[i].name=sqlite3_malloc((int)len+1));
+  if(!rc->schemas[i].name)
+    return -1;
+  memcpy(rc->schemas[i].name, name, len+1);
+  rc->schemas[i].temp=(0==strcmp(name, "temp"));
+  rc->nschemas++;
+  return i;
+}
 
-typedef struct _vtableinfo
+/* Returns the slot of the table, adding it if add is set, or -1 */
+static int
+resultcache_table(ResultCache *rc, const char *dbname, const char *name, int add)
 {
-  PyObject *datasource;           /* object with create/connect methods */
-  Connection *connection;         /* the Connection this is registered against so we don't
-				     have to have a global table mapping sqlite3_db* to
-				     Connection* */
-} vtableinfo;
-
-/* forward declarations */
-struct APSWBlob;
-static void APSWBlob_init(struct APSWBlob *self, Connection *connection, sqlite3_blob *blob);
-static PyTypeObject APSWBlobType;
+  unsigned hash=2166136261u, slot;
+  int schema;
+  size_t len;
+  const char *p;
+  ResultCacheTable *table;
+
+  schema=resultcache_schema(rc, dbname, add);
+  if(schema<0)
+    return -1;
 
-#ifdef EXPERIMENTAL
-struct APSWBackup;
-static void APSWBackup_init(struct APSWBackup *self, Connection *dest, Connection *source, sqlite3_backup *backup);
-static PyTypeObject APSWBackupType;
-#endif
+  /* FNV-1a */
+  for(p=name; *p; p++)
+    hash=(hash ^ (unsigned char)*p)*16777619u;
+  len=p-name;
+  hash^=(unsigned)schema;
 
-struct APSWCursor;
-static void APSWCursor_init(struct APSWCursor *, Connection *);
-static PyTypeObject APSWCursorType;
+  for(slot=hash%RC_TABLESIZE; rc->tables[slot]; slot=(slot+1)%RC_TABLESIZE)
+    if(rc->tables[slot]->hash==hash && rc->tables[slot]->schema==schema && 0==strcmp(rc->tables[slot]->name, name))
+      return (int)slot;
 
-struct ZeroBlobBind;
-static PyTypeObject ZeroBlobBindType;
+  if(!add || rc->ntables>=RC_MAXTABLES)
+    return -1;
 
+  PYSQLITE_HELD_CALL(table=sqlite3_malloc(sizeof(ResultCacheTable)));
+  if(!table)
+    return -1;
+  PYSQLITE_HELD_CALL(table->name=sqlite3_malloc((int)len+1));
+  if(!table->name)
+    {
+      sqlite3_free(table);
+      return -1;
+    }
+  memcpy(table->name, name, len+1);
+  table->hash=hash;
+  table->schema=schema;
+  table->version=0;
+  rc->tables[slot]=table;
+  rc->ntables++;
+  return (int)slot;
+}
 
+/* Adds the table to those read by the query being prepared */
 static void
-FunctionCBInfo_dealloc(FunctionCBInfo *self)
+resultcache_capture(ResultCache *rc, int slot)
 {
-  if(self->name)
-    PyMem_Free(self->name);
-  Py_CLEAR(self->scalarfunc);
-  Py_CLEAR(self->aggregatefactory);
-  Py_TYPE(self)->tp_free((PyObject*)self);
+  int i;
+
+  if(slot<0 || rc->ncaptured==RC_MAXCAPTURE)
+    {
+      rc->uncacheable=1;
+      return;
+    }
+  for(i=0; i<rc->ncaptured; i++)
+    if(rc->captured[i]==slot)
+      return;
+  rc->captured[rc->ncaptured++]=slot;
 }
 
-/** .. class:: Connection
+/* Called by the authorizer as statements are prepared */
+static void
+resultcache_authorize(ResultCache *rc, int operation, const char *paramone, const char *paramtwo, const char *databasename)
+{
+  unsigned i;
+  int cmp;
+  size_t len;
 
+  switch(operation)
+    {
+    case SQLITE_READ:
+      if(!rc->capturing || !paramone)
+        return;
+      if(databasename)
+        {
+          resultcache_capture(rc, resultcache_table(rc, databasename, paramone, 1));
+          return;
+        }
+      /* count(*) and similar don't say which database so the table is
+         looked for in all of them once preparation is finished */
+      if(rc->nanyschema==RC_MAXCAPTURE)
+        {
+          rc->uncacheable=1;
+          return;
+        }
+      len=strlen(paramone);
+      PYSQLITE_HELD_CALL(rc->anyschema[rc->nanyschema]=sqlite3_malloc((int)len+1));
+      if(!rc->anyschema[rc->nanyschema])
+        {
+          rc->uncacheable=1;
+          return;
+        }
+      memcpy(rc->anyschema[rc->nanyschema++], paramone, len+1);
+      return;
 
-  This object wraps a `sqlite3 pointer
-  <https://sqlite.org/c3ref/sqlite3.html>`_.
-*/
+    case SQLITE_FUNCTION:
+      if(!rc->capturing || !paramtwo)
+        return;
+      for(i=0; i<sizeof(resultcache_volatile)/sizeof(resultcache_volatile[0]); i++)
+        {
+          PYSQLITE_HELD_CALL(cmp=sqlite3_stricmp(paramtwo, resultcache_volatile[i]));
+          if(0==cmp)
+            rc->uncacheable=1;
+        }
+      return;
 
-/* CONNECTION CODE */
+    /* these change which tables names refer to or what they contain */
+    case SQLITE_CREATE_TABLE:
+    case SQLITE_CREATE_TEMP_TABLE:
+    case SQLITE_CREATE_VIEW:
+    case SQLITE_CREATE_TEMP_VIEW:
+    case SQLITE_CREATE_VTABLE:
+    case SQLITE_DROP_TABLE:
+    case SQLITE_DROP_TEMP_TABLE:
+    case SQLITE_DROP_VIEW:
+    case SQLITE_DROP_TEMP_VIEW:
+    case SQLITE_DROP_VTABLE:
+    case SQLITE_ALTER_TABLE:
+    case SQLITE_ATTACH:
+    case SQLITE_DETACH:
+      rc->reset=1;
+      return;
+
+    default:
+      return;
+    }
+}
 
+/* Called by the update hook */
 static void
-Connection_internal_cleanup(Connection *self)
+resultcache_changed(ResultCache *rc, const char *databasename, const char *tablename)
 {
-  Py_CLEAR(self->busyhandler);
-  Py_CLEAR(self->rollbackhook);
-  Py_CLEAR(self->profile);
-  Py_CLEAR(self->updatehook);
-  Py_CLEAR(self->commithook);
-  Py_CLEAR(self->walhook);
-  Py_CLEAR(self->progresshandler);
-  Py_CLEAR(self->authorizer);
-  Py_CLEAR(self->collationneeded);
-  Py_CLEAR(self->exectrace);
-  Py_CLEAR(self->rowtrace);
-  Py_CLEAR(self->vfs);
-  Py_CLEAR(self->open_flags);
-  Py_CLEAR(self->open_vfs);
+  int slot;
+
+  rc->hookchanges++;
+  if(!databasename || !tablename)
+    return;
+  slot=resultcache_table(rc, databasename, tablename, 0);
+  if(slot>=0)
+    rc->tables[slot]->version++;
 }
 
-static int
-Connection_close_internal(Connection *self, int force)
+/* Invalidates entries that read any table in the database */
+static void
+resultcache_schemachanged(ResultCache *rc, int schema)
 {
-  Py_ssize_t i;
-  int res;
-  PyObject *etype, *eval, *etb;
+  unsigned i;
 
-  if(force==2)
-    PyErr_Fetch(&etype, &eval, &etb);
+  for(i=0; i<RC_TABLESIZE; i++)
+    if(rc->tables[i] && rc->tables[i]->schema==schema)
+      rc->tables[i]->version++;
+}
 
-  /* Traverse dependents calling close.  We assume the list may be
-     perturbed by item we just called close on being removed from the
-     list. */
-  for(i=0; i<PyList_GET_SIZE(self->dependents);)
+/* Forgets all entries, tables and databases.  Called with the
+   database mutex held. */
+static void
+resultcache_clear(ResultCache *rc)
+{
+  unsigned i;
+  int j;
+
+  for(i=0; i<RC_TABLESIZE; i++)
+    if(rc->tables[i])
+      {
+        sqlite3_free(rc->tables[i]->name);
+        sqlite3_free(rc->tables[i]);
+        rc->tables[i]=0;
+      }
+  rc->ntables=0;
+  for(j=0; j<rc->nschemas; j++)
     {
-      PyObject *item, *closeres, *orig;
+      if(rc->schemas[j].dataversion)
+        PYSQLITE_HELD_CALL(sqlite3_finalize(rc->schemas[j].dataversion));
+      sqlite3_free(rc->schemas[j].name);
+    }
+  rc->nschemas=0;
+  rc->reset=0;
+  rc->generation++;
+  PyDict_Clear(rc->entries);
+  PyDict_Clear(rc->querytables);
+}
 
-      orig=PyList_GET_ITEM(self->dependents, i);
-      item=PyWeakref_GetObject(orig);
-      if(!item || item==Py_None)
-        {
-          i++;
-          continue;
-        }
+/* Detects changes the update hook doesn't report.  Called with the
+   database mutex held before entries are looked up. */
+static void
+resultcache_sync(ResultCache *rc, sqlite3 *db)
+{
+  int i, res, total;
+  sqlite3_int64 version=0;
+
+  if(rc->reset)
+    resultcache_clear(rc);
+
+  /* Rows changed in WITHOUT ROWID and virtual tables, or deleted by
+     the truncate optimization, are counted but don't call the update
+     hook so everything has to be invalidated */
+  total=sqlite3_total_changes(db);
+  if((sqlite3_int64)(unsigned)(total-rc->lasttotalchanges) > rc->hookchanges-rc->lasthookchanges)
+    rc->generation++;
+  rc->lasttotalchanges=total;
+  rc->lasthookchanges=rc->hookchanges;
+
+  /* changes committed by other connections */
+  for(i=0; i<rc->nschemas; i++)
+    {
+      ResultCacheSchema *schema=&rc->schemas[i];
 
-      closeres=Call_PythonMethodV(item, "close", 1, "(i)", !!force);
-      Py_XDECREF(closeres);
-      if(!closeres)
+      if(schema->temp || schema->failed)
+        continue;
+      if(!schema->dataversion)
         {
-          assert(PyErr_Occurred());
-          if(force==2)
-            apsw_write_unraiseable(NULL);
-          else
-            return 1;
+          char *sql=sqlite3_mprintf("pragma \"%w\".data_version", schema->name);
+          res=SQLITE_NOMEM;
+          if(sql)
+            PYSQLITE_HELD_CALL(res=sqlite3_prepare_v2(db, sql, -1, &schema->dataversion, NULL));
+          sqlite3_free(sql);
+          if(res!=SQLITE_OK || !schema->dataversion)
+            {
+              schema->failed=1;
+              resultcache_schemachanged(rc, i);
+              continue;
+            }
         }
-      if(i<PyList_GET_SIZE(self->dependents) && orig==PyList_GET_ITEM(self->dependents, i))
+      PYSQLITE_HELD_CALL(res=sqlite3_step(schema->dataversion));
+      if(res==SQLITE_ROW)
+        PYSQLITE_HELD_CALL(version=sqlite3_column_int64(schema->dataversion, 0));
+      PYSQLITE_HELD_CALL(sqlite3_reset(schema->dataversion));
+      if(res!=SQLITE_ROW)
         {
-          /* list was not perturbed */
-          i++;
+          /* eg busy - results aren't cached until it works again */
+          resultcache_schemachanged(rc, i);
+          schema->known=0;
+          continue;
         }
+      if(schema->known && version!=schema->version)
+        resultcache_schemachanged(rc, i);
+      schema->version=version;
+      schema->known=1;
     }
+}
 
-  if(self->stmtcache)
-    statementcache_free(self->stmtcache);
-  self->stmtcache=0;
+/* Discards entries, least recently used first, until there are at
+   most n.  Hits move their entry to the end of the dict. */
+static void
+resultcache_evict(ResultCache *rc, Py_ssize_t n)
+{
+  while(PyDict_Size(rc->entries)>n)
+    {
+      Py_ssize_t pos=0;
+      PyObject *key, *value;
+
+      if(!PyDict_Next(rc->entries, &pos, &key, &value))
+        break;
+      Py_INCREF(key);
+      PyDict_DelItem(rc->entries, key);
+      Py_DECREF(key);
+      rc->evictions++;
+    }
+}
 
-  PYSQLITE_VOID_CALL(
-    APSW_FAULT_INJECT(ConnectionCloseFail, res=sqlite3_close(self->db), res=SQLITE_IOERR)
-    );
+/* Returns the entry key for the query and bindings, or NULL with an
+   exception set.  Values are accompanied by their type since 1, 1.0
+   and True are equal but give different results. */
+static PyObject *
+resultcache_key(PyObject *query, PyObject *bindings, int rowfactory)
+{
+  PyObject *key=NULL, *items=NULL, *pyrowfactory=NULL;
+  Py_ssize_t i, n, width;
 
-  self->db=0;
+  if(bindings==Py_None)
+    n=0, width=0;
+  else if(PyDict_Check(bindings))
+    {
+      items=PyDict_Items(bindings);
+      if(!items || PyList_Sort(items))
+        goto error;
+      n=PyList_GET_SIZE(items);
+      width=3;
+    }
+  else
+    {
+      items=PySequence_Fast(bindings, "You must supply a dict or a sequence");
+      if(!items)
+        goto error;
+      n=PySequence_Fast_GET_SIZE(items);
+      width=2;
+    }
 
-  if (res!=SQLITE_OK)
+  pyrowfactory=PyInt_FromLong(rowfactory);
+  key=PyTuple_New(2+n*width);
+  if(!pyrowfactory || !key)
+    goto error;
+  Py_INCREF(query);
+  PyTuple_SET_ITEM(key, 0, query);
+  PyTuple_SET_ITEM(key, 1, pyrowfactory);
+  pyrowfactory=NULL;
+  for(i=0; i<n; i++)
     {
-      SET_EXC(res, NULL);
-      if(force==2)
+      PyObject *name=NULL, *value;
+
+      if(width==3)
         {
-          PyErr_Format(ExcConnectionNotClosed,
-                       "apsw.Connection at address %p. The destructor "
-                       "has encountered an error %d closing the connection, but cannot raise an exception.",
-                       self, res);
-          apsw_write_unraiseable(NULL);
+          name=PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 0);
+          value=PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 1);
+          Py_INCREF(name);
+          PyTuple_SET_ITEM(key, 2+i*width, name);
         }
+      else
+        value=PySequence_Fast_GET_ITEM(items, i);
+      Py_INCREF(Py_TYPE(value));
+      PyTuple_SET_ITEM(key, 2+i*width+width-2, (PyObject*)Py_TYPE(value));
+      Py_INCREF(value);
+      PyTuple_SET_ITEM(key, 2+i*width+width-1, value);
     }
+  Py_XDECREF(items);
 
-  Connection_internal_cleanup(self);
-
-  if(PyErr_Occurred())
+  /* bindings such as bytearray can't be keys */
+  if(PyObject_Hash(key)==-1)
     {
-      assert(force!=2);
-      AddTraceBackHere(__FILE__, __LINE__, "Connection.close", NULL);
-      return 1;
+      Py_DECREF(key);
+      return NULL;
     }
+  return key;
 
-  if(force==2)
-    PyErr_Restore(etype, eval, etb);
-  return 0;
+ error:
+  Py_XDECREF(items);
+  Py_XDECREF(pyrowfactory);
+  Py_XDECREF(key);
+  return NULL;
 }
 
-/** .. method:: close([force=False])
+/* Returns a tuple of the slots of the tables the query reads, None if
+   its results can't be cached, or NULL with an exception set.  Called
+   with the database mutex held. */
+static PyObject *
+resultcache_tables(ResultCache *rc, sqlite3 *db, PyObject *query)
+{
+  PyObject *utf8=NULL, *retval=NULL;
+  sqlite3_stmt *stmt=NULL, *names=NULL;
+  const char *sql, *tail=NULL;
+  Py_ssize_t len;
+  int res, readonly, i;
 
-  Closes the database.  If there are any outstanding :class:`cursors
-  <Cursor>`, :class:`blobs <blob>` or :class:`backups <backup>` then
-  they are closed too.  It is normally not necessary to call this
-  method as the database is automatically closed when there are no
-  more references.  It is ok to call the method multiple times.
+  retval=PyDict_GetItem(rc->querytables, query);
+  if(retval)
+    {
+      Py_INCREF(retval);
+      return retval;
+    }
 
-  If your user defined functions or collations have direct or indirect
-  references to the Connection then it won't be automatically garbage
-  collected because of circular referencing that can't be
-  automatically broken.  Calling *close* will free all those objects
-  and what they reference.
+  utf8=getutf8string(query);
+  if(!utf8)
+    return NULL;
+  sql=PyBytes_AS_STRING(utf8);
+  len=PyBytes_GET_SIZE(utf8);
+  if(len>APSW_INT32_MAX-1)
+    {
+      Py_DECREF(utf8);
+      SET_EXC(SQLITE_TOOBIG, NULL);
+      return NULL;
+    }
 
-  SQLite is designed to survive power failures at even the most
-  awkward moments.  Consequently it doesn't matter if it is closed
-  when the process is exited, or even if the exit is graceful or
-  abrupt.  In the worst case of having a transaction in progress, that
-  transaction will be rolled back by the next program to open the
-  database, reverting the database to a know good state.
+  rc->capturing=1;
+  rc->ncaptured=0;
+  rc->nanyschema=0;
+  rc->uncacheable=0;
+  PYSQLITE_HELD_CALL(res=sqlite3_prepare_v2(db, sql, (int)len+1, &stmt, &tail));
+  rc->capturing=0;
 
-  If *force* is *True* then any exceptions are ignored.
+  if(res!=SQLITE_OK || !stmt)
+    {
+      /* the error is reported when the query is run */
+      retval=Py_None;
+      Py_INCREF(retval);
+      goto finally;
+    }
 
-   -* sqlite3_close
-*/
+  while(tail && tail<sql+len && strchr(" \t\r\n\f\v;", *tail))
+    tail++;
+  if(tail && tail<sql+len)
+    {
+      PyErr_Format(PyExc_ValueError, "Query contains more than one statement");
+      goto finally;
+    }
+  PYSQLITE_HELD_CALL(readonly=sqlite3_stmt_readonly(stmt));
+  if(!readonly)
+    {
+      PyErr_Format(PyExc_ValueError, "Query is not read only");
+      goto finally;
+    }
 
-/* Closes cursors and blobs belonging to this connection */
+  if(rc->nanyschema)
+    {
+      PYSQLITE_HELD_CALL(res=sqlite3_prepare_v2(db, "pragma database_list", -1, &names, NULL));
+      if(res!=SQLITE_OK)
+        rc->uncacheable=1;
+      else
+        for(;;)
+          {
+            const char *dbname;
+
+            PYSQLITE_HELD_CALL(res=sqlite3_step(names));
+            if(res!=SQLITE_ROW)
+              break;
+            PYSQLITE_HELD_CALL(dbname=(const char*)sqlite3_column_text(names, 1));
+            for(i=0; dbname && i<rc->nanyschema; i++)
+              resultcache_capture(rc, resultcache_table(rc, dbname, rc->anyschema[i], 1));
+          }
+      if(res!=SQLITE_DONE)
+        rc->uncacheable=1;
+    }
+
+  if(rc->uncacheable)
+    {
+      retval=Py_None;
+      Py_INCREF(retval);
+    }
+  else
+    {
+      retval=PyTuple_New(rc->ncaptured);
+      for(i=0; retval && i<rc->ncaptured; i++)
+        {
+          PyObject *slot=PyInt_FromLong(rc->captured[i]);
+          if(!slot)
+            Py_CLEAR(retval);
+          else
+            PyTuple_SET_ITEM(retval, i, slot);
+        }
+      if(!retval)
+        goto finally;
+    }
+
+  if(PyDict_Size(rc->querytables)>=RC_MAXQUERIES)
+    PyDict_Clear(rc->querytables);
+  if(PyDict_SetItem(rc->querytables, query, retval))
+    Py_CLEAR(retval);
+
+ finally:
+  if(stmt)
+    PYSQLITE_HELD_CALL(sqlite3_finalize(stmt));
+  if(names)
+    PYSQLITE_HELD_CALL(sqlite3_finalize(names));
+  for(i=0; i<rc->nanyschema; i++)
+    sqlite3_free(rc->anyschema[i]);
+  rc->nanyschema=0;
+  Py_DECREF(utf8);
+  if(PyErr_Occurred())
+    Py_CLEAR(retval);
+  return retval;
+}
+
+/* Returns (slot, version, ...) for the tables, None if the results
+   can't be cached, or NULL with an exception set.  Called with the
+   database mutex held. */
 static PyObject *
-Connection_close(Connection *self, PyObject *args)
+resultcache_versions(ResultCache *rc, PyObject *slots)
 {
-  int force=0;
-
-  CHECK_USE(NULL);
+  PyObject *retval;
+  Py_ssize_t i, n=PyTuple_GET_SIZE(slots);
 
-  assert(!PyErr_Occurred());
+  for(i=0; i<n; i++)
+    {
+      long slot=PyIntLong_AsLong(PyTuple_GET_ITEM(slots, i));
+      ResultCacheSchema *schema;
+
+      /* the tables were forgotten */
+      if(!rc->tables[slot])
+        Py_RETURN_NONE;
+      schema=&rc->schemas[rc->tables[slot]->schema];
+      if(!schema->temp && (schema->failed || !schema->known))
+        Py_RETURN_NONE;
+    }
 
-  if(!PyArg_ParseTuple(args, "|i:close(force=False)", &force))
+  retval=PyTuple_New(2*n);
+  if(!retval)
     return NULL;
+  for(i=0; i<n; i++)
+    {
+      long slot=PyIntLong_AsLong(PyTuple_GET_ITEM(slots, i));
+      PyObject *pyslot=PyInt_FromLong(slot), *version=PyLong_FromLongLong(rc->tables[slot]->version);
+
+      if(pyslot)
+        PyTuple_SET_ITEM(retval, 2*i, pyslot);
+      if(version)
+        PyTuple_SET_ITEM(retval, 2*i+1, version);
+      if(!pyslot || !version)
+        {
+          Py_DECREF(retval);
+          return NULL;
+        }
+    }
+  return retval;
+}
 
-  force=!!force; /* must be zero or one */
+/* Returns true if none of the tables read by the entry have changed */
+static int
+resultcache_valid(ResultCache *rc, PyObject *entry)
+{
+  PyObject *versions=PyTuple_GET_ITEM(entry, 2);
+  Py_ssize_t i;
 
-  if(Connection_close_internal(self, force))
+  if(PyLong_AsLongLong(PyTuple_GET_ITEM(entry, 1))!=rc->generation)
+    return 0;
+  for(i=0; i<PyTuple_GET_SIZE(versions); i+=2)
     {
-      assert(PyErr_Occurred());
-      return NULL;
+      long slot=PyIntLong_AsLong(PyTuple_GET_ITEM(versions, i));
+      if(!rc->tables[slot] || rc->tables[slot]->version!=PyLong_AsLongLong(PyTuple_GET_ITEM(versions, i+1)))
+        return 0;
     }
-
-  Py_RETURN_NONE;
+  return 1;
 }
 
+/* Frees the cache.  The hooks must already have been removed. */
 static void
-Connection_dealloc(Connection* self)
+resultcache_free(ResultCache *rc, sqlite3 *db)
 {
-  APSW_CLEAR_WEAKREFS;
+  APSW_DB_MUTEX_ENTER(db);
+  resultcache_clear(rc);
+  APSW_DB_MUTEX_LEAVE(db);
+  Py_XDECREF(rc->entries);
+  Py_XDECREF(rc->querytables);
+  PyMem_Free(rc);
+}
 
-  Connection_close_internal(self, 2);
+/* Change capture - see Connection.setchangecapture.  The update hook
+   appends a record for each changed row to a ring buffer without
+   taking the GIL.  The commit hook marks the records of the
+   transaction as committing, and they become committed once a
+   statement finishes with the transaction ended
+   (changecapture_settle) since the commit can still fail.  The
+   rollback hook discards them, as does a failed statement for its own
+   changes.  Sequence numbers only increase with the slot being the
+   sequence number modulo size.  They are only used with the database
+   mutex held. */
+#define CC_MAXNAMES 1024
+
+typedef struct ChangeCaptureRecord {
+  int op;                         /* SQLITE_INSERT, SQLITE_DELETE or SQLITE_UPDATE */
+  int name;                       /* index into names */
+  sqlite3_int64 rowid;
+} ChangeCaptureRecord;
+
+typedef struct ChangeCaptureName {
+  char *dbname;                   /* allocated with sqlite3_mprintf */
+  char *tablename;
+  PyObject *pydbname;             /* created when first drained */
+  PyObject *pytablename;
+} ChangeCaptureName;
+
+typedef struct ChangeCapture {
+  ChangeCaptureRecord *records;
+  sqlite3_int64 size;
+  sqlite3_int64 tail;             /* oldest record not drained */
+  sqlite3_int64 committed;        /* records before this were committed */
+  sqlite3_int64 committing;       /* records before this are being committed */
+  sqlite3_int64 head;             /* where the next record goes */
+  ChangeCaptureName names[CC_MAXNAMES];
+  int nnames;
+  int lastname;                   /* consecutive changes are usually to the same table */
+  PyObject *oncommit;             /* callable or NULL */
+  int notifying;                  /* oncommit is being called */
+  sqlite3_int64 captured, lost, rolledback;
+} ChangeCapture;
+
+/* Returns the index of the database and table name, adding it if
+   needed, or -1 */
+static int
+changecapture_name(ChangeCapture *cc, const char *dbname, const char *tablename)
+{
+  int i;
 
-  /* Our dependents all hold a refcount on us, so they must have all
-     released before this destructor could be called */
-  assert(PyList_GET_SIZE(self->dependents)==0);
-  Py_CLEAR(self->dependents);
-  Py_CLEAR(self->dependent_remove);
+  if(cc->nnames && 0==strcmp(cc->names[cc->lastname].tablename, tablename) && 0==strcmp(cc->names[cc->lastname].dbname, dbname))
+    return cc->lastname;
 
-  Py_TYPE(self)->tp_free((PyObject*)self);
+  for(i=0; i<cc->nnames; i++)
+    if(0==strcmp(cc->names[i].tablename, tablename) && 0==strcmp(cc->names[i].dbname, dbname))
+      return cc->lastname=i;
+
+  if(cc->nnames==CC_MAXNAMES)
+    return -1;
+  cc->names[i].dbname=sqlite3_mprintf("%s", dbname);
+  cc->names[i].tablename=sqlite3_mprintf("%s", tablename);
+  if(!cc->names[i].dbname || !cc->names[i].tablename)
+    {
+      sqlite3_free(cc->names[i].dbname);
+      sqlite3_free(cc->names[i].tablename);
+      return -1;
+    }
+  cc->names[i].pydbname=cc->names[i].pytablename=NULL;
+  cc->nnames++;
+  return cc->lastname=i;
 }
 
+/* Called from the update hook.  When the buffer is full the oldest
+   record is overwritten. */
 static void
-Connection_remove_dependent(Connection *self, PyObject *o)
+changecapture_add(ChangeCapture *cc, int op, const char *dbname, const char *tablename, sqlite3_int64 rowid)
 {
-  Py_ssize_t i;
+  ChangeCaptureRecord *record;
+  int name=changecapture_name(cc, dbname, tablename);
 
-  for(i=0;i<PyList_GET_SIZE(self->dependents);i++)
+  if(name<0)
     {
-      if(PyWeakref_GetObject(PyList_GET_ITEM(self->dependents, i))==o)
-        {
-          PyList_SetSlice(self->dependents, i, i+1, NULL);
-          break;
-        }
+      cc->lost++;
+      return;
     }
+  if(cc->head-cc->tail==cc->size)
+    {
+      cc->tail++;
+      cc->lost++;
+      if(cc->committed<cc->tail)
+        cc->committed=cc->tail;
+      if(cc->committing<cc->tail)
+        cc->committing=cc->tail;
+    }
+  record=&cc->records[cc->head%cc->size];
+  record->op=op;
+  record->name=name;
+  record->rowid=rowid;
+  cc->head++;
+  cc->captured++;
 }
 
-static PyObject*
-Connection_new(PyTypeObject *type, APSW_ARGUNUSED PyObject *args, APSW_ARGUNUSED PyObject *kwds)
+/* Called when a step that started with the head at mark fails.
+   SQLite undoes the statement's changes, without calling the rollback
+   hook if a transaction is still open, so its records are
+   discarded. */
+static void
+changecapture_stepfailed(ChangeCapture *cc, sqlite3_int64 mark)
 {
-    Connection *self;
-
-    self = (Connection *)type->tp_alloc(type, 0);
-    if (self != NULL) {
-      self->db=0;
-      self->inuse=0;
-      self->dependents=PyList_New(0);
-      self->dependent_remove=PyObject_GetAttrString(self->dependents, "remove");
-      self->stmtcache=0;
-      self->busyhandler=0;
-      self->rollbackhook=0;
-      self->profile=0;
-      self->updatehook=0;
-      self->commithook=0;
-      self->walhook=0;
-      self->progresshandler=0;
-      self->authorizer=0;
-      self->collationneeded=0;
-      self->exectrace=0;
-      self->rowtrace=0;
-      self->vfs=0;
-      self->savepointlevel=0;
-      self->open_flags=0;
-      self->open_vfs=0;
-      self->weakreflist=0;
+  if(mark<cc->committing)
+    mark=cc->committing;
+  if(cc->head>mark)
+    {
+      cc->rolledback+=cc->head-mark;
+      cc->head=mark;
     }
-
-    return (PyObject *)self;
 }
 
+/* Removes up to max committed records returning them as a list.  The
+   database mutex must be held. */
+static PyObject *
+changecapture_drain(ChangeCapture *cc, sqlite3_int64 max)
+{
+  PyObject *res, *item;
+  sqlite3_int64 n=cc->committed-cc->tail, i;
 
-/** .. method:: __init__(filename, flags=SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfs=None, statementcachesize=100)
+  if(max>=0 && n>max)
+    n=max;
+  res=PyList_New((Py_ssize_t)n);
+  if(!res)
+    return NULL;
 
-  Opens the named database.  You can use ``:memory:`` to get a private temporary
-  in-memory database that is not shared with any other connections.
+  for(i=0; i<n; i++)
+    {
+      ChangeCaptureRecord *record=&cc->records[(cc->tail+i)%cc->size];
+      ChangeCaptureName *name=&cc->names[record->name];
+
+      if(!name->pydbname)
+        name->pydbname=convertutf8string(name->dbname);
+      if(!name->pytablename)
+        name->pytablename=convertutf8string(name->tablename);
+      if(!name->pydbname || !name->pytablename)
+        goto error;
+      item=Py_BuildValue("(iOOL)", record->op, name->pydbname, name->pytablename, record->rowid);
+      if(!item)
+        goto error;
+      PyList_SET_ITEM(res, (Py_ssize_t)i, item);
+    }
+  cc->tail+=n;
+  return res;
 
-  :param flags: One or more of the `open flags <https://sqlite.org/c3ref/c_open_autoproxy.html>`_ orred together
-  :param vfs: The name of the `vfs <https://sqlite.org/c3ref/vfs.html>`_ to use.  If :const:`None` then the default
-     vfs will be used.
+ error:
+  Py_DECREF(res);
+  return NULL;
+}
 
-  :param statementcachesize: Use zero to disable the statement cache,
-    or a number larger than the total distinct SQL statements you
-    execute frequently.
+/* Frees the buffer.  The hooks must already have been removed. */
+static void
+changecapture_free(ChangeCapture *cc)
+{
+  int i;
 
-  -* sqlite3_open_v2
+  for(i=0; i<cc->nnames; i++)
+    {
+      sqlite3_free(cc->names[i].dbname);
+      sqlite3_free(cc->names[i].tablename);
+      Py_XDECREF(cc->names[i].pydbname);
+      Py_XDECREF(cc->names[i].pytablename);
+    }
+  Py_XDECREF(cc->oncommit);
+  PyMem_Free(cc->records);
+  PyMem_Free(cc);
+}
 
-  .. seealso::
+/* Native busy handler - see Connection.setbusybackoff.  The callback
+   is called with the database mutex held and only uses this
+   structure so it doesn't need the GIL. */
+typedef struct BusyBackoff {
+  sqlite3_int64 initial;          /* first delay in nanoseconds */
+  sqlite3_int64 maximum;          /* largest delay */
+  sqlite3_int64 timeout;          /* most total waiting for one lock */
+  double jitter;                  /* fraction of each delay that is random */
+  sqlite3_uint64 rng;             /* xorshift state */
+  sqlite3_int64 started;          /* apsw_now_ns() when waiting for the current lock started */
+  sqlite3_int64 busy, retries, timeouts, waited;
+} BusyBackoff;
 
-    * :attr:`apsw.connection_hooks`
-    * :ref:`statementcache`
-    * :ref:`vfs`
+/* CONNECTION TYPE */
 
-*/
-/* forward declaration so we can tell if it is one of ours */
-static int apswvfs_xAccess(sqlite3_vfs *vfs, const char *zName, int flags, int *pResOut);
+struct Connection {
+  PyObject_HEAD
+  sqlite3 *db;                    /* the actual database connection */
+  unsigned inuse;                 /* track if we are in use preventing concurrent thread mangling */
 
-static int
-Connection_init(Connection *self, PyObject *args, PyObject *kwds)
-{
-  static char *kwlist[]={"filename", "flags", "vfs", "statementcachesize", NULL};
-  PyObject *hooks=NULL, *hook=NULL, *iterator=NULL, *hookargs=NULL, *hookresult=NULL;
-  char *filename=NULL;
-  int res=0;
-  int flags=SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
-  char *vfs=0;
-  int statementcachesize=100;
-  sqlite3_vfs *vfsused=0;
+  struct StatementCache *stmtcache;      /* prepared statement cache */
 
-  if(!PyArg_ParseTupleAndKeywords(args, kwds, "es|izi:Connection(filename, flags=SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, vfs=None, statementcachesize=100)", kwlist, STRENCODING, &filename, &flags, &vfs, &statementcachesize))
-    return -1;
+  PyObject *dependents;           /* tracking cursors & blobs belonging to this connection */
+  PyObject *dependent_remove;     /* dependents.remove for weak ref processing */
 
-  if(statementcachesize<0)
-    statementcachesize=0;
+  /* registered hooks/handlers (NULL or callable) */
+  PyObject *busyhandler;
+  PyObject *rollbackhook;
+  PyObject *profile;
+  PyObject *updatehook;
+  PyObject *commithook;
+  PyObject *walhook;
+  PyObject *progresshandler;
+  PyObject *authorizer;
+  int denytransaction;            /* authorizercb denies transaction control while GroupCommit runs a change */
+  PyObject *collationneeded;
+  PyObject *exectrace;
+  PyObject *rowtrace;
 
-  /* Technically there is a race condition as a vfs of the same name
-     could be registered between our find and the open starting.
-     Don't do that!  We also have to manage the error message thread
-     safety manually as self->db is null on entry. */
-  PYSQLITE_VOID_CALL(
-    vfsused=sqlite3_vfs_find(vfs); res=sqlite3_open_v2(filename, &self->db, flags, vfs); if(res!=SQLITE_OK) apsw_set_errmsg(sqlite3_errmsg(self->db));
-    );
-  SET_EXC(res, self->db);  /* nb sqlite3_open always allocates the db even on error */
+  /* ROWFACTORY_* used by cursors */
+  int rowfactory;
 
-  if(res!=SQLITE_OK)
-      goto pyexception;
+  /* turn literals into bindings - see setautoparameterize */
+  int autoparameterize;
 
-  if(vfsused && vfsused->xAccess==apswvfs_xAccess)
-    {
-      PyObject *pyvfsused=(PyObject*)(vfsused->pAppData);
-      Py_INCREF(pyvfsused);
-      self->vfs=pyvfsused;
-    }
+  /* native latency histograms - see setlatencyprofile */
+  LatencyProfile *latency;        /* NULL until first enabled */
+  int latencyenabled;
 
-  /* record information */
-  self->open_flags=PyInt_FromLong(flags);
-  if(vfsused)
-    self->open_vfs=convertutf8string(vfsused->zName);
+  /* query results - see setresultcache */
+  ResultCache *resultcache;       /* NULL when disabled */
 
-  /* get detailed error codes */
-  PYSQLITE_VOID_CALL(sqlite3_extended_result_codes(self->db, 1));
+  /* changed rows - see setchangecapture */
+  ChangeCapture *changecapture;   /* NULL when disabled */
 
-  /* call connection hooks */
-  hooks=PyObject_GetAttrString(apswmodule, "connection_hooks");
-  if(!hooks)
-    goto pyexception;
+  /* native busy handler - see setbusybackoff */
+  BusyBackoff busybackoff;
 
-  hookargs=Py_BuildValue("(O)", self);
-  if(!hookargs) goto pyexception;
+  /* background checkpointing notified by the wal hook (borrowed) */
+  struct Checkpointer *checkpointer;
 
-  iterator=PyObject_GetIter(hooks);
-  if(!iterator)
-    {
-      AddTraceBackHere(__FILE__, __LINE__, "Connection.__init__", "{s: O}", "connection_hooks", hooks);
-      goto pyexception;
-    }
+  /* progress handler - also checks deadlines and cancellation (cancel.c) */
+  int progresssteps;              /* how often the Python progress handler wants calling */
+  int progressinterval;           /* how often SQLite calls progresshandlercb */
+  int progresscount;              /* instructions since the Python progress handler was called */
+  int limits;                     /* a deadline or cancellation token has been used */
+  /* these three are only changed with the database mutex held (stepcursor) */
+  sqlite3_int64 stepdeadline;     /* of the cursor currently stepping, zero for none */
+  CancellationToken *stepcancel;  /* of the cursor currently stepping (borrowed, it holds a reference while stepping) */
+  int stopped;                    /* QUERY_TIMEDOUT or QUERY_CANCELLED if the handler stopped the step */
 
-  self->stmtcache=statementcache_init(self->db, statementcachesize);
-  if(!self->stmtcache)
-    goto pyexception;
+  /* if we are using one of our VFS since sqlite doesn't reference count them */
+  PyObject *vfs;
 
-  while( (hook=PyIter_Next(iterator)) )
-    {
-      hookresult=PyEval_CallObject(hook, hookargs);
-      if(!hookresult)
-        goto pyexception;
-      Py_DECREF(hook);  hook=NULL;
-      Py_DECREF(hookresult);
-    }
+  /* schema name to the bytes SQLite reads in place after a read-only deserialize */
+  PyObject *deserialized;
 
-  if(!PyErr_Occurred())
-    {
-      res=0;
-      goto finally;
-    }
+  /* used for nested with (contextmanager) statements */
+  long savepointlevel;
 
- pyexception:
-  /* clean up db since it is useless - no need for user to call close */
-  assert(PyErr_Occurred());
-  res= -1;
-  sqlite3_close(self->db);  /* PYSQLITE_CALL not needed since no-one else can have a reference to this connection */
-  self->db=0;
-  Connection_internal_cleanup(self);
-  assert(PyErr_Occurred());
+  /* informational attributes */
+  PyObject *open_flags;
+  PyObject *open_vfs;
 
-finally:
-  if(filename) PyMem_Free(filename);
-  Py_XDECREF(hookargs);
-  Py_XDECREF(iterator);
-  Py_XDECREF(hooks);
-  Py_XDECREF(hook);
-  assert(PyErr_Occurred() || res==0);
-  return res;
-}
+  /* weak reference support */
+  PyObject *weakreflist;
 
-/** .. method:: blobopen(database, table, column, rowid, writeable)  -> blob
+};
 
-   Opens a blob for :ref:`incremental I/O <blobio>`.
-
-   :param database: Name of the database.  This will be ``main`` for
-     the main connection and the name you specified for `attached
-     <https://sqlite.org/lang_attach.html>`_ databases.
-   :param table: The name of the table
-   :param column: The name of the column
-   :param rowid: The id that uniquely identifies the row.
-   :param writeable: If True then you can read and write the blob.  If False then you can only read it.
-
-   :rtype: :class:`blob`
-
-   .. seealso::
+typedef struct Connection Connection;
 
-     * :ref:`Blob I/O example <example-blobio>`
-     * `SQLite row ids <https://sqlite.org/autoinc.html>`_
+static PyTypeObject ConnectionType;
 
-   -* sqlite3_blob_open
-*/
-static PyObject *
-Connection_blobopen(Connection *self, PyObject *args)
+typedef struct _vtableinfo
 {
-  struct APSWBlob *apswblob=0;
-  sqlite3_blob *blob=0;
-  const char *dbname, *tablename, *column;
-  long long rowid;
-  int writing;
-  int res;
-  PyObject *weakref;
+  PyObject *datasource;           /* object with create/connect methods */
+  Connection *connection;         /* the Connection this is registered against so we don't
+				     have to have a global table mapping sqlite3_db* to
+				     Connection* */
+} vtableinfo;
 
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self, NULL);
+/* forward declarations */
+struct APSWBlob;
+static void APSWBlob_init(struct APSWBlob *self, Connection *connection, sqlite3_blob *blob);
+static PyTypeObject APSWBlobType;
 
-  if(!PyArg_ParseTuple(args, "esesesLi:blobopen(database, table, column, rowid, rd_wr)",
-                       STRENCODING, &dbname, STRENCODING, &tablename, STRENCODING, &column, &rowid, &writing))
-    return NULL;
+#ifdef EXPERIMENTAL
+struct APSWBackup;
+static void APSWBackup_init(struct APSWBackup *self, Connection *dest, Connection *source, sqlite3_backup *backup);
+static PyTypeObject APSWBackupType;
+#endif
 
-  PYSQLITE_CON_CALL(res=sqlite3_blob_open(self->db, dbname, tablename, column, rowid, writing, &blob));
+struct APSWCursor;
+static void APSWCursor_init(struct APSWCursor *, Connection *);
+static PyTypeObject APSWCursorType;
 
-  PyMem_Free((void*)dbname);
-  PyMem_Free((void*)tablename);
-  PyMem_Free((void*)column);
-  SET_EXC(res, self->db);
-  if(res!=SQLITE_OK)
-    return NULL;
+struct Checkpointer;
+#if PY_VERSION_HEX >= 0x03020000
+static void Checkpointer_walnotify(struct Checkpointer *self, int npages);
+static void Checkpointer_attach(struct Checkpointer *self, Connection *connection);
+static void Checkpointer_sourceclosed(struct Checkpointer *self, PyObject *source);
+#endif
 
-  APSW_FAULT_INJECT(BlobAllocFails,apswblob=PyObject_New(struct APSWBlob, &APSWBlobType), (PyErr_NoMemory(), apswblob=NULL));
-  if(!apswblob)
-    {
-      PYSQLITE_CON_CALL(sqlite3_blob_close(blob));
-      return NULL;
-    }
+struct ZeroBlobBind;
+static PyTypeObject ZeroBlobBindType;
 
+struct APSWPrepared;
+static void APSWPrepared_init(struct APSWPrepared *self, Connection *connection, APSWStatement *statement);
+static PyTypeObject APSWPreparedType;
 
-  APSWBlob_init(apswblob, self, blob);
-  weakref=PyWeakref_NewRef((PyObject*)apswblob, self->dependent_remove);
-  PyList_Append(self->dependents, weakref);
-  Py_DECREF(weakref);
-  return (PyObject*)apswblob;
-}
+#ifdef SQLITE_ENABLE_SESSION
+struct APSWSession;
+static void APSWSession_init(struct APSWSession *self, Connection *connection, sqlite3_session *session);
+static int session_getchangeset(PyObject *obj, const void **buffer, int *size);
+static PyTypeObject APSWSessionType;
+#endif
 
 
-#ifdef EXPERIMENTAL
-/** .. method:: backup(databasename, sourceconnection, sourcedatabasename)  -> backup
+static void
+FunctionCBInfo_dealloc(FunctionCBInfo *self)
+{
+  if(self->name)
+    PyMem_Free(self->name);
+  Py_CLEAR(self->scalarfunc);
+  Py_CLEAR(self->aggregatefactory);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
 
-   Opens a :ref:`backup object <Backup>`.  All data will be copied from source
-   database to this database.
+/** .. class:: Connection
 
-   :param databasename: Name of the database.  This will be ``main`` for
-     the main connection and the name you specified for `attached
-     <https://sqlite.org/lang_attach.html>`_ databases.
-   :param sourceconnection: The :class:`Connection` to copy a database from.
-   :param sourcedatabasename: Name of the database in the source (eg ``main``).
 
-   :rtype: :class:`backup`
+  This object wraps a `sqlite3 pointer
+  <https://sqlite.org/c3ref/sqlite3.html>`_.
+*/
 
-   .. seealso::
+/* CONNECTION CODE */
 
-     * :ref:`Backup`
+static void
+Connection_internal_cleanup(Connection *self)
+{
+  Py_CLEAR(self->busyhandler);
+  Py_CLEAR(self->rollbackhook);
+  Py_CLEAR(self->profile);
+  Py_CLEAR(self->updatehook);
+  Py_CLEAR(self->commithook);
+  Py_CLEAR(self->walhook);
+  Py_CLEAR(self->progresshandler);
+  Py_CLEAR(self->authorizer);
+  Py_CLEAR(self->collationneeded);
+  Py_CLEAR(self->exectrace);
+  Py_CLEAR(self->rowtrace);
+  Py_CLEAR(self->vfs);
+  Py_CLEAR(self->open_flags);
+  Py_CLEAR(self->open_vfs);
+}
 
-   -* sqlite3_backup_init
-*/
-static PyObject *
-Connection_backup(Connection *self, PyObject *args)
+static int
+Connection_close_internal(Connection *self, int force)
 {
-  struct APSWBackup *apswbackup=0;
-  sqlite3_backup *backup=0;
-  int res=-123456; /* stupid compiler */
-  PyObject *result=NULL;
-  PyObject *weakref=NULL;
-  Connection *source=NULL;
-  const char *databasename=NULL;
-  const char *sourcedatabasename=NULL;
-  int isetsourceinuse=0;
+  Py_ssize_t i;
+  int res;
+  PyObject *etype, *eval, *etb;
 
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self, NULL);
+  if(force==2)
+    PyErr_Fetch(&etype, &eval, &etb);
 
-  /* self (destination) can't be used if there are outstanding blobs, cursors or backups */
-  if(PyList_GET_SIZE(self->dependents))
+  /* Traverse dependents calling close.  We assume the list may be
+     perturbed by item we just called close on being removed from the
+     list. */
+  for(i=0; i<PyList_GET_SIZE(self->dependents);)
     {
-      PyObject *args=NULL, *etype, *evalue, *etb;
-
-      args=PyTuple_New(2);
-      if(!args) goto thisfinally;
-      PyTuple_SET_ITEM(args, 0, MAKESTR("The destination database has outstanding objects open on it.  They must all be closed for the backup to proceed (otherwise corruption would be possible.)"));
-      PyTuple_SET_ITEM(args, 1, self->dependents);
-      Py_INCREF(self->dependents);
-
-      PyErr_SetObject(ExcThreadingViolation, args);
+      PyObject *item, *closeres, *orig;
 
-      PyErr_Fetch(&etype, &evalue, &etb);
-      PyErr_NormalizeException(&etype, &evalue, &etb);
-      PyErr_Restore(etype, evalue, etb);
+      orig=PyList_GET_ITEM(self->dependents, i);
+      item=PyWeakref_GetObject(orig);
+      if(!item || item==Py_None)
+        {
+          i++;
+          continue;
+        }
 
-    thisfinally:
-      Py_XDECREF(args);
-      goto finally;
+      closeres=Call_PythonMethodV(item, "close", 1, "(i)", !!force);
+      Py_XDECREF(closeres);
+      if(!closeres)
+        {
+          assert(PyErr_Occurred());
+          if(force==2)
+            apsw_write_unraiseable(NULL);
+          else
+            return 1;
+        }
+      if(i<PyList_GET_SIZE(self->dependents) && orig==PyList_GET_ITEM(self->dependents, i))
+        {
+          /* list was not perturbed */
+          i++;
+        }
     }
 
-  if(!PyArg_ParseTuple(args, "esOes:blobopen(databasename, sourceconnection, sourcedatabasename)",
-                       STRENCODING, &databasename, &source, STRENCODING, &sourcedatabasename))
-    return NULL;
+#if PY_VERSION_HEX >= 0x03020000
+  /* before the wal hook goes away with the database */
+  if(self->checkpointer)
+    Checkpointer_sourceclosed(self->checkpointer, (PyObject*)self);
+#endif
 
-  if(!PyObject_IsInstance((PyObject*)source, (PyObject*)&ConnectionType))
+  if(self->stmtcache)
+    statementcache_free(self->stmtcache);
+  self->stmtcache=0;
+
+  if(self->resultcache)
     {
-      PyErr_Format(PyExc_TypeError, "source connection needs to be a Connection instance");
-      goto finally;
+      ResultCache *rc=self->resultcache;
+      /* the hooks check for it */
+      self->resultcache=0;
+      resultcache_free(rc, self->db);
     }
 
-  if(!source->db)
+  if(self->changecapture)
     {
-      PyErr_Format(PyExc_ValueError, "source connection is closed!");
-      goto finally;
+      ChangeCapture *cc=self->changecapture;
+      self->changecapture=0;
+      changecapture_free(cc);
     }
 
-  if(source->inuse)
+  PYSQLITE_VOID_CALL(
+    APSW_FAULT_INJECT(ConnectionCloseFail, res=sqlite3_close(self->db), res=SQLITE_IOERR)
+    );
+
+  self->db=0;
+
+  /* if the close failed SQLite could still call the trace callback */
+  if(self->latency && res==SQLITE_OK)
     {
-      PyErr_Format(ExcThreadingViolation, "source connection is in concurrent use in another thread");
-      goto finally;
+      latencyprofile_reset(self->latency);
+      PyMem_Free(self->latency);
+      self->latency=0;
     }
+  self->latencyenabled=0;
 
-  if(source->db==self->db)
+  /* or still be reading deserialized databases */
+  if(res==SQLITE_OK)
+    Py_CLEAR(self->deserialized);
+
+  if (res!=SQLITE_OK)
     {
-      PyErr_Format(PyExc_ValueError, "source and destination are the same which sqlite3_backup doesn't allow");
-      goto finally;
+      SET_EXC(res, NULL);
+      if(force==2)
+        {
+          PyErr_Format(ExcConnectionNotClosed,
+                       "apsw.Connection at address %p. The destructor "
+                       "has encountered an error %d closing the connection, but cannot raise an exception.",
+                       self, res);
+          apsw_write_unraiseable(NULL);
+        }
     }
 
-  source->inuse=1;
-  isetsourceinuse=1;
-
-  APSW_FAULT_INJECT(BackupInitFails,
-                    PYSQLITE_CON_CALL( (backup=sqlite3_backup_init(self->db, databasename, source->db, sourcedatabasename),
-                                        res=backup?SQLITE_OK:sqlite3_extended_errcode(self->db)) ),
-                    res=SQLITE_NOMEM);
+  Connection_internal_cleanup(self);
 
-  if(res)
+  if(PyErr_Occurred())
     {
-      SET_EXC(res, self->db);
-      goto finally;
+      assert(force!=2);
+      AddTraceBackHere(__FILE__, __LINE__, "Connection.close", NULL);
+      return 1;
     }
 
-  APSW_FAULT_INJECT(BackupNewFails,
-                    apswbackup=PyObject_New(struct APSWBackup, &APSWBackupType),
-                    apswbackup=(struct APSWBackup*)PyErr_NoMemory());
-  if(!apswbackup)
-    goto finally;
+  if(force==2)
+    PyErr_Restore(etype, eval, etb);
+  return 0;
+}
 
-  APSWBackup_init(apswbackup, self, source, backup);
-  Py_INCREF(self);
-  Py_INCREF(source);
-  backup=NULL;
+/** .. method:: close([force=False])
 
-  /* add to dependent lists */
-  weakref=PyWeakref_NewRef((PyObject*)apswbackup, self->dependent_remove);
-  if(!weakref) goto finally;
-  if(PyList_Append(self->dependents, weakref)) goto finally;
-  Py_DECREF(weakref);
-  weakref=PyWeakref_NewRef((PyObject*)apswbackup, ((Connection*)source)->dependent_remove);
-  if(!weakref) goto finally;
-  if(PyList_Append(((Connection*)source)->dependents, weakref)) goto finally;
-  Py_DECREF(weakref);
-  weakref=0;
-
-  result=(PyObject*)apswbackup;
-  apswbackup=NULL;
-
-  finally:
-  /* check errors occurred vs result */
-  assert(result?(PyErr_Occurred()==NULL):(PyErr_Occurred()!=NULL));
-  assert(result?(backup==NULL):1);
-  if (backup) PYSQLITE_VOID_CALL(sqlite3_backup_finish(backup));
-  if (databasename) PyMem_Free((void*)databasename);
-  if (sourcedatabasename) PyMem_Free((void*)sourcedatabasename);
-  Py_XDECREF((PyObject*)apswbackup);
-  Py_XDECREF(weakref);
-
-  /* if inuse is set then we must be returning result */
-  assert( (self->inuse) ? (!!result):(result==NULL));
-  assert( result?(self->inuse):(!self->inuse));
-  if(isetsourceinuse) source->inuse=0;
-  return result;
-}
-#endif
+  Closes the database.  If there are any outstanding :class:`cursors
+  <Cursor>`, :class:`blobs <blob>` or :class:`backups <backup>` then
+  they are closed too.  It is normally not necessary to call this
+  method as the database is automatically closed when there are no
+  more references.  It is ok to call the method multiple times.
 
+  If your user defined functions or collations have direct or indirect
+  references to the Connection then it won't be automatically garbage
+  collected because of circular referencing that can't be
+  automatically broken.  Calling *close* will free all those objects
+  and what they reference.
 
-/** .. method:: cursor() -> Cursor
+  SQLite is designed to survive power failures at even the most
+  awkward moments.  Consequently it doesn't matter if it is closed
+  when the process is exited, or even if the exit is graceful or
+  abrupt.  In the worst case of having a transaction in progress, that
+  transaction will be rolled back by the next program to open the
+  database, reverting the database to a know good state.
 
-  Creates a new :class:`Cursor` object on this database.
+  If *force* is *True* then any exceptions are ignored.
 
-  :rtype: :class:`Cursor`
+   -* sqlite3_close
 */
+
+/* Closes cursors and blobs belonging to this connection */
 static PyObject *
-Connection_cursor(Connection *self)
+Connection_close(Connection *self, PyObject *args)
 {
-  struct APSWCursor* cursor = NULL;
-  PyObject *weakref;
+  int force=0;
 
   CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
-
-  APSW_FAULT_INJECT(CursorAllocFails,cursor = PyObject_New(struct APSWCursor, &APSWCursorType), (PyErr_NoMemory(), cursor=NULL));
-  if(!cursor)
-    return NULL;
-
-  /* incref me since cursor holds a pointer */
-  Py_INCREF((PyObject*)self);
-  APSWCursor_init(cursor, self);
-  weakref=PyWeakref_NewRef((PyObject*)cursor, self->dependent_remove);
-  PyList_Append(self->dependents, weakref);
-  Py_DECREF(weakref);
 
-  return (PyObject*)cursor;
-}
-
-/** .. method:: setbusytimeout(millseconds)
-
-  If the database is locked such as when another connection is making
-  changes, SQLite will keep retrying.  This sets the maximum amount of
-  time SQLite will keep retrying before giving up.  If the database is
-  still busy then :class:`apsw.BusyError` will be returned.
+  assert(!PyErr_Occurred());
 
-  :param milliseconds: Maximum thousandths of a second to wait.
+  if(!PyArg_ParseTuple(args, "|i:close(force=False)", &force))
+    return NULL;
 
-  If you previously called :meth:`~Connection.setbusyhandler` then
-  calling this overrides that.
+  force=!!force; /* must be zero or one */
 
-  .. seealso::
+  if(Connection_close_internal(self, force))
+    {
+      assert(PyErr_Occurred());
+      return NULL;
+    }
 
-     * :meth:`Connection.setbusyhandler`
-     * :ref:`Busy handling <busyhandling>`
+  Py_RETURN_NONE;
+}
 
-  -* sqlite3_busy_timeout
-*/
-static PyObject *
-Connection_setbusytimeout(Connection *self, PyObject *args)
+static void
+Connection_dealloc(Connection* self)
 {
-  int ms=0;
-  int res;
-
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
-
-  if(!PyArg_ParseTuple(args, "i:setbusytimeout(millseconds)", &ms))
-    return NULL;
+  APSW_CLEAR_WEAKREFS;
 
-  PYSQLITE_CON_CALL(res=sqlite3_busy_timeout(self->db, ms));
-  SET_EXC(res, self->db);
-  if(res!=SQLITE_OK) return NULL;
+  Connection_close_internal(self, 2);
 
-  /* free any explicit busyhandler we may have had */
-  Py_XDECREF(self->busyhandler);
-  self->busyhandler=0;
+  /* Our dependents all hold a refcount on us, so they must have all
+     released before this destructor could be called */
+  assert(PyList_GET_SIZE(self->dependents)==0);
+  Py_CLEAR(self->dependents);
+  Py_CLEAR(self->dependent_remove);
 
-  Py_RETURN_NONE;
+  Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
-/** .. method:: changes() -> int
-
-  Returns the number of database rows that were changed (or inserted
-  or deleted) by the most recently completed INSERT, UPDATE, or DELETE
-  statement.
-
-  -* sqlite3_changes
-*/
-static PyObject *
-Connection_changes(Connection *self)
+static void
+Connection_remove_dependent(Connection *self, PyObject *o)
 {
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
-  return PyLong_FromLong(sqlite3_changes(self->db));
+  Py_ssize_t i;
+
+  for(i=0;i<PyList_GET_SIZE(self->dependents);i++)
+    {
+      if(PyWeakref_GetObject(PyList_GET_ITEM(self->dependents, i))==o)
+        {
+          PyList_SetSlice(self->dependents, i, i+1, NULL);
+          break;
+        }
+    }
 }
 
-/** .. method:: totalchanges() -> int
+static PyObject*
+Connection_new(PyTypeObject *type, APSW_ARGUNUSED PyObject *args, APSW_ARGUNUSED PyObject *kwds)
+{
+    Connection *self;
 
-  Returns the total number of database rows that have be modified,
-  inserted, or deleted since the database connection was opened.
+    self = (Connection *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+      self->db=0;
+      self->inuse=0;
+      self->dependents=PyList_New(0);
+      self->dependent_remove=PyObject_GetAttrString(self->dependents, "remove");
+      self->stmtcache=0;
+      self->busyhandler=0;
+      self->rollbackhook=0;
+      self->profile=0;
+      self->updatehook=0;
+      self->commithook=0;
+      self->walhook=0;
+      self->progresshandler=0;
+      self->authorizer=0;
+      self->denytransaction=0;
+      self->collationneeded=0;
+      self->exectrace=0;
+      self->rowtrace=0;
+      self->rowfactory=ROWFACTORY_TUPLE;
+      self->autoparameterize=0;
+      self->latency=0;
+      self->latencyenabled=0;
+      self->resultcache=0;
+      self->changecapture=0;
+      memset(&self->busybackoff, 0, sizeof(self->busybackoff));
+      self->progresssteps=0;
+      self->progressinterval=0;
+      self->progresscount=0;
+      self->limits=0;
+      self->stepdeadline=0;
+      self->stepcancel=0;
+      self->stopped=0;
+      self->vfs=0;
+      self->deserialized=0;
+      self->checkpointer=0;
+      self->savepointlevel=0;
+      self->open_flags=0;
+      self->open_vfs=0;
+      self->weakreflist=0;
+    }
 
-  -* sqlite3_total_changes
-*/
-static PyObject *
-Connection_totalchanges(Connection *self)
-{
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
-  return PyLong_FromLong(sqlite3_total_changes(self->db));
+    return (PyObject *)self;
 }
 
-/** .. method:: getautocommit() -> bool
 
-  Returns if the Connection is in auto commit mode (ie not in a transaction).
+/** .. method:: __init__(filename, flags=SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfs=None, statementcachesize=100, statementcachememory=0)
 
-  -* sqlite3_get_autocommit
-*/
-static PyObject *
-Connection_getautocommit(Connection *self)
-{
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
-  if (sqlite3_get_autocommit(self->db))
-    Py_RETURN_TRUE;
-  Py_RETURN_FALSE;
-}
+  Opens the named database.  You can use ``:memory:`` to get a private temporary
+  in-memory database that is not shared with any other connections.
 
-/** .. method:: last_insert_rowid() -> int
+  :param flags: One or more of the `open flags <https://sqlite.org/c3ref/c_open_autoproxy.html>`_ orred together
+  :param vfs: The name of the `vfs <https://sqlite.org/c3ref/vfs.html>`_ to use.  If :const:`None` then the default
+     vfs will be used.
 
-  Returns the integer key of the most recent insert in the database.
+  :param statementcachesize: Use zero to disable the statement cache,
+    or a number larger than the total distinct SQL statements you
+    execute frequently.
 
-  -* sqlite3_last_insert_rowid
-*/
-static PyObject *
-Connection_last_insert_rowid(Connection *self)
-{
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
+  :param statementcachememory: If non-zero then the statement cache
+    is also limited to this many bytes of memory used by the compiled
+    statements, and queries up to this length are cached.  You would
+    normally also make *statementcachesize* large so the memory is
+    the limit.  See :ref:`statementcache`.
 
-  return PyLong_FromLongLong(sqlite3_last_insert_rowid(self->db));
-}
+  -* sqlite3_open_v2
 
-/** .. method:: set_last_insert_rowid(int)
+  .. seealso::
 
-  Sets the value calls to :meth:`last_insert_rowid` will return.
+    * :attr:`apsw.connection_hooks`
+    * :ref:`statementcache`
+    * :ref:`vfs`
 
-  -* sqlite3_set_last_insert_rowid
 */
-static PyObject *
-Connection_set_last_insert_rowid(Connection *self, PyObject *o)
+/* forward declaration so we can tell if it is one of ours */
+static int apswvfs_xAccess(sqlite3_vfs *vfs, const char *zName, int flags, int *pResOut);
+
+static int
+Connection_init(Connection *self, PyObject *args, PyObject *kwds)
 {
-  sqlite3_int64 rowid;
+  static char *kwlist[]={"filename", "flags", "vfs", "statementcachesize", "statementcachememory", NULL};
+  PyObject *hooks=NULL, *hook=NULL, *iterator=NULL, *hookargs=NULL, *hookresult=NULL;
+  char *filename=NULL;
+  int res=0;
+  int flags=SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  char *vfs=0;
+  int statementcachesize=100;
+  long long statementcachememory=0;
+  sqlite3_vfs *vfsused=0;
 
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "es|iziL:Connection(filename, flags=SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, vfs=None, statementcachesize=100, statementcachememory=0)", kwlist, STRENCODING, &filename, &flags, &vfs, &statementcachesize, &statementcachememory))
+    return -1;
 
-  if (!PyIntLong_Check(o))
-    return PyErr_Format(PyExc_TypeError, "rowid should be 64bit number");
+  if(statementcachesize<0)
+    statementcachesize=0;
+  if(statementcachememory<0)
+    statementcachememory=0;
 
-  rowid=PyIntLong_AsLongLong(o);
-  if(PyErr_Occurred())
-    return NULL;
+  /* Technically there is a race condition as a vfs of the same name
+     could be registered between our find and the open starting.
+     Don't do that!  We also have to manage the error message thread
+     safety manually as self->db is null on entry. */
+  PYSQLITE_VOID_CALL(
+    vfsused=sqlite3_vfs_find(vfs); res=sqlite3_open_v2(filename, &self->db, flags, vfs); if(res!=SQLITE_OK) apsw_set_errmsg(sqlite3_errmsg(self->db));
+    );
+  SET_EXC(res, self->db);  /* nb sqlite3_open always allocates the db even on error */
 
-  PYSQLITE_VOID_CALL(sqlite3_set_last_insert_rowid(self->db, rowid));
+  if(res!=SQLITE_OK)
+      goto pyexception;
 
-  Py_RETURN_NONE;
-}
+  if(vfsused && vfsused->xAccess==apswvfs_xAccess)
+    {
+      PyObject *pyvfsused=(PyObject*)(vfsused->pAppData);
+      Py_INCREF(pyvfsused);
+      self->vfs=pyvfsused;
+    }
 
+  /* record information */
+  self->open_flags=PyInt_FromLong(flags);
+  if(vfsused)
+    self->open_vfs=convertutf8string(vfsused->zName);
 
-/** .. method:: interrupt()
+  /* get detailed error codes */
+  PYSQLITE_VOID_CALL(sqlite3_extended_result_codes(self->db, 1));
 
-  Causes any pending operations on the database to abort at the
-  earliest opportunity. You can call this from any thread.  For
-  example you may have a long running query when the user presses the
-  stop button in your user interface.  :exc:`InterruptError`
-  will be raised in the query that got interrupted.
+  /* call connection hooks */
+  hooks=PyObject_GetAttrString(apswmodule, "connection_hooks");
+  if(!hooks)
+    goto pyexception;
 
-  -* sqlite3_interrupt
-*/
-static PyObject *
-Connection_interrupt(Connection *self)
-{
-  CHECK_CLOSED(self, NULL);
+  hookargs=Py_BuildValue("(O)", self);
+  if(!hookargs) goto pyexception;
 
-  sqlite3_interrupt(self->db);  /* no return value */
-  Py_RETURN_NONE;
-}
+  iterator=PyObject_GetIter(hooks);
+  if(!iterator)
+    {
+      AddTraceBackHere(__FILE__, __LINE__, "Connection.__init__", "{s: O}", "connection_hooks", hooks);
+      goto pyexception;
+    }
 
-/** .. method:: limit(id[, newval]) -> int
+  self->stmtcache=statementcache_init(self->db, statementcachesize, statementcachememory);
+  if(!self->stmtcache)
+    goto pyexception;
 
-  If called with one parameter then the current limit for that *id* is
-  returned.  If called with two then the limit is set to *newval*.
+  while( (hook=PyIter_Next(iterator)) )
+    {
+      hookresult=PyEval_CallObject(hook, hookargs);
+      if(!hookresult)
+        goto pyexception;
+      Py_DECREF(hook);  hook=NULL;
+      Py_DECREF(hookresult);
+    }
 
+  if(!PyErr_Occurred())
+    {
+      res=0;
+      goto finally;
+    }
 
-  :param id: One of the `runtime limit ids <https://sqlite.org/c3ref/c_limit_attached.html>`_
-  :param newval: The new limit.  This is a 32 bit signed integer even on 64 bit platforms.
+ pyexception:
+  /* clean up db since it is useless - no need for user to call close */
+  assert(PyErr_Occurred());
+  res= -1;
+  sqlite3_close(self->db);  /* PYSQLITE_CALL not needed since no-one else can have a reference to this connection */
+  self->db=0;
+  Connection_internal_cleanup(self);
+  assert(PyErr_Occurred());
 
-  :returns: The limit in place on entry to the call.
+finally:
+  if(filename) PyMem_Free(filename);
+  Py_XDECREF(hookargs);
+  Py_XDECREF(iterator);
+  Py_XDECREF(hooks);
+  Py_XDECREF(hook);
+  assert(PyErr_Occurred() || res==0);
+  return res;
+}
 
-  -* sqlite3_limit
+/** .. method:: blobopen(database, table, column, rowid, writeable)  -> blob
 
-  .. seealso::
+   Opens a blob for :ref:`incremental I/O <blobio>`.
 
-    * :ref:`Example <example-limit>`
+   :param database: Name of the database.  This will be ``main`` for
+     the main connection and the name you specified for `attached
+     <https://sqlite.org/lang_attach.html>`_ databases.
+   :param table: The name of the table
+   :param column: The name of the column
+   :param rowid: The id that uniquely identifies the row.
+   :param writeable: If True then you can read and write the blob.  If False then you can only read it.
+
+   :rtype: :class:`blob`
+
+   .. seealso::
+
+     * :ref:`Blob I/O example <example-blobio>`
+     * `SQLite row ids <https://sqlite.org/autoinc.html>`_
 
+   -* sqlite3_blob_open
 */
 static PyObject *
-Connection_limit(Connection *self, PyObject *args)
+Connection_blobopen(Connection *self, PyObject *args)
 {
-  int val=-1, res, id;
+  struct APSWBlob *apswblob=0;
+  sqlite3_blob *blob=0;
+  const char *dbname, *tablename, *column;
+  long long rowid;
+  int writing;
+  int res;
+  PyObject *weakref;
+
   CHECK_USE(NULL);
   CHECK_CLOSED(self, NULL);
-  if(!PyArg_ParseTuple(args, "i|i", &id, &val))
-    return NULL;
-
-  res=sqlite3_limit(self->db, id, val);
-
-  return PyLong_FromLong(res);
-}
-
-static void
-updatecb(void *context, int updatetype, char const *databasename, char const *tablename, sqlite3_int64 rowid)
-{
-  /* The hook returns void. That makes it impossible for us to
-     abort immediately due to an error in the callback */
 
-  PyGILState_STATE gilstate;
-  PyObject *retval=NULL;
-  Connection *self=(Connection *)context;
+  if(!PyArg_ParseTuple(args, "esesesLi:blobopen(database, table, column, rowid, rd_wr)",
+                       STRENCODING, &dbname, STRENCODING, &tablename, STRENCODING, &column, &rowid, &writing))
+    return NULL;
 
-  assert(self);
-  assert(self->updatehook);
-  assert(self->updatehook!=Py_None);
+  PYSQLITE_CON_CALL(res=sqlite3_blob_open(self->db, dbname, tablename, column, rowid, writing, &blob));
 
-  gilstate=PyGILState_Ensure();
+  PyMem_Free((void*)dbname);
+  PyMem_Free((void*)tablename);
+  PyMem_Free((void*)column);
+  SET_EXC(res, self->db);
+  if(res!=SQLITE_OK)
+    return NULL;
 
-  if(PyErr_Occurred())
-    goto finally;  /* abort hook due to outstanding exception */
+  APSW_FAULT_INJECT(BlobAllocFails,apswblob=PyObject_New(struct APSWBlob, &APSWBlobType), (PyErr_NoMemory(), apswblob=NULL));
+  if(!apswblob)
+    {
+      PYSQLITE_CON_CALL(sqlite3_blob_close(blob));
+      return NULL;
+    }
 
-  retval=PyObject_CallFunction(self->updatehook, "(iO&O&L)", updatetype, convertutf8string, databasename, convertutf8string, tablename, rowid);
 
- finally:
-  Py_XDECREF(retval);
-  PyGILState_Release(gilstate);
+  APSWBlob_init(apswblob, self, blob);
+  weakref=PyWeakref_NewRef((PyObject*)apswblob, self->dependent_remove);
+  PyList_Append(self->dependents, weakref);
+  Py_DECREF(weakref);
+  return (PyObject*)apswblob;
 }
 
-/** .. method:: setupdatehook(callable)
 
-  Calls *callable* whenever a row is updated, deleted or inserted.  If
-  *callable* is :const:`None` then any existing update hook is
-  removed.  The update hook cannot make changes to the database while
-  the query is still executing, but can record them for later use or
-  apply them in a different connection.
+#ifdef EXPERIMENTAL
+/** .. method:: backup(databasename, sourceconnection, sourcedatabasename)  -> backup
 
-  The update hook is called with 4 parameters:
+   Opens a :ref:`backup object <Backup>`.  All data will be copied from source
+   database to this database.
 
-    type (int)
-      :const:`SQLITE_INSERT`, :const:`SQLITE_DELETE` or :const:`SQLITE_UPDATE`
-    database name (string)
-      This is ``main`` for the database or the name specified in
-      `ATTACH <https://sqlite.org/lang_attach.html>`_
-    table name (string)
-      The table on which the update happened
-    rowid (64 bit integer)
-      The affected row
+   :param databasename: Name of the database.  This will be ``main`` for
+     the main connection and the name you specified for `attached
+     <https://sqlite.org/lang_attach.html>`_ databases.
+   :param sourceconnection: The :class:`Connection` to copy a database from.
+   :param sourcedatabasename: Name of the database in the source (eg ``main``).
 
-  .. seealso::
+   :rtype: :class:`backup`
 
-      * :ref:`Example <example-updatehook>`
+   .. seealso::
 
-  -* sqlite3_update_hook
+     * :ref:`Backup`
+
+   -* sqlite3_backup_init
 */
 static PyObject *
-Connection_setupdatehook(Connection *self, PyObject *callable)
+Connection_backup(Connection *self, PyObject *args)
 {
-  /* sqlite3_update_hook doesn't return an error code */
+  struct APSWBackup *apswbackup=0;
+  sqlite3_backup *backup=0;
+  int res=-123456; /* stupid compiler */
+  PyObject *result=NULL;
+  PyObject *weakref=NULL;
+  Connection *source=NULL;
+  const char *databasename=NULL;
+  const char *sourcedatabasename=NULL;
+  int isetsourceinuse=0;
 
   CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
+  CHECK_CLOSED(self, NULL);
 
-  if(callable==Py_None)
+  /* self (destination) can't be used if there are outstanding blobs, cursors or backups */
+  if(PyList_GET_SIZE(self->dependents))
     {
-      PYSQLITE_VOID_CALL(sqlite3_update_hook(self->db, NULL, NULL));
-      callable=NULL;
-      goto finally;
-    }
-
-  if(!PyCallable_Check(callable))
-    return PyErr_Format(PyExc_TypeError, "update hook must be callable");
+      PyObject *args=NULL, *etype, *evalue, *etb;
 
-  PYSQLITE_VOID_CALL(sqlite3_update_hook(self->db, updatecb, self));
+      args=PyTuple_New(2);
+      if(!args) goto thisfinally;
+      PyTuple_SET_ITEM(args, 0, MAKESTR("The destination database has outstanding objects open on it.  They must all be closed for the backup to proceed (otherwise corruption would be possible.)"));
+      PyTuple_SET_ITEM(args, 1, self->dependents);
+      Py_INCREF(self->dependents);
 
-  Py_INCREF(callable);
+      PyErr_SetObject(ExcThreadingViolation, args);
 
- finally:
+      PyErr_Fetch(&etype, &evalue, &etb);
+      PyErr_NormalizeException(&etype, &evalue, &etb);
+      PyErr_Restore(etype, evalue, etb);
 
-  Py_XDECREF(self->updatehook);
-  self->updatehook=callable;
+    thisfinally:
+      Py_XDECREF(args);
+      goto finally;
+    }
 
-  Py_RETURN_NONE;
-}
+  if(!PyArg_ParseTuple(args, "esOes:blobopen(databasename, sourceconnection, sourcedatabasename)",
+                       STRENCODING, &databasename, &source, STRENCODING, &sourcedatabasename))
+    return NULL;
 
-static void
-rollbackhookcb(void *context)
-{
-  /* The hook returns void. That makes it impossible for us to
-     abort immediately due to an error in the callback */
+  if(!PyObject_IsInstance((PyObject*)source, (PyObject*)&ConnectionType))
+    {
+      PyErr_Format(PyExc_TypeError, "source connection needs to be a Connection instance");
+      goto finally;
+    }
 
-  PyGILState_STATE gilstate;
-  PyObject *retval=NULL;
-  Connection *self=(Connection *)context;
+  if(!source->db)
+    {
+      PyErr_Format(PyExc_ValueError, "source connection is closed!");
+      goto finally;
+    }
 
-  assert(self);
-  assert(self->rollbackhook);
-  assert(self->rollbackhook!=Py_None);
-
-  gilstate=PyGILState_Ensure();
-
-  APSW_FAULT_INJECT(RollbackHookExistingError,,PyErr_NoMemory());
-
-  if(PyErr_Occurred())
-    goto finally;  /* abort hook due to outstanding exception */
-
-  retval=PyEval_CallObject(self->rollbackhook, NULL);
-
- finally:
-  Py_XDECREF(retval);
-  PyGILState_Release(gilstate);
-}
-
-/** .. method:: setrollbackhook(callable)
-
-  Sets a callable which is invoked during a rollback.  If *callable*
-  is :const:`None` then any existing rollback hook is removed.
+  if(source->inuse)
+    {
+      PyErr_Format(ExcThreadingViolation, "source connection is in concurrent use in another thread");
+      goto finally;
+    }
 
-  The *callable* is called with no parameters and the return value is ignored.
+  if(source->db==self->db)
+    {
+      PyErr_Format(PyExc_ValueError, "source and destination are the same which sqlite3_backup doesn't allow");
+      goto finally;
+    }
 
-  -* sqlite3_rollback_hook
-*/
-static PyObject *
-Connection_setrollbackhook(Connection *self, PyObject *callable)
-{
-  /* sqlite3_rollback_hook doesn't return an error code */
+  source->inuse=1;
+  isetsourceinuse=1;
 
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
+  APSW_FAULT_INJECT(BackupInitFails,
+                    PYSQLITE_CON_CALL( (backup=sqlite3_backup_init(self->db, databasename, source->db, sourcedatabasename),
+                                        res=backup?SQLITE_OK:sqlite3_extended_errcode(self->db)) ),
+                    res=SQLITE_NOMEM);
 
-  if(callable==Py_None)
+  if(res)
     {
-      PYSQLITE_VOID_CALL(sqlite3_rollback_hook(self->db, NULL, NULL));
-      callable=NULL;
+      SET_EXC(res, self->db);
       goto finally;
     }
 
-  if(!PyCallable_Check(callable))
-    return PyErr_Format(PyExc_TypeError, "rollback hook must be callable");
+  APSW_FAULT_INJECT(BackupNewFails,
+                    apswbackup=PyObject_New(struct APSWBackup, &APSWBackupType),
+                    apswbackup=(struct APSWBackup*)PyErr_NoMemory());
+  if(!apswbackup)
+    goto finally;
 
-  PYSQLITE_VOID_CALL(sqlite3_rollback_hook(self->db, rollbackhookcb, self));
+  APSWBackup_init(apswbackup, self, source, backup);
+  Py_INCREF(self);
+  Py_INCREF(source);
+  backup=NULL;
 
-  Py_INCREF(callable);
+  /* add to dependent lists */
+  weakref=PyWeakref_NewRef((PyObject*)apswbackup, self->dependent_remove);
+  if(!weakref) goto finally;
+  if(PyList_Append(self->dependents, weakref)) goto finally;
+  Py_DECREF(weakref);
+  weakref=PyWeakref_NewRef((PyObject*)apswbackup, ((Connection*)source)->dependent_remove);
+  if(!weakref) goto finally;
+  if(PyList_Append(((Connection*)source)->dependents, weakref)) goto finally;
+  Py_DECREF(weakref);
+  weakref=0;
 
- finally:
+  result=(PyObject*)apswbackup;
+  apswbackup=NULL;
 
-  Py_XDECREF(self->rollbackhook);
-  self->rollbackhook=callable;
+  finally:
+  /* check errors occurred vs result */
+  assert(result?(PyErr_Occurred()==NULL):(PyErr_Occurred()!=NULL));
+  assert(result?(backup==NULL):1);
+  if (backup) PYSQLITE_VOID_CALL(sqlite3_backup_finish(backup));
+  if (databasename) PyMem_Free((void*)databasename);
+  if (sourcedatabasename) PyMem_Free((void*)sourcedatabasename);
+  Py_XDECREF((PyObject*)apswbackup);
+  Py_XDECREF(weakref);
 
-  Py_RETURN_NONE;
+  /* if inuse is set then we must be returning result */
+  assert( (self->inuse) ? (!!result):(result==NULL));
+  assert( result?(self->inuse):(!self->inuse));
+  if(isetsourceinuse) source->inuse=0;
+  return result;
 }
+#endif
 
-#ifdef EXPERIMENTAL /* sqlite3_profile */
-static void
-profilecb(void *context, const char *statement, sqlite_uint64 runtime)
-{
-  /* The hook returns void. That makes it impossible for us to
-     abort immediately due to an error in the callback */
-
-  PyGILState_STATE gilstate;
-  PyObject *retval=NULL;
-  Connection *self=(Connection *)context;
-
-  assert(self);
-  assert(self->profile);
-  assert(self->profile!=Py_None);
-
-  gilstate=PyGILState_Ensure();
-
-  if(PyErr_Occurred())
-    goto finally;  /* abort hook due to outstanding exception */
+#if defined(SQLITE_SERIALIZE_NOCOPY) && !defined(SQLITE_OMIT_DESERIALIZE)
+/** .. method:: serialize(schema="main") -> bytes
 
-  retval=PyObject_CallFunction(self->profile, "(O&K)", convertutf8string, statement, runtime);
+  Returns the contents of the named database as bytes, the same as a
+  database file would contain.  Together with :meth:`deserialize` this
+  copies databases in memory much faster than a :meth:`backup`, for
+  example to give each test or request its own sandbox made from a
+  prepared database::
 
- finally:
-  Py_XDECREF(retval);
-  PyGILState_Release(gilstate);
-}
+    snapshot=template.serialize()
 
-/** .. method:: setprofile(callable)
+    sandbox=apsw.Connection(":memory:")
+    sandbox.deserialize("main", snapshot)
 
-  Sets a callable which is invoked at the end of execution of each
-  statement and passed the statement string and how long it took to
-  execute. (The execution time is in nanoseconds.) Note that it is
-  called only on completion. If for example you do a ``SELECT`` and
-  only read the first result, then you won't reach the end of the
-  statement.
+  A database previously loaded by :meth:`deserialize` is copied
+  straight from SQLite's buffer in one go, while others are read page
+  by page.  An empty database gives empty bytes.
 
-  -* sqlite3_profile
+  -* sqlite3_serialize
 */
-
 static PyObject *
-Connection_setprofile(Connection *self, PyObject *callable)
+Connection_serialize(Connection *self, PyObject *args)
 {
-  /* sqlite3_profile doesn't return an error code */
+  char *schema=NULL;
+  unsigned char *data=NULL;
+  sqlite3_int64 size=-1;
+  PyObject *result=NULL;
+  int res;
 
   CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
+  CHECK_CLOSED(self, NULL);
 
-  if(callable==Py_None)
+  if(!PyArg_ParseTuple(args, "|es:serialize(schema=\"main\")", STRENCODING, &schema))
+    return NULL;
+
+  /* a database held in one buffer is copied while we have the mutex */
+  APSW_DB_MUTEX_ENTER(self->db);
+  PYSQLITE_HELD_CALL(data=sqlite3_serialize(self->db, schema?schema:"main", &size, SQLITE_SERIALIZE_NOCOPY));
+  if(data)
+    result=converttobytes((const char*)data, size);
+  APSW_DB_MUTEX_LEAVE(self->db);
+
+  if(data)
+    goto finally;
+
+  if(size<0)
     {
-      PYSQLITE_VOID_CALL(sqlite3_profile(self->db, NULL, NULL));
-      callable=NULL;
+      PyErr_Format(exc_descriptors[0].cls, "Unknown database name");
       goto finally;
     }
 
-  if(!PyCallable_Check(callable))
-    return PyErr_Format(PyExc_TypeError, "profile function must be callable");
-
-  PYSQLITE_VOID_CALL(sqlite3_profile(self->db, profilecb, self));
+  if(size==0)
+    {
+      result=converttobytes("", 0);
+      goto finally;
+    }
 
-  Py_INCREF(callable);
+  PYSQLITE_CON_CALL((data=sqlite3_serialize(self->db, schema?schema:"main", &size, 0), res=data?SQLITE_OK:SQLITE_NOMEM));
+  if(!data)
+    {
+      SET_EXC(res, NULL);
+      goto finally;
+    }
+  result=converttobytes((const char*)data, size);
+  sqlite3_free(data);
 
  finally:
-
-  Py_XDECREF(self->profile);
-  self->profile=callable;
-
-  Py_RETURN_NONE;
+  PyMem_Free(schema);
+  return result;
 }
-#endif /* EXPERIMENTAL - sqlite3_profile */
-
 
+/* SQLite closes the existing database even if statements are using
+   it, so deserialize has to check first.  Called with the database
+   mutex held, returning SQLITE_NOTFOUND for an unknown name and
+   SQLITE_BUSY (with the error message set) if it is in use. */
 static int
-commithookcb(void *context)
+deserialize_check(sqlite3 *db, const char *schema)
 {
-  /* The hook returns 0 for commit to go ahead and non-zero to abort
-     commit (turn into a rollback). We return non-zero for errors */
-
-  PyGILState_STATE gilstate;
-  PyObject *retval=NULL;
-  int ok=1; /* error state */
-  Connection *self=(Connection *)context;
-
-  assert(self);
-  assert(self->commithook);
-  assert(self->commithook!=Py_None);
-
-  gilstate=PyGILState_Ensure();
-
-  APSW_FAULT_INJECT(CommitHookExistingError,,PyErr_NoMemory());
+  sqlite3_stmt *stmt=NULL;
+  int busy;
 
-  if(PyErr_Occurred())
-    goto finally;  /* abort hook due to outstanding exception */
-
-  retval=PyEval_CallObject(self->commithook, NULL);
+  if(!sqlite3_db_filename(db, schema))
+    return SQLITE_NOTFOUND;
 
-  if(!retval)
-    goto finally; /* abort hook due to exeception */
-
-  ok=PyObject_IsTrue(retval);
-  assert(ok==-1 || ok==0 || ok==1);
-  if(ok==-1)
+  if(!sqlite3_get_autocommit(db))
     {
-      ok=1;
-      goto finally;  /* abort due to exception in return value */
+      apsw_set_errmsg("A transaction is in progress");
+      return SQLITE_BUSY;
     }
-
- finally:
-  Py_XDECREF(retval);
-  PyGILState_Release(gilstate);
-  return ok;
+  for(;;)
+    {
+      PYSQLITE_HELD_CALL(stmt=sqlite3_next_stmt(db, stmt));
+      if(!stmt)
+        break;
+      PYSQLITE_HELD_CALL(busy=sqlite3_stmt_busy(stmt));
+      if(busy)
+        {
+          apsw_set_errmsg("Statements are still executing");
+          return SQLITE_BUSY;
+        }
+    }
+  return SQLITE_OK;
 }
 
-/** .. method:: setcommithook(callable)
-
-  *callable* will be called just before a commit.  It should return
-  zero for the commit to go ahead and non-zero for it to be turned
-  into a rollback. In the case of an exception in your callable, a
-  non-zero (ie rollback) value is returned.
-
-  .. seealso::
+/** .. method:: deserialize(schema, data, readonly=False)
 
-    * :ref:`Example <example-commithook>`
+  Replaces the named database with *data* from :meth:`serialize` or
+  read from a database file.  From then on the database is only held
+  in memory - use :meth:`serialize` to get its contents again.  The
+  database must not be in use by a transaction or active statements.
 
-  -* sqlite3_commit_hook
+  :param readonly: If true the database can't be changed.  When *data*
+    is :class:`bytes` SQLite then reads it in place without making a
+    copy, so many connections can share one snapshot.  Otherwise the
+    data is copied into memory that SQLite grows as needed.
 
+  -* sqlite3_deserialize
 */
 static PyObject *
-Connection_setcommithook(Connection *self, PyObject *callable)
+Connection_deserialize(Connection *self, PyObject *args, PyObject *kwds)
 {
-  /* sqlite3_commit_hook doesn't return an error code */
+  static char *kwlist[]={"schema", "data", "readonly", NULL};
+  char *schema=NULL;
+  PyObject *data, *key=NULL, *previous=NULL, *result=NULL;
+  const void *buffer;
+  Py_ssize_t buflen;
+  unsigned char *copy=NULL;
+  int readonly=0, inplace, flags, res;
 
   CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
+  CHECK_CLOSED(self, NULL);
 
-  if(callable==Py_None)
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "esO|i:deserialize(schema, data, readonly=False)", kwlist,
+                                  STRENCODING, &schema, &data, &readonly))
+    return NULL;
+
+  if(!PyObject_CheckReadBuffer(data) || PyUnicode_Check(data))
     {
-      PYSQLITE_VOID_CALL(sqlite3_commit_hook(self->db, NULL, NULL));
-      callable=NULL;
+      PyErr_Format(PyExc_TypeError, "data must be bytes not %s", Py_TYPE(data)->tp_name);
       goto finally;
     }
+  if(PyObject_AsReadBuffer(data, &buffer, &buflen))
+    goto finally;
 
-  if(!PyCallable_Check(callable))
-    return PyErr_Format(PyExc_TypeError, "commit hook must be callable");
+  /* bytes are immutable so SQLite can read them in place as long as
+     we keep a reference until the database is replaced or closed */
+  inplace=readonly && PyBytes_CheckExact(data);
 
-  PYSQLITE_VOID_CALL(sqlite3_commit_hook(self->db, commithookcb, self));
+  key=convertutf8string(schema);
+  if(!key)
+    goto finally;
 
-  Py_INCREF(callable);
+  if(inplace)
+    {
+      flags=SQLITE_DESERIALIZE_READONLY;
+      if(!self->deserialized && !(self->deserialized=PyDict_New()))
+        goto finally;
+      previous=PyDict_GetItem(self->deserialized, key);
+      Py_XINCREF(previous);
+      if(PyDict_SetItem(self->deserialized, key, data))
+        goto finally;
+    }
+  else
+    {
+      flags=SQLITE_DESERIALIZE_FREEONCLOSE|(readonly?SQLITE_DESERIALIZE_READONLY:SQLITE_DESERIALIZE_RESIZEABLE);
+      if(buflen)
+        {
+          APSW_FAULT_INJECT(DeserializeAllocFails, PYSQLITE_HELD_CALL(copy=sqlite3_malloc64(buflen)), copy=NULL);
+          if(!copy)
+            {
+              PyErr_NoMemory();
+              goto finally;
+            }
+          memcpy(copy, buffer, buflen);
+        }
+    }
 
- finally:
+  APSW_DB_MUTEX_ENTER(self->db);
+  PYSQLITE_HELD_CALL(res=deserialize_check(self->db, schema));
+  if(res==SQLITE_OK)
+    {
+      /* SQLite frees copy if this fails */
+      PYSQLITE_HELD_CALL(res=sqlite3_deserialize(self->db, schema, inplace?(unsigned char*)buffer:copy, buflen, buflen, flags));
+      copy=NULL;
+      if(res!=SQLITE_OK)
+        PYSQLITE_HELD_CALL(apsw_set_errmsg(sqlite3_errmsg(self->db)));
+    }
+  APSW_DB_MUTEX_LEAVE(self->db);
 
-  Py_XDECREF(self->commithook);
-  self->commithook=callable;
+  if(res!=SQLITE_OK)
+    {
+      /* the previous bytes are still in use */
+      if(inplace)
+        {
+          if(previous)
+            PyDict_SetItem(self->deserialized, key, previous);
+          else
+            PyDict_DelItem(self->deserialized, key);
+        }
+      if(res==SQLITE_NOTFOUND)
+        PyErr_Format(exc_descriptors[0].cls, "Unknown database name");
+      SET_EXC(res, self->db);
+      goto finally;
+    }
 
-  Py_RETURN_NONE;
-}
+  if(!inplace && self->deserialized && PyDict_GetItem(self->deserialized, key))
+    PyDict_DelItem(self->deserialized, key);
 
-static int
-walhookcb(void *context, APSW_ARGUNUSED sqlite3 *db, const char *dbname, int npages)
-{
-  PyGILState_STATE gilstate;
-  PyObject *retval=NULL;
-  int code=SQLITE_ERROR;
-  Connection *self=(Connection *)context;
+  if(self->resultcache)
+    self->resultcache->reset=1;
 
-  assert(self);
-  assert(self->walhook);
-  assert(self->walhook!=Py_None);
-  assert(self->db==db);
+  result=Py_None;
+  Py_INCREF(result);
 
-  gilstate=PyGILState_Ensure();
+ finally:
+  PyMem_Free(schema);
+  Py_XDECREF(key);
+  Py_XDECREF(previous);
+  if(copy)
+    PYSQLITE_HELD_CALL(sqlite3_free(copy));
+  return result;
+}
+#endif
 
-  retval=PyEval_CallFunction(self->walhook, "(OO&i)", self, convertutf8string, dbname, npages);
-  if(!retval)
-    {
-      assert(PyErr_Occurred());
-      AddTraceBackHere(__FILE__, __LINE__, "walhookcallback", "{s: O, s: s, s: i}",
-		       "Connection", self,
-		       "dbname", dbname,
-		       "npages", npages);
-      goto finally;
-    }
-  if(!PyIntLong_Check(retval))
-    {
-      PyErr_Format(PyExc_TypeError, "wal hook must return a number");
-      AddTraceBackHere(__FILE__, __LINE__, "walhookcallback", "{s: O, s: s, s: i, s: O}",
-		       "Connection", self,
-		       "dbname", dbname,
-		       "npages", npages,
-		       "retval", retval);
-      goto finally;
-    }
-  code=(int)PyIntLong_AsLong(retval);
 
-  finally:
-  Py_XDECREF(retval);
-  PyGILState_Release(gilstate);
-  return code;
+/** .. method:: cursor() -> Cursor
+
+  Creates a new :class:`Cursor` object on this database.
+
+  :rtype: :class:`Cursor`
+*/
+static PyObject *
+Connection_cursor(Connection *self)
+{
+  struct APSWCursor* cursor = NULL;
+  PyObject *weakref;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+
+  APSW_FAULT_INJECT(CursorAllocFails,cursor = PyObject_New(struct APSWCursor, &APSWCursorType), (PyErr_NoMemory(), cursor=NULL));
+  if(!cursor)
+    return NULL;
+
+  /* incref me since cursor holds a pointer */
+  Py_INCREF((PyObject*)self);
+  APSWCursor_init(cursor, self);
+  weakref=PyWeakref_NewRef((PyObject*)cursor, self->dependent_remove);
+  PyList_Append(self->dependents, weakref);
+  Py_DECREF(weakref);
+
+  return (PyObject*)cursor;
 }
 
-/** .. method:: setwalhook(callable)
+/** .. method:: setbusytimeout(millseconds)
 
- *callable* will be called just after data is committed in :ref:`wal`
- mode.  It should return :const:`SQLITE_OK` or an error code.  The
- callback is called with 3 parameters:
+  If the database is locked such as when another connection is making
+  changes, SQLite will keep retrying.  This sets the maximum amount of
+  time SQLite will keep retrying before giving up.  If the database is
+  still busy then :class:`apsw.BusyError` will be returned.
 
-   * The Connection
-   * The database name (eg "main" or the name of an attached database)
-   * The number of pages in the wal log
+  :param milliseconds: Maximum thousandths of a second to wait.
 
- You can pass in None in order to clear an existing hook.
+  If you previously called :meth:`~Connection.setbusyhandler` or
+  :meth:`~Connection.setbusybackoff` then calling this overrides that.
 
- -* sqlite3_wal_hook
+  .. seealso::
 
-*/
+     * :meth:`Connection.setbusyhandler`
+     * :meth:`Connection.setbusybackoff`
+     * :ref:`Busy handling <busyhandling>`
 
+  -* sqlite3_busy_timeout
+*/
 static PyObject *
-Connection_setwalhook(Connection *self, PyObject *callable)
+Connection_setbusytimeout(Connection *self, PyObject *args)
 {
+  int ms=0;
+  int res;
+
   CHECK_USE(NULL);
-  CHECK_CLOSED(self, NULL);
+  CHECK_CLOSED(self,NULL);
 
-  if(callable==Py_None)
-    {
-      PYSQLITE_VOID_CALL(sqlite3_wal_hook(self->db, NULL, NULL));
-      callable=NULL;
-      goto finally;
-    }
+  if(!PyArg_ParseTuple(args, "i:setbusytimeout(millseconds)", &ms))
+    return NULL;
 
-  if(!PyCallable_Check(callable))
-    return PyErr_Format(PyExc_TypeError, "wal hook must be callable");
+  PYSQLITE_CON_CALL(res=sqlite3_busy_timeout(self->db, ms));
+  SET_EXC(res, self->db);
+  if(res!=SQLITE_OK) return NULL;
 
-  PYSQLITE_VOID_CALL(sqlite3_wal_hook(self->db, walhookcb, self));
+  /* free any explicit busyhandler we may have had */
+  Py_XDECREF(self->busyhandler);
+  self->busyhandler=0;
 
-  Py_INCREF(callable);
+  Py_RETURN_NONE;
+}
 
- finally:
+/** .. method:: changes() -> int
 
-  Py_XDECREF(self->walhook);
-  self->walhook=callable;
+  Returns the number of database rows that were changed (or inserted
+  or deleted) by the most recently completed INSERT, UPDATE, or DELETE
+  statement.
 
-  Py_RETURN_NONE;
+  -* sqlite3_changes
+*/
+static PyObject *
+Connection_changes(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+  return PyLong_FromLong(sqlite3_changes(self->db));
 }
 
-static int
-progresshandlercb(void *context)
-{
-  /* The hook returns 0 for continue and non-zero to abort (rollback).
-     We return non-zero for errors */
+/** .. method:: totalchanges() -> int
 
-  PyGILState_STATE gilstate;
-  PyObject *retval=NULL;
-  int ok=1; /* error state */
-  Connection *self=(Connection *)context;
+  Returns the total number of database rows that have be modified,
+  inserted, or deleted since the database connection was opened.
 
-  assert(self);
-  assert(self->progresshandler);
+  -* sqlite3_total_changes
+*/
+static PyObject *
+Connection_totalchanges(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+  return PyLong_FromLong(sqlite3_total_changes(self->db));
+}
 
-  gilstate=PyGILState_Ensure();
+/** .. method:: getautocommit() -> bool
 
-  retval=PyEval_CallObject(self->progresshandler, NULL);
+  Returns if the Connection is in auto commit mode (ie not in a transaction).
 
-  if(!retval)
-    goto finally; /* abort due to exeception */
+  -* sqlite3_get_autocommit
+*/
+static PyObject *
+Connection_getautocommit(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+  if (sqlite3_get_autocommit(self->db))
+    Py_RETURN_TRUE;
+  Py_RETURN_FALSE;
+}
 
-  ok=PyObject_IsTrue(retval);
+/** .. method:: last_insert_rowid() -> int
 
-  assert(ok==-1 || ok==0 || ok==1);
-  if(ok==-1)
-    {
-      ok=1;
-      goto finally;  /* abort due to exception in result */
-    }
+  Returns the integer key of the most recent insert in the database.
 
- finally:
-  Py_XDECREF(retval);
+  -* sqlite3_last_insert_rowid
+*/
+static PyObject *
+Connection_last_insert_rowid(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
 
-  PyGILState_Release(gilstate);
-  return ok;
+  return PyLong_FromLongLong(sqlite3_last_insert_rowid(self->db));
 }
 
-/** .. method:: setprogresshandler(callable[, nsteps=20])
-
-  Sets a callable which is invoked every *nsteps* SQLite
-  inststructions. The callable should return a non-zero value to abort
-  or zero to continue. (If there is an error in your Python *callable*
-  then non-zero will be returned).
-
-  .. seealso::
+/** .. method:: set_last_insert_rowid(int)
 
-     * :ref:`Example <example-progress-handler>`
+  Sets the value calls to :meth:`last_insert_rowid` will return.
 
-  -* sqlite3_progress_handler
+  -* sqlite3_set_last_insert_rowid
 */
-
 static PyObject *
-Connection_setprogresshandler(Connection *self, PyObject *args)
+Connection_set_last_insert_rowid(Connection *self, PyObject *o)
 {
-  /* sqlite3_progress_handler doesn't return an error code */
-  int nsteps=20;
-  PyObject *callable=NULL;
+  sqlite3_int64 rowid;
 
   CHECK_USE(NULL);
   CHECK_CLOSED(self,NULL);
 
-  if(!PyArg_ParseTuple(args, "O|i:setprogresshandler(callable, nsteps=20)", &callable, &nsteps))
+  if (!PyIntLong_Check(o))
+    return PyErr_Format(PyExc_TypeError, "rowid should be 64bit number");
+
+  rowid=PyIntLong_AsLongLong(o);
+  if(PyErr_Occurred())
     return NULL;
 
-  if(callable==Py_None)
-    {
-      PYSQLITE_VOID_CALL(sqlite3_progress_handler(self->db, 0, NULL, NULL));
-      callable=NULL;
-      goto finally;
-    }
+  PYSQLITE_VOID_CALL(sqlite3_set_last_insert_rowid(self->db, rowid));
 
-  if(!PyCallable_Check(callable))
-    return PyErr_Format(PyExc_TypeError, "progress handler must be callable");
+  Py_RETURN_NONE;
+}
 
-  PYSQLITE_VOID_CALL(sqlite3_progress_handler(self->db, nsteps, progresshandlercb, self));
-  Py_INCREF(callable);
 
- finally:
+/** .. method:: interrupt()
 
-  Py_XDECREF(self->progresshandler);
-  self->progresshandler=callable;
+  Causes any pending operations on the database to abort at the
+  earliest opportunity. You can call this from any thread.  For
+  example you may have a long running query when the user presses the
+  stop button in your user interface.  :exc:`InterruptError`
+  will be raised in the query that got interrupted.
+
+  -* sqlite3_interrupt
+*/
+static PyObject *
+Connection_interrupt(Connection *self)
+{
+  CHECK_CLOSED(self, NULL);
 
+  sqlite3_interrupt(self->db);  /* no return value */
   Py_RETURN_NONE;
 }
 
-static int
-authorizercb(void *context, int operation, const char *paramone, const char *paramtwo, const char *databasename, const char *triggerview)
-{
-  /* should return one of SQLITE_OK, SQLITE_DENY, or
-     SQLITE_IGNORE. (0, 1 or 2 respectively) */
+/** .. method:: limit(id[, newval]) -> int
 
-  PyGILState_STATE gilstate;
-  PyObject *retval=NULL;
-  int result=SQLITE_DENY;  /* default to deny */
-  Connection *self=(Connection *)context;
+  If called with one parameter then the current limit for that *id* is
+  returned.  If called with two then the limit is set to *newval*.
 
-  assert(self);
-  assert(self->authorizer);
-  assert(self->authorizer!=Py_None);
 
-  gilstate=PyGILState_Ensure();
+  :param id: One of the `runtime limit ids <https://sqlite.org/c3ref/c_limit_attached.html>`_
+  :param newval: The new limit.  This is a 32 bit signed integer even on 64 bit platforms.
 
-  APSW_FAULT_INJECT(AuthorizerExistingError,,PyErr_NoMemory());
+  :returns: The limit in place on entry to the call.
 
-  if(PyErr_Occurred())
-    goto finally;  /* abort due to earlier exception */
+  -* sqlite3_limit
 
-  retval=PyObject_CallFunction(self->authorizer, "(iO&O&O&O&)", operation, convertutf8string, paramone,
-                               convertutf8string, paramtwo, convertutf8string, databasename,
-                               convertutf8string, triggerview);
+  .. seealso::
 
-  if(!retval)
-    goto finally; /* abort due to exeception */
+    * :ref:`Example <example-limit>`
 
-  if (PyIntLong_Check(retval))
-    {
-      result=PyIntLong_AsLong(retval);
-      goto haveval;
-    }
+*/
+static PyObject *
+Connection_limit(Connection *self, PyObject *args)
+{
+  int val=-1, res, id;
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+  if(!PyArg_ParseTuple(args, "i|i", &id, &val))
+    return NULL;
 
-  PyErr_Format(PyExc_TypeError, "Authorizer must return a number");
-  AddTraceBackHere(__FILE__, __LINE__, "authorizer callback", "{s: i, s: s:, s: s, s: s}",
-                   "operation", operation, "paramone", paramone, "paramtwo", paramtwo,
-                   "databasename", databasename, "triggerview", triggerview);
+  res=sqlite3_limit(self->db, id, val);
 
- haveval:
-  if (PyErr_Occurred())
-    result=SQLITE_DENY;
+  return PyLong_FromLong(res);
+}
+
+static void
+updatecb(void *context, int updatetype, char const *databasename, char const *tablename, sqlite3_int64 rowid)
+{
+  /* The hook returns void. That makes it impossible for us to
+     abort immediately due to an error in the callback */
+
+  PyGILState_STATE gilstate;
+  PyObject *retval=NULL;
+  Connection *self=(Connection *)context;
+
+  assert(self);
+
+  if(self->resultcache)
+    resultcache_changed(self->resultcache, databasename, tablename);
+  if(self->changecapture)
+    changecapture_add(self->changecapture, updatetype, databasename, tablename, rowid);
+
+  if(!self->updatehook)
+    return;
+  assert(self->updatehook!=Py_None);
+
+  gilstate=PyGILState_Ensure();
+
+  if(PyErr_Occurred())
+    goto finally;  /* abort hook due to outstanding exception */
+
+  retval=PyObject_CallFunction(self->updatehook, "(iO&O&L)", updatetype, convertutf8string, databasename, convertutf8string, tablename, rowid);
 
  finally:
   Py_XDECREF(retval);
-
   PyGILState_Release(gilstate);
-  return result;
 }
 
-/** .. method:: setauthorizer(callable)
-
-  While `preparing <https://sqlite.org/c3ref/prepare.html>`_
-  statements, SQLite will call any defined authorizer to see if a
-  particular action is ok to be part of the statement.
-
-  Typical usage would be if you are running user supplied SQL and want
-  to prevent harmful operations.  You should also
-  set the :class:`statementcachesize <Connection>` to zero.
+/** .. method:: setupdatehook(callable)
 
-  The authorizer callback has 5 parameters:
+  Calls *callable* whenever a row is updated, deleted or inserted.  If
+  *callable* is :const:`None` then any existing update hook is
+  removed.  The update hook cannot make changes to the database while
+  the query is still executing, but can record them for later use or
+  apply them in a different connection.
 
-    * An `operation code <https://sqlite.org/c3ref/c_alter_table.html>`_
-    * A string (or None) dependent on the operation `(listed as 3rd) <https://sqlite.org/c3ref/c_alter_table.html>`_
-    * A string (or None) dependent on the operation `(listed as 4th) <https://sqlite.org/c3ref/c_alter_table.html>`_
-    * A string name of the database (or None)
-    * Name of the innermost trigger or view doing the access (or None)
+  The update hook is called with 4 parameters:
 
-  The authorizer callback should return one of :const:`SQLITE_OK`,
-  :const:`SQLITE_DENY` or :const:`SQLITE_IGNORE`.
-  (:const:`SQLITE_DENY` is returned if there is an error in your
-  Python code).
+    type (int)
+      :const:`SQLITE_INSERT`, :const:`SQLITE_DELETE` or :const:`SQLITE_UPDATE`
+    database name (string)
+      This is ``main`` for the database or the name specified in
+      `ATTACH <https://sqlite.org/lang_attach.html>`_
+    table name (string)
+      The table on which the update happened
+    rowid (64 bit integer)
+      The affected row
 
   .. seealso::
 
-    * :ref:`Example <authorizer-example>`
-    * :ref:`statementcache`
+      * :ref:`Example <example-updatehook>`
 
-  -* sqlite3_set_authorizer
+  -* sqlite3_update_hook
 */
-
 static PyObject *
-Connection_setauthorizer(Connection *self, PyObject *callable)
+Connection_setupdatehook(Connection *self, PyObject *callable)
 {
-  int res;
+  /* sqlite3_update_hook doesn't return an error code */
 
   CHECK_USE(NULL);
   CHECK_CLOSED(self,NULL);
 
   if(callable==Py_None)
     {
-      APSW_FAULT_INJECT(SetAuthorizerNullFail,
-                        PYSQLITE_CON_CALL(res=sqlite3_set_authorizer(self->db, NULL, NULL)),
-                        res=SQLITE_IOERR);
-      if(res!=SQLITE_OK)
-        {
-          SET_EXC(res, self->db);
-          return NULL;
-        }
+      /* the result cache and change capture also use the hook */
+      PYSQLITE_VOID_CALL(sqlite3_update_hook(self->db, (self->resultcache || self->changecapture)?updatecb:NULL, self));
       callable=NULL;
       goto finally;
     }
 
   if(!PyCallable_Check(callable))
-    return PyErr_Format(PyExc_TypeError, "authorizer must be callable");
+    return PyErr_Format(PyExc_TypeError, "update hook must be callable");
 
-  APSW_FAULT_INJECT(SetAuthorizerFail,
-                    PYSQLITE_CON_CALL(res=sqlite3_set_authorizer(self->db, authorizercb, self)),
-                    res=SQLITE_IOERR);
-  if(res!=SQLITE_OK)
-    {
-      SET_EXC(res, self->db);
-      return NULL;
-    }
+  PYSQLITE_VOID_CALL(sqlite3_update_hook(self->db, updatecb, self));
 
   Py_INCREF(callable);
 
  finally:
-  Py_XDECREF(self->authorizer);
-  self->authorizer=callable;
+
+  Py_XDECREF(self->updatehook);
+  self->updatehook=callable;
 
   Py_RETURN_NONE;
 }
 
 static void
-collationneeded_cb(void *pAux, APSW_ARGUNUSED sqlite3 *db, int eTextRep, const char *name)
+rollbackhookcb(void *context)
 {
-  PyObject *res=NULL, *pyname=NULL;
-  Connection *self=(Connection*)pAux;
-  PyGILState_STATE gilstate=PyGILState_Ensure();
+  /* The hook returns void. That makes it impossible for us to
+     abort immediately due to an error in the callback */
 
-  assert(self->collationneeded);
-  if(!self->collationneeded) goto finally;
-  if(PyErr_Occurred()) goto finally;
-  pyname=convertutf8string(name);
-  if(pyname)  res=PyEval_CallFunction(self->collationneeded, "(OO)", self, pyname);
-  if(!pyname || !res)
-    AddTraceBackHere(__FILE__, __LINE__, "collationneeded callback", "{s: O, s: i, s: s}",
-                     "Connection", self, "eTextRep", eTextRep, "name", name);
-  Py_XDECREF(res);
+  PyGILState_STATE gilstate;
+  PyObject *retval=NULL;
+  Connection *self=(Connection *)context;
+
+  assert(self);
+
+  /* discard the changes of the transaction */
+  if(self->changecapture)
+    {
+      self->changecapture->rolledback+=self->changecapture->head-self->changecapture->committed;
+      self->changecapture->head=self->changecapture->committing=self->changecapture->committed;
+    }
+
+  if(!self->rollbackhook)
+    return;
+  assert(self->rollbackhook!=Py_None);
+
+  gilstate=PyGILState_Ensure();
+
+  APSW_FAULT_INJECT(RollbackHookExistingError,,PyErr_NoMemory());
+
+  if(PyErr_Occurred())
+    goto finally;  /* abort hook due to outstanding exception */
+
+  retval=PyEval_CallObject(self->rollbackhook, NULL);
 
  finally:
-  Py_XDECREF(pyname);
+  Py_XDECREF(retval);
   PyGILState_Release(gilstate);
 }
 
-/** .. method:: collationneeded(callable)
-
-  *callable* will be called if a statement requires a `collation
-  <http://en.wikipedia.org/wiki/Collation>`_ that hasn't been
-  registered. Your callable will be passed two parameters. The first
-  is the connection object. The second is the name of the
-  collation. If you have the collation code available then call
-  :meth:`Connection.createcollation`.
-
-  This is useful for creating collations on demand.  For example you
-  may include the `locale <http://en.wikipedia.org/wiki/Locale>`_ in
-  the collation name, but since there are thousands of locales in
-  popular use it would not be useful to :meth:`prereigster
-  <Connection.createcollation>` them all.  Using
-  :meth:`~Connection.collationneeded` tells you when you need to
-  register them.
+/** .. method:: setrollbackhook(callable)
 
-  .. seealso::
+  Sets a callable which is invoked during a rollback.  If *callable*
+  is :const:`None` then any existing rollback hook is removed.
 
-    * :meth:`~Connection.createcollation`
+  The *callable* is called with no parameters and the return value is ignored.
 
-  -* sqlite3_collation_needed
+  -* sqlite3_rollback_hook
 */
 static PyObject *
-Connection_collationneeded(Connection *self, PyObject *callable)
+Connection_setrollbackhook(Connection *self, PyObject *callable)
 {
-  int res;
+  /* sqlite3_rollback_hook doesn't return an error code */
 
   CHECK_USE(NULL);
   CHECK_CLOSED(self,NULL);
 
   if(callable==Py_None)
     {
-      APSW_FAULT_INJECT(CollationNeededNullFail,
-                        PYSQLITE_CON_CALL(res=sqlite3_collation_needed(self->db, NULL, NULL)),
-                        res=SQLITE_IOERR);
-      if(res!=SQLITE_OK)
-        {
-          SET_EXC(res, self->db);
-          return NULL;
-        }
+      /* change capture also uses the hook */
+      PYSQLITE_VOID_CALL(sqlite3_rollback_hook(self->db, self->changecapture?rollbackhookcb:NULL, self));
       callable=NULL;
       goto finally;
     }
 
   if(!PyCallable_Check(callable))
-    return PyErr_Format(PyExc_TypeError, "collationneeded callback must be callable");
+    return PyErr_Format(PyExc_TypeError, "rollback hook must be callable");
 
-  APSW_FAULT_INJECT(CollationNeededFail,
-                    PYSQLITE_CON_CALL(res=sqlite3_collation_needed(self->db, self, collationneeded_cb)),
-                    res=SQLITE_IOERR);
-  if(res!=SQLITE_OK)
-    {
-      SET_EXC(res, self->db);
-      return NULL;
-    }
+  PYSQLITE_VOID_CALL(sqlite3_rollback_hook(self->db, rollbackhookcb, self));
 
   Py_INCREF(callable);
 
  finally:
-  Py_XDECREF(self->collationneeded);
-  self->collationneeded=callable;
+
+  Py_XDECREF(self->rollbackhook);
+  self->rollbackhook=callable;
 
   Py_RETURN_NONE;
 }
 
-static int
-busyhandlercb(void *context, int ncall)
+#ifdef EXPERIMENTAL /* sqlite3_profile */
+static void
+profilecb(void *context, const char *statement, sqlite_uint64 runtime)
 {
-  /* Return zero for caller to get SQLITE_BUSY error. We default to
-     zero in case of error. */
+  /* The hook returns void. That makes it impossible for us to
+     abort immediately due to an error in the callback */
 
   PyGILState_STATE gilstate;
-  PyObject *retval;
-  int result=0;  /* default to fail with SQLITE_BUSY */
+  PyObject *retval=NULL;
   Connection *self=(Connection *)context;
 
   assert(self);
-  assert(self->busyhandler);
+  assert(self->profile);
+  assert(self->profile!=Py_None);
 
   gilstate=PyGILState_Ensure();
 
-  retval=PyObject_CallFunction(self->busyhandler, "i", ncall);
-
-  if(!retval)
-    goto finally; /* abort due to exeception */
-
-  result=PyObject_IsTrue(retval);
-  assert(result==-1 || result==0 || result==1);
-  Py_DECREF(retval);
+  if(PyErr_Occurred())
+    goto finally;  /* abort hook due to outstanding exception */
 
-  if(result==-1)
-    {
-      result=0;
-      goto finally;  /* abort due to exception converting retval */
-    }
+  retval=PyObject_CallFunction(self->profile, "(O&K)", convertutf8string, statement, runtime);
 
  finally:
+  Py_XDECREF(retval);
   PyGILState_Release(gilstate);
-  return result;
 }
 
-/** .. method:: setbusyhandler(callable)
-
-   Sets the busy handler to callable. callable will be called with one
-   integer argument which is the number of prior calls to the busy
-   callback for the same lock. If the busy callback returns something
-   that evaluates to False, then SQLite returns :const:`SQLITE_BUSY` to the
-   calling code.. If the callback returns something that evaluates to
-   True, then SQLite tries to open the table again and the cycle
-   repeats.
-
-   If you previously called :meth:`~Connection.setbusytimeout` then
-   calling this overrides that.
+/** .. method:: setprofile(callable)
 
-   .. seealso::
-
-     * :meth:`Connection.setbusytimeout`
-     * :ref:`Busy handling <busyhandling>`
-
-   -* sqlite3_busy_handler
+  Sets a callable which is invoked at the end of execution of each
+  statement and passed the statement string and how long it took to
+  execute. (The execution time is in nanoseconds.) Note that it is
+  called only on completion. If for example you do a ``SELECT`` and
+  only read the first result, then you won't reach the end of the
+  statement.  :meth:`setlatencyprofile` is a lower overhead
+  alternative that doesn't call Python code.
 
+  -* sqlite3_profile
 */
+
 static PyObject *
-Connection_setbusyhandler(Connection *self, PyObject *callable)
+Connection_setprofile(Connection *self, PyObject *callable)
 {
-  int res=SQLITE_OK;
+  /* sqlite3_profile doesn't return an error code */
 
   CHECK_USE(NULL);
   CHECK_CLOSED(self,NULL);
 
   if(callable==Py_None)
     {
-      APSW_FAULT_INJECT(SetBusyHandlerNullFail,
-                        PYSQLITE_CON_CALL(res=sqlite3_busy_handler(self->db, NULL, NULL)),
-                        res=SQLITE_IOERR);
-      if(res!=SQLITE_OK)
-        {
-          SET_EXC(res, self->db);
-          return NULL;
-        }
+      PYSQLITE_VOID_CALL(sqlite3_profile(self->db, NULL, NULL));
       callable=NULL;
       goto finally;
     }
 
   if(!PyCallable_Check(callable))
-    return PyErr_Format(PyExc_TypeError, "busyhandler must be callable");
+    return PyErr_Format(PyExc_TypeError, "profile function must be callable");
 
-  APSW_FAULT_INJECT(SetBusyHandlerFail,
-                    PYSQLITE_CON_CALL(res=sqlite3_busy_handler(self->db, busyhandlercb, self)),
-                    res=SQLITE_IOERR);
-  if(res!=SQLITE_OK)
+  /* replaces the latency profile */
+  if(self->latencyenabled)
     {
-      SET_EXC(res, self->db);
-      return NULL;
+      PYSQLITE_VOID_CALL(sqlite3_trace_v2(self->db, 0, NULL, NULL));
+      self->latencyenabled=0;
     }
 
+  PYSQLITE_VOID_CALL(sqlite3_profile(self->db, profilecb, self));
+
   Py_INCREF(callable);
 
  finally:
-  Py_XDECREF(self->busyhandler);
-  self->busyhandler=callable;
+
+  Py_XDECREF(self->profile);
+  self->profile=callable;
 
   Py_RETURN_NONE;
 }
+#endif /* EXPERIMENTAL - sqlite3_profile */
 
-#if defined(EXPERIMENTAL) && !defined(SQLITE_OMIT_LOAD_EXTENSION)  /* extension loading */
-
-/** .. method:: enableloadextension(enable)
-
-  Enables/disables `extension loading
-  <https://sqlite.org/cvstrac/wiki/wiki?p=LoadableExtensions>`_
-  which is disabled by default.
-
-  :param enable: If True then extension loading is enabled, else it is disabled.
+/* Which histogram bucket nanoseconds goes in */
+static unsigned
+latencyprofile_bucket(sqlite3_uint64 ns)
+{
+  unsigned msb, shift;
+
+  if(ns>=((sqlite3_uint64)1<<LP_MAXBITS))
+    ns=((sqlite3_uint64)1<<LP_MAXBITS)-1;
+  if(ns<LP_SUB)
+    return (unsigned)ns;
+  for(msb=LP_SUBBITS; ns>>(msb+1); msb++);
+  shift=msb-LP_SUBBITS;
+  return (shift+1)*LP_SUB + (unsigned)((ns>>shift)-LP_SUB);
+}
 
-  -* sqlite3_enable_load_extension
+/* The largest nanoseconds that goes in a bucket */
+static sqlite3_uint64
+latencyprofile_bucketmax(unsigned bucket)
+{
+  unsigned shift;
 
-  .. seealso::
+  if(bucket<LP_SUB)
+    return bucket;
+  shift=bucket/LP_SUB-1;
+  return (((sqlite3_uint64)(LP_SUB+bucket%LP_SUB+1))<<shift)-1;
+}
 
-    * :meth:`~Connection.loadextension`
-*/
+/* Finds or makes the entry for the query text.  Called with the
+   database mutex held. */
+static LatencyEntry *
+latencyprofile_entry(LatencyProfile *lp, const char *sql)
+{
+  unsigned hash=2166136261u, slot;
+  size_t len;
+  const char *p;
+  LatencyEntry *entry;
+
+  /* FNV-1a */
+  for(p=sql; *p; p++)
+    hash=(hash ^ (unsigned char)*p)*16777619u;
+  len=p-sql;
+
+  for(slot=hash%LP_TABLESIZE; lp->table[slot]; slot=(slot+1)%LP_TABLESIZE)
+    if(lp->table[slot]->hash==hash && 0==strcmp(lp->table[slot]->sql, sql))
+      return lp->table[slot];
+
+  if(lp->nentries>=LP_MAXENTRIES)
+    return &lp->overflow;
+
+  PYSQLITE_HELD_CALL(entry=sqlite3_malloc(sizeof(LatencyEntry)));
+  if(!entry)
+    return &lp->overflow;
+  memset(entry, 0, sizeof(LatencyEntry));
+  PYSQLITE_HELD_CALL(entry->sql=sqlite3_malloc((int)len+1));
+  if(!entry->sql)
+    {
+      sqlite3_free(entry);
+      return &lp->overflow;
+    }
+  memcpy(entry->sql, sql, len+1);
+  entry->hash=hash;
+  lp->table[slot]=entry;
+  lp->nentries++;
+  return entry;
+}
 
-static PyObject *
-Connection_enableloadextension(Connection *self, PyObject *enabled)
+static int
+latencyprofilecb(unsigned type, void *context, void *p, void *x)
 {
-  int enabledp, res;
+  /* No Python is used so the GIL isn't needed.  SQLite holds the
+     database mutex which protects the profile. */
+  Connection *self=(Connection *)context;
+  LatencyProfile *lp=self->latency;
+  sqlite3_stmt *stmt=(sqlite3_stmt*)p;
+  LatencyEntry *entry;
+  const char *sql;
+  sqlite3_int64 ns, rows=0;
+  int i, empty=-1;
 
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self, NULL);
+  assert(lp);
 
-  /* get the boolean value */
-  enabledp=PyObject_IsTrue(enabled);
-  if(enabledp==-1) return NULL;
-  if (PyErr_Occurred()) return NULL;
+  for(i=0; i<LP_MAXACTIVE; i++)
+    {
+      if(lp->active[i].stmt==stmt)
+        break;
+      if(empty<0 && !lp->active[i].stmt)
+        empty=i;
+    }
 
-  /* call function */
-  APSW_FAULT_INJECT(EnableLoadExtensionFail,
-                    PYSQLITE_CON_CALL(res=sqlite3_enable_load_extension(self->db, enabledp)),
-                    res=SQLITE_IOERR);
-  SET_EXC(res, self->db);
+  if(type==SQLITE_TRACE_STMT || type==SQLITE_TRACE_ROW)
+    {
+      /* triggers also report SQLITE_TRACE_STMT with text starting -- */
+      if(type==SQLITE_TRACE_STMT && x && 0==strncmp((const char*)x, "--", 2))
+        return 0;
+      if(i==LP_MAXACTIVE)
+        {
+          if(empty<0)
+            return 0;
+          i=empty;
+          lp->active[i].stmt=stmt;
+          lp->active[i].rows=0;
+          lp->active[i].start=0;
+        }
+      if(type==SQLITE_TRACE_ROW)
+        lp->active[i].rows++;
+      else
+        {
+          lp->active[i].rows=0;
+          lp->active[i].start=apsw_now_ns();
+        }
+      return 0;
+    }
 
-  /* done */
-  if (res==SQLITE_OK)
-    Py_RETURN_NONE;
-  return NULL;
+  assert(type==SQLITE_TRACE_PROFILE);
+  ns=*(sqlite3_int64*)x;
+  if(i<LP_MAXACTIVE)
+    {
+      rows=lp->active[i].rows;
+      if(lp->active[i].start)
+        ns=apsw_now_ns()-lp->active[i].start;
+      lp->active[i].stmt=0;
+    }
+  if(ns<0)
+    ns=0;
+
+  PYSQLITE_HELD_CALL(sql=sqlite3_sql(stmt));
+  entry=sql?latencyprofile_entry(lp, sql):&lp->overflow;
+
+  entry->count++;
+  entry->rows+=rows;
+  entry->total+=ns;
+  if(ns>entry->max)
+    entry->max=ns;
+  entry->buckets[latencyprofile_bucket((sqlite3_uint64)ns)]++;
+  return 0;
 }
 
-/** .. method:: loadextension(filename[, entrypoint])
-
-  Loads *filename* as an `extension <https://sqlite.org/cvstrac/wiki/wiki?p=LoadableExtensions>`_
+/** .. method:: setlatencyprofile(enable)
 
-  :param filename: The file to load.  This must be Unicode or Unicode compatible
+  Records how long each statement takes to execute in histograms kept
+  in C, one per query text, without calling any Python code.  This
+  costs far less than :meth:`setprofile` which calls a Python function
+  for every statement.  Use :meth:`latencyprofile` to get the results,
+  for example periodically from a metrics exporter.
 
-  :param entrypoint: The initialization method to call.  If this
-    parameter is not supplied then the SQLite default of
-    ``sqlite3_extension_init`` is used.
+  Times are in nanoseconds from when a statement starts until it is
+  reset, so a query whose rows are only partly read includes the time
+  until the cursor moves on.  A high resolution clock is used rather
+  than SQLite's own measurement which usually only has millisecond
+  resolution.  Each power of two is
+  divided into 16 buckets so the percentiles are within about 6% of
+  the actual value.  Up to 512 different queries are tracked, with
+  any others combined under the key :const:`None`.
 
-  :raises ExtensionLoadingError: If the extension could not be
-    loaded.  The exception string includes more details.
+  Disabling keeps the recorded times.  :meth:`setprofile` and this
+  method both use the same SQLite facility so enabling one disables
+  the other.
 
-  -* sqlite3_load_extension
+  -* sqlite3_trace_v2
 
   .. seealso::
 
-    * :meth:`~Connection.enableloadextension`
+    * :meth:`getlatencyprofile`
+    * :meth:`latencyprofile`
 */
 static PyObject *
-Connection_loadextension(Connection *self, PyObject *args)
+Connection_setlatencyprofile(Connection *self, PyObject *args)
 {
-  int res;
-  char *zfile=NULL, *zproc=NULL, *errmsg=NULL;
+  int enable, res;
 
   CHECK_USE(NULL);
   CHECK_CLOSED(self, NULL);
 
-  if(!PyArg_ParseTuple(args, "es|z:loadextension(filename, entrypoint=None)", STRENCODING, &zfile, &zproc))
+  if(!PyArg_ParseTuple(args, "i:setlatencyprofile(enable)", &enable))
     return NULL;
 
-  PYSQLITE_CON_CALL(res=sqlite3_load_extension(self->db, zfile, zproc, &errmsg));
+  if(enable && !self->latency)
+    {
+      APSW_FAULT_INJECT(LatencyProfileAllocFails, self->latency=PyMem_Malloc(sizeof(LatencyProfile)), self->latency=NULL);
+      if(!self->latency)
+        return PyErr_NoMemory();
+      memset(self->latency, 0, sizeof(LatencyProfile));
+    }
 
-  PyMem_Free(zfile);
+  /* replaces the sqlite3_profile callback */
+  if(enable && self->profile)
+    {
+      PYSQLITE_VOID_CALL(sqlite3_profile(self->db, NULL, NULL));
+      Py_CLEAR(self->profile);
+    }
 
-  /* load_extension doesn't set the error message on the db so we have to make exception manually */
+  PYSQLITE_CON_CALL(res=enable?
+                    sqlite3_trace_v2(self->db, SQLITE_TRACE_STMT|SQLITE_TRACE_PROFILE|SQLITE_TRACE_ROW, latencyprofilecb, self):  /* PYSQLITE_CON_CALL */
+                    sqlite3_trace_v2(self->db, 0, NULL, NULL)  /* PYSQLITE_CON_CALL */
+                    );
   if(res!=SQLITE_OK)
     {
-      assert(errmsg);
-      PyErr_Format(ExcExtensionLoading, "ExtensionLoadingError: %s", errmsg?errmsg:"unspecified");
-      sqlite3_free(errmsg);
+      SET_EXC(res, self->db);
       return NULL;
     }
+
+  self->latencyenabled=!!enable;
+
   Py_RETURN_NONE;
 }
 
-#endif /* EXPERIMENTAL extension loading */
-
+/** .. method:: getlatencyprofile() -> bool
 
-/* USER DEFINED FUNCTION CODE.*/
-static PyTypeObject FunctionCBInfoType =
-  {
-    APSW_PYTYPE_INIT
-    "apsw.FunctionCBInfo",     /*tp_name*/
-    sizeof(FunctionCBInfo),    /*tp_basicsize*/
-    0,                         /*tp_itemsize*/
-    (destructor)FunctionCBInfo_dealloc, /*tp_dealloc*/
-    0,                         /*tp_print*/
-    0,                         /*tp_getattr*/
-    0,                         /*tp_setattr*/
-    0,                         /*tp_compare*/
-    0,                         /*tp_repr*/
-    0,                         /*tp_as_number*/
-    0,                         /*tp_as_sequence*/
-    0,                         /*tp_as_mapping*/
-    0,                         /*tp_hash */
-    0,                         /*tp_call*/
-    0,                         /*tp_str*/
-    0,                         /*tp_getattro*/
-    0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
-    "FunctionCBInfo object",   /* tp_doc */
-    0,		               /* tp_traverse */
-    0,		               /* tp_clear */
-    0,		               /* tp_richcompare */
-    0,		               /* tp_weaklistoffset */
-    0,		               /* tp_iter */
-    0,		               /* tp_iternext */
-    0,                         /* tp_methods */
-    0,                         /* tp_members */
-    0,                         /* tp_getset */
-    0,                         /* tp_base */
-    0,                         /* tp_dict */
-    0,                         /* tp_descr_get */
-    0,                         /* tp_descr_set */
-    0,                         /* tp_dictoffset */
-    0,                         /* tp_init */
-    0,                         /* tp_alloc */
-    0,                         /* tp_new */
-    0,                         /* tp_free */
-    0,                         /* tp_is_gc */
-    0,                         /* tp_bases */
-    0,                         /* tp_mro */
-    0,                         /* tp_cache */
-    0,                         /* tp_subclasses */
-    0,                         /* tp_weaklist */
-    0                          /* tp_del */
-    APSW_PYTYPE_VERSION
-  };
+  Returns if statement latencies are being recorded as set by
+  :meth:`setlatencyprofile`.
+*/
+static PyObject *
+Connection_getlatencyprofile(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
+  return PyBool_FromLong(self->latencyenabled);
+}
 
-static FunctionCBInfo *
-allocfunccbinfo(void)
+static PyObject *
+latencyprofile_entrydict(LatencyEntry *entry)
 {
-  FunctionCBInfo *res=PyObject_New(FunctionCBInfo, &FunctionCBInfoType);
-  if(res)
+  static const double percentiles[]={0.5, 0.9, 0.99};
+  sqlite3_uint64 values[3];
+  sqlite3_int64 seen=0;
+  unsigned bucket=0, i;
+
+  for(i=0; i<3; i++)
     {
-      res->name=0;
-      res->scalarfunc=0;
-      res->aggregatefactory=0;
+      /* the bucket containing the value at that rank */
+      sqlite3_int64 rank=(sqlite3_int64)(percentiles[i]*entry->count+0.999999);
+      if(rank<1)
+        rank=1;
+      while(bucket<LP_NBUCKETS && seen+entry->buckets[bucket]<rank)
+        seen+=entry->buckets[bucket++];
+      values[i]=latencyprofile_bucketmax(bucket);
+      if(values[i]>(sqlite3_uint64)entry->max)
+        values[i]=entry->max;
     }
-  return res;
-}
 
+  return Py_BuildValue("{s: L, s: L, s: L, s: K, s: K, s: K, s: L}",
+                       "count", entry->count,
+                       "rows", entry->rows,
+                       "total", entry->total,
+                       "p50", values[0],
+                       "p90", values[1],
+                       "p99", values[2],
+                       "max", entry->max);
+}
 
-/* converts a python object into a sqlite3_context result */
-static void
-set_context_result(sqlite3_context *context, PyObject *obj)
+/** .. method:: latencyprofile(reset=False) -> dict
+
+  Returns the statement latencies recorded since
+  :meth:`setlatencyprofile` was enabled or the last reset.  The dict
+  is keyed by query text (:const:`None` for queries beyond the number
+  tracked) with each value being a dict of:
+
+    count
+      How many times the query was executed
+    rows
+      How many rows it returned in total
+    total
+      Total nanoseconds
+    p50, p90, p99
+      Nanoseconds within which that percentage of executions
+      completed
+    max
+      Longest execution in nanoseconds
+
+  :param reset: If true then the recorded values are discarded after
+    being returned so the next call covers only the time in between.
+*/
+static PyObject *
+Connection_latencyprofile(Connection *self, PyObject *args)
 {
-  if(!obj)
-    {
-      assert(PyErr_Occurred());
-      sqlite3_result_error_code(context, MakeSqliteMsgFromPyException(NULL));
-      sqlite3_result_error(context, "bad object given to set_context_result", -1);
-      return;
-    }
+  int reset=0;
+  unsigned i;
+  PyObject *res, *item=NULL, *key=NULL;
 
-  /* DUPLICATE(ish) code: this is substantially similar to the code in
-     APSWCursor_dobinding.  If you fix anything here then do it there as
-     well. */
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
-  if(obj==Py_None)
+  if(!PyArg_ParseTuple(args, "|i:latencyprofile(reset=False)", &reset))
+    return NULL;
+
+  res=PyDict_New();
+  if(!res || !self->latency)
+    return res;
+
+  /* the callback updates the profile while holding the mutex */
+  APSW_DB_MUTEX_ENTER(self->db);
+  for(i=0; i<LP_TABLESIZE; i++)
     {
-      sqlite3_result_null(context);
-      return;
+      LatencyEntry *entry=self->latency->table[i];
+      if(!entry)
+        continue;
+      item=latencyprofile_entrydict(entry);
+      key=convertutf8string(entry->sql);
+      if(!item || !key || PyDict_SetItem(res, key, item))
+        goto error;
+      Py_CLEAR(item);
+      Py_CLEAR(key);
     }
-#if PY_MAJOR_VERSION < 3
-  if(PyInt_Check(obj))
+  if(self->latency->overflow.count)
     {
-      sqlite3_result_int64(context, PyInt_AS_LONG(obj));
-      return;
+      item=latencyprofile_entrydict(&self->latency->overflow);
+      if(!item || PyDict_SetItem(res, Py_None, item))
+        goto error;
+      Py_CLEAR(item);
     }
-#endif
-  if (PyLong_Check(obj))
+  if(reset)
+    latencyprofile_reset(self->latency);
+  APSW_DB_MUTEX_LEAVE(self->db);
+
+  return res;
+
+ error:
+  APSW_DB_MUTEX_LEAVE(self->db);
+  Py_XDECREF(item);
+  Py_XDECREF(key);
+  Py_DECREF(res);
+  return NULL;
+}
+
+
+/* Called with the GIL held after statements are stepped.  Records the
+   commit hook marked as committing are committed once the transaction
+   has ended.  If the commit failed and the transaction is still open
+   they stay committing, and the rollback hook discards them if it
+   rolls back.  The records for oncommit are taken under the database
+   mutex but it is called after releasing it.  Errors are reported as
+   unraisable. */
+static void
+changecapture_settle(Connection *connection)
+{
+  ChangeCapture *cc=connection->changecapture;
+  PyObject *etype, *eval, *etb, *records=NULL, *oncommit=NULL, *retval;
+  unsigned inuse;
+  int drained=0;
+
+  if(!cc || !connection->db || cc->committing==cc->committed || !sqlite3_get_autocommit(connection->db))
+    return;
+
+  PyErr_Fetch(&etype, &eval, &etb);
+
+  APSW_DB_MUTEX_ENTER(connection->db);
+  cc->committed=cc->committing;
+  if(cc->oncommit && !cc->notifying)
     {
-      sqlite3_result_int64(context, PyLong_AsLongLong(obj));
-      return;
+      drained=1;
+      records=changecapture_drain(cc, -1);
+      if(records && PyList_GET_SIZE(records))
+        {
+          oncommit=cc->oncommit;
+          Py_INCREF(oncommit);
+          cc->notifying=1;
+        }
     }
-  if (PyFloat_Check(obj))
+  APSW_DB_MUTEX_LEAVE(connection->db);
+
+  if(drained && !records)
+    apsw_write_unraiseable(NULL);
+  if(oncommit)
     {
-      sqlite3_result_double(context, PyFloat_AS_DOUBLE(obj));
-      return;
+      /* the callable must not use the connection */
+      inuse=connection->inuse;
+      connection->inuse=1;
+      retval=PyObject_CallFunctionObjArgs(oncommit, records, NULL);
+      connection->inuse=inuse;
+      cc->notifying=0;
+      if(!retval)
+        apsw_write_unraiseable(NULL);
+      Py_XDECREF(retval);
+      Py_DECREF(oncommit);
     }
-  if (PyUnicode_Check(obj))
-    {
-      UNIDATABEGIN(obj)
-        APSW_FAULT_INJECT(SetContextResultUnicodeConversionFails,,strdata=(char*)PyErr_NoMemory());
-        if(strdata)
-          {
-#ifdef APSW_TEST_LARGE_OBJECTS
-            APSW_FAULT_INJECT(SetContextResultLargeUnicode,,strbytes=0x001234567890L);
-#endif
-	    if(strbytes>APSW_INT32_MAX)
-	      {
-                SET_EXC(SQLITE_TOOBIG, NULL);
-                sqlite3_result_error_toobig(context);
-	      }
-	    else
-              USE16(sqlite3_result_text)(context, strdata, strbytes, SQLITE_TRANSIENT);
-          }
-        else
-          sqlite3_result_error(context, "Unicode conversions failed", -1);
-      UNIDATAEND(obj);
-      return;
-    }
-#if PY_MAJOR_VERSION < 3
-  if (PyString_Check(obj))
-    {
-      const char *val=PyString_AS_STRING(obj);
-      const Py_ssize_t lenval=PyString_GET_SIZE(obj);
-      const char *chk=val;
-      /* check if string is all ascii if less than 10kb in size */
-      if(lenval<10000)
-        for(;chk<val+lenval && !((*chk)&0x80); chk++);
-      /* Non-ascii or long, so convert to unicode */
-      if(chk<val+lenval)
-        {
-          PyObject *str2=PyUnicode_FromObject(obj);
-          if(!str2)
-            {
-              sqlite3_result_error(context, "PyUnicode_FromObject failed", -1);
-              return;
-            }
-          UNIDATABEGIN(str2)
-            APSW_FAULT_INJECT(SetContextResultStringUnicodeConversionFails,,strdata=(char*)PyErr_NoMemory());
-            if(strdata)
-              {
-#ifdef APSW_TEST_LARGE_OBJECTS
-                APSW_FAULT_INJECT(SetContextResultLargeString,,strbytes=0x001234567890L);
-#endif
-		if(strbytes>APSW_INT32_MAX)
-		  {
-                    SET_EXC(SQLITE_TOOBIG, NULL);
-                    sqlite3_result_error_toobig(context);
-		  }
-		else
-                  USE16(sqlite3_result_text)(context, strdata, strbytes, SQLITE_TRANSIENT);
-              }
-            else
-              sqlite3_result_error(context, "Unicode conversions failed", -1);
-          UNIDATAEND(str2);
-          Py_DECREF(str2);
-        }
-      else /* just ascii chars */
-        sqlite3_result_text(context, val, lenval, SQLITE_TRANSIENT);
+  Py_XDECREF(records);
 
-      return;
-    }
-#endif
-  if (PyObject_CheckReadBuffer(obj))
-    {
-      const void *buffer;
-      Py_ssize_t buflen;
-      int asrb=PyObject_AsReadBuffer(obj, &buffer, &buflen);
+  PyErr_Restore(etype, eval, etb);
+}
 
-      APSW_FAULT_INJECT(SetContextResultAsReadBufferFail,,(PyErr_NoMemory(),asrb=-1));
+static int
+commithookcb(void *context)
+{
+  /* The hook returns 0 for commit to go ahead and non-zero to abort
+     commit (turn into a rollback). We return non-zero for errors */
 
-      if(asrb!=0)
-        {
-          sqlite3_result_error(context, "PyObject_AsReadBuffer failed", -1);
-          return;
-        }
-      if (buflen>APSW_INT32_MAX)
-	sqlite3_result_error_toobig(context);
-      else
-	sqlite3_result_blob(context, buffer, buflen, SQLITE_TRANSIENT);
-      return;
-    }
+  PyGILState_STATE gilstate;
+  PyObject *retval=NULL;
+  int ok=1; /* error state */
+  Connection *self=(Connection *)context;
 
-  PyErr_Format(PyExc_TypeError, "Bad return type from function callback");
-  sqlite3_result_error(context, "Bad return type from function callback", -1);
-}
+  assert(self);
 
-/* Returns a new reference to a tuple formed from function parameters */
-static PyObject *
-getfunctionargs(sqlite3_context *context, PyObject *firstelement, int argc, sqlite3_value **argv)
-{
-  PyObject *pyargs=NULL;
-  int i;
-  int extra=0;
+  /* the commit can still fail so the records are only committed once
+     the statement finishes (changecapture_settle) */
+  if(self->changecapture)
+    self->changecapture->committing=self->changecapture->head;
 
-  /* extra first item */
-  if(firstelement)
-    extra=1;
+  if(!self->commithook)
+    return 0;
+  assert(self->commithook!=Py_None);
 
-  APSW_FAULT_INJECT(GFAPyTuple_NewFail,pyargs=PyTuple_New((long)argc+extra),pyargs=PyErr_NoMemory());
-  if(!pyargs)
-    {
-      sqlite3_result_error(context, "PyTuple_New failed", -1);
-      goto error;
-    }
+  gilstate=PyGILState_Ensure();
 
-  if(extra)
-    {
-      Py_INCREF(firstelement);
-      PyTuple_SET_ITEM(pyargs, 0, firstelement);
-    }
+  APSW_FAULT_INJECT(CommitHookExistingError,,PyErr_NoMemory());
 
-  for(i=0;i<argc;i++)
+  if(PyErr_Occurred())
+    goto finally;  /* abort hook due to outstanding exception */
+
+  retval=PyEval_CallObject(self->commithook, NULL);
+
+  if(!retval)
+    goto finally; /* abort hook due to exeception */
+
+  ok=PyObject_IsTrue(retval);
+  assert(ok==-1 || ok==0 || ok==1);
+  if(ok==-1)
     {
-      PyObject *item=convert_value_to_pyobject(argv[i]);
-      if(!item)
-        {
-          sqlite3_result_error(context, "convert_value_to_pyobject failed", -1);
-          goto error;
-        }
-      PyTuple_SET_ITEM(pyargs, i+extra, item);
+      ok=1;
+      goto finally;  /* abort due to exception in return value */
     }
 
-  return pyargs;
-
- error:
-  Py_XDECREF(pyargs);
-  return NULL;
+ finally:
+  Py_XDECREF(retval);
+  PyGILState_Release(gilstate);
+  return ok;
 }
 
+/** .. method:: setcommithook(callable)
 
-/* dispatches scalar function */
-static void
-cbdispatch_func(sqlite3_context *context, int argc, sqlite3_value **argv)
-{
-  PyGILState_STATE gilstate;
-  PyObject *pyargs=NULL;
-  PyObject *retval=NULL;
-  FunctionCBInfo *cbinfo=(FunctionCBInfo*)sqlite3_user_data(context);
-  assert(cbinfo);
+  *callable* will be called just before a commit.  It should return
+  zero for the commit to go ahead and non-zero for it to be turned
+  into a rollback. In the case of an exception in your callable, a
+  non-zero (ie rollback) value is returned.
 
-  gilstate=PyGILState_Ensure();
+  .. seealso::
 
-  assert(cbinfo->scalarfunc);
+    * :ref:`Example <example-commithook>`
 
+  -* sqlite3_commit_hook
 
-  APSW_FAULT_INJECT(CBDispatchExistingError,,PyErr_NoMemory());
+*/
+static PyObject *
+Connection_setcommithook(Connection *self, PyObject *callable)
+{
+  /* sqlite3_commit_hook doesn't return an error code */
 
-  if(PyErr_Occurred())
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+
+  if(callable==Py_None)
     {
-      sqlite3_result_error_code(context, MakeSqliteMsgFromPyException(NULL));
-      sqlite3_result_error(context, "Prior Python Error", -1);
-      goto finalfinally;
+      /* change capture also uses the hook */
+      PYSQLITE_VOID_CALL(sqlite3_commit_hook(self->db, self->changecapture?commithookcb:NULL, self));
+      callable=NULL;
+      goto finally;
     }
 
-  pyargs=getfunctionargs(context, NULL, argc, argv);
-  if(!pyargs)
-      goto finally;
+  if(!PyCallable_Check(callable))
+    return PyErr_Format(PyExc_TypeError, "commit hook must be callable");
 
-  assert(!PyErr_Occurred());
-  retval=PyEval_CallObject(cbinfo->scalarfunc, pyargs);
-  if(retval)
-    set_context_result(context, retval);
+  PYSQLITE_VOID_CALL(sqlite3_commit_hook(self->db, commithookcb, self));
+
+  Py_INCREF(callable);
 
  finally:
-  if (PyErr_Occurred())
-    {
-      char *errmsg=NULL;
-      char *funname=sqlite3_mprintf("user-defined-scalar-%s", cbinfo->name);
-      sqlite3_result_error_code(context, MakeSqliteMsgFromPyException(&errmsg));
-      sqlite3_result_error(context, errmsg, -1);
-      AddTraceBackHere(__FILE__, __LINE__, funname, "{s: i, s: s}", "NumberOfArguments", argc, "message", errmsg);
-      sqlite3_free(funname);
-      sqlite3_free(errmsg);
-    }
- finalfinally:
-  Py_XDECREF(pyargs);
-  Py_XDECREF(retval);
 
-  PyGILState_Release(gilstate);
+  Py_XDECREF(self->commithook);
+  self->commithook=callable;
+
+  Py_RETURN_NONE;
 }
 
-static aggregatefunctioncontext *
-getaggregatefunctioncontext(sqlite3_context *context)
+static int
+walhookcb(void *context, APSW_ARGUNUSED sqlite3 *db, const char *dbname, int npages)
 {
-  aggregatefunctioncontext *aggfc=sqlite3_aggregate_context(context, sizeof(aggregatefunctioncontext));
-  FunctionCBInfo *cbinfo;
-  PyObject *retval;
-  /* have we seen it before? */
-  if(aggfc->aggvalue)
-    return aggfc;
+  PyGILState_STATE gilstate;
+  PyObject *retval=NULL;
+  int code=SQLITE_ERROR;
+  Connection *self=(Connection *)context;
 
-  /* fill in with Py_None so we know it is valid */
-  aggfc->aggvalue=Py_None;
-  Py_INCREF(Py_None);
+  assert(self);
+  assert(self->db==db);
 
-  cbinfo=(FunctionCBInfo*)sqlite3_user_data(context);
-  assert(cbinfo);
-  assert(cbinfo->aggregatefactory);
+#if PY_VERSION_HEX >= 0x03020000
+  if(self->checkpointer && 0==strcmp(dbname, "main"))
+    Checkpointer_walnotify(self->checkpointer, npages);
+#endif
 
-  /* call the aggregatefactory to get our working objects */
-  retval=PyEval_CallObject(cbinfo->aggregatefactory, NULL);
+  if(!self->walhook)
+    return SQLITE_OK;
+  assert(self->walhook!=Py_None);
+
+  gilstate=PyGILState_Ensure();
 
+  retval=PyEval_CallFunction(self->walhook, "(OO&i)", self, convertutf8string, dbname, npages);
   if(!retval)
-    return aggfc;
-  /* it should have returned a tuple of 3 items: object, stepfunction and finalfunction */
-  if(!PyTuple_Check(retval))
     {
-      PyErr_Format(PyExc_TypeError, "Aggregate factory should return tuple of (object, stepfunction, finalfunction)");
+      assert(PyErr_Occurred());
+      AddTraceBackHere(__FILE__, __LINE__, "walhookcallback", "{s: O, s: s, s: i}",
+		       "Connection", self,
+		       "dbname", dbname,
+		       "npages", npages);
       goto finally;
     }
-  if(PyTuple_GET_SIZE(retval)!=3)
+  if(!PyIntLong_Check(retval))
     {
-      PyErr_Format(PyExc_TypeError, "Aggregate factory should return 3 item tuple of (object, stepfunction, finalfunction)");
+      PyErr_Format(PyExc_TypeError, "wal hook must return a number");
+      AddTraceBackHere(__FILE__, __LINE__, "walhookcallback", "{s: O, s: s, s: i, s: O}",
+		       "Connection", self,
+		       "dbname", dbname,
+		       "npages", npages,
+		       "retval", retval);
       goto finally;
     }
-  /* we don't care about the type of the zeroth item (object) ... */
+  code=(int)PyIntLong_AsLong(retval);
 
-  /* stepfunc */
-  if (!PyCallable_Check(PyTuple_GET_ITEM(retval,1)))
-    {
-      PyErr_Format(PyExc_TypeError, "stepfunction must be callable");
-      goto finally;
-    }
+  finally:
+  Py_XDECREF(retval);
+  PyGILState_Release(gilstate);
+  return code;
+}
 
-  /* finalfunc */
-  if (!PyCallable_Check(PyTuple_GET_ITEM(retval,2)))
+/** .. method:: setwalhook(callable)
+
+ *callable* will be called just after data is committed in :ref:`wal`
+ mode.  It should return :const:`SQLITE_OK` or an error code.  The
+ callback is called with 3 parameters:
+
+   * The Connection
+   * The database name (eg "main" or the name of an attached database)
+   * The number of pages in the wal log
+
+ You can pass in None in order to clear an existing hook.
+
+ -* sqlite3_wal_hook
+
+*/
+
+static PyObject *
+Connection_setwalhook(Connection *self, PyObject *callable)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(callable==Py_None)
     {
-      PyErr_Format(PyExc_TypeError, "final function must be callable");
+      /* a Checkpointer also uses the hook */
+      PYSQLITE_VOID_CALL(sqlite3_wal_hook(self->db, self->checkpointer?walhookcb:NULL, self));
+      callable=NULL;
       goto finally;
     }
 
-  aggfc->aggvalue=PyTuple_GET_ITEM(retval,0);
-  aggfc->stepfunc=PyTuple_GET_ITEM(retval,1);
-  aggfc->finalfunc=PyTuple_GET_ITEM(retval,2);
+  if(!PyCallable_Check(callable))
+    return PyErr_Format(PyExc_TypeError, "wal hook must be callable");
 
-  Py_INCREF(aggfc->aggvalue);
-  Py_INCREF(aggfc->stepfunc);
-  Py_INCREF(aggfc->finalfunc);
+  PYSQLITE_VOID_CALL(sqlite3_wal_hook(self->db, walhookcb, self));
 
-  Py_DECREF(Py_None);  /* we used this earlier as a sentinel */
+  Py_INCREF(callable);
 
  finally:
-  assert(retval);
-  Py_DECREF(retval);
-  return aggfc;
-}
 
+  Py_XDECREF(self->walhook);
+  self->walhook=callable;
 
-/*
-  Note that we can't call sqlite3_result_error in the step function as
-  SQLite doesn't want to you to do that (and core dumps!)
-  Consequently if an error is returned, we will still be repeatedly
-  called.
-*/
+  Py_RETURN_NONE;
+}
 
-static void
-cbdispatch_step(sqlite3_context *context, int argc, sqlite3_value **argv)
+static int
+progresshandlercb(void *context)
 {
+  /* The hook returns 0 for continue and non-zero to abort (rollback).
+     We return non-zero for errors */
+
   PyGILState_STATE gilstate;
-  PyObject *pyargs;
-  PyObject *retval;
-  aggregatefunctioncontext *aggfc=NULL;
+  PyObject *retval=NULL;
+  int ok=1; /* error state */
+  Connection *self=(Connection *)context;
 
-  gilstate=PyGILState_Ensure();
+  assert(self);
 
-  if (PyErr_Occurred())
-    goto finalfinally;
+  /* deadlines and cancellation are checked without the GIL */
+  if(self->stepcancel && self->stepcancel->cancelled)
+    {
+      self->stopped=QUERY_CANCELLED;
+      return 1;
+    }
+  if(self->stepdeadline && apsw_now_ns()>=self->stepdeadline)
+    {
+      self->stopped=QUERY_TIMEDOUT;
+      return 1;
+    }
 
-  aggfc=getaggregatefunctioncontext(context);
+  if(!self->progresshandler || self->progresssteps<1)
+    return 0;
+  /* we may be called more often than the Python handler asked for */
+  self->progresscount+=self->progressinterval;
+  if(self->progresscount<self->progresssteps)
+    return 0;
+  self->progresscount=0;
 
-  if (PyErr_Occurred())
-    goto finally;
+  gilstate=PyGILState_Ensure();
 
-  assert(aggfc);
+  retval=PyEval_CallObject(self->progresshandler, NULL);
 
-  pyargs=getfunctionargs(context, aggfc->aggvalue, argc, argv);
-  if(!pyargs)
-    goto finally;
+  if(!retval)
+    goto finally; /* abort due to exeception */
 
-  assert(!PyErr_Occurred());
-  retval=PyEval_CallObject(aggfc->stepfunc, pyargs);
-  Py_DECREF(pyargs);
-  Py_XDECREF(retval);
+  ok=PyObject_IsTrue(retval);
 
-  if(!retval)
+  assert(ok==-1 || ok==0 || ok==1);
+  if(ok==-1)
     {
-      assert(PyErr_Occurred());
+      ok=1;
+      goto finally;  /* abort due to exception in result */
     }
 
  finally:
-  if(PyErr_Occurred())
-    {
-      char *funname=0;
-      FunctionCBInfo *cbinfo=(FunctionCBInfo*)sqlite3_user_data(context);
-      assert(cbinfo);
-      funname=sqlite3_mprintf("user-defined-aggregate-step-%s", cbinfo->name);
-      AddTraceBackHere(__FILE__, __LINE__, funname, "{s: i}", "NumberOfArguments", argc);
-      sqlite3_free(funname);
-    }
- finalfinally:
+  Py_XDECREF(retval);
+
   PyGILState_Release(gilstate);
+  return ok;
 }
 
-/* this is somewhat similar to cbdispatch_step, except we also have to
-   do some cleanup of the aggregatefunctioncontext */
+/* Installs progresshandlercb to call the Python progress handler every
+   progresssteps instructions, and to check deadlines and cancellation
+   every CANCEL_STEPS once they have been used on the connection. */
 static void
-cbdispatch_final(sqlite3_context *context)
+progresshandler_install(Connection *connection)
 {
-  PyGILState_STATE gilstate;
-  PyObject *retval=NULL;
-  aggregatefunctioncontext *aggfc=NULL;
-  PyObject *err_type=NULL, *err_value=NULL, *err_traceback=NULL;
+  int nsteps=0;
+
+  if(connection->progresshandler)
+    nsteps=connection->progresssteps;
+  if(connection->limits && (nsteps<1 || nsteps>CANCEL_STEPS))
+    nsteps=CANCEL_STEPS;
+  connection->progressinterval=nsteps;
+  connection->progresscount=0;
+
+  APSW_DB_MUTEX_ENTER(connection->db);
+  PYSQLITE_HELD_CALL(sqlite3_progress_handler(connection->db, nsteps, (nsteps>0)?progresshandlercb:NULL, connection));
+  APSW_DB_MUTEX_LEAVE(connection->db);
+}
 
-  gilstate=PyGILState_Ensure();
+/** .. method:: setprogresshandler(callable[, nsteps=20])
 
-  PyErr_Fetch(&err_type, &err_value, &err_traceback);
+  Sets a callable which is invoked every *nsteps* SQLite
+  inststructions. The callable should return a non-zero value to abort
+  or zero to continue. (If there is an error in your Python *callable*
+  then non-zero will be returned).
 
-  aggfc=getaggregatefunctioncontext(context);
-  assert(aggfc);
+  It keeps being called at its own interval when :ref:`deadlines or
+  cancellation <cancellation>` are used on the connection.
 
-  APSW_FAULT_INJECT(CBDispatchFinalError,,PyErr_NoMemory());
+  .. seealso::
 
-  if((err_type||err_value||err_traceback) || PyErr_Occurred() || !aggfc->finalfunc)
-    {
-      sqlite3_result_error(context, "Prior Python Error in step function", -1);
-      goto finally;
-    }
+     * :ref:`Example <example-progress-handler>`
 
-  retval=PyObject_CallFunctionObjArgs(aggfc->finalfunc, aggfc->aggvalue, NULL);
-  set_context_result(context, retval);
-  Py_XDECREF(retval);
+  -* sqlite3_progress_handler
+*/
 
- finally:
-  /* we also free the aggregatefunctioncontext here */
-  assert(aggfc->aggvalue);  /* should always be set, perhaps to Py_None */
-  Py_XDECREF(aggfc->aggvalue);
-  Py_XDECREF(aggfc->stepfunc);
-  Py_XDECREF(aggfc->finalfunc);
+static PyObject *
+Connection_setprogresshandler(Connection *self, PyObject *args)
+{
+  /* sqlite3_progress_handler doesn't return an error code */
+  int nsteps=20;
+  PyObject *callable=NULL;
 
-  if(PyErr_Occurred() && (err_type||err_value||err_traceback))
-    {
-      PyErr_Format(PyExc_Exception, "An exception happened during cleanup of an aggregate function, but there was already error in the step function so only that can be returned");
-      apsw_write_unraiseable(NULL);
-    }
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
 
-  if(err_type||err_value||err_traceback)
-    PyErr_Restore(err_type, err_value, err_traceback);
+  if(!PyArg_ParseTuple(args, "O|i:setprogresshandler(callable, nsteps=20)", &callable, &nsteps))
+    return NULL;
 
-  if(PyErr_Occurred())
+  if(callable==Py_None)
     {
-      char *funname=0;
-      FunctionCBInfo *cbinfo=(FunctionCBInfo*)sqlite3_user_data(context);
-      assert(cbinfo);
-      funname=sqlite3_mprintf("user-defined-aggregate-final-%s", cbinfo->name);
-      AddTraceBackHere(__FILE__, __LINE__, funname, NULL);
-      sqlite3_free(funname);
+      callable=NULL;
+      goto finally;
     }
 
-  /* sqlite3 frees the actual underlying memory we used (aggfc itself) */
+  if(!PyCallable_Check(callable))
+    return PyErr_Format(PyExc_TypeError, "progress handler must be callable");
 
-  PyGILState_Release(gilstate);
+  Py_INCREF(callable);
+
+ finally:
+
+  Py_XDECREF(self->progresshandler);
+  self->progresshandler=callable;
+  self->progresssteps=nsteps;
+  progresshandler_install(self);
+
+  Py_RETURN_NONE;
 }
 
-/* Used for the create function v2 xDestroy callbacks.  Note this is
-   called even when supplying NULL for the function implementation (ie
-   deleting it), so XDECREF has to be used.
- */
-static void
-apsw_free_func(void *funcinfo)
+static int
+authorizercb(void *context, int operation, const char *paramone, const char *paramtwo, const char *databasename, const char *triggerview)
 {
+  /* should return one of SQLITE_OK, SQLITE_DENY, or
+     SQLITE_IGNORE. (0, 1 or 2 respectively) */
+
   PyGILState_STATE gilstate;
+  PyObject *retval=NULL;
+  int result=SQLITE_DENY;  /* default to deny */
+  Connection *self=(Connection *)context;
+
+  assert(self);
+
+  if(self->resultcache)
+    resultcache_authorize(self->resultcache, operation, paramone, paramtwo, databasename);
+
+  if(self->denytransaction && (operation==SQLITE_TRANSACTION || operation==SQLITE_SAVEPOINT))
+    return SQLITE_DENY;
+
+  if(!self->authorizer)
+    return SQLITE_OK;
+  assert(self->authorizer!=Py_None);
+
   gilstate=PyGILState_Ensure();
 
-  Py_XDECREF((PyObject*)funcinfo);
+  APSW_FAULT_INJECT(AuthorizerExistingError,,PyErr_NoMemory());
+
+  if(PyErr_Occurred())
+    goto finally;  /* abort due to earlier exception */
+
+  retval=PyObject_CallFunction(self->authorizer, "(iO&O&O&O&)", operation, convertutf8string, paramone,
+                               convertutf8string, paramtwo, convertutf8string, databasename,
+                               convertutf8string, triggerview);
+
+  if(!retval)
+    goto finally; /* abort due to exeception */
+
+  if (PyIntLong_Check(retval))
+    {
+      result=PyIntLong_AsLong(retval);
+      goto haveval;
+    }
+
+  PyErr_Format(PyExc_TypeError, "Authorizer must return a number");
+  AddTraceBackHere(__FILE__, __LINE__, "authorizer callback", "{s: i, s: s:, s: s, s: s}",
+                   "operation", operation, "paramone", paramone, "paramtwo", paramtwo,
+                   "databasename", databasename, "triggerview", triggerview);
+
+ haveval:
+  if (PyErr_Occurred())
+    result=SQLITE_DENY;
+
+ finally:
+  Py_XDECREF(retval);
 
   PyGILState_Release(gilstate);
+  return result;
 }
 
-/** .. method:: createscalarfunction(name, callable[, numargs=-1, deterministic=False])
+/** .. method:: setauthorizer(callable)
 
-  Registers a scalar function.  Scalar functions operate on one set of parameters once.
+  While `preparing <https://sqlite.org/c3ref/prepare.html>`_
+  statements, SQLite will call any defined authorizer to see if a
+  particular action is ok to be part of the statement.
 
-  :param name: The string name of the function.  It should be less than 255 characters
-  :param callable: The function that will be called
-  :param numargs: How many arguments the function takes, with -1 meaning any number
-  :param deterministic: When True this means the function always
-           returns the same result for the same input arguments.
+  Typical usage would be if you are running user supplied SQL and want
+  to prevent harmful operations.  You should also
+  set the :class:`statementcachesize <Connection>` to zero.
+
+  The authorizer callback has 5 parameters:
+
+    * An `operation code <https://sqlite.org/c3ref/c_alter_table.html>`_
+    * A string (or None) dependent on the operation `(listed as 3rd) <https://sqlite.org/c3ref/c_alter_table.html>`_
+    * A string (or None) dependent on the operation `(listed as 4th) <https://sqlite.org/c3ref/c_alter_table.html>`_
+    * A string name of the database (or None)
+    * Name of the innermost trigger or view doing the access (or None)
+
+  The authorizer callback should return one of :const:`SQLITE_OK`,
+  :const:`SQLITE_DENY` or :const:`SQLITE_IGNORE`.
+  (:const:`SQLITE_DENY` is returned if there is an error in your
+  Python code).
+
+  .. seealso::
+
+    * :ref:`Example <authorizer-example>`
+    * :ref:`statementcache`
+
+  -* sqlite3_set_authorizer
+*/
+
+static PyObject *
+Connection_setauthorizer(Connection *self, PyObject *callable)
+{
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+
+  if(callable==Py_None)
+    {
+      APSW_FAULT_INJECT(SetAuthorizerNullFail,
+                        PYSQLITE_CON_CALL(res=sqlite3_set_authorizer(self->db, self->resultcache?authorizercb:NULL, self)),
+                        res=SQLITE_IOERR);
+      if(res!=SQLITE_OK)
+        {
+          SET_EXC(res, self->db);
+          return NULL;
+        }
+      callable=NULL;
+      goto finally;
+    }
+
+  if(!PyCallable_Check(callable))
+    return PyErr_Format(PyExc_TypeError, "authorizer must be callable");
+
+  APSW_FAULT_INJECT(SetAuthorizerFail,
+                    PYSQLITE_CON_CALL(res=sqlite3_set_authorizer(self->db, authorizercb, self)),
+                    res=SQLITE_IOERR);
+  if(res!=SQLITE_OK)
+    {
+      SET_EXC(res, self->db);
+      return NULL;
+    }
+
+  Py_INCREF(callable);
+
+ finally:
+  Py_XDECREF(self->authorizer);
+  self->authorizer=callable;
+
+  Py_RETURN_NONE;
+}
+
+static void
+collationneeded_cb(void *pAux, APSW_ARGUNUSED sqlite3 *db, int eTextRep, const char *name)
+{
+  PyObject *res=NULL, *pyname=NULL;
+  Connection *self=(Connection*)pAux;
+  PyGILState_STATE gilstate=PyGILState_Ensure();
+
+  assert(self->collationneeded);
+  if(!self->collationneeded) goto finally;
+  if(PyErr_Occurred()) goto finally;
+  pyname=convertutf8string(name);
+  if(pyname)  res=PyEval_CallFunction(self->collationneeded, "(OO)", self, pyname);
+  if(!pyname || !res)
+    AddTraceBackHere(__FILE__, __LINE__, "collationneeded callback", "{s: O, s: i, s: s}",
+                     "Connection", self, "eTextRep", eTextRep, "name", name);
+  Py_XDECREF(res);
+
+ finally:
+  Py_XDECREF(pyname);
+  PyGILState_Release(gilstate);
+}
+
+/** .. method:: collationneeded(callable)
+
+  *callable* will be called if a statement requires a `collation
+  <http://en.wikipedia.org/wiki/Collation>`_ that hasn't been
+  registered. Your callable will be passed two parameters. The first
+  is the connection object. The second is the name of the
+  collation. If you have the collation code available then call
+  :meth:`Connection.createcollation`.
+
+  This is useful for creating collations on demand.  For example you
+  may include the `locale <http://en.wikipedia.org/wiki/Locale>`_ in
+  the collation name, but since there are thousands of locales in
+  popular use it would not be useful to :meth:`prereigster
+  <Connection.createcollation>` them all.  Using
+  :meth:`~Connection.collationneeded` tells you when you need to
+  register them.
+
+  .. seealso::
+
+    * :meth:`~Connection.createcollation`
+
+  -* sqlite3_collation_needed
+*/
+static PyObject *
+Connection_collationneeded(Connection *self, PyObject *callable)
+{
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+
+  if(callable==Py_None)
+    {
+      APSW_FAULT_INJECT(CollationNeededNullFail,
+                        PYSQLITE_CON_CALL(res=sqlite3_collation_needed(self->db, NULL, NULL)),
+                        res=SQLITE_IOERR);
+      if(res!=SQLITE_OK)
+        {
+          SET_EXC(res, self->db);
+          return NULL;
+        }
+      callable=NULL;
+      goto finally;
+    }
+
+  if(!PyCallable_Check(callable))
+    return PyErr_Format(PyExc_TypeError, "collationneeded callback must be callable");
+
+  APSW_FAULT_INJECT(CollationNeededFail,
+                    PYSQLITE_CON_CALL(res=sqlite3_collation_needed(self->db, self, collationneeded_cb)),
+                    res=SQLITE_IOERR);
+  if(res!=SQLITE_OK)
+    {
+      SET_EXC(res, self->db);
+      return NULL;
+    }
+
+  Py_INCREF(callable);
+
+ finally:
+  Py_XDECREF(self->collationneeded);
+  self->collationneeded=callable;
+
+  Py_RETURN_NONE;
+}
+
+static int
+busyhandlercb(void *context, int ncall)
+{
+  /* Return zero for caller to get SQLITE_BUSY error. We default to
+     zero in case of error. */
+
+  PyGILState_STATE gilstate;
+  PyObject *retval;
+  int result=0;  /* default to fail with SQLITE_BUSY */
+  Connection *self=(Connection *)context;
+
+  assert(self);
+  assert(self->busyhandler);
+
+  gilstate=PyGILState_Ensure();
+
+  retval=PyObject_CallFunction(self->busyhandler, "i", ncall);
+
+  if(!retval)
+    goto finally; /* abort due to exeception */
+
+  result=PyObject_IsTrue(retval);
+  assert(result==-1 || result==0 || result==1);
+  Py_DECREF(retval);
+
+  if(result==-1)
+    {
+      result=0;
+      goto finally;  /* abort due to exception converting retval */
+    }
+
+ finally:
+  PyGILState_Release(gilstate);
+  return result;
+}
+
+/** .. method:: setbusyhandler(callable)
+
+   Sets the busy handler to callable. callable will be called with one
+   integer argument which is the number of prior calls to the busy
+   callback for the same lock. If the busy callback returns something
+   that evaluates to False, then SQLite returns :const:`SQLITE_BUSY` to the
+   calling code.. If the callback returns something that evaluates to
+   True, then SQLite tries to open the table again and the cycle
+   repeats.
+
+   If you previously called :meth:`~Connection.setbusytimeout` or
+   :meth:`~Connection.setbusybackoff` then calling this overrides that.
+
+   .. seealso::
+
+     * :meth:`Connection.setbusytimeout`
+     * :meth:`Connection.setbusybackoff`
+     * :ref:`Busy handling <busyhandling>`
+
+   -* sqlite3_busy_handler
+
+*/
+static PyObject *
+Connection_setbusyhandler(Connection *self, PyObject *callable)
+{
+  int res=SQLITE_OK;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+
+  if(callable==Py_None)
+    {
+      APSW_FAULT_INJECT(SetBusyHandlerNullFail,
+                        PYSQLITE_CON_CALL(res=sqlite3_busy_handler(self->db, NULL, NULL)),
+                        res=SQLITE_IOERR);
+      if(res!=SQLITE_OK)
+        {
+          SET_EXC(res, self->db);
+          return NULL;
+        }
+      callable=NULL;
+      goto finally;
+    }
+
+  if(!PyCallable_Check(callable))
+    return PyErr_Format(PyExc_TypeError, "busyhandler must be callable");
+
+  APSW_FAULT_INJECT(SetBusyHandlerFail,
+                    PYSQLITE_CON_CALL(res=sqlite3_busy_handler(self->db, busyhandlercb, self)),
+                    res=SQLITE_IOERR);
+  if(res!=SQLITE_OK)
+    {
+      SET_EXC(res, self->db);
+      return NULL;
+    }
+
+  Py_INCREF(callable);
+
+ finally:
+  Py_XDECREF(self->busyhandler);
+  self->busyhandler=callable;
+
+  Py_RETURN_NONE;
+}
+
+static int
+busybackoffcb(void *context, int ncall)
+{
+  /* Return zero for caller to get SQLITE_BUSY error. */
+  BusyBackoff *bb=&((Connection*)context)->busybackoff;
+  sqlite3_int64 now=apsw_now_ns(), delay=bb->initial;
+  sqlite3_vfs *vfs;
+  int i;
+
+  if(ncall==0)
+    {
+      bb->busy++;
+      bb->started=now;
+    }
+
+  for(i=0; i<ncall && delay<bb->maximum; i++)
+    delay*=2;
+  if(delay>bb->maximum)
+    delay=bb->maximum;
+
+  /* randomly shorten the delay so waiters don't retry in step */
+  if(bb->jitter>0)
+    {
+      bb->rng^=bb->rng<<13;
+      bb->rng^=bb->rng>>7;
+      bb->rng^=bb->rng<<17;
+      delay-=(sqlite3_int64)(delay*bb->jitter*((bb->rng>>11)*(1.0/9007199254740992.0)));
+    }
+
+  if(now+delay>bb->started+bb->timeout)
+    {
+      delay=bb->started+bb->timeout-now;
+      if(delay<=0)
+        {
+          bb->timeouts++;
+          return 0;
+        }
+    }
+
+  PYSQLITE_HELD_CALL(vfs=sqlite3_vfs_find(NULL));
+  vfs->xSleep(vfs, (int)((delay+999)/1000));
+  bb->retries++;
+  bb->waited+=apsw_now_ns()-now;
+  return 1;
+}
+
+/** .. method:: setbusybackoff(timeout, initial=0.001, maximum=0.1, jitter=0.5)
+
+  Installs a busy handler implemented in C that keeps retrying with
+  exponentially increasing sleeps while the database is locked, giving
+  up with :exc:`BusyError` once *timeout* seconds have been spent
+  waiting for the same lock.  Unlike :meth:`setbusyhandler` it doesn't
+  acquire the GIL, and unlike :meth:`setbusytimeout` the sleeps start
+  short and are spread out so competing connections don't retry at the
+  same moments.
+
+  :param timeout: Most seconds to wait for one lock.  Zero removes the
+    busy handler.
+  :param initial: Seconds to sleep after the first busy response.  It
+    doubles on each retry.
+  :param maximum: Most seconds to sleep between retries, up to 2000.
+  :param jitter: Between 0 and 1.  Each sleep is shortened by a random
+    amount up to this fraction of it.
+
+  Calling :meth:`setbusytimeout` or :meth:`setbusyhandler` overrides
+  this.  The counters are available from :meth:`busystats`.
+
+  .. seealso::
+
+     * :meth:`Connection.busystats`
+     * :ref:`Busy handling <busyhandling>`
+
+  -* sqlite3_busy_handler
+*/
+static PyObject *
+Connection_setbusybackoff(Connection *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[]={"timeout", "initial", "maximum", "jitter", NULL};
+  double timeout, initial=0.001, maximum=0.1, jitter=0.5;
+  int res=SQLITE_OK;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "d|ddd:setbusybackoff(timeout, initial=0.001, maximum=0.1, jitter=0.5)",
+                                  kwlist, &timeout, &initial, &maximum, &jitter))
+    return NULL;
+
+  /* the comparisons are written so NaN fails them */
+  if(!(timeout>=0 && timeout<=1000000))
+    return PyErr_Format(PyExc_ValueError, "timeout must be between 0 and 1000000 seconds");
+  /* xSleep takes an int number of microseconds */
+  if(!(initial>=0.000001 && initial<=maximum && maximum<=2000))
+    return PyErr_Format(PyExc_ValueError, "initial must be between a microsecond and maximum, and maximum at most 2000 seconds");
+  if(!(jitter>=0 && jitter<=1))
+    return PyErr_Format(PyExc_ValueError, "jitter must be between 0 and 1");
+
+  APSW_FAULT_INJECT(SetBusyBackoffFail,
+                    PYSQLITE_CON_CALL(res=sqlite3_busy_handler(self->db, timeout?busybackoffcb:NULL, self)),
+                    res=SQLITE_IOERR);
+  if(res!=SQLITE_OK)
+    {
+      SET_EXC(res, self->db);
+      return NULL;
+    }
+
+  Py_CLEAR(self->busyhandler);
+  self->busybackoff.initial=(sqlite3_int64)(initial*1000000000.0);
+  self->busybackoff.maximum=(sqlite3_int64)(maximum*1000000000.0);
+  self->busybackoff.timeout=(sqlite3_int64)(timeout*1000000000.0);
+  self->busybackoff.jitter=jitter;
+  if(!self->busybackoff.rng)
+    self->busybackoff.rng=((sqlite3_uint64)apsw_now_ns()^(sqlite3_uint64)(size_t)self)|1;
+
+  Py_RETURN_NONE;
+}
+
+/** .. method:: busystats(reset=False) -> dict
+
+  Returns counters kept by the :meth:`setbusybackoff` busy handler
+  since the connection was opened or they were last reset.
+
+    busy
+      How many times a lock was busy
+    retries
+      How many sleeps there were before trying again
+    timeouts
+      How many times :exc:`BusyError` was returned after waiting
+      *timeout*
+    waited
+      Total nanoseconds spent sleeping
+
+  :param reset: If True then the counters are zeroed after being
+    returned.
+*/
+static PyObject *
+Connection_busystats(Connection *self, PyObject *args)
+{
+  int reset=0;
+  PyObject *res;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(!PyArg_ParseTuple(args, "|i:busystats(reset=False)", &reset))
+    return NULL;
+
+  res=Py_BuildValue("{s: L, s: L, s: L, s: L}",
+                    "busy", self->busybackoff.busy,
+                    "retries", self->busybackoff.retries,
+                    "timeouts", self->busybackoff.timeouts,
+                    "waited", self->busybackoff.waited);
+  if(res && reset)
+    self->busybackoff.busy=self->busybackoff.retries=self->busybackoff.timeouts=self->busybackoff.waited=0;
+  return res;
+}
+
+#if defined(EXPERIMENTAL) && !defined(SQLITE_OMIT_LOAD_EXTENSION)  /* extension loading */
+
+/** .. method:: enableloadextension(enable)
+
+  Enables/disables `extension loading
+  <https://sqlite.org/cvstrac/wiki/wiki?p=LoadableExtensions>`_
+  which is disabled by default.
+
+  :param enable: If True then extension loading is enabled, else it is disabled.
+
+  -* sqlite3_enable_load_extension
+
+  .. seealso::
+
+    * :meth:`~Connection.loadextension`
+*/
+
+static PyObject *
+Connection_enableloadextension(Connection *self, PyObject *enabled)
+{
+  int enabledp, res;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  /* get the boolean value */
+  enabledp=PyObject_IsTrue(enabled);
+  if(enabledp==-1) return NULL;
+  if (PyErr_Occurred()) return NULL;
+
+  /* call function */
+  APSW_FAULT_INJECT(EnableLoadExtensionFail,
+                    PYSQLITE_CON_CALL(res=sqlite3_enable_load_extension(self->db, enabledp)),
+                    res=SQLITE_IOERR);
+  SET_EXC(res, self->db);
+
+  /* done */
+  if (res==SQLITE_OK)
+    Py_RETURN_NONE;
+  return NULL;
+}
+
+/** .. method:: loadextension(filename[, entrypoint])
+
+  Loads *filename* as an `extension <https://sqlite.org/cvstrac/wiki/wiki?p=LoadableExtensions>`_
+
+  :param filename: The file to load.  This must be Unicode or Unicode compatible
+
+  :param entrypoint: The initialization method to call.  If this
+    parameter is not supplied then the SQLite default of
+    ``sqlite3_extension_init`` is used.
+
+  :raises ExtensionLoadingError: If the extension could not be
+    loaded.  The exception string includes more details.
+
+  -* sqlite3_load_extension
+
+  .. seealso::
+
+    * :meth:`~Connection.enableloadextension`
+*/
+static PyObject *
+Connection_loadextension(Connection *self, PyObject *args)
+{
+  int res;
+  char *zfile=NULL, *zproc=NULL, *errmsg=NULL;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(!PyArg_ParseTuple(args, "es|z:loadextension(filename, entrypoint=None)", STRENCODING, &zfile, &zproc))
+    return NULL;
+
+  PYSQLITE_CON_CALL(res=sqlite3_load_extension(self->db, zfile, zproc, &errmsg));
+
+  PyMem_Free(zfile);
+
+  /* load_extension doesn't set the error message on the db so we have to make exception manually */
+  if(res!=SQLITE_OK)
+    {
+      assert(errmsg);
+      PyErr_Format(ExcExtensionLoading, "ExtensionLoadingError: %s", errmsg?errmsg:"unspecified");
+      sqlite3_free(errmsg);
+      return NULL;
+    }
+  Py_RETURN_NONE;
+}
+
+#endif /* EXPERIMENTAL extension loading */
+
+
+/* USER DEFINED FUNCTION CODE.*/
+static PyTypeObject FunctionCBInfoType =
+  {
+    APSW_PYTYPE_INIT
+    "apsw.FunctionCBInfo",     /*tp_name*/
+    sizeof(FunctionCBInfo),    /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)FunctionCBInfo_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "FunctionCBInfo object",   /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    0,		               /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    0,                         /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+  };
+
+
+static FunctionCBInfo *
+allocfunccbinfo(void)
+{
+  FunctionCBInfo *res=PyObject_New(FunctionCBInfo, &FunctionCBInfoType);
+  if(res)
+    {
+      res->name=0;
+      res->scalarfunc=0;
+      res->aggregatefactory=0;
+    }
+  return res;
+}
+
+
+/* converts a python object into a sqlite3_context result */
+static void
+set_context_result(sqlite3_context *context, PyObject *obj)
+{
+  if(!obj)
+    {
+      assert(PyErr_Occurred());
+      sqlite3_result_error_code(context, MakeSqliteMsgFromPyException(NULL));
+      sqlite3_result_error(context, "bad object given to set_context_result", -1);
+      return;
+    }
+
+  /* DUPLICATE(ish) code: this is substantially similar to the code in
+     APSWCursor_dobinding.  If you fix anything here then do it there as
+     well. */
+
+  if(obj==Py_None)
+    {
+      sqlite3_result_null(context);
+      return;
+    }
+#if PY_MAJOR_VERSION < 3
+  if(PyInt_Check(obj))
+    {
+      sqlite3_result_int64(context, PyInt_AS_LONG(obj));
+      return;
+    }
+#endif
+  if (PyLong_Check(obj))
+    {
+      sqlite3_result_int64(context, PyLong_AsLongLong(obj));
+      return;
+    }
+  if (PyFloat_Check(obj))
+    {
+      sqlite3_result_double(context, PyFloat_AS_DOUBLE(obj));
+      return;
+    }
+  if (PyUnicode_Check(obj))
+    {
+      UNIDATABEGIN(obj)
+        APSW_FAULT_INJECT(SetContextResultUnicodeConversionFails,,strdata=(char*)PyErr_NoMemory());
+        if(strdata)
+          {
+#ifdef APSW_TEST_LARGE_OBJECTS
+            APSW_FAULT_INJECT(SetContextResultLargeUnicode,,strbytes=0x001234567890L);
+#endif
+	    if(strbytes>APSW_INT32_MAX)
+	      {
+                SET_EXC(SQLITE_TOOBIG, NULL);
+                sqlite3_result_error_toobig(context);
+	      }
+	    else
+              USE16(sqlite3_result_text)(context, strdata, strbytes, SQLITE_TRANSIENT);
+          }
+        else
+          sqlite3_result_error(context, "Unicode conversions failed", -1);
+      UNIDATAEND(obj);
+      return;
+    }
+#if PY_MAJOR_VERSION < 3
+  if (PyString_Check(obj))
+    {
+      const char *val=PyString_AS_STRING(obj);
+      const Py_ssize_t lenval=PyString_GET_SIZE(obj);
+      const char *chk=val;
+      /* check if string is all ascii if less than 10kb in size */
+      if(lenval<10000)
+        for(;chk<val+lenval && !((*chk)&0x80); chk++);
+      /* Non-ascii or long, so convert to unicode */
+      if(chk<val+lenval)
+        {
+          PyObject *str2=PyUnicode_FromObject(obj);
+          if(!str2)
+            {
+              sqlite3_result_error(context, "PyUnicode_FromObject failed", -1);
+              return;
+            }
+          UNIDATABEGIN(str2)
+            APSW_FAULT_INJECT(SetContextResultStringUnicodeConversionFails,,strdata=(char*)PyErr_NoMemory());
+            if(strdata)
+              {
+#ifdef APSW_TEST_LARGE_OBJECTS
+                APSW_FAULT_INJECT(SetContextResultLargeString,,strbytes=0x001234567890L);
+#endif
+		if(strbytes>APSW_INT32_MAX)
+		  {
+                    SET_EXC(SQLITE_TOOBIG, NULL);
+                    sqlite3_result_error_toobig(context);
+		  }
+		else
+                  USE16(sqlite3_result_text)(context, strdata, strbytes, SQLITE_TRANSIENT);
+              }
+            else
+              sqlite3_result_error(context, "Unicode conversions failed", -1);
+          UNIDATAEND(str2);
+          Py_DECREF(str2);
+        }
+      else /* just ascii chars */
+        sqlite3_result_text(context, val, lenval, SQLITE_TRANSIENT);
+
+      return;
+    }
+#endif
+  if (PyObject_CheckReadBuffer(obj))
+    {
+      const void *buffer;
+      Py_ssize_t buflen;
+      int asrb=PyObject_AsReadBuffer(obj, &buffer, &buflen);
+
+      APSW_FAULT_INJECT(SetContextResultAsReadBufferFail,,(PyErr_NoMemory(),asrb=-1));
+
+      if(asrb!=0)
+        {
+          sqlite3_result_error(context, "PyObject_AsReadBuffer failed", -1);
+          return;
+        }
+      if (buflen>APSW_INT32_MAX)
+	sqlite3_result_error_toobig(context);
+      else
+	sqlite3_result_blob(context, buffer, buflen, SQLITE_TRANSIENT);
+      return;
+    }
+
+  PyErr_Format(PyExc_TypeError, "Bad return type from function callback");
+  sqlite3_result_error(context, "Bad return type from function callback", -1);
+}
+
+/* Returns a new reference to a tuple formed from function parameters */
+static PyObject *
+getfunctionargs(sqlite3_context *context, PyObject *firstelement, int argc, sqlite3_value **argv)
+{
+  PyObject *pyargs=NULL;
+  int i;
+  int extra=0;
+
+  /* extra first item */
+  if(firstelement)
+    extra=1;
+
+  APSW_FAULT_INJECT(GFAPyTuple_NewFail,pyargs=PyTuple_New((long)argc+extra),pyargs=PyErr_NoMemory());
+  if(!pyargs)
+    {
+      sqlite3_result_error(context, "PyTuple_New failed", -1);
+      goto error;
+    }
+
+  if(extra)
+    {
+      Py_INCREF(firstelement);
+      PyTuple_SET_ITEM(pyargs, 0, firstelement);
+    }
+
+  for(i=0;i<argc;i++)
+    {
+      PyObject *item=convert_value_to_pyobject(argv[i]);
+      if(!item)
+        {
+          sqlite3_result_error(context, "convert_value_to_pyobject failed", -1);
+          goto error;
+        }
+      PyTuple_SET_ITEM(pyargs, i+extra, item);
+    }
+
+  return pyargs;
+
+ error:
+  Py_XDECREF(pyargs);
+  return NULL;
+}
+
+
+/* dispatches scalar function */
+static void
+cbdispatch_func(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  PyGILState_STATE gilstate;
+  PyObject *pyargs=NULL;
+  PyObject *retval=NULL;
+  FunctionCBInfo *cbinfo=(FunctionCBInfo*)sqlite3_user_data(context);
+  assert(cbinfo);
+
+  gilstate=PyGILState_Ensure();
+
+  assert(cbinfo->scalarfunc);
+
+
+  APSW_FAULT_INJECT(CBDispatchExistingError,,PyErr_NoMemory());
+
+  if(PyErr_Occurred())
+    {
+      sqlite3_result_error_code(context, MakeSqliteMsgFromPyException(NULL));
+      sqlite3_result_error(context, "Prior Python Error", -1);
+      goto finalfinally;
+    }
+
+  pyargs=getfunctionargs(context, NULL, argc, argv);
+  if(!pyargs)
+      goto finally;
+
+  assert(!PyErr_Occurred());
+  retval=PyEval_CallObject(cbinfo->scalarfunc, pyargs);
+  if(retval)
+    set_context_result(context, retval);
+
+ finally:
+  if (PyErr_Occurred())
+    {
+      char *errmsg=NULL;
+      char *funname=sqlite3_mprintf("user-defined-scalar-%s", cbinfo->name);
+      sqlite3_result_error_code(context, MakeSqliteMsgFromPyException(&errmsg));
+      sqlite3_result_error(context, errmsg, -1);
+      AddTraceBackHere(__FILE__, __LINE__, funname, "{s: i, s: s}", "NumberOfArguments", argc, "message", errmsg);
+      sqlite3_free(funname);
+      sqlite3_free(errmsg);
+    }
+ finalfinally:
+  Py_XDECREF(pyargs);
+  Py_XDECREF(retval);
+
+  PyGILState_Release(gilstate);
+}
+
+static aggregatefunctioncontext *
+getaggregatefunctioncontext(sqlite3_context *context)
+{
+  aggregatefunctioncontext *aggfc=sqlite3_aggregate_context(context, sizeof(aggregatefunctioncontext));
+  FunctionCBInfo *cbinfo;
+  PyObject *retval;
+  /* have we seen it before? */
+  if(aggfc->aggvalue)
+    return aggfc;
+
+  /* fill in with Py_None so we know it is valid */
+  aggfc->aggvalue=Py_None;
+  Py_INCREF(Py_None);
+
+  cbinfo=(FunctionCBInfo*)sqlite3_user_data(context);
+  assert(cbinfo);
+  assert(cbinfo->aggregatefactory);
+
+  /* call the aggregatefactory to get our working objects */
+  retval=PyEval_CallObject(cbinfo->aggregatefactory, NULL);
+
+  if(!retval)
+    return aggfc;
+  /* it should have returned a tuple of 3 items: object, stepfunction and finalfunction */
+  if(!PyTuple_Check(retval))
+    {
+      PyErr_Format(PyExc_TypeError, "Aggregate factory should return tuple of (object, stepfunction, finalfunction)");
+      goto finally;
+    }
+  if(PyTuple_GET_SIZE(retval)!=3)
+    {
+      PyErr_Format(PyExc_TypeError, "Aggregate factory should return 3 item tuple of (object, stepfunction, finalfunction)");
+      goto finally;
+    }
+  /* we don't care about the type of the zeroth item (object) ... */
+
+  /* stepfunc */
+  if (!PyCallable_Check(PyTuple_GET_ITEM(retval,1)))
+    {
+      PyErr_Format(PyExc_TypeError, "stepfunction must be callable");
+      goto finally;
+    }
+
+  /* finalfunc */
+  if (!PyCallable_Check(PyTuple_GET_ITEM(retval,2)))
+    {
+      PyErr_Format(PyExc_TypeError, "final function must be callable");
+      goto finally;
+    }
+
+  aggfc->aggvalue=PyTuple_GET_ITEM(retval,0);
+  aggfc->stepfunc=PyTuple_GET_ITEM(retval,1);
+  aggfc->finalfunc=PyTuple_GET_ITEM(retval,2);
+
+  Py_INCREF(aggfc->aggvalue);
+  Py_INCREF(aggfc->stepfunc);
+  Py_INCREF(aggfc->finalfunc);
+
+  Py_DECREF(Py_None);  /* we used this earlier as a sentinel */
+
+ finally:
+  assert(retval);
+  Py_DECREF(retval);
+  return aggfc;
+}
+
+
+/*
+  Note that we can't call sqlite3_result_error in the step function as
+  SQLite doesn't want to you to do that (and core dumps!)
+  Consequently if an error is returned, we will still be repeatedly
+  called.
+*/
+
+static void
+cbdispatch_step(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  PyGILState_STATE gilstate;
+  PyObject *pyargs;
+  PyObject *retval;
+  aggregatefunctioncontext *aggfc=NULL;
+
+  gilstate=PyGILState_Ensure();
+
+  if (PyErr_Occurred())
+    goto finalfinally;
+
+  aggfc=getaggregatefunctioncontext(context);
+
+  if (PyErr_Occurred())
+    goto finally;
+
+  assert(aggfc);
+
+  pyargs=getfunctionargs(context, aggfc->aggvalue, argc, argv);
+  if(!pyargs)
+    goto finally;
+
+  assert(!PyErr_Occurred());
+  retval=PyEval_CallObject(aggfc->stepfunc, pyargs);
+  Py_DECREF(pyargs);
+  Py_XDECREF(retval);
+
+  if(!retval)
+    {
+      assert(PyErr_Occurred());
+    }
+
+ finally:
+  if(PyErr_Occurred())
+    {
+      char *funname=0;
+      FunctionCBInfo *cbinfo=(FunctionCBInfo*)sqlite3_user_data(context);
+      assert(cbinfo);
+      funname=sqlite3_mprintf("user-defined-aggregate-step-%s", cbinfo->name);
+      AddTraceBackHere(__FILE__, __LINE__, funname, "{s: i}", "NumberOfArguments", argc);
+      sqlite3_free(funname);
+    }
+ finalfinally:
+  PyGILState_Release(gilstate);
+}
+
+/* this is somewhat similar to cbdispatch_step, except we also have to
+   do some cleanup of the aggregatefunctioncontext */
+static void
+cbdispatch_final(sqlite3_context *context)
+{
+  PyGILState_STATE gilstate;
+  PyObject *retval=NULL;
+  aggregatefunctioncontext *aggfc=NULL;
+  PyObject *err_type=NULL, *err_value=NULL, *err_traceback=NULL;
+
+  gilstate=PyGILState_Ensure();
+
+  PyErr_Fetch(&err_type, &err_value, &err_traceback);
+
+  aggfc=getaggregatefunctioncontext(context);
+  assert(aggfc);
+
+  APSW_FAULT_INJECT(CBDispatchFinalError,,PyErr_NoMemory());
+
+  if((err_type||err_value||err_traceback) || PyErr_Occurred() || !aggfc->finalfunc)
+    {
+      sqlite3_result_error(context, "Prior Python Error in step function", -1);
+      goto finally;
+    }
+
+  retval=PyObject_CallFunctionObjArgs(aggfc->finalfunc, aggfc->aggvalue, NULL);
+  set_context_result(context, retval);
+  Py_XDECREF(retval);
+
+ finally:
+  /* we also free the aggregatefunctioncontext here */
+  assert(aggfc->aggvalue);  /* should always be set, perhaps to Py_None */
+  Py_XDECREF(aggfc->aggvalue);
+  Py_XDECREF(aggfc->stepfunc);
+  Py_XDECREF(aggfc->finalfunc);
+
+  if(PyErr_Occurred() && (err_type||err_value||err_traceback))
+    {
+      PyErr_Format(PyExc_Exception, "An exception happened during cleanup of an aggregate function, but there was already error in the step function so only that can be returned");
+      apsw_write_unraiseable(NULL);
+    }
+
+  if(err_type||err_value||err_traceback)
+    PyErr_Restore(err_type, err_value, err_traceback);
+
+  if(PyErr_Occurred())
+    {
+      char *funname=0;
+      FunctionCBInfo *cbinfo=(FunctionCBInfo*)sqlite3_user_data(context);
+      assert(cbinfo);
+      funname=sqlite3_mprintf("user-defined-aggregate-final-%s", cbinfo->name);
+      AddTraceBackHere(__FILE__, __LINE__, funname, NULL);
+      sqlite3_free(funname);
+    }
+
+  /* sqlite3 frees the actual underlying memory we used (aggfc itself) */
+
+  PyGILState_Release(gilstate);
+}
+
+/* Used for the create function v2 xDestroy callbacks.  Note this is
+   called even when supplying NULL for the function implementation (ie
+   deleting it), so XDECREF has to be used.
+ */
+static void
+apsw_free_func(void *funcinfo)
+{
+  PyGILState_STATE gilstate;
+  gilstate=PyGILState_Ensure();
+
+  Py_XDECREF((PyObject*)funcinfo);
+
+  PyGILState_Release(gilstate);
+}
+
+/** .. method:: createscalarfunction(name, callable[, numargs=-1, deterministic=False])
+
+  Registers a scalar function.  Scalar functions operate on one set of parameters once.
+
+  :param name: The string name of the function.  It should be less than 255 characters
+  :param callable: The function that will be called
+  :param numargs: How many arguments the function takes, with -1 meaning any number
+  :param deterministic: When True this means the function always
+           returns the same result for the same input arguments.
            SQLite's query planner can perform additional optimisations
            for deterministic functions.  For example a random()
            function is not deterministic while one that returns the
            length of a string is.
 
-  .. note::
+  .. note::
+
+    You can register the same named function but with different
+    *callable* and *numargs*.  For example::
+
+      connection.createscalarfunction("toip", ipv4convert, 4)
+      connection.createscalarfunction("toip", ipv6convert, 16)
+      connection.createscalarfunction("toip", strconvert, -1)
+
+    The one with the correct *numargs* will be called and only if that
+    doesn't exist then the one with negative *numargs* will be called.
+
+  .. seealso::
+
+     * :ref:`Example <scalar-example>`
+     * :meth:`~Connection.createaggregatefunction`
+
+  -* sqlite3_create_function_v2
+*/
+
+static PyObject *
+Connection_createscalarfunction(Connection *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[]={"name", "callable", "numargs", "deterministic", NULL};
+  int numargs=-1;
+  PyObject *callable=NULL;
+  PyObject *odeterministic=NULL;
+  int deterministic=0;
+  char *name=0;
+  FunctionCBInfo *cbinfo;
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "esO|iO!:createscalarfunction(name,callback, numargs=-1, deterministic=False)",
+                                  kwlist, STRENCODING, &name, &callable, &numargs, &PyBool_Type, &odeterministic))
+    return NULL;
+
+  assert(name);
+  assert(callable);
+  if(odeterministic) {
+    res=PyObject_IsTrue(odeterministic);
+    if (res<0) return NULL;
+    deterministic=res;
+  }
+
+  if(callable!=Py_None && !PyCallable_Check(callable))
+    {
+      PyMem_Free(name);
+      PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+      return NULL;
+    }
+
+  if(callable==Py_None)
+    {
+      cbinfo=0;
+    }
+  else
+    {
+      cbinfo=allocfunccbinfo();
+      if(!cbinfo) goto finally;
+      cbinfo->name=name;
+      cbinfo->scalarfunc=callable;
+      Py_INCREF(callable);
+    }
+
+  PYSQLITE_CON_CALL(
+                res=sqlite3_create_function_v2(self->db,
+					       name,
+					       numargs,
+					       SQLITE_UTF8|(deterministic?SQLITE_DETERMINISTIC:0),
+					       cbinfo,
+					       cbinfo?cbdispatch_func:NULL,
+					       NULL,
+					       NULL,
+					       apsw_free_func)
+                );
+  if(res)
+    {
+      /* Note: On error sqlite3_create_function_v2 calls the
+	 destructor (apsw_free_func)! */
+      SET_EXC(res, self->db);
+      goto finally;
+    }
+
+  if(callable==Py_None)
+    PyMem_Free(name);
+
+ finally:
+  if(PyErr_Occurred())
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+/** .. method:: createaggregatefunction(name, factory[, numargs=-1])
+
+  Registers an aggregate function.  Aggregate functions operate on all
+  the relevant rows such as counting how many there are.
+
+  :param name: The string name of the function.  It should be less than 255 characters
+  :param callable: The function that will be called
+  :param numargs: How many arguments the function takes, with -1 meaning any number
+
+  When a query starts, the *factory* will be called and must return a tuple of 3 items:
+
+    a context object
+       This can be of any type
+
+    a step function
+       This function is called once for each row.  The first parameter
+       will be the context object and the remaining parameters will be
+       from the SQL statement.  Any value returned will be ignored.
+
+    a final function
+       This function is called at the very end with the context object
+       as a parameter.  The value returned is set as the return for
+       the function. The final function is always called even if an
+       exception was raised by the step function. This allows you to
+       ensure any resources are cleaned up.
+
+  .. note::
+
+    You can register the same named function but with different
+    callables and *numargs*.  See
+    :meth:`~Connection.createscalarfunction` for an example.
+
+  .. seealso::
+
+     * :ref:`Example <aggregate-example>`
+     * :meth:`~Connection.createscalarfunction`
+
+  -* sqlite3_create_function_v2
+*/
+
+static PyObject *
+Connection_createaggregatefunction(Connection *self, PyObject *args)
+{
+  int numargs=-1;
+  PyObject *callable;
+  char *name=0;
+  FunctionCBInfo *cbinfo;
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+
+  if(!PyArg_ParseTuple(args, "esO|i:createaggregatefunction(name, factorycallback, numargs=-1)", STRENCODING, &name, &callable, &numargs))
+    return NULL;
+
+  assert(name);
+  assert(callable);
+
+  if(callable!=Py_None && !PyCallable_Check(callable))
+    {
+      PyMem_Free(name);
+      PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+      return NULL;
+    }
+
+  if(callable==Py_None)
+    cbinfo=0;
+  else
+    {
+      cbinfo=allocfunccbinfo();
+      if(!cbinfo) goto finally;
+
+      cbinfo->name=name;
+      cbinfo->aggregatefactory=callable;
+      Py_INCREF(callable);
+    }
+
+  PYSQLITE_CON_CALL(
+                res=sqlite3_create_function_v2(self->db,
+					       name,
+					       numargs,
+					       SQLITE_UTF8,
+					       cbinfo,
+					       NULL,
+					       cbinfo?cbdispatch_step:NULL,
+					       cbinfo?cbdispatch_final:NULL,
+					       apsw_free_func)
+                );
+
+  if(res)
+    {
+      /* Note: On error sqlite3_create_function_v2 calls the
+	 destructor (apsw_free_func)! */
+      SET_EXC(res, self->db);
+      goto finally;
+    }
+
+  if(callable==Py_None)
+    PyMem_Free(name);
+
+ finally:
+  if(PyErr_Occurred())
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+/* USER DEFINED COLLATION CODE.*/
+
+static int
+collation_cb(void *context,
+	     int stringonelen, const void *stringonedata,
+	     int stringtwolen, const void *stringtwodata)
+{
+  PyGILState_STATE gilstate;
+  PyObject *cbinfo=(PyObject*)context;
+  PyObject *pys1=NULL, *pys2=NULL, *retval=NULL;
+  int result=0;
+
+  assert(cbinfo);
+
+  gilstate=PyGILState_Ensure();
+
+  if(PyErr_Occurred()) goto finally;  /* outstanding error */
+
+  pys1=convertutf8stringsize(stringonedata, stringonelen);
+  pys2=convertutf8stringsize(stringtwodata, stringtwolen);
+
+  if(!pys1 || !pys2)
+    goto finally;   /* failed to allocate strings */
+
+  retval=PyObject_CallFunction(cbinfo, "(OO)", pys1, pys2);
+
+  if(!retval)
+    {
+      AddTraceBackHere(__FILE__, __LINE__, "Collation_callback", "{s: O, s: O, s: O}", "callback", cbinfo, "stringone", pys1, "stringtwo", pys2);
+      goto finally;  /* execution failed */
+    }
+
+  if (PyIntLong_Check(retval))
+    {
+      result=PyIntLong_AsLong(retval);
+      goto haveval;
+    }
+
+  PyErr_Format(PyExc_TypeError, "Collation callback must return a number");
+  AddTraceBackHere(__FILE__, __LINE__, "collation callback", "{s: O, s: O}",
+                   "stringone", pys1, "stringtwo", pys2);
+
+ haveval:
+  if(PyErr_Occurred())
+      result=0;
+
+ finally:
+  Py_XDECREF(pys1);
+  Py_XDECREF(pys2);
+  Py_XDECREF(retval);
+  PyGILState_Release(gilstate);
+  return result;
+
+}
+
+static void
+collation_destroy(void *context)
+{
+  PyGILState_STATE gilstate=PyGILState_Ensure();
+  Py_DECREF((PyObject*)context);
+  PyGILState_Release(gilstate);
+}
+
+/** .. method:: createcollation(name, callback)
+
+  You can control how SQLite sorts (termed `collation
+  <http://en.wikipedia.org/wiki/Collation>`_) when giving the
+  ``COLLATE`` term to a `SELECT
+  <https://sqlite.org/lang_select.html>`_.  For example your
+  collation could take into account locale or do numeric sorting.
+
+  The *callback* will be called with two items.  It should return -1
+  if the first is less then the second, 0 if they are equal, and 1 if
+  first is greater::
+
+     def mycollation(one, two):
+         if one < two:
+             return -1
+         if one == two:
+             return 0
+         if one > two:
+             return 1
+
+  .. seealso::
+
+    * :ref:`Example <collation-example>`
+
+  -* sqlite3_create_collation_v2
+*/
+
+static PyObject *
+Connection_createcollation(Connection *self, PyObject *args)
+{
+  PyObject *callable=NULL;
+  char *name=0;
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+
+  if(!PyArg_ParseTuple(args, "esO:createcollation(name,callback)", STRENCODING, &name, &callable))
+      return NULL;
+
+  assert(name);
+  assert(callable);
+
+  if(callable!=Py_None && !PyCallable_Check(callable))
+    {
+      PyMem_Free(name);
+      PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+      return NULL;
+    }
+
+  PYSQLITE_CON_CALL(
+                res=sqlite3_create_collation_v2(self->db,
+                                                name,
+                                                SQLITE_UTF8,
+                                                (callable!=Py_None)?callable:NULL,
+                                                (callable!=Py_None)?collation_cb:NULL,
+                                                (callable!=Py_None)?collation_destroy:NULL)
+                );
+  PyMem_Free(name);
+  if(res!=SQLITE_OK)
+    {
+      SET_EXC(res, self->db);
+      return NULL;
+    }
+
+  if (callable!=Py_None)
+    Py_INCREF(callable);
+
+  Py_RETURN_NONE;
+}
+
+/** .. method:: filecontrol(dbname, op, pointer) -> bool
+
+  Calls the :meth:`~VFSFile.xFileControl` method on the :ref:`VFS`
+  implementing :class:`file access <VFSFile>` for the database.
+
+  :param dbname: The name of the database to affect (eg "main", "temp", attached name)
+  :param op: A `numeric code
+    <https://sqlite.org/c3ref/c_fcntl_lockstate.html>`_ with values less
+    than 100 reserved for SQLite internal use.
+  :param pointer: A number which is treated as a ``void pointer`` at the C level.
+
+  :returns: True or False indicating if the VFS understood the op.
+
+  If you want data returned back then the *pointer* needs to point to
+  something mutable.  Here is an example using `ctypes
+  <http://www.python.org/doc/2.5.2/lib/module-ctypes.html>`_ of
+  passing a Python dictionary to :meth:`~VFSFile.xFileControl` which
+  can then modify the dictionary to set return values::
+
+    obj={"foo": 1, 2: 3}                 # object we want to pass
+    objwrap=ctypes.py_object(obj)        # objwrap must live before and after the call else
+                                         # it gets garbage collected
+    connection.filecontrol(
+             "main",                     # which db
+             123,                        # our op code
+             ctypes.addressof(objwrap))  # get pointer
+
+  The :meth:`~VFSFile.xFileControl` method then looks like this::
+
+    def xFileControl(self, op, pointer):
+        if op==123:                      # our op code
+            obj=ctypes.py_object.from_address(pointer).value
+            # play with obj - you can use id() to verify it is the same
+            print obj["foo"]
+            obj["result"]="it worked"
+	    return True
+        else:
+            # pass to parent/superclass
+            return super(MyFile, self).xFileControl(op, pointer)
+
+  This is how you set the chunk size by which the database grows.  Do
+  not combine it into one line as the c_int would be garbage collected
+  before the filecontrol call is made::
+
+     chunksize=ctypes.c_int(32768)
+     connection.filecontrol("main", apsw.SQLITE_FCNTL_CHUNK_SIZE, ctypes.addressof(chunksize))
+
+  -* sqlite3_file_control
+*/
+
+static PyObject *
+Connection_filecontrol(Connection *self, PyObject *args)
+{
+  PyObject *pyptr;
+  void *ptr=NULL;
+  int res=SQLITE_ERROR, op;
+  char *dbname=NULL;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self,NULL);
+
+  if(!PyArg_ParseTuple(args, "esiO", STRENCODING, &dbname, &op, &pyptr))
+    return NULL;
+
+  if(PyIntLong_Check(pyptr))
+    ptr=PyLong_AsVoidPtr(pyptr);
+  else
+    PyErr_Format(PyExc_TypeError, "Argument is not a number (pointer)");
+
+  if(PyErr_Occurred())
+    {
+      AddTraceBackHere(__FILE__, __LINE__, "Connection.filecontrol", "{s: O}", "args", args);
+      goto finally;
+    }
+
+  PYSQLITE_CON_CALL(res=sqlite3_file_control(self->db, dbname, op, ptr));
+
+  if(res!=SQLITE_OK && res!=SQLITE_NOTFOUND)
+    SET_EXC(res, self->db);
+
+ finally:
+  if(dbname) PyMem_Free(dbname);
+
+  if(PyErr_Occurred())
+    return NULL;
+
+  if(res==SQLITE_NOTFOUND)
+    Py_RETURN_FALSE;
+  Py_RETURN_TRUE;
+}
+
+/** .. method:: sqlite3pointer() -> int
+
+  Returns the underlying `sqlite3 *
+  <https://sqlite.org/c3ref/sqlite3.html>`_ for the connection. This
+  method is useful if there are other C level libraries in the same
+  process and you want them to use the APSW connection handle. The
+  value is returned as a number using :meth:`PyLong_FromVoidPtr` under the
+  hood. You should also ensure that you increment the reference count on
+  the :class:`Connection` for as long as the other libraries are using
+  the pointer.  It is also a very good idea to call
+  :meth:`sqlitelibversion` and ensure it is the same as the other
+  libraries.
+
+*/
+static PyObject*
+Connection_sqlite3pointer(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  return PyLong_FromVoidPtr(self->db);
+}
+
+/** .. method:: wal_autocheckpoint(n)
+
+    Sets how often the :ref:`wal` checkpointing is run.
+
+    :param n: A number representing the checkpointing interval or
+      zero/negative to disable auto checkpointing.
+
+   -* sqlite3_wal_autocheckpoint
+*/
+static PyObject *
+Connection_wal_autocheckpoint(Connection *self, PyObject *arg)
+{
+  long v;
+  int res;
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(!PyIntLong_Check(arg))
+    return PyErr_Format(PyExc_TypeError, "Parameter must be a number");
+  v=PyIntLong_AsLong(arg);
+
+  APSW_FAULT_INJECT(WalAutocheckpointFails,
+		    PYSQLITE_CON_CALL(res=sqlite3_wal_autocheckpoint(self->db, (int)v)),
+		    res=SQLITE_IOERR);
+
+  SET_EXC(res, self->db);
+
+  /* done */
+  if (res==SQLITE_OK)
+    Py_RETURN_NONE;
+  return NULL;
+}
+
+/** .. method:: wal_checkpoint(dbname=None, mode=apsw.SQLITE_CHECKPOINT_PASSIVE) -> ( int, int )
+
+    Does a WAL checkpoint.  Has no effect if the database(s) are not in WAL mode.
+
+    :param dbname:  The name of the database or all databases if None
+
+    :param mode: One of the `checkpoint modes <https://sqlite.org/c3ref/wal_checkpoint_v2.html>`__.
+
+    :return: A tuple of the size of the WAL log in frames and the
+       number of frames checkpointed as described in the
+       `documentation
+       <https://sqlite.org/c3ref/wal_checkpoint_v2.html>`__.
+
+  -* sqlite3_wal_checkpoint_v2
+*/
+static PyObject *
+Connection_wal_checkpoint(Connection *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[]={"dbname", "mode", NULL};
+  int res;
+  char *dbname=NULL;
+  int mode=SQLITE_CHECKPOINT_PASSIVE;
+  int nLog=0, nCkpt=0;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|esi:wal_checkpoint(dbname=None)",
+				  kwlist, STRENCODING, &dbname, &mode))
+    return NULL;
+
+  APSW_FAULT_INJECT(WalCheckpointFails,
+		    PYSQLITE_CON_CALL(res=sqlite3_wal_checkpoint_v2(self->db, dbname, mode, &nLog, &nCkpt)),
+		    res=SQLITE_IOERR);
+
+  SET_EXC(res, self->db);
+  PyMem_Free(dbname);
+  /* done */
+  if (res==SQLITE_OK)
+    return Py_BuildValue("ii", nLog, nCkpt);
+  return NULL;
+}
+
+
+#ifdef EXPERIMENTAL
+
+static struct sqlite3_module apsw_vtable_module;
+static void apswvtabFree(void *context);
+
+/** .. method:: createmodule(name, datasource)
+
+    Registers a virtual table.  See :ref:`virtualtables` for details.
+
+    .. seealso::
+
+       * :ref:`Example <example-vtable>`
+
+    -* sqlite3_create_module_v2
+*/
+static PyObject *
+Connection_createmodule(Connection *self, PyObject *args)
+{
+  char *name=NULL;
+  PyObject *datasource=NULL;
+  vtableinfo *vti;
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(!PyArg_ParseTuple(args, "esO:createmodule(name, datasource)", STRENCODING, &name, &datasource))
+    return NULL;
+
+  Py_INCREF(datasource);
+  vti=PyMem_Malloc(sizeof(vtableinfo));
+  vti->connection=self;
+  vti->datasource=datasource;
+
+  /* SQLite is really finnicky.  Note that it calls the destructor on
+     failure  */
+  APSW_FAULT_INJECT(CreateModuleFail,
+                    PYSQLITE_CON_CALL((res=sqlite3_create_module_v2(self->db, name, &apsw_vtable_module, vti, apswvtabFree), vti=NULL)),
+                    res=SQLITE_IOERR);
+  PyMem_Free(name);
+  SET_EXC(res, self->db);
+
+  if(res!=SQLITE_OK)
+    {
+      if(vti)
+	apswvtabFree(vti);
+      return NULL;
+    }
+
+  Py_RETURN_NONE;
+}
+
+/** .. method:: overloadfunction(name, nargs)
+
+  Registers a placeholder function so that a virtual table can provide an implementation via
+  :meth:`VTTable.FindFunction`.
+
+  :param name: Function name
+  :param nargs: How many arguments the function takes
+
+  Due to :cvstrac:`3507` underlying errors will not be returned.
+
+  -* sqlite3_overload_function
+*/
+static PyObject*
+Connection_overloadfunction(Connection *self, PyObject *args)
+{
+  char *name;
+  int nargs, res;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(!PyArg_ParseTuple(args, "esi:overloadfunction(name, nargs)", STRENCODING, &name, &nargs))
+    return NULL;
+
+  APSW_FAULT_INJECT(OverloadFails,
+                    PYSQLITE_CON_CALL(res=sqlite3_overload_function(self->db, name, nargs)),
+                    res=SQLITE_NOMEM);
+  PyMem_Free(name);
+
+  SET_EXC(res, self->db);
+
+  if(res)
+    return NULL;
+
+  Py_RETURN_NONE;
+}
+
+#endif
+
+/** .. method:: setexectrace(callable)
+
+  *callable* is called with the cursor, statement and bindings for
+  each :meth:`~Cursor.execute` or :meth:`~Cursor.executemany` on this
+  Connection, unless the :class:`Cursor` installed its own
+  tracer. Your execution tracer can also abort execution of a
+  statement.
+
+  If *callable* is :const:`None` then any existing execution tracer is
+  removed.
+
+  .. seealso::
+
+    * :ref:`tracing`
+    * :ref:`rowtracer`
+    * :meth:`Cursor.setexectrace`
+*/
+
+static PyObject *
+Connection_setexectrace(Connection *self, PyObject *func)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(func!=Py_None && !PyCallable_Check(func))
+    {
+      PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+      return NULL;
+    }
+
+  if(func!=Py_None)
+    Py_INCREF(func);
+  Py_XDECREF(self->exectrace);
+  self->exectrace=(func==Py_None)?0:func;
 
-    You can register the same named function but with different
-    *callable* and *numargs*.  For example::
+  Py_RETURN_NONE;
+}
 
-      connection.createscalarfunction("toip", ipv4convert, 4)
-      connection.createscalarfunction("toip", ipv6convert, 16)
-      connection.createscalarfunction("toip", strconvert, -1)
 
-    The one with the correct *numargs* will be called and only if that
-    doesn't exist then the one with negative *numargs* will be called.
+/** .. method:: setrowtrace(callable)
 
-  .. seealso::
+  *callable* is called with the cursor and row being returned for
+  :class:`cursors <Cursor>` associated with this Connection, unless
+  the Cursor installed its own tracer.  You can change the data that
+  is returned or cause the row to be skipped altogether.
 
-     * :ref:`Example <scalar-example>`
-     * :meth:`~Connection.createaggregatefunction`
+  If *callable* is :const:`None` then any existing row tracer is
+  removed.
 
-  -* sqlite3_create_function_v2
+  .. seealso::
+
+    * :ref:`tracing`
+    * :ref:`rowtracer`
+    * :meth:`Cursor.setexectrace`
 */
 
 static PyObject *
-Connection_createscalarfunction(Connection *self, PyObject *args, PyObject *kwargs)
+Connection_setrowtrace(Connection *self, PyObject *func)
 {
-  static char *kwlist[]={"name", "callable", "numargs", "deterministic", NULL};
-  int numargs=-1;
-  PyObject *callable=NULL;
-  PyObject *odeterministic=NULL;
-  int deterministic=0;
-  char *name=0;
-  FunctionCBInfo *cbinfo;
-  int res;
-
   CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
-
-  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "esO|iO!:createscalarfunction(name,callback, numargs=-1, deterministic=False)",
-                                  kwlist, STRENCODING, &name, &callable, &numargs, &PyBool_Type, &odeterministic))
-    return NULL;
-
-  assert(name);
-  assert(callable);
-  if(odeterministic) {
-    res=PyObject_IsTrue(odeterministic);
-    if (res<0) return NULL;
-    deterministic=res;
-  }
+  CHECK_CLOSED(self, NULL);
 
-  if(callable!=Py_None && !PyCallable_Check(callable))
+  if(func!=Py_None && !PyCallable_Check(func))
     {
-      PyMem_Free(name);
       PyErr_SetString(PyExc_TypeError, "parameter must be callable");
       return NULL;
     }
 
-  if(callable==Py_None)
-    {
-      cbinfo=0;
-    }
-  else
-    {
-      cbinfo=allocfunccbinfo();
-      if(!cbinfo) goto finally;
-      cbinfo->name=name;
-      cbinfo->scalarfunc=callable;
-      Py_INCREF(callable);
-    }
-
-  PYSQLITE_CON_CALL(
-                res=sqlite3_create_function_v2(self->db,
-					       name,
-					       numargs,
-					       SQLITE_UTF8|(deterministic?SQLITE_DETERMINISTIC:0),
-					       cbinfo,
-					       cbinfo?cbdispatch_func:NULL,
-					       NULL,
-					       NULL,
-					       apsw_free_func)
-                );
-  if(res)
-    {
-      /* Note: On error sqlite3_create_function_v2 calls the
-	 destructor (apsw_free_func)! */
-      SET_EXC(res, self->db);
-      goto finally;
-    }
-
-  if(callable==Py_None)
-    PyMem_Free(name);
+  if(func!=Py_None)
+    Py_INCREF(func);
+  Py_XDECREF(self->rowtrace);
+  self->rowtrace=(func==Py_None)?0:func;
 
- finally:
-  if(PyErr_Occurred())
-    return NULL;
   Py_RETURN_NONE;
 }
 
-/** .. method:: createaggregatefunction(name, factory[, numargs=-1])
-
-  Registers an aggregate function.  Aggregate functions operate on all
-  the relevant rows such as counting how many there are.
+/** .. method:: getexectrace() -> callable or None
 
-  :param name: The string name of the function.  It should be less than 255 characters
-  :param callable: The function that will be called
-  :param numargs: How many arguments the function takes, with -1 meaning any number
+  Returns the currently installed (via :meth:`~Connection.setexectrace`)
+  execution tracer.
 
-  When a query starts, the *factory* will be called and must return a tuple of 3 items:
+  .. seealso::
 
-    a context object
-       This can be of any type
+    * :ref:`tracing`
+*/
+static PyObject *
+Connection_getexectrace(Connection *self)
+{
+  PyObject *ret;
 
-    a step function
-       This function is called once for each row.  The first parameter
-       will be the context object and the remaining parameters will be
-       from the SQL statement.  Any value returned will be ignored.
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
-    a final function
-       This function is called at the very end with the context object
-       as a parameter.  The value returned is set as the return for
-       the function. The final function is always called even if an
-       exception was raised by the step function. This allows you to
-       ensure any resources are cleaned up.
+  ret=(self->exectrace)?(self->exectrace):Py_None;
+  Py_INCREF(ret);
+  return ret;
+}
 
-  .. note::
+/** .. method:: getrowtrace() -> callable or None
 
-    You can register the same named function but with different
-    callables and *numargs*.  See
-    :meth:`~Connection.createscalarfunction` for an example.
+  Returns the currently installed (via :meth:`~Connection.setrowtrace`)
+  row tracer.
 
   .. seealso::
 
-     * :ref:`Example <aggregate-example>`
-     * :meth:`~Connection.createscalarfunction`
-
-  -* sqlite3_create_function_v2
+    * :ref:`tracing`
 */
-
 static PyObject *
-Connection_createaggregatefunction(Connection *self, PyObject *args)
+Connection_getrowtrace(Connection *self)
 {
-  int numargs=-1;
-  PyObject *callable;
-  char *name=0;
-  FunctionCBInfo *cbinfo;
-  int res;
+  PyObject *ret;
 
   CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
+  CHECK_CLOSED(self, NULL);
 
-  if(!PyArg_ParseTuple(args, "esO|i:createaggregatefunction(name, factorycallback, numargs=-1)", STRENCODING, &name, &callable, &numargs))
-    return NULL;
+  ret=(self->rowtrace)?(self->rowtrace):Py_None;
+  Py_INCREF(ret);
+  return ret;
+}
 
-  assert(name);
-  assert(callable);
+/** .. method:: setrowfactory(mode)
 
-  if(callable!=Py_None && !PyCallable_Check(callable))
-    {
-      PyMem_Free(name);
-      PyErr_SetString(PyExc_TypeError, "parameter must be callable");
-      return NULL;
-    }
+  Sets what kind of object is returned for each row by
+  :class:`cursors <Cursor>` associated with this Connection, unless
+  the Cursor has its own setting.  The rows are built natively so
+  there is no extra per row cost as there would be with a
+  :meth:`row tracer <setrowtrace>`.
 
-  if(callable==Py_None)
-    cbinfo=0;
-  else
-    {
-      cbinfo=allocfunccbinfo();
-      if(!cbinfo) goto finally;
+  :param mode: One of
 
-      cbinfo->name=name;
-      cbinfo->aggregatefactory=callable;
-      Py_INCREF(callable);
-    }
+    tuple
+       The default. Rows are tuples.
 
-  PYSQLITE_CON_CALL(
-                res=sqlite3_create_function_v2(self->db,
-					       name,
-					       numargs,
-					       SQLITE_UTF8,
-					       cbinfo,
-					       NULL,
-					       cbinfo?cbdispatch_step:NULL,
-					       cbinfo?cbdispatch_final:NULL,
-					       apsw_free_func)
-                );
+    named
+       Rows are :func:`collections.namedtuple` instances so you can
+       access columns by name as attributes as well as by index.
+       Column names that are not valid Python identifiers (or are
+       duplicates) are replaced by position names such as ``_3`` as
+       done by namedtuple's *rename* option.  Requires Python 2.7 or
+       later.
 
-  if(res)
-    {
-      /* Note: On error sqlite3_create_function_v2 calls the
-	 destructor (apsw_free_func)! */
-      SET_EXC(res, self->db);
-      goto finally;
-    }
+    dict
+       Rows are dictionaries keyed by column name.  If several
+       columns have the same name then the value of the last one is
+       used.
 
-  if(callable==Py_None)
-    PyMem_Free(name);
+  The row types and dictionary keys are made once per statement and
+  kept in the :ref:`statement cache <statementcache>` so repeating a
+  query reuses them.  Any :meth:`row tracer <setrowtrace>` is called
+  with the row as made by the factory.
 
- finally:
-  if(PyErr_Occurred())
+  .. seealso::
+
+    * :meth:`Cursor.setrowfactory`
+*/
+static PyObject *
+Connection_setrowfactory(Connection *self, PyObject *args)
+{
+  const char *name=NULL;
+  int mode;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(!PyArg_ParseTuple(args, "s:setrowfactory(mode)", &name))
+    return NULL;
+
+  mode=rowfactory_from_name(name);
+  if(mode<0)
     return NULL;
+
+  self->rowfactory=mode;
+
   Py_RETURN_NONE;
 }
 
-/* USER DEFINED COLLATION CODE.*/
+/** .. method:: getrowfactory() -> str
 
-static int
-collation_cb(void *context,
-	     int stringonelen, const void *stringonedata,
-	     int stringtwolen, const void *stringtwodata)
+  Returns the current row factory mode as set by :meth:`setrowfactory`.
+*/
+static PyObject *
+Connection_getrowfactory(Connection *self)
 {
-  PyGILState_STATE gilstate;
-  PyObject *cbinfo=(PyObject*)context;
-  PyObject *pys1=NULL, *pys2=NULL, *retval=NULL;
-  int result=0;
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
-  assert(cbinfo);
+  return convertutf8string(rowfactory_names[self->rowfactory]);
+}
 
-  gilstate=PyGILState_Ensure();
+/** .. method:: setautoparameterize(enable)
+
+  When enabled, queries executed by :meth:`Cursor.execute` without
+  bindings have their numeric and string literals replaced by ``?``
+  and supplied as bindings instead, with whitespace and comments
+  collapsed.  Queries that only differ in their literals then share
+  one :ref:`statement cache <statementcache>` entry rather than each
+  being prepared separately and pushing other entries out.  For
+  example these all run the same cached ``select * from items where
+  id=? and kind=?``::
+
+    cursor.execute("select * from items where id=1 and kind='box'")
+    cursor.execute("select * from items  where id=7 and kind='tin'")
+
+  It only applies to single SELECT, INSERT, UPDATE, DELETE, REPLACE,
+  WITH and VALUES statements that contain no parameters.  Literals in
+  the result columns, ORDER BY and GROUP BY terms are left alone
+  since replacing them would change column names or meaning, as is
+  any statement using window functions.  If the rewritten query can't
+  be prepared then the original is used.  The ``normalized`` count in
+  :meth:`cache_stats` says how many queries were rewritten.  Keywords
+  and names are not changed so differences in their case still result
+  in separate entries.
+
+  Things to be aware of:
+
+  * The :ref:`execution tracer <executiontracer>` and
+    :attr:`Cursor.description` relate to the rewritten query, and the
+    tracer gets the literal values as the bindings.
+  * SQLite can't use a partial index, or one on an expression
+    involving a literal, when the value is only known at execution
+    time.
+
+  The default is disabled.
 
-  if(PyErr_Occurred()) goto finally;  /* outstanding error */
+  .. seealso::
 
-  pys1=convertutf8stringsize(stringonedata, stringonelen);
-  pys2=convertutf8stringsize(stringtwodata, stringtwolen);
+    * :meth:`getautoparameterize`
+*/
+static PyObject *
+Connection_setautoparameterize(Connection *self, PyObject *args)
+{
+  int enable;
+
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
+
+  if(!PyArg_ParseTuple(args, "i:setautoparameterize(enable)", &enable))
+    return NULL;
+
+  self->autoparameterize=!!enable;
+
+  Py_RETURN_NONE;
+}
+
+/** .. method:: getautoparameterize() -> bool
+
+  Returns if literals are turned into bindings as set by
+  :meth:`setautoparameterize`.
+*/
+static PyObject *
+Connection_getautoparameterize(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
-  if(!pys1 || !pys2)
-    goto finally;   /* failed to allocate strings */
+  return PyBool_FromLong(self->autoparameterize);
+}
 
-  retval=PyObject_CallFunction(cbinfo, "(OO)", pys1, pys2);
+/** .. method:: cache_stats() -> dict
+
+  Returns statistics about the :ref:`statement cache <statementcache>`
+  which are useful for deciding on the *statementcachesize* to use.
+  The counts are since the connection was opened.
+
+    size
+      Maximum number of entries (the *statementcachesize*)
+    entries
+      How many statements are currently in the cache
+    duplicates
+      How many of the entries are additional instances of a query
+      already in the cache.  They are kept when a query is run while
+      the cached instance is still executing (eg nested cursors
+      walking a tree) so each use gets an already prepared statement.
+    hits
+      Statements found in the cache and reused
+    misses
+      Statements not in the cache which had to be prepared
+    inuse
+      Statements in the cache but with every instance already
+      executing so another instance had to be prepared
+    evictions
+      Entries discarded to make space.  When over a memory limit it
+      is the entry among the least recently used ones that gives the
+      least benefit for its memory.
+    recycled
+      Statement objects reused rather than allocated
+    reprepares
+      Statements prepared again because the schema changed
+    memory
+      Bytes of memory used by the statements currently in the cache
+      (`SQLITE_STMTSTATUS_MEMUSED
+      <https://sqlite.org/c3ref/c_stmtstatus_counter.html>`__)
+    memorylimit
+      The *statementcachememory* limit, or zero if there isn't one
+    normalized
+      Queries whose literals were turned into bindings by
+      :meth:`setautoparameterize`
+
+  -* sqlite3_stmt_status
 
-  if(!retval)
-    {
-      AddTraceBackHere(__FILE__, __LINE__, "Collation_callback", "{s: O, s: O, s: O}", "callback", cbinfo, "stringone", pys1, "stringtwo", pys2);
-      goto finally;  /* execution failed */
-    }
+  .. seealso::
 
-  if (PyIntLong_Check(retval))
-    {
-      result=PyIntLong_AsLong(retval);
-      goto haveval;
-    }
+    * :meth:`cache_entries`
+*/
+static PyObject *
+Connection_cache_stats(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
-  PyErr_Format(PyExc_TypeError, "Collation callback must return a number");
-  AddTraceBackHere(__FILE__, __LINE__, "collation callback", "{s: O, s: O}",
-                   "stringone", pys1, "stringtwo", pys2);
+  return statementcache_stats(self->stmtcache);
+}
 
- haveval:
-  if(PyErr_Occurred())
-      result=0;
+/** .. method:: cache_entries() -> list of str
 
- finally:
-  Py_XDECREF(pys1);
-  Py_XDECREF(pys2);
-  Py_XDECREF(retval);
-  PyGILState_Release(gilstate);
-  return result;
+  Returns the queries currently in the :ref:`statement cache
+  <statementcache>` starting with the least recently used, which is
+  the next to be evicted.  Queries that are currently executing can't
+  be evicted and are at the end.  Comparing this with the queries your
+  program runs helps diagnose a poor hit rate in :meth:`cache_stats`.
+*/
+static PyObject *
+Connection_cache_entries(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
+  return statementcache_entries(self->stmtcache);
 }
 
-static void
-collation_destroy(void *context)
+/** .. method:: cache_profile(n=10) -> dict
+
+  Returns which statements in the :ref:`statement cache
+  <statementcache>` did the most work of each kind, as measured by
+  SQLite's per statement counters.  They are added up every time a
+  statement finishes executing so there is no per row overhead and
+  nothing needs to be enabled, unlike :meth:`setprofile`.  The result
+  is a dict with a list of up to *n* ``(query, count)`` tuples,
+  largest count first, for each of these keys:
+
+    fullscan_step
+      Rows stepped through in full table scans.  Large values
+      suggest an index is missing.
+    sort
+      Sort operations.  An index might let them be avoided.
+    autoindex
+      Rows inserted into automatic indices that SQLite built because
+      there was no suitable index
+    vm_step
+      Virtual machine operations, a rough measure of the total work
+    reprepare
+      Times SQLite automatically prepared the statement again due to
+      a schema change or different bindings
+    run
+      Times the statement was run
+
+  Queries with a zero count are omitted.  Counts for multiple cached
+  instances of a query are combined, and each statement of a cached
+  script is listed separately.  Statements are forgotten when evicted
+  from the cache, and those of a :class:`PreparedStatement` are not
+  included.
+
+  When SQLite was compiled with `SQLITE_ENABLE_STMT_SCANSTATUS
+  <https://sqlite.org/compile.html#enable_stmt_scanstatus>`__ there
+  is also a ``scanstatus`` key.  It is a dict keyed by query with a
+  list of the loops of the query plan, each a dict with ``name``
+  (the table or index), ``explain`` (the query plan text), ``loops``
+  (times the loop was started), ``rows`` (rows visited) and
+  ``estimate`` (the planner's estimate of rows per loop).
+
+  -* sqlite3_stmt_status sqlite3_stmt_scanstatus
+
+  .. seealso::
+
+    * :meth:`cache_stats`
+*/
+static PyObject *
+Connection_cache_profile(Connection *self, PyObject *args)
 {
-  PyGILState_STATE gilstate=PyGILState_Ensure();
-  Py_DECREF((PyObject*)context);
-  PyGILState_Release(gilstate);
-}
+  int n=10;
 
-/** .. method:: createcollation(name, callback)
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
-  You can control how SQLite sorts (termed `collation
-  <http://en.wikipedia.org/wiki/Collation>`_) when giving the
-  ``COLLATE`` term to a `SELECT
-  <https://sqlite.org/lang_select.html>`_.  For example your
-  collation could take into account locale or do numeric sorting.
+  if(!PyArg_ParseTuple(args, "|i:cache_profile(n=10)", &n))
+    return NULL;
 
-  The *callback* will be called with two items.  It should return -1
-  if the first is less then the second, 0 if they are equal, and 1 if
-  first is greater::
+  if(n<0)
+    return PyErr_Format(PyExc_ValueError, "n must be zero or more");
 
-     def mycollation(one, two):
-         if one < two:
-             return -1
-         if one == two:
-             return 0
-         if one > two:
-             return 1
+  return statementcache_profile(self->stmtcache, n);
+}
 
-  .. seealso::
+/** .. method:: setresultcache(entries)
+
+  Enables a cache of query results used by :meth:`cachedquery`,
+  keeping up to *entries* results.  Zero disables the cache and
+  discards its contents and counters.  When full, or if the size is
+  reduced, the least recently used entries are discarded.
+
+  Entries are invalidated precisely:
+
+  * The tables each query reads, including those behind views, are
+    recorded while it is prepared.  When the update hook reports a
+    change to one of them, only the results that read it are
+    invalidated.
+  * `PRAGMA data_version <https://sqlite.org/pragma.html#pragma_data_version>`__
+    is checked on each lookup so changes committed by other
+    connections and processes invalidate results that read the
+    changed database.
+  * Creating, dropping or altering tables and views, and attaching or
+    detaching databases, discards everything.  So do changes the
+    update hook doesn't report such as those to WITHOUT ROWID and
+    virtual tables, and deleting all rows.
+
+  Results are only stored when no transaction is open so they never
+  contain uncommitted changes that could be rolled back.  Queries
+  using the built in functions whose results vary such as
+  ``random()`` and ``datetime('now')`` are not cached.  SQLite can't
+  say if your own functions are deterministic, so don't use
+  :meth:`cachedquery` with functions and virtual tables whose
+  results change without the database changing.
+
+  The cache uses the authorizer and update hook which continue to
+  call any Python callables you supply with :meth:`setauthorizer` and
+  :meth:`setupdatehook`.
+
+  -* sqlite3_set_authorizer sqlite3_update_hook sqlite3_total_changes
 
-    * :ref:`Example <collation-example>`
+  .. seealso::
 
-  -* sqlite3_create_collation_v2
+    * :meth:`getresultcache`
+    * :meth:`resultcache_stats`
 */
-
 static PyObject *
-Connection_createcollation(Connection *self, PyObject *args)
+Connection_setresultcache(Connection *self, PyObject *args)
 {
-  PyObject *callable=NULL;
-  char *name=0;
-  int res;
+  int size, res;
+  ResultCache *rc;
 
   CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
+  CHECK_CLOSED(self, NULL);
 
-  if(!PyArg_ParseTuple(args, "esO:createcollation(name,callback)", STRENCODING, &name, &callable))
-      return NULL;
+  if(!PyArg_ParseTuple(args, "i:setresultcache(entries)", &size))
+    return NULL;
 
-  assert(name);
-  assert(callable);
+  if(size<0)
+    return PyErr_Format(PyExc_ValueError, "entries must be zero or more");
 
-  if(callable!=Py_None && !PyCallable_Check(callable))
+  rc=self->resultcache;
+
+  if(!size)
     {
-      PyMem_Free(name);
-      PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+      if(!rc)
+        Py_RETURN_NONE;
+      self->resultcache=0;
+      PYSQLITE_VOID_CALL(sqlite3_update_hook(self->db, (self->updatehook || self->changecapture)?updatecb:NULL, self));
+      PYSQLITE_CON_CALL(res=sqlite3_set_authorizer(self->db, self->authorizer?authorizercb:NULL, self));
+      resultcache_free(rc, self->db);
+      if(res!=SQLITE_OK)
+        {
+          SET_EXC(res, self->db);
+          return NULL;
+        }
+      Py_RETURN_NONE;
+    }
+
+  if(rc)
+    {
+      rc->size=size;
+      resultcache_evict(rc, size);
+      Py_RETURN_NONE;
+    }
+
+  APSW_FAULT_INJECT(ResultCacheAllocFails, rc=PyMem_Malloc(sizeof(ResultCache)), rc=NULL);
+  if(!rc)
+    return PyErr_NoMemory();
+  memset(rc, 0, sizeof(ResultCache));
+  rc->size=size;
+  rc->entries=PyDict_New();
+  rc->querytables=PyDict_New();
+  if(!rc->entries || !rc->querytables)
+    {
+      resultcache_free(rc, self->db);
       return NULL;
     }
+  rc->lasttotalchanges=sqlite3_total_changes(self->db);
 
-  PYSQLITE_CON_CALL(
-                res=sqlite3_create_collation_v2(self->db,
-                                                name,
-                                                SQLITE_UTF8,
-                                                (callable!=Py_None)?callable:NULL,
-                                                (callable!=Py_None)?collation_cb:NULL,
-                                                (callable!=Py_None)?collation_destroy:NULL)
-                );
-  PyMem_Free(name);
+  self->resultcache=rc;
+  PYSQLITE_CON_CALL(res=sqlite3_set_authorizer(self->db, authorizercb, self));
   if(res!=SQLITE_OK)
     {
+      self->resultcache=0;
+      resultcache_free(rc, self->db);
       SET_EXC(res, self->db);
       return NULL;
     }
-
-  if (callable!=Py_None)
-    Py_INCREF(callable);
+  PYSQLITE_VOID_CALL(sqlite3_update_hook(self->db, updatecb, self));
 
   Py_RETURN_NONE;
 }
 
-/** .. method:: filecontrol(dbname, op, pointer) -> bool
-
-  Calls the :meth:`~VFSFile.xFileControl` method on the :ref:`VFS`
-  implementing :class:`file access <VFSFile>` for the database.
-
-  :param dbname: The name of the database to affect (eg "main", "temp", attached name)
-  :param op: A `numeric code
-    <https://sqlite.org/c3ref/c_fcntl_lockstate.html>`_ with values less
-    than 100 reserved for SQLite internal use.
-  :param pointer: A number which is treated as a ``void pointer`` at the C level.
-
-  :returns: True or False indicating if the VFS understood the op.
-
-  If you want data returned back then the *pointer* needs to point to
-  something mutable.  Here is an example using `ctypes
-  <http://www.python.org/doc/2.5.2/lib/module-ctypes.html>`_ of
-  passing a Python dictionary to :meth:`~VFSFile.xFileControl` which
-  can then modify the dictionary to set return values::
+/** .. method:: getresultcache() -> int
 
-    obj={"foo": 1, 2: 3}                 # object we want to pass
-    objwrap=ctypes.py_object(obj)        # objwrap must live before and after the call else
-                                         # it gets garbage collected
-    connection.filecontrol(
-             "main",                     # which db
-             123,                        # our op code
-             ctypes.addressof(objwrap))  # get pointer
+  Returns the maximum number of entries in the result cache as set by
+  :meth:`setresultcache`, zero if it is disabled.
+*/
+static PyObject *
+Connection_getresultcache(Connection *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
-  The :meth:`~VFSFile.xFileControl` method then looks like this::
+  return PyInt_FromLong(self->resultcache?self->resultcache->size:0);
+}
 
-    def xFileControl(self, op, pointer):
-        if op==123:                      # our op code
-            obj=ctypes.py_object.from_address(pointer).value
-            # play with obj - you can use id() to verify it is the same
-            print obj["foo"]
-            obj["result"]="it worked"
-	    return True
-        else:
-            # pass to parent/superclass
-            return super(MyFile, self).xFileControl(op, pointer)
+/** .. method:: cachedquery(statement, bindings=None) -> list
 
-  This is how you set the chunk size by which the database grows.  Do
-  not combine it into one line as the c_int would be garbage collected
-  before the filecontrol call is made::
+  Returns all the result rows of a single read only query as a list,
+  from the result cache enabled by :meth:`setresultcache` if an
+  earlier execution with the same bindings is still valid.
+  Otherwise the query is run using a :class:`Cursor` and the rows are
+  stored.  Rows are made by the :meth:`row factory <setrowfactory>`
+  and :meth:`row tracer <setrowtrace>`, and the same row objects are
+  returned on every hit so don't modify them.  The tracers are only
+  called when the query is actually run.
 
-     chunksize=ctypes.c_int(32768)
-     connection.filecontrol("main", apsw.SQLITE_FCNTL_CHUNK_SIZE, ctypes.addressof(chunksize))
+  Bindings that can't be dictionary keys, such as a bytearray, are
+  supplied but the results aren't cached.  When the result cache is
+  disabled this is the same as ``cursor().execute(statement,
+  bindings).fetchall()``.
 
-  -* sqlite3_file_control
+  :raises ValueError: The statement isn't read only or there is more
+    than one.
 */
-
 static PyObject *
-Connection_filecontrol(Connection *self, PyObject *args)
+Connection_cachedquery(Connection *self, PyObject *args)
 {
-  PyObject *pyptr;
-  void *ptr=NULL;
-  int res=SQLITE_ERROR, op;
-  char *dbname=NULL;
+  PyObject *query, *bindings=Py_None;
+  PyObject *key=NULL, *entry, *slots=NULL, *versions=NULL, *cursor=NULL, *executed, *rows=NULL, *retval=NULL;
+  ResultCache *rc;
+  sqlite3_int64 generation=0;
 
   CHECK_USE(NULL);
-  CHECK_CLOSED(self,NULL);
+  CHECK_CLOSED(self, NULL);
 
-  if(!PyArg_ParseTuple(args, "esiO", STRENCODING, &dbname, &op, &pyptr))
+  if(!PyArg_ParseTuple(args, "O|O:cachedquery(statement, bindings=None)", &query, &bindings))
     return NULL;
 
-  if(PyIntLong_Check(pyptr))
-    ptr=PyLong_AsVoidPtr(pyptr);
-  else
-    PyErr_Format(PyExc_TypeError, "Argument is not a number (pointer)");
-
-  if(PyErr_Occurred())
+  rc=self->resultcache;
+  if(rc)
     {
-      AddTraceBackHere(__FILE__, __LINE__, "Connection.filecontrol", "{s: O}", "args", args);
-      goto finally;
+      key=resultcache_key(query, bindings, self->rowfactory);
+      if(!key)
+        {
+          if(!PyErr_ExceptionMatches(PyExc_TypeError))
+            return NULL;
+          PyErr_Clear();
+          rc->uncached++;
+        }
     }
 
-  PYSQLITE_CON_CALL(res=sqlite3_file_control(self->db, dbname, op, ptr));
+  if(key)
+    {
+      APSW_DB_MUTEX_ENTER(self->db);
+      resultcache_sync(rc, self->db);
+      entry=PyDict_GetItem(rc->entries, key);
+      if(entry && resultcache_valid(rc, entry))
+        {
+          rc->hits++;
+          /* most recently used go last.  Failing only loses the entry */
+          Py_INCREF(entry);
+          if(PyDict_DelItem(rc->entries, key) || PyDict_SetItem(rc->entries, key, entry))
+            PyErr_Clear();
+          APSW_DB_MUTEX_LEAVE(self->db);
+          Py_DECREF(key);
+          retval=PySequence_List(PyTuple_GET_ITEM(entry, 0));
+          Py_DECREF(entry);
+          return retval;
+        }
+      rc->misses++;
+      if(entry)
+        {
+          rc->invalidations++;
+          PyDict_DelItem(rc->entries, key);
+        }
+      slots=resultcache_tables(rc, self->db, query);
+      if(slots && slots!=Py_None)
+        {
+          /* versions of databases seen for the first time */
+          resultcache_sync(rc, self->db);
+          versions=resultcache_versions(rc, slots);
+        }
+      generation=rc->generation;
+      APSW_DB_MUTEX_LEAVE(self->db);
+      if(!slots || (slots!=Py_None && !versions))
+        goto finally;
+      if(slots==Py_None || versions==Py_None)
+        rc->uncached++;
+    }
 
-  if(res!=SQLITE_OK && res!=SQLITE_NOTFOUND)
-    SET_EXC(res, self->db);
+  cursor=Connection_cursor(self);
+  if(!cursor)
+    goto finally;
+  executed=Call_PythonMethodV(cursor, "execute", 1, "(OO)", query, bindings);
+  if(!executed)
+    goto finally;
+  rows=Call_PythonMethodV(executed, "fetchall", 1, "()");
+  Py_DECREF(executed);
+  if(!rows)
+    goto finally;
 
- finally:
-  if(dbname) PyMem_Free(dbname);
+  if(!versions || versions==Py_None || self->resultcache!=rc)
+    {
+      retval=rows;
+      rows=NULL;
+      goto finally;
+    }
 
-  if(PyErr_Occurred())
-    return NULL;
+  /* an open transaction could be rolled back */
+  if(!sqlite3_get_autocommit(self->db))
+    rc->uncached++;
+  else
+    {
+      resultcache_evict(rc, rc->size-1);
+      entry=Py_BuildValue("(OLO)", rows, generation, versions);
+      if(!entry)
+        goto finally;
+      if(PyDict_SetItem(rc->entries, key, entry))
+        {
+          Py_DECREF(entry);
+          goto finally;
+        }
+      Py_DECREF(entry);
+    }
+  retval=PySequence_List(rows);
 
-  if(res==SQLITE_NOTFOUND)
-    Py_RETURN_FALSE;
-  Py_RETURN_TRUE;
+ finally:
+  Py_XDECREF(key);
+  Py_XDECREF(slots);
+  Py_XDECREF(versions);
+  Py_XDECREF(cursor);
+  Py_XDECREF(rows);
+  return retval;
 }
 
-/** .. method:: sqlite3pointer() -> int
-
-  Returns the underlying `sqlite3 *
-  <https://sqlite.org/c3ref/sqlite3.html>`_ for the connection. This
-  method is useful if there are other C level libraries in the same
-  process and you want them to use the APSW connection handle. The
-  value is returned as a number using :meth:`PyLong_FromVoidPtr` under the
-  hood. You should also ensure that you increment the reference count on
-  the :class:`Connection` for as long as the other libraries are using
-  the pointer.  It is also a very good idea to call
-  :meth:`sqlitelibversion` and ensure it is the same as the other
-  libraries.
-
+/** .. method:: resultcache_stats() -> dict
+
+  Returns counters for the result cache since it was enabled with
+  :meth:`setresultcache`.
+
+    size
+      Maximum number of entries
+    entries
+      How many results are currently stored
+    hits
+      Queries answered from the cache
+    misses
+      Queries that had to be run
+    invalidations
+      Misses where the stored results were out of date because a
+      table they read changed
+    evictions
+      Entries discarded to make space
+    uncached
+      Queries whose results couldn't be stored, such as those using
+      ``random()`` or run while a transaction was open
 */
-static PyObject*
-Connection_sqlite3pointer(Connection *self)
+static PyObject *
+Connection_resultcache_stats(Connection *self)
 {
+  ResultCache *rc;
+
   CHECK_USE(NULL);
   CHECK_CLOSED(self, NULL);
 
-  return PyLong_FromVoidPtr(self->db);
+  rc=self->resultcache;
+  return Py_BuildValue("{s: i, s: n, s: L, s: L, s: L, s: L, s: L}",
+                       "size", rc?rc->size:0,
+                       "entries", rc?PyDict_Size(rc->entries):(Py_ssize_t)0,
+                       "hits", rc?rc->hits:(sqlite3_int64)0,
+                       "misses", rc?rc->misses:(sqlite3_int64)0,
+                       "invalidations", rc?rc->invalidations:(sqlite3_int64)0,
+                       "evictions", rc?rc->evictions:(sqlite3_int64)0,
+                       "uncached", rc?rc->uncached:(sqlite3_int64)0);
 }
 
-/** .. method:: wal_autocheckpoint(n)
-
-    Sets how often the :ref:`wal` checkpointing is run.
+/** .. method:: setchangecapture(size, oncommit=None)
+
+  Records the rows changed by this connection in a native ring buffer
+  of *size* records.  The update hook appends a record without
+  acquiring the GIL or calling any Python code so bulk changes are not
+  slowed.  Records of a transaction become available once it commits
+  and are discarded if it rolls back.  Use :meth:`drainchanges` to
+  remove them in batches, or supply *oncommit* which is called with a
+  list of the records each time a transaction with changes commits::
+
+    def invalidate(changes):
+        for op, dbname, table, rowid in changes:
+            cache.discard((table, rowid))
+
+    connection.setchangecapture(100000, invalidate)
+
+  Each record is a tuple of the same values the :meth:`update hook
+  <setupdatehook>` gets - the operation (:const:`SQLITE_INSERT`,
+  :const:`SQLITE_DELETE` or :const:`SQLITE_UPDATE`), database name,
+  table name and rowid.
+
+  When the buffer is full the oldest records are overwritten and
+  counted as lost in :meth:`changecapture_stats`, so a consumer that
+  must not miss changes should check it and treat everything as
+  changed if it increases.  Records of a statement that fails are
+  discarded even if the transaction continues, including rows an ``OR
+  FAIL`` conflict clause keeps.  Changes undone by `ROLLBACK TO
+  <https://sqlite.org/lang_savepoint.html>`__ a savepoint are still
+  reported.  The same limitations as the update hook apply, such as
+  WITHOUT ROWID tables and the truncate optimization not being
+  reported.
+
+  *oncommit* is called once the commit has completed, after the
+  statement that committed finishes, and must not use this
+  connection.  If the commit fails (for example with
+  :exc:`BusyError`) the records are kept until the transaction
+  commits or rolls back.  Exceptions in it are reported as
+  unraisable.
+
+  :param size: How many records are kept.  Zero disables capture.
+    Any records not yet drained are discarded when this is called.
+  :param oncommit: Called with a list of the committed records
+    instead of them being kept for :meth:`drainchanges`.
+
+  It can be used at the same time as :meth:`setupdatehook`,
+  :meth:`setcommithook` and :meth:`setrollbackhook`.
 
-    :param n: A number representing the checkpointing interval or
-      zero/negative to disable auto checkpointing.
+  .. seealso::
 
-   -* sqlite3_wal_autocheckpoint
+    * :meth:`drainchanges`
+    * :meth:`changecapture_stats`
 */
 static PyObject *
-Connection_wal_autocheckpoint(Connection *self, PyObject *arg)
+Connection_setchangecapture(Connection *self, PyObject *args)
 {
-  long v;
-  int res;
+  Py_ssize_t size;
+  PyObject *oncommit=Py_None;
+  ChangeCapture *cc=NULL, *old;
+
   CHECK_USE(NULL);
   CHECK_CLOSED(self, NULL);
 
-  if(!PyIntLong_Check(arg))
-    return PyErr_Format(PyExc_TypeError, "Parameter must be a number");
-  v=PyIntLong_AsLong(arg);
-
-  APSW_FAULT_INJECT(WalAutocheckpointFails,
-		    PYSQLITE_CON_CALL(res=sqlite3_wal_autocheckpoint(self->db, (int)v)),
-		    res=SQLITE_IOERR);
-
-  SET_EXC(res, self->db);
-
-  /* done */
-  if (res==SQLITE_OK)
-    Py_RETURN_NONE;
-  return NULL;
-}
+  if(!PyArg_ParseTuple(args, "n|O:setchangecapture(size, oncommit=None)", &size, &oncommit))
+    return NULL;
 
-/** .. method:: wal_checkpoint(dbname=None, mode=apsw.SQLITE_CHECKPOINT_PASSIVE) -> ( int, int )
+  if(size<0)
+    return PyErr_Format(PyExc_ValueError, "size must be zero or more");
+  if(oncommit!=Py_None && !PyCallable_Check(oncommit))
+    return PyErr_Format(PyExc_TypeError, "oncommit must be callable");
+  if(self->changecapture && self->changecapture->notifying)
+    return PyErr_Format(ExcThreadingViolation, "Change capture can't be changed from its oncommit callable");
 
-    Does a WAL checkpoint.  Has no effect if the database(s) are not in WAL mode.
+  if(size)
+    {
+      APSW_FAULT_INJECT(ChangeCaptureAllocFails, cc=PyMem_Malloc(sizeof(ChangeCapture)), cc=NULL);
+      if(!cc)
+        return PyErr_NoMemory();
+      memset(cc, 0, sizeof(ChangeCapture));
+      cc->records=PyMem_New(ChangeCaptureRecord, size);
+      if(!cc->records)
+        {
+          PyMem_Free(cc);
+          return PyErr_NoMemory();
+        }
+      cc->size=size;
+      if(oncommit!=Py_None)
+        {
+          Py_INCREF(oncommit);
+          cc->oncommit=oncommit;
+        }
+    }
 
-    :param dbname:  The name of the database or all databases if None
+  old=self->changecapture;
+  self->changecapture=cc;
+  PYSQLITE_VOID_CALL(sqlite3_update_hook(self->db, (cc || self->updatehook || self->resultcache)?updatecb:NULL, self));
+  PYSQLITE_VOID_CALL(sqlite3_commit_hook(self->db, (cc || self->commithook)?commithookcb:NULL, self));
+  PYSQLITE_VOID_CALL(sqlite3_rollback_hook(self->db, (cc || self->rollbackhook)?rollbackhookcb:NULL, self));
+  if(old)
+    changecapture_free(old);
 
-    :param mode: One of the `checkpoint modes <https://sqlite.org/c3ref/wal_checkpoint_v2.html>`__.
+  Py_RETURN_NONE;
+}
 
-    :return: A tuple of the size of the WAL log in frames and the
-       number of frames checkpointed as described in the
-       `documentation
-       <https://sqlite.org/c3ref/wal_checkpoint_v2.html>`__.
+/** .. method:: drainchanges(max=-1) -> list
 
-  -* sqlite3_wal_checkpoint_v2
+  Removes and returns up to *max* (all if negative) of the oldest
+  committed records captured since :meth:`setchangecapture`, as a list
+  of (operation, database name, table name, rowid) tuples.  The list
+  is empty if change capture is not enabled.
 */
 static PyObject *
-Connection_wal_checkpoint(Connection *self, PyObject *args, PyObject *kwargs)
+Connection_drainchanges(Connection *self, PyObject *args)
 {
-  static char *kwlist[]={"dbname", "mode", NULL};
-  int res;
-  char *dbname=NULL;
-  int mode=SQLITE_CHECKPOINT_PASSIVE;
-  int nLog=0, nCkpt=0;
+  sqlite3_int64 max=-1;
+  PyObject *res;
 
   CHECK_USE(NULL);
   CHECK_CLOSED(self, NULL);
 
-  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|esi:wal_checkpoint(dbname=None)",
-				  kwlist, STRENCODING, &dbname, &mode))
+  if(!PyArg_ParseTuple(args, "|L:drainchanges(max=-1)", &max))
     return NULL;
 
-  APSW_FAULT_INJECT(WalCheckpointFails,
-		    PYSQLITE_CON_CALL(res=sqlite3_wal_checkpoint_v2(self->db, dbname, mode, &nLog, &nCkpt)),
-		    res=SQLITE_IOERR);
+  if(!self->changecapture)
+    return PyList_New(0);
 
-  SET_EXC(res, self->db);
-  PyMem_Free(dbname);
-  /* done */
-  if (res==SQLITE_OK)
-    return Py_BuildValue("ii", nLog, nCkpt);
-  return NULL;
+  changecapture_settle(self);
+  APSW_DB_MUTEX_ENTER(self->db);
+  res=changecapture_drain(self->changecapture, max);
+  APSW_DB_MUTEX_LEAVE(self->db);
+  return res;
 }
 
+/** .. method:: changecapture_stats() -> dict
+
+  Returns counters for change capture since it was enabled with
+  :meth:`setchangecapture`.
+
+    size
+      Maximum number of records kept
+    captured
+      Rows changed
+    lost
+      Records overwritten before being drained, or not recorded
+      because there were too many different tables
+    rolledback
+      Records discarded because their transaction rolled back or
+      their statement failed
+    pending
+      Committed records waiting to be drained
+    uncommitted
+      Records of the open transaction
+*/
+static PyObject *
+Connection_changecapture_stats(Connection *self)
+{
+  ChangeCapture *cc;
+  PyObject *res;
 
-#ifdef EXPERIMENTAL
-
-static struct sqlite3_module apsw_vtable_module;
-static void apswvtabFree(void *context);
+  CHECK_USE(NULL);
+  CHECK_CLOSED(self, NULL);
 
-/** .. method:: createmodule(name, datasource)
+  cc=self->changecapture;
+  if(!cc)
+    return Py_BuildValue("{s: i, s: i, s: i, s: i, s: i, s: i}", "size", 0, "captured", 0, "lost", 0,
+                         "rolledback", 0, "pending", 0, "uncommitted", 0);
+
+  changecapture_settle(self);
+  APSW_DB_MUTEX_ENTER(self->db);
+  res=Py_BuildValue("{s: L, s: L, s: L, s: L, s: L, s: L}",
+                    "size", cc->size,
+                    "captured", cc->captured,
+                    "lost", cc->lost,
+                    "rolledback", cc->rolledback,
+                    "pending", cc->committed-cc->tail,
+                    "uncommitted", cc->head-cc->committed);
+  APSW_DB_MUTEX_LEAVE(self->db);
+  return res;
+}
 
-    Registers a virtual table.  See :ref:`virtualtables` for details.
+/** .. method:: prepare(statement, persistent=False) -> PreparedStatement
 
-    .. seealso::
+  Compiles a single SQL statement returning a
+  :class:`PreparedStatement` which you can supply to
+  :meth:`Cursor.execute` and :meth:`Cursor.executemany` instead of the
+  text.  The statement is kept until the PreparedStatement is closed
+  and is never evicted from the :ref:`statement cache
+  <statementcache>`.  See :ref:`preparedstatements`.
 
-       * :ref:`Example <example-vtable>`
+  :param statement: The SQL text.  :exc:`ValueError` is raised if
+    there is more than one statement.
+  :param persistent: If true then SQLite is told the statement will be
+    used many times.  This is ignored for SQLite versions before 3.20.
 
-    -* sqlite3_create_module_v2
+  -* sqlite3_prepare_v3
 */
 static PyObject *
-Connection_createmodule(Connection *self, PyObject *args)
+Connection_prepare(Connection *self, PyObject *args)
 {
-  char *name=NULL;
-  PyObject *datasource=NULL;
-  vtableinfo *vti;
-  int res;
+  struct APSWPrepared *apswprepared=0;
+  APSWStatement *statement=0;
+  PyObject *query, *weakref;
+  int persistent=0;
 
   CHECK_USE(NULL);
   CHECK_CLOSED(self, NULL);
 
-  if(!PyArg_ParseTuple(args, "esO:createmodule(name, datasource)", STRENCODING, &name, &datasource))
+  if(!PyArg_ParseTuple(args, "O|i:prepare(statement, persistent=False)", &query, &persistent))
     return NULL;
 
-  Py_INCREF(datasource);
-  vti=PyMem_Malloc(sizeof(vtableinfo));
-  vti->connection=self;
-  vti->datasource=datasource;
-
-  /* SQLite is really finnicky.  Note that it calls the destructor on
-     failure  */
-  APSW_FAULT_INJECT(CreateModuleFail,
-                    PYSQLITE_CON_CALL((res=sqlite3_create_module_v2(self->db, name, &apsw_vtable_module, vti, apswvtabFree), vti=NULL)),
-                    res=SQLITE_IOERR);
-  PyMem_Free(name);
-  SET_EXC(res, self->db);
+  INUSE_CALL(statement=statementcache_preparepinned(self->stmtcache, query, persistent));
+  if(!statement)
+    {
+      AddTraceBackHere(__FILE__, __LINE__, "Connection.prepare", "{s: O}", "statement", query);
+      return NULL;
+    }
 
-  if(res!=SQLITE_OK)
+  APSW_FAULT_INJECT(PreparedAllocFails, apswprepared=PyObject_New(struct APSWPrepared, &APSWPreparedType), (PyErr_NoMemory(), apswprepared=NULL));
+  if(!apswprepared)
     {
-      if(vti)
-	apswvtabFree(vti);
+      Py_DECREF(statement);
       return NULL;
     }
 
-  Py_RETURN_NONE;
+  APSWPrepared_init(apswprepared, self, statement);
+  weakref=PyWeakref_NewRef((PyObject*)apswprepared, self->dependent_remove);
+  PyList_Append(self->dependents, weakref);
+  Py_DECREF(weakref);
+  return (PyObject*)apswprepared;
 }
 
-/** .. method:: overloadfunction(name, nargs)
-
-  Registers a placeholder function so that a virtual table can provide an implementation via
-  :meth:`VTTable.FindFunction`.
+#ifdef SQLITE_ENABLE_SESSION
+/** .. method:: session(schema="main") -> Session
 
-  :param name: Function name
-  :param nargs: How many arguments the function takes
+  Returns a :class:`Session` that records changes made to the named
+  database.  Call :meth:`Session.attach` to choose which tables.  See
+  :ref:`session`.
 
-  Due to :cvstrac:`3507` underlying errors will not be returned.
+  .. note::
 
-  -* sqlite3_overload_function
+    This is only present if SQLite was compiled with the session
+    extension.
 */
-static PyObject*
-Connection_overloadfunction(Connection *self, PyObject *args)
+static PyObject *
+Connection_session(Connection *self, PyObject *args)
 {
-  char *name;
-  int nargs, res;
+  struct APSWSession *apswsession=0;
+  sqlite3_session *session=0;
+  char *schema=NULL;
+  PyObject *weakref;
+  int res;
 
   CHECK_USE(NULL);
   CHECK_CLOSED(self, NULL);
 
-  if(!PyArg_ParseTuple(args, "esi:overloadfunction(name, nargs)", STRENCODING, &name, &nargs))
+  if(!PyArg_ParseTuple(args, "|es:session(schema=\"main\")", STRENCODING, &schema))
     return NULL;
 
-  APSW_FAULT_INJECT(OverloadFails,
-                    PYSQLITE_CON_CALL(res=sqlite3_overload_function(self->db, name, nargs)),
+  APSW_FAULT_INJECT(SessionCreateFails,
+                    PYSQLITE_CON_CALL(res=sqlite3session_create(self->db, schema?schema:"main", &session)),
                     res=SQLITE_NOMEM);
-  PyMem_Free(name);
-
+  PyMem_Free(schema);
   SET_EXC(res, self->db);
+  if(res!=SQLITE_OK)
+    {
+      assert(!session);
+      return NULL;
+    }
 
-  if(res)
-    return NULL;
+  apswsession=PyObject_New(struct APSWSession, &APSWSessionType);
+  if(!apswsession)
+    {
+      PYSQLITE_VOID_CALL(sqlite3session_delete(session));
+      return NULL;
+    }
 
-  Py_RETURN_NONE;
+  APSWSession_init(apswsession, self, session);
+  weakref=PyWeakref_NewRef((PyObject*)apswsession, self->dependent_remove);
+  PyList_Append(self->dependents, weakref);
+  Py_DECREF(weakref);
+  return (PyObject*)apswsession;
 }
 
-#endif
+/* The callables given to Connection.applychangeset */
+typedef struct {
+  PyObject *conflict;
+  PyObject *filter;
+} ChangesetApply;
 
-/** .. method:: setexectrace(callable)
+static int
+applychangeset_filtercb(void *context, const char *table)
+{
+  ChangesetApply *apply=(ChangesetApply*)context;
+  PyGILState_STATE gilstate;
+  PyObject *retval=NULL;
+  int ok=0;
 
-  *callable* is called with the cursor, statement and bindings for
-  each :meth:`~Cursor.execute` or :meth:`~Cursor.executemany` on this
-  Connection, unless the :class:`Cursor` installed its own
-  tracer. Your execution tracer can also abort execution of a
-  statement.
+  gilstate=PyGILState_Ensure();
 
-  If *callable* is :const:`None` then any existing execution tracer is
-  removed.
+  if(PyErr_Occurred())
+    goto finally;  /* skip everything due to outstanding exception */
 
-  .. seealso::
+  retval=PyObject_CallFunction(apply->filter, "(O&)", convertutf8string, table);
+  if(!retval)
+    {
+      AddTraceBackHere(__FILE__, __LINE__, "Connection.applychangeset.filter", "{s: s}", "table", table);
+      goto finally;
+    }
+  ok=PyObject_IsTrue(retval);
+  if(ok<0)
+    ok=0;
 
-    * :ref:`tracing`
-    * :ref:`rowtracer`
-    * :meth:`Cursor.setexectrace`
-*/
+ finally:
+  Py_XDECREF(retval);
+  PyGILState_Release(gilstate);
+  return ok;
+}
 
+/* Returns a tuple of the column values from one of the changeset
+   iterator accessors.  Values not present (eg unchanged columns of an
+   update) are None. */
 static PyObject *
-Connection_setexectrace(Connection *self, PyObject *func)
+applychangeset_values(sqlite3_changeset_iter *iter, int ncols, int (*get)(sqlite3_changeset_iter*, int, sqlite3_value**))
 {
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self, NULL);
+  PyObject *values;
+  int i, res;
 
-  if(func!=Py_None && !PyCallable_Check(func))
+  values=PyTuple_New(ncols);
+  if(!values)
+    return NULL;
+
+  for(i=0; i<ncols; i++)
     {
-      PyErr_SetString(PyExc_TypeError, "parameter must be callable");
-      return NULL;
-    }
+      sqlite3_value *value=NULL;
+      PyObject *item;
 
-  if(func!=Py_None)
-    Py_INCREF(func);
-  Py_XDECREF(self->exectrace);
-  self->exectrace=(func==Py_None)?0:func;
+      res=get(iter, i, &value);
+      if(res!=SQLITE_OK)
+        {
+          SET_EXC(res, NULL);
+          goto error;
+        }
+      if(value)
+        item=convert_value_to_pyobject(value);
+      else
+        {
+          item=Py_None;
+          Py_INCREF(item);
+        }
+      if(!item)
+        goto error;
+      PyTuple_SET_ITEM(values, i, item);
+    }
+  return values;
 
-  Py_RETURN_NONE;
+ error:
+  Py_DECREF(values);
+  return NULL;
 }
 
+static int
+applychangeset_conflictcb(void *context, int conflict, sqlite3_changeset_iter *iter)
+{
+  ChangesetApply *apply=(ChangesetApply*)context;
+  PyGILState_STATE gilstate;
+  PyObject *retval=NULL, *table=NULL, *pyop=NULL, *old=NULL, *new=NULL, *conflicting=NULL;
+  const char *tablename=NULL;
+  int code=SQLITE_CHANGESET_ABORT, ncols=0, op=0, indirect=0, res;
 
-/** .. method:: setrowtrace(callable)
-
-  *callable* is called with the cursor and row being returned for
-  :class:`cursors <Cursor>` associated with this Connection, unless
-  the Cursor installed its own tracer.  You can change the data that
-  is returned or cause the row to be skipped altogether.
-
-  If *callable* is :const:`None` then any existing row tracer is
-  removed.
-
-  .. seealso::
+  if(!apply->conflict)
+    return SQLITE_CHANGESET_ABORT;
 
-    * :ref:`tracing`
-    * :ref:`rowtracer`
-    * :meth:`Cursor.setexectrace`
-*/
+  gilstate=PyGILState_Ensure();
 
-static PyObject *
-Connection_setrowtrace(Connection *self, PyObject *func)
-{
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self, NULL);
+  if(PyErr_Occurred())
+    goto finally;  /* abandon due to outstanding exception */
 
-  if(func!=Py_None && !PyCallable_Check(func))
+  /* the iterator doesn't point to a row for foreign key conflicts */
+  if(conflict!=SQLITE_CHANGESET_FOREIGN_KEY)
     {
-      PyErr_SetString(PyExc_TypeError, "parameter must be callable");
-      return NULL;
+      res=sqlite3changeset_op(iter, &tablename, &ncols, &op, &indirect);
+      if(res!=SQLITE_OK)
+        {
+          SET_EXC(res, NULL);
+          goto finally;
+        }
+      table=convertutf8string(tablename);
+      pyop=PyInt_FromLong(op);
+      if(!table || !pyop)
+        goto finally;
+      if(op!=SQLITE_INSERT && !(old=applychangeset_values(iter, ncols, sqlite3changeset_old)))
+        goto finally;
+      if(op!=SQLITE_DELETE && !(new=applychangeset_values(iter, ncols, sqlite3changeset_new)))
+        goto finally;
+      if((conflict==SQLITE_CHANGESET_DATA || conflict==SQLITE_CHANGESET_CONFLICT)
+         && !(conflicting=applychangeset_values(iter, ncols, sqlite3changeset_conflict)))
+        goto finally;
     }
 
-  if(func!=Py_None)
-    Py_INCREF(func);
-  Py_XDECREF(self->rowtrace);
-  self->rowtrace=(func==Py_None)?0:func;
+  retval=PyObject_CallFunction(apply->conflict, "(iOOOOO)", conflict,
+                               table?table:Py_None, pyop?pyop:Py_None,
+                               old?old:Py_None, new?new:Py_None,
+                               conflicting?conflicting:Py_None);
+  if(!retval)
+    {
+      AddTraceBackHere(__FILE__, __LINE__, "Connection.applychangeset.conflict", "{s: i, s: O}",
+                       "reason", conflict, "table", table?table:Py_None);
+      goto finally;
+    }
+  if(!PyIntLong_Check(retval))
+    {
+      PyErr_Format(PyExc_TypeError, "conflict must return SQLITE_CHANGESET_OMIT, SQLITE_CHANGESET_REPLACE or SQLITE_CHANGESET_ABORT");
+      goto finally;
+    }
+  code=(int)PyIntLong_AsLong(retval);
+  if(code!=SQLITE_CHANGESET_OMIT && code!=SQLITE_CHANGESET_REPLACE && code!=SQLITE_CHANGESET_ABORT)
+    {
+      PyErr_Format(PyExc_ValueError, "conflict returned %d which is not SQLITE_CHANGESET_OMIT, SQLITE_CHANGESET_REPLACE or SQLITE_CHANGESET_ABORT", code);
+      code=SQLITE_CHANGESET_ABORT;
+    }
 
-  Py_RETURN_NONE;
+ finally:
+  Py_XDECREF(retval);
+  Py_XDECREF(table);
+  Py_XDECREF(pyop);
+  Py_XDECREF(old);
+  Py_XDECREF(new);
+  Py_XDECREF(conflicting);
+  PyGILState_Release(gilstate);
+  return code;
 }
 
-/** .. method:: getexectrace() -> callable or None
-
-  Returns the currently installed (via :meth:`~Connection.setexectrace`)
-  execution tracer.
+/** .. method:: applychangeset(changeset, conflict=None, filter=None)
+
+  Makes the changes in a changeset or patchset from
+  :meth:`Session.changeset` or :meth:`Session.patchset` to the
+  database, all in one transaction.  See :ref:`session`.
+
+  :param changeset: The bytes of the changeset.
+  :param conflict: Called when a change can't be made as recorded, with
+    six parameters - the reason which is one of the
+    :data:`conflict constants <apsw.mapping_changeset_conflict>`, the table
+    name, the operation (:const:`SQLITE_INSERT`, :const:`SQLITE_UPDATE`
+    or :const:`SQLITE_DELETE`), and tuples of the old values, new
+    values and the values of the row currently in the database.  The
+    tuples are None when they don't apply to the operation or reason,
+    and unchanged columns of an update are None in the new values.
+    For foreign key conflicts only the reason is supplied.  Return
+    :const:`SQLITE_CHANGESET_OMIT` to skip the change,
+    :const:`SQLITE_CHANGESET_REPLACE` to overwrite the row (only for
+    :const:`SQLITE_CHANGESET_DATA` and
+    :const:`SQLITE_CHANGESET_CONFLICT`) or
+    :const:`SQLITE_CHANGESET_ABORT` to roll back all the changes and
+    raise :exc:`AbortError`.  If it is None then any conflict aborts.
+  :param filter: Called with each table name in the changeset.
+    Changes are only made to tables it returns True for.  If it is
+    None then all tables are changed.
 
-  .. seealso::
+  .. note::
 
-    * :ref:`tracing`
+    This is only present if SQLite was compiled with the session
+    extension.
 */
 static PyObject *
-Connection_getexectrace(Connection *self)
+Connection_applychangeset(Connection *self, PyObject *args, PyObject *kwds)
 {
-  PyObject *ret;
+  static char *kwlist[]={"changeset", "conflict", "filter", NULL};
+  PyObject *changeset, *conflict=Py_None, *filter=Py_None;
+  ChangesetApply apply;
+  const void *buffer;
+  int size, res, errcode;
 
   CHECK_USE(NULL);
   CHECK_CLOSED(self, NULL);
 
-  ret=(self->exectrace)?(self->exectrace):Py_None;
-  Py_INCREF(ret);
-  return ret;
-}
-
-/** .. method:: getrowtrace() -> callable or None
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO:applychangeset(changeset, conflict=None, filter=None)", kwlist,
+                                  &changeset, &conflict, &filter))
+    return NULL;
 
-  Returns the currently installed (via :meth:`~Connection.setrowtrace`)
-  row tracer.
+  if((conflict!=Py_None && !PyCallable_Check(conflict)) || (filter!=Py_None && !PyCallable_Check(filter)))
+    return PyErr_Format(PyExc_TypeError, "conflict and filter must be callable or None");
 
-  .. seealso::
+  if(session_getchangeset(changeset, &buffer, &size))
+    return NULL;
 
-    * :ref:`tracing`
-*/
-static PyObject *
-Connection_getrowtrace(Connection *self)
-{
-  PyObject *ret;
+  apply.conflict=(conflict!=Py_None)?conflict:NULL;
+  apply.filter=(filter!=Py_None)?filter:NULL;
 
-  CHECK_USE(NULL);
-  CHECK_CLOSED(self, NULL);
+  PYSQLITE_CON_CALL((res=sqlite3changeset_apply(self->db, size, (void*)buffer, apply.filter?applychangeset_filtercb:NULL,
+                                                applychangeset_conflictcb, &apply), errcode=sqlite3_errcode(self->db)));
+  /* SQLite doesn't set an error message for conflicts or a bad changeset */
+  if(res!=SQLITE_OK && errcode==SQLITE_OK)
+    apsw_set_errmsg((res==SQLITE_ABORT)?"A conflict abandoned the changeset":"The changeset could not be applied");
+  SET_EXC(res, self->db);
+  if(PyErr_Occurred())
+    return NULL;
 
-  ret=(self->rowtrace)?(self->rowtrace):Py_None;
-  Py_INCREF(ret);
-  return ret;
+  Py_RETURN_NONE;
 }
+#endif
 
 /** .. method:: __enter__() -> context
 
@@ -3120,6 +6037,7 @@ static int connection_trace_and_exec(Connection *self, int release, int sp, int
   PYSQLITE_CON_CALL(res=sqlite3_exec(self->db, sql, 0, 0, 0));
   SET_EXC(res, self->db);
   sqlite3_free(sql);
+  changecapture_settle(self);
   assert (res==SQLITE_OK || PyErr_Occurred());
   return res==SQLITE_OK;
 }
@@ -3371,6 +6289,10 @@ static PyMethodDef Connection_methods[] = {
    "Creates an aggregate function"},
   {"setbusyhandler", (PyCFunction)Connection_setbusyhandler, METH_O,
    "Sets the busy handler"},
+  {"setbusybackoff", (PyCFunction)Connection_setbusybackoff, METH_VARARGS|METH_KEYWORDS,
+   "Sets a native busy handler with exponential backoff"},
+  {"busystats", (PyCFunction)Connection_busystats, METH_VARARGS,
+   "Returns busy handler counters"},
   {"changes", (PyCFunction)Connection_changes, METH_NOARGS,
    "Returns the number of rows changed by last query"},
   {"totalchanges", (PyCFunction)Connection_totalchanges, METH_NOARGS,
@@ -3417,6 +6339,18 @@ static PyMethodDef Connection_methods[] = {
   {"backup", (PyCFunction)Connection_backup, METH_VARARGS,
    "starts a backup"},
 #endif
+#if defined(SQLITE_SERIALIZE_NOCOPY) && !defined(SQLITE_OMIT_DESERIALIZE)
+  {"serialize", (PyCFunction)Connection_serialize, METH_VARARGS,
+   "Returns the contents of a database"},
+  {"deserialize", (PyCFunction)Connection_deserialize, METH_VARARGS|METH_KEYWORDS,
+   "Replaces a database with supplied contents"},
+#endif
+  {"setlatencyprofile", (PyCFunction)Connection_setlatencyprofile, METH_VARARGS,
+   "Sets if statement latencies are recorded"},
+  {"getlatencyprofile", (PyCFunction)Connection_getlatencyprofile, METH_NOARGS,
+   "Returns if statement latencies are recorded"},
+  {"latencyprofile", (PyCFunction)Connection_latencyprofile, METH_VARARGS,
+   "Returns the recorded statement latencies"},
   {"filecontrol", (PyCFunction)Connection_filecontrol, METH_VARARGS,
    "file control"},
   {"sqlite3pointer", (PyCFunction)Connection_sqlite3pointer, METH_NOARGS,
@@ -3427,8 +6361,44 @@ static PyMethodDef Connection_methods[] = {
    "Installs a function called for every row returned"},
   {"getexectrace", (PyCFunction)Connection_getexectrace, METH_NOARGS,
    "Returns the current exec tracer function"},
+  {"setrowfactory", (PyCFunction)Connection_setrowfactory, METH_VARARGS,
+   "Sets how rows are returned"},
+  {"getrowfactory", (PyCFunction)Connection_getrowfactory, METH_NOARGS,
+   "Returns how rows are returned"},
+  {"setautoparameterize", (PyCFunction)Connection_setautoparameterize, METH_VARARGS,
+   "Sets if literals are turned into bindings"},
+  {"getautoparameterize", (PyCFunction)Connection_getautoparameterize, METH_NOARGS,
+   "Returns if literals are turned into bindings"},
   {"getrowtrace", (PyCFunction)Connection_getrowtrace, METH_NOARGS,
    "Returns the current row tracer function"},
+  {"cache_stats", (PyCFunction)Connection_cache_stats, METH_NOARGS,
+   "Returns statement cache statistics"},
+  {"cache_profile", (PyCFunction)Connection_cache_profile, METH_VARARGS,
+   "Returns the statements doing the most work"},
+  {"cache_entries", (PyCFunction)Connection_cache_entries, METH_NOARGS,
+   "Returns the queries in the statement cache"},
+  {"setresultcache", (PyCFunction)Connection_setresultcache, METH_VARARGS,
+   "Enables the query result cache"},
+  {"getresultcache", (PyCFunction)Connection_getresultcache, METH_NOARGS,
+   "Returns the size of the query result cache"},
+  {"cachedquery", (PyCFunction)Connection_cachedquery, METH_VARARGS,
+   "Returns the rows of a query using the result cache"},
+  {"resultcache_stats", (PyCFunction)Connection_resultcache_stats, METH_NOARGS,
+   "Returns query result cache statistics"},
+  {"setchangecapture", (PyCFunction)Connection_setchangecapture, METH_VARARGS,
+   "Records changed rows in a native ring buffer"},
+  {"drainchanges", (PyCFunction)Connection_drainchanges, METH_VARARGS,
+   "Removes and returns committed changed row records"},
+  {"changecapture_stats", (PyCFunction)Connection_changecapture_stats, METH_NOARGS,
+   "Returns change capture statistics"},
+  {"prepare", (PyCFunction)Connection_prepare, METH_VARARGS,
+   "Compiles a statement that stays prepared"},
+#ifdef SQLITE_ENABLE_SESSION
+  {"session", (PyCFunction)Connection_session, METH_VARARGS,
+   "Records changes to make a changeset"},
+  {"applychangeset", (PyCFunction)Connection_applychangeset, METH_VARARGS|METH_KEYWORDS,
+   "Applies a changeset to the database"},
+#endif
   {"__enter__", (PyCFunction)Connection_enter, METH_NOARGS,
    "Context manager entry"},
   {"__exit__", (PyCFunction)Connection_exit, METH_VARARGS,
@@ -137,7 +137,7 @@ struct APSWCursor {
   PyObject *bindings;              /* dict or sequence */
   Py_ssize_t bindingsoffset;       /* for sequence tracks how far along we are when dealing with multiple statements */
 
-  /* iterator for executemany, original query string */
+  /* iterator for executemany, original query string (or PreparedStatement) */
   PyObject *emiter;
   PyObject *emoriginalquery;
 
@@ -145,6 +145,13 @@ struct APSWCursor {
   PyObject *exectrace;
   PyObject *rowtrace;
 
+  /* ROWFACTORY_* or -1 to use the connection's */
+  int rowfactory;
+
+  /* from the timeout and cancel arguments of execute - see cancel.c */
+  sqlite3_int64 deadline;          /* apsw_now_ns() value, zero for none */
+  CancellationToken *cancel;
+
   /* weak reference support */
   PyObject *weakreflist;
 
@@ -162,6 +169,59 @@ static PyTypeObject APSWCursorType;
 
 #define EXECTRACE  ( (self->exectrace && self->exectrace!=Py_None) ? self->exectrace : ( (self->exectrace==Py_None) ? 0 : self->connection->exectrace ) )
 
+#define ROWFACTORY ( (self->rowfactory>=0) ? self->rowfactory : self->connection->rowfactory )
+
+/* Steps stmt for the cursor, with the database mutex held and the
+   GIL released.  The connection's progress handler checks the
+   deadline and cancellation token of the cursor making the step, so
+   they are installed here under the mutex as other cursors on the
+   connection could be stepping in other threads.  The previous ones
+   are restored since user defined functions can run queries.
+   *stopped is set to why the progress handler stopped the step.
+   Change capture records of a failed step are discarded.  The mark is
+   taken under the mutex too since other cursors can add records
+   between steps. */
+static int
+stepcursor(APSWCursor *self, sqlite3_stmt *stmt, int *stopped)
+{
+  Connection *connection=self->connection;
+  ChangeCapture *cc=connection->changecapture;
+  sqlite3_int64 mark=cc?cc->head:0, prevdeadline=connection->stepdeadline;
+  CancellationToken *prevcancel=connection->stepcancel;
+  int res, prevstopped=connection->stopped;
+
+  if(!stmt)
+    return SQLITE_DONE;
+
+  connection->stepdeadline=self->deadline;
+  connection->stepcancel=self->cancel;
+  connection->stopped=0;
+  PYSQLITE_HELD_CALL(res=sqlite3_step(stmt));
+  *stopped=connection->stopped;
+  connection->stepdeadline=prevdeadline;
+  connection->stepcancel=prevcancel;
+  connection->stopped=prevstopped;
+
+  /* a user defined function could have changed change capture */
+  if(cc && cc==connection->changecapture && res!=SQLITE_ROW && res!=SQLITE_DONE)
+    changecapture_stepfailed(cc, mark);
+  return res;
+}
+
+/* x must set res using stepcursor passing &stopped.  The cursor's
+   token is referenced while it is installed on the connection. */
+#define CURSOR_STEP(x)                                                  \
+  do {                                                                  \
+    int stopped=0;                                                      \
+    PyObject *steptoken=(PyObject*)self->cancel;                        \
+    Py_XINCREF(steptoken);                                              \
+    x;                                                                  \
+    Py_XDECREF(steptoken);                                              \
+    changecapture_settle(self->connection);                             \
+    if(stopped && res!=SQLITE_ROW && res!=SQLITE_DONE)                  \
+      cancel_raise(stopped);                                            \
+  } while(0)
+
 
 /* Do finalization and free resources.  Returns the SQLITE error code.  If force is 2 then don't raise any exceptions */
 static int
@@ -273,6 +333,9 @@ APSWCursor_close_internal(APSWCursor *self, int force)
   /* executemany iterator */
   Py_CLEAR(self->emiter);
 
+  self->deadline=0;
+  Py_CLEAR(self->cancel);
+
   /* no need for tracing */
   Py_CLEAR(self->exectrace);
   Py_CLEAR(self->rowtrace);
@@ -308,6 +371,9 @@ APSWCursor_init(APSWCursor *self, Connection *connection)
   self->emoriginalquery=0;
   self->exectrace=0;
   self->rowtrace=0;
+  self->rowfactory=-1;
+  self->deadline=0;
+  self->cancel=0;
   self->inuse=0;
   self->weakreflist=NULL;
   self->description_cache[0]=0;
@@ -459,6 +525,8 @@ APSWCursor_dobinding(APSWCursor *self, int arg, PyObject *obj)
      well. */
 
   int res=SQLITE_OK;
+  /* set when SQLite is using the memory of obj directly (SQLITE_STATIC) */
+  PyObject *bound=NULL;
 
   assert(!PyErr_Occurred());
 
@@ -484,6 +552,29 @@ APSWCursor_dobinding(APSWCursor *self, int arg, PyObject *obj)
       double v=PyFloat_AS_DOUBLE(obj);
       PYSQLITE_CUR_CALL(res=sqlite3_bind_double(self->statement->vdbestatement, arg, v));
     }
+#if PY_VERSION_HEX >= 0x03030000
+  else if (PyUnicode_Check(obj))
+    {
+      /* The utf8 representation is cached inside the string object
+         and lives as long as it does so SQLite can use it directly */
+      Py_ssize_t strbytes;
+      const char *strdata;
+
+      APSW_FAULT_INJECT(DoBindingUnicodeConversionFails,strdata=PyUnicode_AsUTF8AndSize(obj, &strbytes),strdata=(char*)PyErr_NoMemory());
+      if(!strdata)
+        return -1;
+#ifdef APSW_TEST_LARGE_OBJECTS
+      APSW_FAULT_INJECT(DoBindingLargeUnicode,,strbytes=0x001234567890L);
+#endif
+      if(strbytes>APSW_INT32_MAX)
+        {
+          SET_EXC(SQLITE_TOOBIG, NULL);
+          return -1;
+        }
+      PYSQLITE_CUR_CALL(res=sqlite3_bind_text(self->statement->vdbestatement, arg, strdata, strbytes, SQLITE_STATIC));
+      bound=obj;
+    }
+#else
   else if (PyUnicode_Check(obj))
     {
       const void *badptr=NULL;
@@ -509,6 +600,7 @@ APSWCursor_dobinding(APSWCursor *self, int arg, PyObject *obj)
           return -1;
         }
     }
+#endif
 #if PY_MAJOR_VERSION < 3
   else if (PyString_Check(obj))
     {
@@ -551,9 +643,23 @@ APSWCursor_dobinding(APSWCursor *self, int arg, PyObject *obj)
       else
 	{
 	  assert(lenval<APSW_INT32_MAX);
-	  PYSQLITE_CUR_CALL(res=sqlite3_bind_text(self->statement->vdbestatement, arg, val, lenval, SQLITE_TRANSIENT));
+	  PYSQLITE_CUR_CALL(res=sqlite3_bind_text(self->statement->vdbestatement, arg, val, lenval, SQLITE_STATIC));
+	  bound=obj;
 	}
     }
+#endif
+#if PY_MAJOR_VERSION >= 3
+  else if (PyBytes_CheckExact(obj))
+    {
+      /* bytes are immutable so SQLite can use the memory directly */
+      if(PyBytes_GET_SIZE(obj)>APSW_INT32_MAX)
+        {
+          SET_EXC(SQLITE_TOOBIG, NULL);
+          return -1;
+        }
+      PYSQLITE_CUR_CALL(res=sqlite3_bind_blob(self->statement->vdbestatement, arg, PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj), SQLITE_STATIC));
+      bound=obj;
+    }
 #endif
   else if (PyObject_CheckReadBuffer(obj))
     {
@@ -586,6 +692,10 @@ APSWCursor_dobinding(APSWCursor *self, int arg, PyObject *obj)
       SET_EXC(res, self->connection->db);
       return -1;
     }
+  /* keep obj alive while SQLite points at it and let go of whatever
+     this parameter was previously using */
+  if(bound || self->statement->nbound)
+    statementcache_setbound(self->statement, arg, bound);
   if(PyErr_Occurred())
     return -1;
   return 0;
@@ -595,7 +705,7 @@ APSWCursor_dobinding(APSWCursor *self, int arg, PyObject *obj)
 static int
 APSWCursor_dobindings(APSWCursor *self)
 {
-  int nargs, arg, res=-1, sz=0;
+  int nargs, arg, sz=0;
   PyObject *obj;
 
   assert(!PyErr_Occurred());
@@ -614,27 +724,20 @@ APSWCursor_dobindings(APSWCursor *self)
   /* a dictionary? */
   if (self->bindings && PyDict_Check(self->bindings))
     {
+      /* the names were made by statementcache_prepare */
+      PyObject *paramnames=self->statement->paramnames;
+
       for(arg=1;arg<=nargs;arg++)
         {
-	  PyObject *keyo=NULL;
-          const char *key;
-
-          PYSQLITE_CUR_CALL(key=sqlite3_bind_parameter_name(self->statement->vdbestatement, arg));
+	  PyObject *keyo=paramnames?PyTuple_GET_ITEM(paramnames, arg-1):Py_None;
 
-          if(!key)
+          if(keyo==Py_None)
             {
               PyErr_Format(ExcBindings, "Binding %d has no name, but you supplied a dict (which only has names).", arg-1);
               return -1;
             }
 
-	  assert(*key==':' || *key=='$');
-          key++; /* first char is a colon or dollar which we skip */
-
-	  keyo=PyUnicode_DecodeUTF8(key, strlen(key), NULL);
-	  if(!keyo) return -1;
-
 	  obj=PyDict_GetItem(self->bindings, keyo);
-	  Py_DECREF(keyo);
 
           if(!obj)
             /* this is where we could error on missing keys */
@@ -668,8 +771,6 @@ APSWCursor_dobindings(APSWCursor *self)
       return -1;
     }
 
-  res=SQLITE_OK;
-
   /* nb sqlite starts bind args at one not zero */
   for(arg=1;arg<=nargs;arg++)
     {
@@ -682,7 +783,6 @@ APSWCursor_dobindings(APSWCursor *self)
     }
 
   self->bindingsoffset+=nargs;
-  assert(res==0);
   return 0;
 }
 
@@ -764,17 +864,21 @@ APSWCursor_dorowtrace(APSWCursor *self, PyObject *retval)
   return PyObject_CallFunction(rowtrace, "OO", self, retval);
 }
 
-/* Returns a borrowed reference to self if all is ok, else NULL on error */
+/* Returns a borrowed reference to self if all is ok, else NULL on
+   error.  res is the result of a sqlite3_step already made by the
+   caller, or -1 to have the step made here. */
 static PyObject *
-APSWCursor_step(APSWCursor *self)
+APSWCursor_dostep(APSWCursor *self, int res)
 {
-  int res;
   int savedbindingsoffset=0; /* initialised to stop stupid compiler from whining */
 
   for(;;)
     {
-      assert(!PyErr_Occurred());
-      PYSQLITE_CUR_CALL(res=(self->statement->vdbestatement)?(sqlite3_step(self->statement->vdbestatement)):(SQLITE_DONE));
+      if(res<0)
+        {
+          assert(!PyErr_Occurred());
+          CURSOR_STEP(PYSQLITE_CUR_CALL(res=stepcursor(self, self->statement->vdbestatement, &stopped)));
+        }
 
       switch(res&0xff)
         {
@@ -806,6 +910,7 @@ APSWCursor_step(APSWCursor *self)
           if(res==SQLITE_SCHEMA && !PyErr_Occurred())
             {
               self->status=C_BEGIN;
+              res=-1;
               continue;
             }
           return NULL;
@@ -867,7 +972,7 @@ APSWCursor_step(APSWCursor *self)
         {
           /* we are going again in executemany mode */
           assert(self->emiter);
-          INUSE_CALL(self->statement=statementcache_prepare(self->connection->stmtcache, self->emoriginalquery, 1));
+          INUSE_CALL(self->statement=prepared_getstatement(self->connection, self->emoriginalquery, 1));
           res=(self->statement)?SQLITE_OK:SQLITE_ERROR;
         }
       else
@@ -909,6 +1014,7 @@ APSWCursor_step(APSWCursor *self)
         }
       assert(self->status==C_DONE);
       self->status=C_BEGIN;
+      res=-1;
     }
 
   /* you can't actually get here */
@@ -916,7 +1022,74 @@ APSWCursor_step(APSWCursor *self)
   return NULL;
 }
 
-/** .. method:: execute(statements[, bindings]) -> iterator
+static PyObject *
+APSWCursor_step(APSWCursor *self)
+{
+  return APSWCursor_dostep(self, -1);
+}
+
+/* Sets the deadline and cancellation token from the keyword arguments
+   of execute and executemany.  Returns -1 with an exception set on
+   error. */
+static int
+APSWCursor_limits(APSWCursor *self, PyObject *kwargs)
+{
+  PyObject *timeout=NULL, *cancel=NULL;
+  double seconds;
+
+  self->deadline=0;
+  Py_CLEAR(self->cancel);
+
+  if(!kwargs)
+    return 0;
+
+  timeout=PyDict_GetItemString(kwargs, "timeout");
+  cancel=PyDict_GetItemString(kwargs, "cancel");
+  if(PyDict_Size(kwargs)!=(timeout!=NULL)+(cancel!=NULL))
+    {
+      PyErr_Format(PyExc_TypeError, "The only keyword arguments are timeout and cancel");
+      return -1;
+    }
+
+  if(timeout && timeout!=Py_None)
+    {
+      seconds=PyFloat_AsDouble(timeout);
+      if(seconds==-1 && PyErr_Occurred())
+        return -1;
+      /* written so NaN fails */
+      if(!(seconds>=0 && seconds<=1000000000))
+        {
+          PyErr_Format(PyExc_ValueError, "timeout must be between 0 and 1000000000 seconds");
+          return -1;
+        }
+      self->deadline=apsw_now_ns()+(sqlite3_int64)(seconds*1000000000.0);
+    }
+
+  if(cancel && cancel!=Py_None)
+    {
+      if(Py_TYPE(cancel)!=&CancellationTokenType && !PyObject_TypeCheck(cancel, &CancellationTokenType))
+        {
+          PyErr_Format(PyExc_TypeError, "cancel must be a CancellationToken");
+          return -1;
+        }
+      if(((CancellationToken*)cancel)->cancelled)
+        {
+          cancel_raise(QUERY_CANCELLED);
+          return -1;
+        }
+      Py_INCREF(cancel);
+      self->cancel=(CancellationToken*)cancel;
+    }
+
+  if((self->deadline || self->cancel) && !self->connection->limits)
+    {
+      self->connection->limits=1;
+      progresshandler_install(self->connection);
+    }
+  return 0;
+}
+
+/** .. method:: execute(statements[, bindings, timeout=None, cancel=None]) -> iterator
 
     Executes the statements using the supplied bindings.  Execution
     returns when the first row is available or all statements have
@@ -924,8 +1097,14 @@ APSWCursor_step(APSWCursor *self)
 
     :param statements: One or more SQL statements such as ``select *
       from books`` or ``begin; insert into books ...; select
-      last_insert_rowid(); end``.
+      last_insert_rowid(); end``, or a :class:`PreparedStatement`
+      from this cursor's connection.
     :param bindings: If supplied should either be a sequence or a dictionary.  Each item must be one of the :ref:`supported types <types>`
+    :param timeout: Most seconds the statements can take including
+      getting the rows, after which :exc:`QueryCancelledError` is
+      raised.  See :ref:`cancellation`.
+    :param cancel: A :class:`CancellationToken` which stops the
+      statements with :exc:`QueryCancelledError` when cancelled.
 
     If you use numbered bindings in the query then supply a sequence.
     Any sequence will work including lists and iterators.  For
@@ -971,7 +1150,7 @@ APSWCursor_step(APSWCursor *self)
 
 */
 static PyObject *
-APSWCursor_execute(APSWCursor *self, PyObject *args)
+APSWCursor_execute(APSWCursor *self, PyObject *args, PyObject *kwargs)
 {
   int res;
   int savedbindingsoffset=-1;
@@ -994,6 +1173,9 @@ APSWCursor_execute(APSWCursor *self, PyObject *args)
   if(PyTuple_GET_SIZE(args)<1 || PyTuple_GET_SIZE(args)>2)
     return PyErr_Format(PyExc_TypeError, "Incorrect number of arguments.  execute(statements [,bindings])");
 
+  if(APSWCursor_limits(self, kwargs))
+    return NULL;
+
   query=PyTuple_GET_ITEM(args, 0);
   if (PyTuple_GET_SIZE(args)==2)
     if (PyTuple_GET_ITEM(args, 1)!=Py_None)
@@ -1013,7 +1195,39 @@ APSWCursor_execute(APSWCursor *self, PyObject *args)
 
   assert(!self->statement);
   assert(!PyErr_Occurred());
-  INUSE_CALL(self->statement=statementcache_prepare(self->connection->stmtcache, query, !!self->bindings));
+
+  if(!self->bindings && self->connection->autoparameterize && Py_TYPE(query)!=&APSWPreparedType)
+    {
+      PyObject *values=NULL, *normalized;
+
+      normalized=statementcache_normalize(self->connection->stmtcache, query, &values);
+      if(!normalized && PyErr_Occurred())
+        return NULL;
+      if(normalized)
+        {
+          INUSE_CALL(self->statement=prepared_getstatement(self->connection, normalized, 1));
+          APSWBuffer_XDECREF_unlikely(normalized);
+          if(self->statement)
+            {
+              self->bindings=values;
+              self->connection->stmtcache->st_normalized++;
+            }
+          else
+            {
+              Py_DECREF(values);
+              /* only a parse error, such as a literal where a binding
+                 isn't allowed, is retried with the original text */
+              if(!PyErr_ExceptionMatches(exc_descriptors[0].cls))
+                return NULL;
+              PyErr_Clear();
+              /* the original text counts its own miss */
+              self->connection->stmtcache->st_misses--;
+            }
+        }
+    }
+
+  if(!self->statement)
+    INUSE_CALL(self->statement=prepared_getstatement(self->connection, query, !!self->bindings));
   if (!self->statement)
     {
       AddTraceBackHere(__FILE__, __LINE__, "APSWCursor_execute.sqlite3_prepare", "{s: O, s: O}",
@@ -1053,7 +1267,7 @@ APSWCursor_execute(APSWCursor *self, PyObject *args)
   return retval;
 }
 
-/** .. method:: executemany(statements, sequenceofbindings)  -> iterator
+/** .. method:: executemany(statements, sequenceofbindings, timeout=None, cancel=None)  -> iterator
 
   This method is for when you want to execute the same statements over
   a sequence of bindings.  Conceptually it does this::
@@ -1072,11 +1286,14 @@ APSWCursor_execute(APSWCursor *self, PyObject *args)
 
   The return is the cursor itself which acts as an iterator.  Your
   statements can return data.  See :meth:`~Cursor.execute` for more
-  information.
+  information.  Using a :class:`PreparedStatement` avoids looking up
+  the statements in the cache for each binding.  *timeout* and
+  *cancel* apply to the whole sequence as described in
+  :ref:`cancellation`.
 */
 
 static PyObject *
-APSWCursor_executemany(APSWCursor *self, PyObject *args)
+APSWCursor_executemany(APSWCursor *self, PyObject *args, PyObject *kwargs)
 {
   int res;
   PyObject *retval=NULL;
@@ -1103,6 +1320,9 @@ APSWCursor_executemany(APSWCursor *self, PyObject *args)
   if(!PyArg_ParseTuple(args, "OO:executemany(statements, sequenceofbindings)", &query, &theiterable))
     return NULL;
 
+  if(APSWCursor_limits(self, kwargs))
+    return NULL;
+
   self->emiter=PyObject_GetIter(theiterable);
   if (!self->emiter)
     return PyErr_Format(PyExc_TypeError, "2nd parameter must be iterable");
@@ -1130,7 +1350,7 @@ APSWCursor_executemany(APSWCursor *self, PyObject *args)
   assert(!self->statement);
   assert(!PyErr_Occurred());
   assert(!self->statement);
-  INUSE_CALL(self->statement=statementcache_prepare(self->connection->stmtcache, query, 1));
+  INUSE_CALL(self->statement=prepared_getstatement(self->connection, query, 1));
   if (!self->statement)
     {
       AddTraceBackHere(__FILE__, __LINE__, "APSWCursor_executemany.sqlite3_prepare", "{s: O, s: O}",
@@ -1140,7 +1360,8 @@ APSWCursor_executemany(APSWCursor *self, PyObject *args)
     }
   assert(!PyErr_Occurred());
 
-  self->emoriginalquery=self->statement->utf8;
+  /* a PreparedStatement is kept so each row uses its statement */
+  self->emoriginalquery=(Py_TYPE(query)==&APSWPreparedType)?query:self->statement->utf8;
   Py_INCREF(self->emoriginalquery);
 
   self->bindingsoffset=0;
@@ -1173,6 +1394,177 @@ APSWCursor_executemany(APSWCursor *self, PyObject *args)
   return retval;
 }
 
+#if PY_VERSION_HEX >= 0x02060000
+/** .. method:: executecolumns(statement, columns, nulls=None) -> Cursor
+
+  Executes a single statement once per row with the bindings taken
+  from *columns*, which has one column per parameter.  See
+  :ref:`columnbuffers` for what the columns can be.  *nulls* if
+  supplied has an entry per column which is :const:`None` or a bitmap
+  with the same layout as :attr:`ColumnBuffer.nulls` saying which rows
+  are null.
+
+  This is intended for bulk loading::
+
+    import array
+    ids=array.array("q", range(100000))
+    prices=array.array("d", (i*1.5 for i in range(100000)))
+    cursor.execute("begin")
+    cursor.executecolumns("insert into orders(id, price) values(?,?)", (ids, prices))
+    cursor.execute("commit")
+
+  Binding, stepping and resetting the statement happen in a native
+  loop with the GIL released for the whole batch and no Python objects
+  created per value.  Text and blobs are bound directly from the
+  column memory without copying.  Any rows returned by the statement
+  are discarded.
+
+  The :meth:`exec tracer <setexectrace>` is called once with the
+  sequence of columns as the bindings.  If an error occurs then the
+  rows before it will have been executed so you should use a
+  transaction.
+
+  The return is the cursor itself.
+*/
+static PyObject *
+APSWCursor_executecolumns(APSWCursor *self, PyObject *args)
+{
+  int res, ncols, nargs, i, nsources=0;
+  PyObject *query=NULL, *columns=NULL, *nulls=NULL;
+  ColumnSource *sources=NULL;
+  Py_ssize_t nrows=-1, row=0;
+
+  CHECK_USE(NULL);
+  CHECK_CURSOR_CLOSED(NULL);
+
+  res=resetcursor(self, /* force= */ 0);
+  if(res!=SQLITE_OK)
+    {
+      assert(PyErr_Occurred());
+      return NULL;
+    }
+
+  assert(!self->bindings);
+  assert(self->status==C_DONE);
+
+  if(!PyArg_ParseTuple(args, "OO|O:executecolumns(statement, columns, nulls=None)", &query, &columns, &nulls))
+    return NULL;
+
+  self->bindings=PySequence_Fast(columns, "columns must be a sequence");
+  if(!self->bindings)
+    return NULL;
+  ncols=(int)PySequence_Fast_GET_SIZE(self->bindings);
+
+  if(nulls==Py_None)
+    nulls=NULL;
+  if(nulls)
+    {
+      nulls=PySequence_Fast(nulls, "nulls must be a sequence");
+      if(!nulls)
+        goto error;
+      if(PySequence_Fast_GET_SIZE(nulls)!=ncols)
+        {
+          PyErr_Format(PyExc_ValueError, "There are %d columns but %d nulls", ncols, (int)PySequence_Fast_GET_SIZE(nulls));
+          goto error;
+        }
+    }
+
+  INUSE_CALL(self->statement=prepared_getstatement(self->connection, query, 1));
+  if(!self->statement)
+    {
+      AddTraceBackHere(__FILE__, __LINE__, "APSWCursor_executecolumns.sqlite3_prepare", "{s: O, s: O}",
+		       "Connection", self->connection,
+		       "statement", query);
+      goto error;
+    }
+
+  if(self->statement->next)
+    {
+      PyErr_Format(PyExc_ValueError, "executecolumns only runs a single statement");
+      goto error;
+    }
+
+  nargs=sqlite3_bind_parameter_count(self->statement->vdbestatement);
+  if(nargs!=ncols)
+    {
+      PyErr_Format(ExcBindings, "Statement has %d bindings but %d columns were supplied", nargs, ncols);
+      goto error;
+    }
+
+  APSW_FAULT_INJECT(ExecuteColumnsAllocFails,sources=PyMem_Malloc(sizeof(ColumnSource)*(ncols?ncols:1)),sources=NULL);
+  if(!sources)
+    {
+      PyErr_NoMemory();
+      goto error;
+    }
+
+  for(i=0;i<ncols;i++)
+    {
+      if(ColumnSource_init(sources+i, PySequence_Fast_GET_ITEM(self->bindings, i), nulls?PySequence_Fast_GET_ITEM(nulls, i):NULL, i))
+        goto error;
+      nsources++;
+      if(sources[i].nrows<0)
+        continue;
+      if(nrows<0)
+        nrows=sources[i].nrows;
+      else if(nrows!=sources[i].nrows)
+        {
+          PyErr_Format(PyExc_ValueError, "Column %d has %d rows but previous columns have %d", i, (int)sources[i].nrows, (int)nrows);
+          goto error;
+        }
+    }
+
+  if(nrows<0)
+    {
+      PyErr_Format(PyExc_ValueError, "At least one column must have values to know how many rows there are");
+      goto error;
+    }
+
+  if(EXECTRACE)
+    {
+      self->bindingsoffset=ncols;
+      if(APSWCursor_doexectrace(self, 0))
+        {
+          assert(PyErr_Occurred());
+          goto error;
+        }
+    }
+
+  PYSQLITE_CUR_CALL(res=ColumnSource_execute(self->statement->vdbestatement, self->connection->changecapture, sources, nsources, nrows, &row));
+  changecapture_settle(self->connection);
+  if(res!=SQLITE_OK || PyErr_Occurred())
+    {
+      SET_EXC(res, self->connection->db);
+      AddTraceBackHere(__FILE__, __LINE__, "APSWCursor_executecolumns", "{s: O, s: n}",
+                       "statement", query, "row", row);
+      goto error;
+    }
+
+  while(nsources)
+    ColumnSource_release(sources+(--nsources));
+  PyMem_Free(sources);
+  Py_XDECREF(nulls);
+
+  res=resetcursor(self, 0);
+  if(res!=SQLITE_OK)
+    {
+      assert(PyErr_Occurred());
+      return NULL;
+    }
+  Py_INCREF(self);
+  return (PyObject*)self;
+
+ error:
+  assert(PyErr_Occurred());
+  while(nsources)
+    ColumnSource_release(sources+(--nsources));
+  PyMem_Free(sources);
+  Py_XDECREF(nulls);
+  resetcursor(self, 1);
+  return NULL;
+}
+#endif
+
 /** .. method:: close(force=False)
 
   It is very unlikely you will need to call this method.  It exists
@@ -1215,13 +1607,151 @@ APSWCursor_close(APSWCursor *self, PyObject *args)
   Py_RETURN_NONE;
 }
 
+/* Makes sure the current statement has what the row factory needs.
+   The caller must hold the database mutex.  SQLite automatically
+   reprepares statements after schema changes which can change the
+   columns so we check for that. */
+static int
+APSWCursor_rowfactoryprep(APSWCursor *self)
+{
+  APSWStatement *stmt=self->statement;
+  PyObject *colnames=NULL, *namedtuple=NULL, *args=NULL, *kwargs=NULL, *rowtype=NULL;
+  int factory=ROWFACTORY;
+  int ncols, i, reprepare;
+
+  if(factory==ROWFACTORY_TUPLE)
+    return 0;
+
+  PYSQLITE_HELD_CALL(reprepare=sqlite3_stmt_status(stmt->vdbestatement, SQLITE_STMTSTATUS_REPREPARE, 0));
+  if(stmt->colnames && reprepare!=stmt->colnames_reprepare)
+    {
+      Py_CLEAR(stmt->colnames);
+      Py_CLEAR(stmt->rowtype);
+    }
+
+  if(stmt->colnames && (factory==ROWFACTORY_DICT || stmt->rowtype))
+    return 0;
+
+  if(!stmt->colnames)
+    {
+      ncols=sqlite3_column_count(stmt->vdbestatement);
+      colnames=PyTuple_New(ncols);
+      if(!colnames) goto error;
+      for(i=0;i<ncols;i++)
+        {
+          const char *colname;
+          PyObject *name;
+
+          PYSQLITE_HELD_CALL(colname=sqlite3_column_name(stmt->vdbestatement, i));
+          name=convertutf8string(colname);
+          if(!name) goto error;
+#if PY_MAJOR_VERSION < 3
+          if(PyString_CheckExact(name))
+            PyString_InternInPlace(&name);
+#else
+          PyUnicode_InternInPlace(&name);
+#endif
+          PyTuple_SET_ITEM(colnames, i, name);
+        }
+      stmt->colnames=colnames;
+      stmt->colnames_reprepare=reprepare;
+      colnames=NULL;
+    }
+
+  if(factory==ROWFACTORY_NAMED && !stmt->rowtype)
+    {
+      PyObject *collections=PyImport_ImportModule("collections");
+      if(!collections) goto error;
+      namedtuple=PyObject_GetAttrString(collections, "namedtuple");
+      Py_DECREF(collections);
+      if(!namedtuple) goto error;
+      args=Py_BuildValue("(sO)", "Row", stmt->colnames);
+      kwargs=Py_BuildValue("{s:O}", "rename", Py_True);
+      if(!args || !kwargs) goto error;
+      rowtype=PyObject_Call(namedtuple, args, kwargs);
+      if(!rowtype) goto error;
+      if(!PyType_Check(rowtype) || !PyType_IsSubtype((PyTypeObject*)rowtype, &PyTuple_Type))
+        {
+          PyErr_Format(PyExc_TypeError, "collections.namedtuple didn't make a tuple subclass");
+          goto error;
+        }
+      stmt->rowtype=rowtype;
+      rowtype=NULL;
+      Py_DECREF(namedtuple);
+      Py_DECREF(args);
+      Py_DECREF(kwargs);
+    }
+  return 0;
+
+ error:
+  AddTraceBackHere(__FILE__, __LINE__, "APSWCursor_rowfactoryprep", "{s: s}", "factory", rowfactory_names[factory]);
+  Py_XDECREF(colnames);
+  Py_XDECREF(namedtuple);
+  Py_XDECREF(args);
+  Py_XDECREF(kwargs);
+  Py_XDECREF(rowtype);
+  return -1;
+}
+
+/* Returns the current row as made by the row factory.  The caller
+   must hold the database mutex */
 static PyObject *
-APSWCursor_next(APSWCursor *self)
+APSWCursor_makerow(APSWCursor *self)
 {
   PyObject *retval;
   PyObject *item;
   int numcols=-1;
   int i;
+  int factory=ROWFACTORY;
+
+  if(APSWCursor_rowfactoryprep(self))
+    return NULL;
+
+  numcols=sqlite3_data_count(self->statement->vdbestatement);
+  switch(factory)
+    {
+    case ROWFACTORY_DICT:
+      assert(self->statement->colnames && PyTuple_GET_SIZE(self->statement->colnames)==numcols);
+      retval=PyDict_New();
+      break;
+    case ROWFACTORY_NAMED:
+      assert(self->statement->rowtype);
+      retval=((PyTypeObject*)self->statement->rowtype)->tp_alloc((PyTypeObject*)self->statement->rowtype, numcols);
+      break;
+    default:
+      retval=PyTuple_New(numcols);
+      break;
+    }
+  if(!retval) return NULL;
+
+  for(i=0;i<numcols;i++)
+    {
+      INUSE_CALL(item=convert_column_to_pyobject(self->statement->vdbestatement, i));
+      if(!item)
+        {
+          Py_DECREF(retval);
+          return NULL;
+        }
+      if(factory==ROWFACTORY_DICT)
+        {
+          int res=PyDict_SetItem(retval, PyTuple_GET_ITEM(self->statement->colnames, i), item);
+          Py_DECREF(item);
+          if(res)
+            {
+              Py_DECREF(retval);
+              return NULL;
+            }
+        }
+      else
+        PyTuple_SET_ITEM(retval, i, item);
+    }
+  return retval;
+}
+
+static PyObject *
+APSWCursor_next(APSWCursor *self)
+{
+  PyObject *retval=NULL;
 
   CHECK_USE(NULL);
   CHECK_CURSOR_CLOSED(NULL);
@@ -1241,16 +1771,11 @@ APSWCursor_next(APSWCursor *self)
   self->status=C_BEGIN;
 
   /* return the row of data */
-  numcols=sqlite3_data_count(self->statement->vdbestatement);
-  retval=PyTuple_New(numcols);
+  APSW_DB_MUTEX_ENTER(self->connection->db);
+  retval=APSWCursor_makerow(self);
+  APSW_DB_MUTEX_LEAVE(self->connection->db);
   if(!retval) goto error;
 
-  for(i=0;i<numcols;i++)
-    {
-      INUSE_CALL(item=convert_column_to_pyobject(self->statement->vdbestatement, i));
-      if(!item) goto error;
-      PyTuple_SET_ITEM(retval, i, item);
-    }
   if(ROWTRACE)
     {
       PyObject *r2=APSWCursor_dorowtrace(self, retval);
@@ -1350,6 +1875,51 @@ APSWCursor_setrowtrace(APSWCursor *self, PyObject *func)
   Py_RETURN_NONE;
 }
 
+/** .. method:: setrowfactory(mode)
+
+  Sets what kind of object is returned for each row by this cursor.
+  The modes are ``tuple``, ``named`` and ``dict`` and are described in
+  :meth:`Connection.setrowfactory`.  If *mode* is :const:`None` then
+  the Connection's setting is used, which is also the default.
+*/
+static PyObject *
+APSWCursor_setrowfactory(APSWCursor *self, PyObject *args)
+{
+  const char *name=NULL;
+  int mode=-1;
+
+  CHECK_USE(NULL);
+  CHECK_CURSOR_CLOSED(NULL);
+
+  if(!PyArg_ParseTuple(args, "z:setrowfactory(mode)", &name))
+    return NULL;
+
+  if(name)
+    {
+      mode=rowfactory_from_name(name);
+      if(mode<0)
+        return NULL;
+    }
+
+  self->rowfactory=mode;
+
+  Py_RETURN_NONE;
+}
+
+/** .. method:: getrowfactory() -> str
+
+  Returns the row factory mode in effect for this cursor.  This will
+  be the Connection's setting unless :meth:`setrowfactory` was used.
+*/
+static PyObject *
+APSWCursor_getrowfactory(APSWCursor *self)
+{
+  CHECK_USE(NULL);
+  CHECK_CURSOR_CLOSED(NULL);
+
+  return convertutf8string(rowfactory_names[ROWFACTORY]);
+}
+
 /** .. method:: getexectrace() -> callable or None
 
   Returns the currently installed (via :meth:`~Cursor.setexectrace`)
@@ -1413,10 +1983,99 @@ APSWCursor_getconnection(APSWCursor *self)
   return (PyObject*)self->connection;
 }
 
+/* Returns a list of up to size rows, or all remaining rows if size is
+   negative.  The database mutex is acquired once for the batch rather
+   than for each row, and the rows are converted without releasing the
+   GIL for each column.  The GIL is still released around each
+   sqlite3_step since that can take arbitrary amounts of time, and the
+   mutex is given up around the row tracer and for anything other than
+   another row (errors, the next statement, executemany). */
+static PyObject *
+APSWCursor_fetchrows(APSWCursor *self, Py_ssize_t size)
+{
+  PyObject *rows=NULL, *row=NULL;
+  sqlite3 *db=self->connection->db;
+  int held=0;
+  int res;
+
+  rows=PyList_New(0);
+  if(!rows) return NULL;
+
+  while(size<0 || PyList_GET_SIZE(rows)<size)
+    {
+      if(self->status==C_BEGIN)
+        {
+          if(held && self->statement->vdbestatement)
+            {
+              assert(!PyErr_Occurred());
+              CURSOR_STEP(PYSQLITE_VOID_CALL(res=stepcursor(self, self->statement->vdbestatement, &stopped)));
+              if(res==SQLITE_ROW && !PyErr_Occurred())
+                self->status=C_ROW;
+              else
+                {
+                  if(res!=SQLITE_DONE && res!=SQLITE_ROW)
+                    PYSQLITE_HELD_CALL(apsw_set_errmsg(sqlite3_errmsg(db)));
+                  APSW_DB_MUTEX_LEAVE(db);
+                  held=0;
+                  if(!APSWCursor_dostep(self, res))
+                    goto error;
+                }
+            }
+          else if(!APSWCursor_step(self))
+            goto error;
+        }
+      if(self->status==C_DONE)
+        break;
+
+      assert(self->status==C_ROW);
+      self->status=C_BEGIN;
+
+      if(!held)
+        {
+          APSW_DB_MUTEX_ENTER(db);
+          held=1;
+        }
+      row=APSWCursor_makerow(self);
+      if(!row) goto error;
+
+      if(ROWTRACE)
+        {
+          PyObject *r2;
+          APSW_DB_MUTEX_LEAVE(db);
+          held=0;
+          r2=APSWCursor_dorowtrace(self, row);
+          Py_DECREF(row);
+          row=r2;
+          if(!row) goto error;
+          if(row==Py_None)
+            {
+              Py_CLEAR(row);
+              continue;
+            }
+        }
+      if(PyList_Append(rows, row))
+        goto error;
+      Py_CLEAR(row);
+    }
+
+  if(held)
+    APSW_DB_MUTEX_LEAVE(db);
+  return rows;
+
+ error:
+  assert(PyErr_Occurred());
+  if(held)
+    APSW_DB_MUTEX_LEAVE(db);
+  Py_XDECREF(row);
+  Py_DECREF(rows);
+  return NULL;
+}
+
 /** .. method:: fetchall() -> list
 
   Returns all remaining result rows as a list.  This method is defined
-  in DBAPI.  It is a longer way of doing ``list(cursor)``.
+  in DBAPI.  It gives the same results as ``list(cursor)`` but is
+  faster since the rows are fetched in batches internally.
 */
 static PyObject *
 APSWCursor_fetchall(APSWCursor *self)
@@ -1424,9 +2083,140 @@ APSWCursor_fetchall(APSWCursor *self)
   CHECK_USE(NULL);
   CHECK_CURSOR_CLOSED(NULL);
 
-  return PySequence_List((PyObject*)self);
+  return APSWCursor_fetchrows(self, -1);
 }
 
+/** .. method:: fetchmany(size) -> list
+
+  Returns a list of up to *size* of the remaining result rows.  An
+  empty list is returned when there are no more rows.  This method is
+  defined in DBAPI although there is no default size since
+  :attr:`arraysize` is not supported.
+
+  The rows are stepped and converted in a single batch which has
+  considerably less overhead than fetching them one at a time.  This
+  is useful for processing large result sets in chunks::
+
+    cursor.execute("select * from huge")
+    while True:
+        rows=cursor.fetchmany(1000)
+        if not rows:
+            break
+        process(rows)
+*/
+static PyObject *
+APSWCursor_fetchmany(APSWCursor *self, PyObject *args)
+{
+  Py_ssize_t size;
+
+  CHECK_USE(NULL);
+  CHECK_CURSOR_CLOSED(NULL);
+
+  if(!PyArg_ParseTuple(args, "n:fetchmany(size)", &size))
+    return NULL;
+
+  if(size<0)
+    return PyErr_Format(PyExc_ValueError, "fetchmany size must be zero or positive");
+
+  return APSWCursor_fetchrows(self, size);
+}
+
+#if PY_VERSION_HEX >= 0x02060000
+/** .. method:: fetchcolumns() -> list of ColumnBuffer
+
+  Returns the remaining rows of the current statement as a list with
+  one :class:`ColumnBuffer` per result column.  No Python objects are
+  created for the individual values.  See :ref:`columnbuffers` for
+  details of the layout.
+
+  Only the current statement is consumed.  If there are further
+  statements (or more bindings with :meth:`executemany`) then you can
+  call this again, or iterate the cursor as normal to get their rows.
+  An empty list is returned when there are no more rows.  The
+  :meth:`row tracer <setrowtrace>` is not called.
+*/
+static PyObject *
+APSWCursor_fetchcolumns(APSWCursor *self)
+{
+  PyObject *columns=NULL, *name;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  int held=0;
+  int numcols, i, res;
+
+  CHECK_USE(NULL);
+  CHECK_CURSOR_CLOSED(NULL);
+
+  if(self->status==C_BEGIN)
+    if(!APSWCursor_step(self))
+      {
+        assert(PyErr_Occurred());
+        return NULL;
+      }
+  if(self->status==C_DONE)
+    return PyList_New(0);
+
+  assert(self->status==C_ROW);
+  db=self->connection->db;
+  stmt=self->statement->vdbestatement;
+
+  APSW_DB_MUTEX_ENTER(db);
+  held=1;
+
+  numcols=sqlite3_column_count(stmt);
+  columns=PyList_New(numcols);
+  if(!columns) goto error;
+
+  for(i=0;i<numcols;i++)
+    {
+      const char *colname;
+      ColumnBuffer *colbuf;
+
+      PYSQLITE_HELD_CALL(colname=sqlite3_column_name(stmt, i));
+      name=convertutf8string(colname);
+      if(!name) goto error;
+      colbuf=ColumnBuffer_new(name);
+      Py_DECREF(name);
+      if(!colbuf) goto error;
+      PyList_SET_ITEM(columns, i, (PyObject*)colbuf);
+    }
+
+  for(;;)
+    {
+      assert(self->status==C_ROW);
+      for(i=0;i<numcols;i++)
+        if(ColumnBuffer_append((ColumnBuffer*)PyList_GET_ITEM(columns, i), stmt, i))
+          goto error;
+      self->status=C_BEGIN;
+
+      CURSOR_STEP(PYSQLITE_VOID_CALL(res=stepcursor(self, stmt, &stopped)));
+      if(res==SQLITE_ROW && !PyErr_Occurred())
+        {
+          self->status=C_ROW;
+          continue;
+        }
+      /* this statement is finished - let the normal mechanism deal
+         with errors and moving on to the next one */
+      if(res!=SQLITE_DONE && res!=SQLITE_ROW)
+        PYSQLITE_HELD_CALL(apsw_set_errmsg(sqlite3_errmsg(db)));
+      APSW_DB_MUTEX_LEAVE(db);
+      held=0;
+      if(!APSWCursor_dostep(self, res))
+        goto error;
+      break;
+    }
+
+  return columns;
+
+ error:
+  assert(PyErr_Occurred());
+  if(held)
+    APSW_DB_MUTEX_LEAVE(db);
+  Py_XDECREF(columns);
+  return NULL;
+}
+#endif
+
 /** .. method:: fetchone() -> row or None
 
   Returns the next row of data or None if there are no more rows.
@@ -1451,10 +2241,14 @@ APSWCursor_fetchone(APSWCursor *self)
 
 
 static PyMethodDef APSWCursor_methods[] = {
-  {"execute", (PyCFunction)APSWCursor_execute, METH_VARARGS,
+  {"execute", (PyCFunction)APSWCursor_execute, METH_VARARGS|METH_KEYWORDS,
    "Executes one or more statements" },
-  {"executemany", (PyCFunction)APSWCursor_executemany, METH_VARARGS,
+  {"executemany", (PyCFunction)APSWCursor_executemany, METH_VARARGS|METH_KEYWORDS,
    "Repeatedly executes statements on sequence" },
+#if PY_VERSION_HEX >= 0x02060000
+  {"executecolumns", (PyCFunction)APSWCursor_executecolumns, METH_VARARGS,
+   "Executes a statement binding from columns of values" },
+#endif
   {"setexectrace", (PyCFunction)APSWCursor_setexectrace, METH_O,
    "Installs a function called for every statement executed"},
   {"setrowtrace", (PyCFunction)APSWCursor_setrowtrace, METH_O,
@@ -1463,6 +2257,10 @@ static PyMethodDef APSWCursor_methods[] = {
    "Returns the current exec tracer function"},
   {"getrowtrace", (PyCFunction)APSWCursor_getrowtrace, METH_NOARGS,
    "Returns the current row tracer function"},
+  {"setrowfactory", (PyCFunction)APSWCursor_setrowfactory, METH_VARARGS,
+   "Sets how rows are returned"},
+  {"getrowfactory", (PyCFunction)APSWCursor_getrowfactory, METH_NOARGS,
+   "Returns how rows are returned"},
   {"getconnection", (PyCFunction)APSWCursor_getconnection, METH_NOARGS,
    "Returns the connection object for this cursor"},
   {"getdescription", (PyCFunction)APSWCursor_getdescription, METH_NOARGS,
@@ -1473,6 +2271,12 @@ static PyMethodDef APSWCursor_methods[] = {
    "Fetches all result rows" },
   {"fetchone", (PyCFunction)APSWCursor_fetchone, METH_NOARGS,
    "Fetches next result row" },
+  {"fetchmany", (PyCFunction)APSWCursor_fetchmany, METH_VARARGS,
+   "Fetches a batch of result rows" },
+#if PY_VERSION_HEX >= 0x02060000
+  {"fetchcolumns", (PyCFunction)APSWCursor_fetchcolumns, METH_NOARGS,
+   "Fetches the current statement's rows by column" },
+#endif
 
   {0, 0, 0, 0}  /* Sentinel */
 };
@@ -20,6 +20,7 @@ static PyObject *ExcConnectionClosed; /* connection was closed when function cal
 static PyObject *ExcVFSNotImplemented; /* base vfs doesn't implment function */
 static PyObject *ExcVFSFileClosed;     /* attempted operation on closed file */
 static PyObject *ExcForkingViolation; /* used object across a fork */
+static PyObject *ExcQueryCancelled; /* timeout or cancellation token stopped a query */
 
 static void make_exception(int res, sqlite3 *db);
 
@@ -193,6 +194,15 @@ static int init_exceptions(PyObject *m)
       sprintf(buffy, "%sError", exc_descriptors[i].name);
       if(PyModule_AddObject(m, buffy, obj))
         return -1;
+      /* it is still an interrupt as far as SQLite is concerned */
+      if(exc_descriptors[i].code==SQLITE_INTERRUPT)
+        {
+          ExcQueryCancelled=PyErr_NewException("apsw.QueryCancelledError", obj, NULL);
+          if(!ExcQueryCancelled) return -1;
+          Py_INCREF(ExcQueryCancelled);
+          if(PyModule_AddObject(m, "QueryCancelledError", ExcQueryCancelled))
+            return -1;
+        }
     }
   
   return 0;
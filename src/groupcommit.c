@@ -0,0 +1,754 @@
+/*
+  Group commit code
+
+  See the accompanying LICENSE file.
+*/
+
+/**
+
+.. _groupcommit:
+
+Group Commit
+************
+
+Each committed transaction waits for the data to reach storage
+(fsync), which takes far longer than the writes themselves.  When many
+threads each make small changes in their own transactions, most of
+the time goes on those waits.  :class:`GroupCommit` makes the changes
+from many threads in one transaction on a single writer
+:class:`Connection` so they all share one commit::
+
+  gc=apsw.GroupCommit(apsw.Connection("database.db"), maxdelay=0.005, maxbatch=100)
+
+  def ingest(record):
+      # returns immediately with a concurrent.futures.Future
+      future=gc.submit("insert into events values(?,?,?)", record)
+      # waits until the shared transaction containing it is committed
+      future.result()
+
+A worker thread started in C takes up to *maxbatch* queued changes,
+waiting at most *maxdelay* seconds after the oldest was queued for
+others to arrive.  It then starts a transaction, applies each change in
+its own `savepoint <https://sqlite.org/lang_savepoint.html>`__, and
+commits.  Each change's :class:`~concurrent.futures.Future` gets its
+result when the commit returns.  If a change fails, only that change
+is rolled back and its future gets the exception while the others are
+still committed.  If the commit fails then every future in the batch
+gets the exception.
+
+Changes queued while a commit is in progress form the next batch, so
+even with a *maxdelay* of zero the batches grow as the load increases.
+Use `WAL mode <https://sqlite.org/wal.html>`__ so readers don't block
+the writer.
+
+Group commit needs Python 3.2 or later.
+
+*/
+
+/** .. class:: GroupCommit(connection, maxdelay=0.005, maxbatch=100)
+
+  Starts a worker thread that makes the changes submitted by all
+  threads on *connection*.  Once wrapped, only use the connection
+  through this object until :meth:`close` is called.
+
+  :param maxdelay: The most seconds to wait after a change is queued
+    for more to arrive before committing.  Zero commits as soon as the
+    worker is free.
+  :param maxbatch: The most changes in one transaction.
+*/
+
+/* job operations */
+enum { GROUPCOMMIT_EXECUTE, GROUPCOMMIT_EXECUTEMANY };
+
+/* waiting states of the worker */
+enum { GROUPCOMMIT_BUSY, GROUPCOMMIT_IDLE, GROUPCOMMIT_FILLING };
+
+typedef struct GroupCommit {
+  PyObject_HEAD
+  Connection *connection;
+  PyObject *futuretype;           /* concurrent.futures.Future */
+  PyObject *queue;                /* list of (future, op, args, queued ns) */
+  sqlite3_int64 maxdelay;         /* nanoseconds */
+  Py_ssize_t maxbatch;
+  PyThread_type_lock wakeup;      /* held except when the worker is signalled */
+  PyThread_type_lock done;        /* held while the worker thread runs */
+  long thread;                    /* worker thread ident */
+  int running;                    /* worker thread has been started and not exited */
+  int waiting;                    /* GROUPCOMMIT_IDLE waiting for work, GROUPCOMMIT_FILLING for the batch to fill */
+  int signalled;
+  int closed;
+  /* statistics */
+  sqlite3_int64 st_batches, st_changes, st_failed, st_largest;
+  PyObject *weakreflist;          /* weak reference tracking */
+} GroupCommit;
+
+static PyTypeObject GroupCommitType;
+
+#define CHECK_GROUPCOMMIT_CLOSED(e)                                     \
+  do { if(self->closed)                                                 \
+      { PyErr_Format(ExcConnectionClosed, "The GroupCommit has been closed"); return e; } \
+  } while(0)
+
+#define GROUPCOMMIT_SAVEPOINT "\"_apsw-groupcommit\""
+
+/* Runs transaction control SQL, returning zero or -1 with an exception set */
+static int
+GroupCommit_exec(GroupCommit *self, const char *sql)
+{
+  Connection *connection=self->connection;
+  sqlite3 *db=connection->db;
+  int res;
+
+  if(!db)
+    {
+      PyErr_Format(ExcConnectionClosed, "The connection has been closed");
+      return -1;
+    }
+  if(connection->inuse)
+    {
+      PyErr_Format(ExcThreadingViolation, "The connection is being used in another thread.  Only use it through the GroupCommit");
+      return -1;
+    }
+
+  connection->inuse=1;
+  _PYSQLITE_CALL_E(db, res=sqlite3_exec(db, sql, NULL, NULL, NULL));
+  connection->inuse=0;
+  changecapture_settle(connection);
+  if(res!=SQLITE_OK)
+    {
+      SET_EXC(res, db);
+      return -1;
+    }
+  return 0;
+}
+
+/* Returns the current exception, clearing it */
+static PyObject *
+GroupCommit_fetchexception(void)
+{
+  PyObject *etype, *evalue, *etb;
+
+  PyErr_Fetch(&etype, &evalue, &etb);
+  PyErr_NormalizeException(&etype, &evalue, &etb);
+  if(etb)
+    PyException_SetTraceback(evalue, etb);
+  Py_XDECREF(etype);
+  Py_XDECREF(etb);
+  return evalue;
+}
+
+/* Resolves a future with a result (exc NULL) or exception */
+static void
+GroupCommit_resolve(PyObject *future, PyObject *exc)
+{
+  PyObject *res;
+
+  if(exc)
+    res=PyObject_CallMethod(future, "set_exception", "(O)", exc);
+  else
+    res=PyObject_CallMethod(future, "set_result", "(O)", Py_None);
+  if(!res)
+    apsw_write_unraiseable(NULL);
+  Py_XDECREF(res);
+}
+
+/* Resolves all the futures in the list and empties it */
+static void
+GroupCommit_resolveall(PyObject *futures, PyObject *exc)
+{
+  Py_ssize_t i;
+
+  for(i=0; i<PyList_GET_SIZE(futures); i++)
+    GroupCommit_resolve(PyList_GET_ITEM(futures, i), exc);
+  if(PyList_SetSlice(futures, 0, PyList_GET_SIZE(futures), NULL))
+    apsw_write_unraiseable(NULL);
+}
+
+/* Makes one submitted change, returning zero or -1 with an exception set */
+static int
+GroupCommit_change(GroupCommit *self, APSWCursor *cursor, int op, PyObject *args)
+{
+  PyObject *res;
+
+  if(GroupCommit_exec(self, "SAVEPOINT " GROUPCOMMIT_SAVEPOINT))
+    return -1;
+
+  /* transaction control would end the transaction of the whole batch
+     so the authorizer rejects it when the statements are prepared */
+  self->connection->denytransaction=1;
+  res=(op==GROUPCOMMIT_EXECUTE)?APSWCursor_execute(cursor, args, NULL):APSWCursor_executemany(cursor, args, NULL);
+  /* statements returning rows need stepping to the end */
+  if(res)
+    {
+      Py_DECREF(res);
+      res=APSWCursor_fetchall(cursor);
+    }
+  self->connection->denytransaction=0;
+  if(res)
+    {
+      Py_DECREF(res);
+      if(sqlite3_get_autocommit(self->connection->db))
+        PyErr_Format(PyExc_ValueError, "The statements must not end the transaction");
+      else if(!GroupCommit_exec(self, "RELEASE " GROUPCOMMIT_SAVEPOINT))
+        return 0;
+    }
+
+  /* discard what the change did, keeping the exception */
+  {
+    PyObject *etype, *evalue, *etb;
+    int autocommit;
+
+    resetcursor(cursor, 1);
+    PyErr_Fetch(&etype, &evalue, &etb);
+    autocommit=self->connection->db?sqlite3_get_autocommit(self->connection->db):1;
+    if(!autocommit)
+      {
+        if(GroupCommit_exec(self, "ROLLBACK TO " GROUPCOMMIT_SAVEPOINT) || GroupCommit_exec(self, "RELEASE " GROUPCOMMIT_SAVEPOINT))
+          PyErr_Clear();
+      }
+    PyErr_Restore(etype, evalue, etb);
+  }
+  return -1;
+}
+
+/* Takes a batch of changes from the queue, makes them in one
+   transaction and resolves their futures */
+static void
+GroupCommit_batch(GroupCommit *self)
+{
+  PyObject *jobs, *pending=NULL, *exc;
+  APSWCursor *cursor=NULL;
+  Py_ssize_t i, n=PyList_GET_SIZE(self->queue);
+  int autocommit, failed;
+
+  if(n>self->maxbatch)
+    n=self->maxbatch;
+  jobs=PyList_GetSlice(self->queue, 0, n);
+  if(!jobs || PyList_SetSlice(self->queue, 0, n, NULL))
+    {
+      /* can't take them off the queue so fail the whole queue */
+      Py_XDECREF(jobs);
+      jobs=self->queue;
+      self->queue=PyList_New(0);
+      if(!self->queue)
+        {
+          self->queue=jobs;
+          apsw_write_unraiseable(NULL);
+          return;
+        }
+    }
+
+  pending=PyList_New(0);
+  if(!pending)
+    goto error;
+
+  for(i=0; i<PyList_GET_SIZE(jobs); i++)
+    {
+      PyObject *job=PyList_GET_ITEM(jobs, i), *future, *args, *res;
+      int op, notcancelled;
+
+      future=PyTuple_GET_ITEM(job, 0);
+      op=(int)PyIntLong_AsLong(PyTuple_GET_ITEM(job, 1));
+      args=PyTuple_GET_ITEM(job, 2);
+
+      res=PyObject_CallMethod(future, "set_running_or_notify_cancel", NULL);
+      if(!res)
+        {
+          apsw_write_unraiseable(NULL);
+          continue;
+        }
+      notcancelled=PyObject_IsTrue(res);
+      Py_DECREF(res);
+      if(notcancelled!=1)
+        continue;
+
+      if(!cursor)
+        {
+          cursor=(APSWCursor*)Connection_cursor(self->connection);
+          if(!cursor)
+            goto jobfailed;
+        }
+
+      autocommit=sqlite3_get_autocommit(self->connection->db);
+      if(autocommit && GroupCommit_exec(self, "BEGIN IMMEDIATE"))
+        goto jobfailed;
+
+      if(!GroupCommit_change(self, cursor, op, args))
+        {
+          self->st_changes++;
+          if(PyList_Append(pending, future))
+            goto error;
+          continue;
+        }
+
+    jobfailed:
+      self->st_failed++;
+      exc=GroupCommit_fetchexception();
+      /* some errors roll back the whole transaction */
+      autocommit=self->connection->db?sqlite3_get_autocommit(self->connection->db):1;
+      if(autocommit && PyList_GET_SIZE(pending))
+        {
+          self->st_failed+=PyList_GET_SIZE(pending);
+          self->st_changes-=PyList_GET_SIZE(pending);
+          GroupCommit_resolveall(pending, exc);
+        }
+      GroupCommit_resolve(future, exc);
+      Py_XDECREF(exc);
+    }
+
+  autocommit=self->connection->db?sqlite3_get_autocommit(self->connection->db):1;
+  if(!autocommit)
+    {
+      if(PyList_GET_SIZE(pending))
+        {
+          self->st_batches++;
+          if(PyList_GET_SIZE(pending)>self->st_largest)
+            self->st_largest=PyList_GET_SIZE(pending);
+          APSW_FAULT_INJECT(GroupCommitCommitFails, failed=GroupCommit_exec(self, "COMMIT"), (PyErr_NoMemory(), failed=-1));
+        }
+      else
+        failed=GroupCommit_exec(self, "ROLLBACK");
+      if(failed)
+        {
+          exc=GroupCommit_fetchexception();
+          autocommit=self->connection->db?sqlite3_get_autocommit(self->connection->db):1;
+          if(!autocommit && GroupCommit_exec(self, "ROLLBACK"))
+            apsw_write_unraiseable(NULL);
+          self->st_failed+=PyList_GET_SIZE(pending);
+          self->st_changes-=PyList_GET_SIZE(pending);
+          GroupCommit_resolveall(pending, exc);
+          Py_XDECREF(exc);
+        }
+    }
+  GroupCommit_resolveall(pending, NULL);
+  goto finally;
+
+ error:
+  /* nothing is committed and futures not yet resolved get the exception */
+  exc=GroupCommit_fetchexception();
+  if(self->connection->db && !sqlite3_get_autocommit(self->connection->db) && GroupCommit_exec(self, "ROLLBACK"))
+    apsw_write_unraiseable(NULL);
+  if(pending)
+    {
+      self->st_failed+=PyList_GET_SIZE(pending);
+      self->st_changes-=PyList_GET_SIZE(pending);
+    }
+  for(i=0; i<PyList_GET_SIZE(jobs); i++)
+    {
+      PyObject *res=PyObject_CallMethod(PyTuple_GET_ITEM(PyList_GET_ITEM(jobs, i), 0), "done", NULL);
+      if(res && !PyObject_IsTrue(res))
+        GroupCommit_resolve(PyTuple_GET_ITEM(PyList_GET_ITEM(jobs, i), 0), exc);
+      Py_XDECREF(res);
+      PyErr_Clear();
+    }
+  Py_XDECREF(exc);
+
+ finally:
+  Py_XDECREF((PyObject*)cursor);
+  Py_XDECREF(pending);
+  Py_DECREF(jobs);
+}
+
+/* The worker thread.  It has a reference to the GroupCommit until it
+   exits. */
+static void
+GroupCommit_worker(void *arg)
+{
+  GroupCommit *self=(GroupCommit*)arg;
+  PyGILState_STATE gilstate=PyGILState_Ensure();
+
+  self->thread=PyThread_get_thread_ident();
+
+  for(;;)
+    {
+      Py_ssize_t queued=PyList_GET_SIZE(self->queue);
+      sqlite3_int64 wait=-1;
+      int acquired;
+
+      if(!queued && self->closed)
+        break;
+      if(queued)
+        {
+          sqlite3_int64 first=PyLong_AsLongLong(PyTuple_GET_ITEM(PyList_GET_ITEM(self->queue, 0), 3));
+          wait=(queued>=self->maxbatch || self->closed)?0:first+self->maxdelay-apsw_now_ns();
+          if(wait<=0)
+            {
+              GroupCommit_batch(self);
+              continue;
+            }
+        }
+
+      self->waiting=queued?GROUPCOMMIT_FILLING:GROUPCOMMIT_IDLE;
+      Py_BEGIN_ALLOW_THREADS
+        if(wait<0)
+          acquired=PyThread_acquire_lock(self->wakeup, WAIT_LOCK);
+        else
+          acquired=(PyThread_acquire_lock_timed(self->wakeup, (PY_TIMEOUT_T)(wait/1000), 0)==PY_LOCK_ACQUIRED);
+      Py_END_ALLOW_THREADS;
+      /* signalled after the timeout expired so take the lock back */
+      if(!acquired && self->signalled)
+        PyThread_acquire_lock(self->wakeup, NOWAIT_LOCK);
+      self->waiting=GROUPCOMMIT_BUSY;
+      self->signalled=0;
+    }
+
+  self->running=0;
+  PyThread_release_lock(self->done);
+  Py_DECREF(self);
+  PyGILState_Release(gilstate);
+}
+
+static void
+GroupCommit_signal(GroupCommit *self)
+{
+  if(self->waiting && !self->signalled)
+    {
+      self->signalled=1;
+      PyThread_release_lock(self->wakeup);
+    }
+}
+
+/* Queues a change returning its future */
+static PyObject *
+GroupCommit_submit(GroupCommit *self, int op, PyObject *args)
+{
+  PyObject *future, *job;
+
+  CHECK_GROUPCOMMIT_CLOSED(NULL);
+
+  future=PyObject_CallObject(self->futuretype, NULL);
+  if(!future)
+    return NULL;
+
+  job=Py_BuildValue("(OiOL)", future, op, args, apsw_now_ns());
+  if(!job || PyList_Append(self->queue, job))
+    {
+      Py_XDECREF(job);
+      Py_DECREF(future);
+      return NULL;
+    }
+  Py_DECREF(job);
+
+  /* while filling a batch the worker only needs waking when it is full */
+  if(self->waiting==GROUPCOMMIT_IDLE || PyList_GET_SIZE(self->queue)>=self->maxbatch)
+    GroupCommit_signal(self);
+  return future;
+}
+
+static PyObject *
+GroupCommit_new(PyTypeObject *type, APSW_ARGUNUSED PyObject *args, APSW_ARGUNUSED PyObject *kwds)
+{
+  GroupCommit *self;
+
+  self=(GroupCommit*)type->tp_alloc(type, 0);
+  if(self)
+    {
+      self->connection=0;
+      self->futuretype=0;
+      self->queue=0;
+      self->maxdelay=0;
+      self->maxbatch=0;
+      self->wakeup=0;
+      self->done=0;
+      self->thread=0;
+      self->running=0;
+      self->waiting=GROUPCOMMIT_BUSY;
+      self->signalled=0;
+      self->closed=1;
+      self->st_batches=self->st_changes=self->st_failed=self->st_largest=0;
+      self->weakreflist=0;
+    }
+
+  return (PyObject*)self;
+}
+
+static int
+GroupCommit_init(GroupCommit *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[]={"connection", "maxdelay", "maxbatch", NULL};
+  PyObject *connection=NULL, *futures;
+  double maxdelay=0.005;
+  Py_ssize_t maxbatch=100;
+  long thread;
+  int res;
+
+  if(self->queue)
+    {
+      PyErr_Format(PyExc_RuntimeError, "The GroupCommit has already been initialized");
+      return -1;
+    }
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "O!|dn:GroupCommit(connection, maxdelay=0.005, maxbatch=100)", kwlist,
+                                  &ConnectionType, &connection, &maxdelay, &maxbatch))
+    return -1;
+
+  if(maxdelay<0 || maxdelay>3600)
+    {
+      PyErr_Format(PyExc_ValueError, "maxdelay must be between 0 and 3600 seconds");
+      return -1;
+    }
+  if(maxbatch<1)
+    {
+      PyErr_Format(PyExc_ValueError, "maxbatch must be at least 1");
+      return -1;
+    }
+  self->maxdelay=(sqlite3_int64)(maxdelay*1000000000.0);
+  self->maxbatch=maxbatch;
+
+  futures=PyImport_ImportModule("concurrent.futures");
+  if(!futures)
+    return -1;
+  self->futuretype=PyObject_GetAttrString(futures, "Future");
+  Py_DECREF(futures);
+  if(!self->futuretype)
+    return -1;
+
+  Py_INCREF(connection);
+  self->connection=(Connection*)connection;
+  self->queue=PyList_New(0);
+  if(!self->queue)
+    return -1;
+
+  if(!self->connection->db)
+    {
+      PyErr_Format(ExcConnectionClosed, "The connection has been closed");
+      return -1;
+    }
+  /* for denytransaction.  This also expires already prepared
+     statements so cached ones are authorized again.  It is left
+     installed as other GroupCommits could be using the connection. */
+  _PYSQLITE_CALL_E(self->connection->db, res=sqlite3_set_authorizer(self->connection->db, authorizercb, self->connection));
+  if(res!=SQLITE_OK)
+    {
+      SET_EXC(res, self->connection->db);
+      return -1;
+    }
+
+  APSW_FAULT_INJECT(GroupCommitLockAllocFails,
+                    (self->wakeup=PyThread_allocate_lock(), self->done=PyThread_allocate_lock()),
+                    (self->wakeup=self->done=NULL));
+  if(!self->wakeup || !self->done)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+  /* held until the worker is signalled or exits */
+  PyThread_acquire_lock(self->wakeup, WAIT_LOCK);
+  PyThread_acquire_lock(self->done, WAIT_LOCK);
+
+  Py_INCREF(self);
+  APSW_FAULT_INJECT(GroupCommitThreadFails, thread=(long)PyThread_start_new_thread(GroupCommit_worker, self), thread=-1);
+  if(thread==-1)
+    {
+      Py_DECREF(self);
+      PyErr_Format(PyExc_RuntimeError, "Unable to start the GroupCommit worker thread");
+      return -1;
+    }
+  self->running=1;
+  self->closed=0;
+  return 0;
+}
+
+static void
+GroupCommit_dealloc(GroupCommit *self)
+{
+  /* the worker has a reference so it has exited */
+  assert(!self->running);
+  APSW_CLEAR_WEAKREFS;
+
+  if(self->wakeup)
+    {
+      if(!self->signalled)
+        PyThread_release_lock(self->wakeup);
+      PyThread_free_lock(self->wakeup);
+    }
+  if(self->done)
+    {
+      PyThread_acquire_lock(self->done, NOWAIT_LOCK);
+      PyThread_release_lock(self->done);
+      PyThread_free_lock(self->done);
+    }
+
+  Py_CLEAR(self->queue);
+  Py_CLEAR(self->futuretype);
+  Py_CLEAR(self->connection);
+
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/** .. method:: submit(statements, bindings=None) -> concurrent.futures.Future
+
+  Queues :meth:`Cursor.execute` of *statements* with *bindings* to be
+  run in the next batch.  The future's result is :const:`None` once
+  the batch has been committed, or it has the exception if the
+  statements or the commit failed.  Any rows returned by the
+  statements are discarded.  Transaction control statements such as
+  `COMMIT` and `SAVEPOINT` would affect the transaction of the other
+  changes in the batch, so they fail with :exc:`AuthError`.
+  Cancelling the future before the batch starts means the statements
+  are not run.
+*/
+static PyObject *
+GroupCommit_submit_execute(GroupCommit *self, PyObject *args)
+{
+  CHECK_GROUPCOMMIT_CLOSED(NULL);
+
+  if(PyTuple_GET_SIZE(args)<1 || PyTuple_GET_SIZE(args)>2)
+    return PyErr_Format(PyExc_TypeError, "Incorrect number of arguments.  submit(statements [,bindings])");
+
+  return GroupCommit_submit(self, GROUPCOMMIT_EXECUTE, args);
+}
+
+/** .. method:: submitmany(statements, sequenceofbindings) -> concurrent.futures.Future
+
+  Like :meth:`submit` but runs :meth:`Cursor.executemany` so all the
+  bindings are applied as one change which either all succeed or are
+  all rolled back.
+*/
+static PyObject *
+GroupCommit_submitmany(GroupCommit *self, PyObject *args)
+{
+  CHECK_GROUPCOMMIT_CLOSED(NULL);
+
+  if(PyTuple_GET_SIZE(args)!=2)
+    return PyErr_Format(PyExc_TypeError, "Incorrect number of arguments.  submitmany(statements, sequenceofbindings)");
+
+  return GroupCommit_submit(self, GROUPCOMMIT_EXECUTEMANY, args);
+}
+
+/** .. method:: close()
+
+  Stops the worker thread once it has committed the changes already
+  queued, waiting for it to do so unless called from the worker
+  thread itself (for example in a future's done callback).  Further
+  calls to :meth:`submit` raise :exc:`ConnectionClosedError`.  The
+  wrapped connection is not closed.  You can call this method multiple
+  times.
+*/
+static PyObject *
+GroupCommit_close(GroupCommit *self)
+{
+  if(self->closed)
+    Py_RETURN_NONE;
+
+  self->closed=1;
+  GroupCommit_signal(self);
+
+  if(self->running && self->thread!=(long)PyThread_get_thread_ident())
+    {
+      Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->done, WAIT_LOCK);
+      Py_END_ALLOW_THREADS;
+      /* the worker released it */
+      PyThread_release_lock(self->done);
+    }
+
+  Py_RETURN_NONE;
+}
+
+/** .. method:: stats() -> dict
+
+  Returns counts since this object was created.
+
+    batches
+      Transactions committed, or attempted to be
+    changes
+      Submitted changes that have been committed
+    failed
+      Submitted changes that got an exception
+    largest
+      The most changes committed together
+    queued
+      Changes waiting for the next batch
+*/
+static PyObject *
+GroupCommit_stats(GroupCommit *self)
+{
+  return Py_BuildValue("{s: L, s: L, s: L, s: L, s: n}",
+                       "batches", self->st_batches,
+                       "changes", self->st_changes,
+                       "failed", self->st_failed,
+                       "largest", self->st_largest,
+                       "queued", self->queue?PyList_GET_SIZE(self->queue):(Py_ssize_t)0);
+}
+
+/** .. attribute:: connection
+
+  The :class:`Connection` changes are made on.
+*/
+static PyObject *
+GroupCommit_getconnection(GroupCommit *self)
+{
+  if(!self->connection)
+    Py_RETURN_NONE;
+  Py_INCREF(self->connection);
+  return (PyObject*)self->connection;
+}
+
+static PyMethodDef GroupCommit_methods[] = {
+  {"submit", (PyCFunction)GroupCommit_submit_execute, METH_VARARGS,
+   "Queues statements for the next batch"},
+  {"submitmany", (PyCFunction)GroupCommit_submitmany, METH_VARARGS,
+   "Queues statements with a sequence of bindings for the next batch"},
+  {"close", (PyCFunction)GroupCommit_close, METH_NOARGS,
+   "Stops the worker thread"},
+  {"stats", (PyCFunction)GroupCommit_stats, METH_NOARGS,
+   "Returns group commit statistics"},
+  {0,0,0,0}
+};
+
+static PyGetSetDef GroupCommit_getset[] = {
+  /* name getter setter doc closure */
+  {"connection", (getter)GroupCommit_getconnection, NULL, "The wrapped Connection", NULL},
+  {0,0,0,0,0}
+};
+
+static PyTypeObject GroupCommitType = {
+    APSW_PYTYPE_INIT
+    "apsw.GroupCommit",        /*tp_name*/
+    sizeof(GroupCommit),       /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)GroupCommit_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "Group commit",            /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    offsetof(GroupCommit, weakreflist), /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    GroupCommit_methods,       /* tp_methods */
+    0,                         /* tp_members */
+    GroupCommit_getset,        /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)GroupCommit_init, /* tp_init */
+    0,                         /* tp_alloc */
+    GroupCommit_new,           /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+};
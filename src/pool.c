@@ -0,0 +1,1431 @@
+/*
+  Connection pool code
+
+  See the accompanying LICENSE file.
+*/
+
+/**
+
+.. _pool:
+
+Connection Pool
+***************
+
+Multi-threaded programs often keep a pool of :class:`Connections
+<Connection>` to a database, handing one out to each thread that needs
+to do some work.  :class:`ConnectionPool` does this natively.  All the
+bookkeeping is done while holding the GIL so there is no additional
+Python level locking, and the GIL is only released while waiting for a
+connection to become available.
+
+The pool has one writer connection and up to *readers* read only
+connections.  By default the database is put in `WAL mode
+<https://sqlite.org/wal.html>`__ so the readers can run at the same
+time as the writer::
+
+  pool=apsw.ConnectionPool("database.db", readers=8)
+
+  def handler(request):
+      con=pool.acquire()
+      try:
+          return con.cursor().execute("select ...").fetchall()
+      finally:
+          pool.release(con)
+
+Each connection remembers the thread that last released it, and
+:meth:`ConnectionPool.acquire` gives a thread back the same connection
+when it is idle.  This keeps the :ref:`statement cache
+<statementcache>` of that connection full of the queries the thread
+runs.  Connections are created when needed so :attr:`connection_hooks`
+are run once for each one, not each time it is acquired.
+
+When a connection is released, any transaction left open is rolled
+back.  A connection that has been closed, or whose rollback fails, is
+discarded and a new one will be created when needed.
+
+*/
+
+/** .. class:: ConnectionPool(filename, flags=SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfs=None, statementcachesize=100, statementcachememory=0, readers=4, wal=True)
+
+  Creates a pool of connections to *filename*.  The writer connection
+  is opened immediately with the parameters having the same meaning
+  as for :class:`Connection`.  The reader connections are opened as
+  needed with :const:`SQLITE_OPEN_READONLY` replacing
+  :const:`SQLITE_OPEN_READWRITE` and :const:`SQLITE_OPEN_CREATE` in
+  *flags*.
+
+  :param readers: The most reader connections to have open.  If zero
+    then readers share the writer connection.  It must be zero for
+    in-memory databases since each connection would get its own
+    database.
+  :param wal: Put the database in `WAL mode
+    <https://sqlite.org/wal.html>`__ so readers and the writer don't
+    block each other.
+*/
+
+/* an idle reader connection */
+typedef struct PoolEntry {
+  Connection *connection;
+  long thread;                    /* the thread that released it */
+} PoolEntry;
+
+typedef struct ConnectionPool {
+  PyObject_HEAD
+  PyObject *connargs;             /* positional arguments for Connection */
+  PyObject *writerkwargs;         /* keyword arguments for the writer */
+  PyObject *readerkwargs;         /* keyword arguments for readers */
+  int wal;                        /* set WAL mode when opening the writer */
+  int closed;
+
+  Connection *writer;             /* NULL if it needs to be opened */
+  int writerinuse;
+  struct Checkpointer *checkpointer; /* attached to each writer opened (borrowed) */
+
+  int maxreaders;
+  int nreaders;                   /* readers open or being opened, including idle and in use ones */
+  PoolEntry *idle;                /* idle readers, least recently released first */
+  int nidle;
+  PyObject *inuse;                /* list of readers handed out */
+
+  /* Waiting.  The lock is held except when a waiter is being woken up */
+  PyThread_type_lock readerlock, writerlock;
+  int readerwaiters, writerwaiters;
+  int readersignalled, writersignalled;
+
+  /* statistics returned by stats */
+  sqlite3_int64 st_acquires;
+  sqlite3_int64 st_affinity;
+  sqlite3_int64 st_created;
+  sqlite3_int64 st_waits;
+  sqlite3_int64 st_discarded;
+
+  PyObject *weakreflist;          /* weak reference tracking */
+} ConnectionPool;
+
+static PyTypeObject ConnectionPoolType;
+
+#define CHECK_POOL_CLOSED(e)                                            \
+  do { if(self->closed)                                                 \
+      { PyErr_Format(ExcConnectionClosed, "The ConnectionPool has been closed"); return e; } \
+  } while(0)
+
+static PyObject *
+ConnectionPool_new(PyTypeObject *type, APSW_ARGUNUSED PyObject *args, APSW_ARGUNUSED PyObject *kwds)
+{
+  ConnectionPool *self;
+
+  self=(ConnectionPool*)type->tp_alloc(type, 0);
+  if(self)
+    {
+      self->connargs=0;
+      self->writerkwargs=0;
+      self->readerkwargs=0;
+      self->wal=1;
+      self->closed=1;
+      self->writer=0;
+      self->writerinuse=0;
+      self->checkpointer=0;
+      self->maxreaders=0;
+      self->nreaders=0;
+      self->idle=0;
+      self->nidle=0;
+      self->inuse=0;
+      self->readerlock=0;
+      self->writerlock=0;
+      self->readerwaiters=self->writerwaiters=0;
+      self->readersignalled=self->writersignalled=0;
+      self->st_acquires=self->st_affinity=self->st_created=self->st_waits=self->st_discarded=0;
+      self->weakreflist=0;
+    }
+
+  return (PyObject*)self;
+}
+
+/* Wakes up one waiter if there are any */
+static void
+ConnectionPool_signal(PyThread_type_lock lock, int waiters, int *signalled)
+{
+  if(waiters && !*signalled)
+    {
+      *signalled=1;
+      PyThread_release_lock(lock);
+    }
+}
+
+/* Waits to be signalled or the deadline (apsw_now_ns, zero for none)
+   to pass.  Returns 0 if signalled, otherwise -1 with an exception. */
+static int
+ConnectionPool_wait(ConnectionPool *self, PyThread_type_lock lock, int *waiters, int *signalled, sqlite3_int64 deadline)
+{
+  int got, i;
+  sqlite3_int64 remaining=0;
+
+  if(deadline)
+    {
+      remaining=deadline-apsw_now_ns();
+      if(remaining<0)
+        remaining=0;
+    }
+
+  self->st_waits++;
+  (*waiters)++;
+  Py_BEGIN_ALLOW_THREADS
+#if PY_VERSION_HEX >= 0x03020000
+    {
+      PY_TIMEOUT_T microseconds=-1;
+      if(deadline)
+        microseconds=(remaining/1000 > PY_TIMEOUT_MAX)?PY_TIMEOUT_MAX:(PY_TIMEOUT_T)(remaining/1000);
+      got=PyThread_acquire_lock_timed(lock, microseconds, 0)==PY_LOCK_ACQUIRED;
+    }
+#else
+    got=PyThread_acquire_lock(lock, deadline?NOWAIT_LOCK:WAIT_LOCK);
+#endif
+  Py_END_ALLOW_THREADS;
+  (*waiters)--;
+
+  if(got)
+    {
+      *signalled=0;
+      return 0;
+    }
+
+  for(i=0; exc_descriptors[i].name; i++)
+    if(exc_descriptors[i].code==SQLITE_BUSY)
+      {
+        PyErr_Format(exc_descriptors[i].cls, "BusyError: Timed out waiting for a connection from the ConnectionPool");
+        break;
+      }
+  assert(PyErr_Occurred());
+  return -1;
+}
+
+/* Returns a new Connection or NULL with an exception */
+static Connection *
+ConnectionPool_open(ConnectionPool *self, int writer)
+{
+  Connection *connection;
+  int res;
+
+  connection=(Connection*)PyObject_Call((PyObject*)&ConnectionType, self->connargs, writer?self->writerkwargs:self->readerkwargs);
+  if(!connection)
+    return NULL;
+  self->st_created++;
+
+  if(writer && self->wal)
+    {
+      _PYSQLITE_CALL_E(connection->db,
+        APSW_FAULT_INJECT(PoolWALFails, res=sqlite3_exec(connection->db, "pragma journal_mode=wal", NULL, NULL, NULL), res=SQLITE_IOERR)
+        );
+      if(res!=SQLITE_OK)
+        {
+          SET_EXC(res, connection->db);
+          Py_DECREF(connection);
+          return NULL;
+        }
+    }
+#if PY_VERSION_HEX >= 0x03020000
+  if(writer && self->checkpointer)
+    Checkpointer_attach(self->checkpointer, connection);
+#endif
+  return connection;
+}
+
+static int
+ConnectionPool_init(ConnectionPool *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[]={"filename", "flags", "vfs", "statementcachesize", "statementcachememory", "readers", "wal", NULL};
+  char *filename=NULL;
+  int flags=SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  PyObject *vfs=Py_None;
+  int statementcachesize=100;
+  long long statementcachememory=0;
+  int readers=4, wal=1, readerflags;
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "es|iOiLii:ConnectionPool(filename, flags=SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, vfs=None, statementcachesize=100, statementcachememory=0, readers=4, wal=True)",
+                                  kwlist, STRENCODING, &filename, &flags, &vfs, &statementcachesize, &statementcachememory, &readers, &wal))
+    return -1;
+
+  if(readers<0)
+    {
+      PyErr_Format(PyExc_ValueError, "readers must be zero or more");
+      goto error;
+    }
+  if(readers && (!*filename || 0==strcmp(filename, ":memory:")))
+    {
+      PyErr_Format(PyExc_ValueError, "readers must be zero for in-memory databases");
+      goto error;
+    }
+  if(self->connargs)
+    {
+      PyErr_Format(PyExc_RuntimeError, "ConnectionPool is already initialized");
+      goto error;
+    }
+
+  /* readers are read only.  They also never set WAL mode */
+  readerflags=(flags & ~(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)) | SQLITE_OPEN_READONLY;
+  self->wal=wal && !(flags & SQLITE_OPEN_READONLY);
+  self->maxreaders=readers;
+
+  self->connargs=Py_BuildValue("(N)", convertutf8string(filename));
+  self->writerkwargs=Py_BuildValue("{s: i, s: O, s: i, s: L}", "flags", flags, "vfs", vfs,
+                                   "statementcachesize", statementcachesize, "statementcachememory", statementcachememory);
+  self->readerkwargs=Py_BuildValue("{s: i, s: O, s: i, s: L}", "flags", readerflags, "vfs", vfs,
+                                   "statementcachesize", statementcachesize, "statementcachememory", statementcachememory);
+  self->inuse=PyList_New(0);
+  if(!self->connargs || !self->writerkwargs || !self->readerkwargs || !self->inuse)
+    goto error;
+
+  if(readers)
+    {
+      self->idle=PyMem_Malloc(sizeof(PoolEntry)*readers);
+      if(!self->idle)
+        {
+          PyErr_NoMemory();
+          goto error;
+        }
+    }
+
+  APSW_FAULT_INJECT(PoolLockAllocFails,
+                    (self->readerlock=PyThread_allocate_lock(), self->writerlock=PyThread_allocate_lock()),
+                    (self->readerlock=self->writerlock=NULL));
+  if(!self->readerlock || !self->writerlock)
+    {
+      PyErr_NoMemory();
+      goto error;
+    }
+  /* held until a waiter is signalled */
+  PyThread_acquire_lock(self->readerlock, WAIT_LOCK);
+  PyThread_acquire_lock(self->writerlock, WAIT_LOCK);
+
+  self->writer=ConnectionPool_open(self, 1);
+  if(!self->writer)
+    goto error;
+
+  self->closed=0;
+  PyMem_Free(filename);
+  return 0;
+
+ error:
+  PyMem_Free(filename);
+  return -1;
+}
+
+/* Closes a connection that is no longer part of the pool, writing
+   any error as unraiseable */
+static void
+ConnectionPool_discard(Connection *connection)
+{
+  PyObject *res=Call_PythonMethodV((PyObject*)connection, "close", 1, "(i)", 1);
+  if(!res)
+    apsw_write_unraiseable(NULL);
+  Py_XDECREF(res);
+}
+
+static void
+ConnectionPool_dealloc(ConnectionPool *self)
+{
+  APSW_CLEAR_WEAKREFS;
+
+  while(self->nidle)
+    {
+      Connection *connection=self->idle[--self->nidle].connection;
+      ConnectionPool_discard(connection);
+      Py_DECREF(connection);
+    }
+  PyMem_Free(self->idle);
+
+  /* connections still in use keep working but aren't returned to
+     the pool */
+  Py_CLEAR(self->writer);
+  Py_CLEAR(self->inuse);
+  Py_CLEAR(self->connargs);
+  Py_CLEAR(self->writerkwargs);
+  Py_CLEAR(self->readerkwargs);
+
+  /* there can't be any waiters as they have a reference to us */
+  if(self->readerlock)
+    {
+      if(!self->readersignalled)
+        PyThread_release_lock(self->readerlock);
+      PyThread_free_lock(self->readerlock);
+    }
+  if(self->writerlock)
+    {
+      if(!self->writersignalled)
+        PyThread_release_lock(self->writerlock);
+      PyThread_free_lock(self->writerlock);
+    }
+
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/** .. method:: acquire(write=False, timeout=-1) -> Connection
+
+  Returns a connection from the pool which you must give back with
+  :meth:`release` when done.  A reader connection is returned unless
+  *write* is true, preferring the one this thread last released if it
+  is idle.  When all connections are in use this waits until one is
+  released.
+
+  :param write: If true then the writer connection is returned.
+    There is only one so this waits if another thread has it.
+  :param timeout: How many seconds to wait for a connection before
+    raising :exc:`BusyError`.  Negative means wait forever.  Before
+    Python 3.2 only negative and zero are supported, with other values
+    treated as zero.
+*/
+static PyObject *
+ConnectionPool_acquire(ConnectionPool *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[]={"write", "timeout", NULL};
+  int write=0;
+  double timeout=-1;
+  sqlite3_int64 deadline=0;
+  Connection *connection;
+
+  CHECK_POOL_CLOSED(NULL);
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "|id:acquire(write=False, timeout=-1)", kwlist, &write, &timeout))
+    return NULL;
+
+  if(timeout>=0)
+    deadline=apsw_now_ns()+(sqlite3_int64)(timeout*1000000000.0);
+
+  for(;;)
+    {
+      if(self->closed)
+        {
+          /* pass on the wakeup from close */
+          ConnectionPool_signal(self->readerlock, self->readerwaiters, &self->readersignalled);
+          ConnectionPool_signal(self->writerlock, self->writerwaiters, &self->writersignalled);
+          CHECK_POOL_CLOSED(NULL);
+        }
+
+      if(write || !self->maxreaders)
+        {
+          if(!self->writerinuse)
+            {
+              self->writerinuse=1;
+              if(!self->writer)
+                {
+                  /* the previous one was discarded */
+                  self->writer=ConnectionPool_open(self, 1);
+                  if(!self->writer)
+                    {
+                      self->writerinuse=0;
+                      ConnectionPool_signal(self->writerlock, self->writerwaiters, &self->writersignalled);
+                      return NULL;
+                    }
+                }
+              self->st_acquires++;
+              Py_INCREF(self->writer);
+              return (PyObject*)self->writer;
+            }
+          if(ConnectionPool_wait(self, self->writerlock, &self->writerwaiters, &self->writersignalled, deadline))
+            return NULL;
+          continue;
+        }
+
+      if(self->nidle)
+        {
+          long thread=PyThread_get_thread_ident();
+          int i, chosen=0;
+
+          /* the connection this thread last used, otherwise the one
+             idle longest as its thread is least likely to want it */
+          for(i=self->nidle-1; i>=0; i--)
+            if(self->idle[i].thread==thread)
+              {
+                chosen=i;
+                self->st_affinity++;
+                break;
+              }
+          connection=self->idle[chosen].connection;
+          memmove(self->idle+chosen, self->idle+chosen+1, sizeof(PoolEntry)*(self->nidle-chosen-1));
+          self->nidle--;
+        }
+      else if(self->nreaders<self->maxreaders)
+        {
+          /* reserve the slot as opening runs Python code */
+          self->nreaders++;
+          connection=ConnectionPool_open(self, 0);
+          if(!connection)
+            {
+              self->nreaders--;
+              ConnectionPool_signal(self->readerlock, self->readerwaiters, &self->readersignalled);
+              return NULL;
+            }
+        }
+      else
+        {
+          if(ConnectionPool_wait(self, self->readerlock, &self->readerwaiters, &self->readersignalled, deadline))
+            return NULL;
+          continue;
+        }
+
+      if(PyList_Append(self->inuse, (PyObject*)connection))
+        {
+          /* put it back */
+          self->idle[self->nidle].connection=connection;
+          self->idle[self->nidle].thread=0;
+          self->nidle++;
+          return NULL;
+        }
+      /* pass on the wakeup if another can be satisfied */
+      if(self->nidle || self->nreaders<self->maxreaders)
+        ConnectionPool_signal(self->readerlock, self->readerwaiters, &self->readersignalled);
+      self->st_acquires++;
+      return (PyObject*)connection;
+    }
+}
+
+/* Makes the connection ready for reuse.  Returns false if it should
+   be discarded instead. */
+static int
+ConnectionPool_healthy(Connection *connection)
+{
+  int res;
+
+  if(!connection->db)
+    return 0;
+
+  if(sqlite3_get_autocommit(connection->db))
+    return 1;
+
+  /* a transaction was left open */
+  _PYSQLITE_CALL_E(connection->db,
+    APSW_FAULT_INJECT(PoolRollbackFails, res=sqlite3_exec(connection->db, "rollback", NULL, NULL, NULL), res=SQLITE_IOERR)
+    );
+  return res==SQLITE_OK;
+}
+
+/** .. method:: release(connection)
+
+  Returns a connection obtained from :meth:`acquire` to the pool.  An
+  open transaction is rolled back.  If the connection has been
+  closed, or the rollback fails, then it is discarded and a new
+  connection will be opened when needed.
+
+  After the pool has been closed, released connections are closed.
+*/
+static PyObject *
+ConnectionPool_release(ConnectionPool *self, PyObject *connection)
+{
+  Py_ssize_t i;
+  Connection *con=(Connection*)connection;
+  int keep;
+
+  if(connection==(PyObject*)self->writer && self->writer)
+    {
+      if(!self->writerinuse)
+        return PyErr_Format(PyExc_ValueError, "The connection is not acquired from this ConnectionPool");
+
+      keep=ConnectionPool_healthy(con) && !self->closed;
+      if(!keep)
+        {
+          self->st_discarded+=!self->closed;
+          ConnectionPool_discard(con);
+          Py_CLEAR(self->writer);
+        }
+      self->writerinuse=0;
+      ConnectionPool_signal(self->writerlock, self->writerwaiters, &self->writersignalled);
+      Py_RETURN_NONE;
+    }
+
+  for(i=0; self->inuse && i<PyList_GET_SIZE(self->inuse); i++)
+    if(PyList_GET_ITEM(self->inuse, i)==connection)
+      break;
+  if(!self->inuse || i==PyList_GET_SIZE(self->inuse))
+    return PyErr_Format(PyExc_ValueError, "The connection is not acquired from this ConnectionPool");
+
+  /* the list owns the reference we now own */
+  Py_INCREF(connection);
+  if(PySequence_DelItem(self->inuse, i))
+    {
+      Py_DECREF(connection);
+      return NULL;
+    }
+
+  keep=ConnectionPool_healthy(con) && !self->closed;
+  if(keep)
+    {
+      assert(self->nidle<self->maxreaders);
+      self->idle[self->nidle].connection=con;
+      self->idle[self->nidle].thread=PyThread_get_thread_ident();
+      self->nidle++;
+    }
+  else
+    {
+      self->st_discarded+=!self->closed;
+      self->nreaders--;
+      ConnectionPool_discard(con);
+      Py_DECREF(connection);
+    }
+  ConnectionPool_signal(self->readerlock, self->readerwaiters, &self->readersignalled);
+
+  Py_RETURN_NONE;
+}
+
+/** .. method:: close()
+
+  Closes the idle connections and the writer if it isn't in use.
+  Connections currently acquired are closed when they are released.
+  Threads waiting in :meth:`acquire` get :exc:`ConnectionClosedError`.
+  You can call this method multiple times.
+*/
+static PyObject *
+ConnectionPool_close(ConnectionPool *self)
+{
+  self->closed=1;
+
+  while(self->nidle)
+    {
+      Connection *connection=self->idle[--self->nidle].connection;
+      self->nreaders--;
+      ConnectionPool_discard(connection);
+      Py_DECREF(connection);
+    }
+  if(self->writer && !self->writerinuse)
+    {
+      ConnectionPool_discard(self->writer);
+      Py_CLEAR(self->writer);
+    }
+
+#if PY_VERSION_HEX >= 0x03020000
+  if(self->checkpointer)
+    Checkpointer_sourceclosed(self->checkpointer, (PyObject*)self);
+#endif
+
+  /* waiters see we are closed and pass the wakeup on */
+  ConnectionPool_signal(self->readerlock, self->readerwaiters, &self->readersignalled);
+  ConnectionPool_signal(self->writerlock, self->writerwaiters, &self->writersignalled);
+
+  Py_RETURN_NONE;
+}
+
+/* Fanning out read only queries across reader connections.  The
+   bindings going in and the rows coming out are encoded into buffers
+   so the worker threads never need the GIL.  Each value is a type
+   byte followed by the int64, double, or int length and bytes. */
+
+typedef struct FanoutBuffer {
+  unsigned char *data;            /* allocated with sqlite3_realloc64 */
+  size_t size;
+  size_t allocated;
+} FanoutBuffer;
+
+enum { FANOUT_OK, FANOUT_NOTREADONLY, FANOUT_MULTIPLE, FANOUT_BINDCOUNT };
+
+/* how many times a query is prepared again if the schema changed
+   while preparing it */
+#define FANOUT_SCHEMA_RETRIES 5
+
+typedef struct FanoutQuery {
+  PyObject *utf8;                 /* query text */
+  const char *sql;
+  int sqllen;
+  FanoutBuffer bindings;
+  int nbindings;
+  FanoutBuffer rows;
+  int ncolumns;
+  Py_ssize_t nrows;
+  int res;                        /* SQLite error code */
+  int problem;                    /* one of the FANOUT_ values */
+  int nparams;                    /* what the statement wanted for FANOUT_BINDCOUNT */
+  char *errmsg;                   /* allocated with sqlite3_mprintf */
+} FanoutQuery;
+
+typedef struct FanoutState {
+  FanoutQuery *queries;
+  int nqueries;
+  int next;                       /* next query to run */
+  int running;                    /* workers not finished */
+  PyThread_type_lock mutex;       /* protects next and running */
+  PyThread_type_lock finished;    /* held until the last worker finishes */
+} FanoutState;
+
+typedef struct FanoutWorker {
+  FanoutState *state;
+  sqlite3 *db;
+} FanoutWorker;
+
+static int
+fanoutbuffer_append(FanoutBuffer *buf, const void *data, size_t len)
+{
+  if(buf->size+len>buf->allocated)
+    {
+      size_t newsize=buf->allocated?buf->allocated*2:256;
+      unsigned char *newdata;
+
+      while(newsize<buf->size+len)
+        newsize*=2;
+      APSW_FAULT_INJECT(FanoutBufferAllocFails,
+                        PYSQLITE_HELD_CALL(newdata=sqlite3_realloc64(buf->data, newsize)),
+                        newdata=NULL);
+      if(!newdata)
+        return SQLITE_NOMEM;
+      buf->data=newdata;
+      buf->allocated=newsize;
+    }
+  memcpy(buf->data+buf->size, data, len);
+  buf->size+=len;
+  return SQLITE_OK;
+}
+
+static int
+fanoutbuffer_value(FanoutBuffer *buf, int type, sqlite3_int64 ival, double dval, const void *data, int len)
+{
+  unsigned char t=(unsigned char)type;
+  int res=fanoutbuffer_append(buf, &t, 1);
+
+  if(res==SQLITE_OK)
+    switch(type)
+      {
+      case SQLITE_INTEGER:
+        res=fanoutbuffer_append(buf, &ival, sizeof(ival));
+        break;
+      case SQLITE_FLOAT:
+        res=fanoutbuffer_append(buf, &dval, sizeof(dval));
+        break;
+      case SQLITE_TEXT:
+      case SQLITE_BLOB:
+        res=fanoutbuffer_append(buf, &len, sizeof(len));
+        if(res==SQLITE_OK && len)
+          res=fanoutbuffer_append(buf, data, len);
+        break;
+      }
+  return res;
+}
+
+/* Decodes the value at *p advancing it past */
+static int
+fanoutbuffer_next(const unsigned char **p, sqlite3_int64 *ival, double *dval, const unsigned char **data, int *len)
+{
+  int type=*(*p)++;
+
+  switch(type)
+    {
+    case SQLITE_INTEGER:
+      memcpy(ival, *p, sizeof(*ival));
+      *p+=sizeof(*ival);
+      break;
+    case SQLITE_FLOAT:
+      memcpy(dval, *p, sizeof(*dval));
+      *p+=sizeof(*dval);
+      break;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      memcpy(len, *p, sizeof(*len));
+      *p+=sizeof(*len);
+      *data=*p;
+      *p+=*len;
+      break;
+    }
+  return type;
+}
+
+/* Encodes a binding.  Returns 0 on success, otherwise -1 with an
+   exception */
+static int
+ConnectionPool_fanoutbinding(FanoutBuffer *buf, PyObject *obj, int arg)
+{
+  int res;
+
+  if(obj==Py_None)
+    res=fanoutbuffer_value(buf, SQLITE_NULL, 0, 0, NULL, 0);
+#if PY_MAJOR_VERSION < 3
+  else if(PyInt_Check(obj))
+    res=fanoutbuffer_value(buf, SQLITE_INTEGER, PyInt_AS_LONG(obj), 0, NULL, 0);
+#endif
+  else if(PyLong_Check(obj))
+    {
+      sqlite3_int64 v=PyLong_AsLongLong(obj);
+      if(v==-1 && PyErr_Occurred())
+        return -1;
+      res=fanoutbuffer_value(buf, SQLITE_INTEGER, v, 0, NULL, 0);
+    }
+  else if(PyFloat_Check(obj))
+    res=fanoutbuffer_value(buf, SQLITE_FLOAT, 0, PyFloat_AS_DOUBLE(obj), NULL, 0);
+  else if(PyUnicode_Check(obj)
+#if PY_MAJOR_VERSION < 3
+          || PyString_Check(obj)
+#endif
+          )
+    {
+      PyObject *utf8=getutf8string(obj);
+      if(!utf8)
+        return -1;
+      if(PyBytes_GET_SIZE(utf8)>APSW_INT32_MAX)
+        {
+          Py_DECREF(utf8);
+          SET_EXC(SQLITE_TOOBIG, NULL);
+          return -1;
+        }
+      res=fanoutbuffer_value(buf, SQLITE_TEXT, 0, 0, PyBytes_AS_STRING(utf8), (int)PyBytes_GET_SIZE(utf8));
+      Py_DECREF(utf8);
+    }
+  else if(PyObject_CheckReadBuffer(obj))
+    {
+      const void *buffer;
+      Py_ssize_t buflen;
+
+      if(PyObject_AsReadBuffer(obj, &buffer, &buflen))
+        return -1;
+      if(buflen>APSW_INT32_MAX)
+        {
+          SET_EXC(SQLITE_TOOBIG, NULL);
+          return -1;
+        }
+      res=fanoutbuffer_value(buf, SQLITE_BLOB, 0, 0, buffer, (int)buflen);
+    }
+  else
+    {
+      PyErr_Format(PyExc_TypeError, "Bad binding argument type supplied - argument #%d: type %s", arg, Py_TYPE(obj)->tp_name);
+      return -1;
+    }
+
+  if(res!=SQLITE_OK)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+  return 0;
+}
+
+/* Runs one query on the worker thread with the database mutex held */
+static void
+ConnectionPool_fanoutquery(sqlite3 *db, FanoutQuery *q)
+{
+  sqlite3_stmt *stmt=NULL;
+  const char *tail=NULL;
+  const unsigned char *b, *data=NULL;
+  sqlite3_int64 ival=0;
+  double dval=0;
+  int res, i, type, len=0, readonly, retries=0;
+
+  for(;;)
+    {
+      PYSQLITE_HELD_CALL(res=sqlite3_prepare_v2(db, q->sql, q->sqllen+1, &stmt, &tail));
+      if(res!=SQLITE_SCHEMA || retries++>=FANOUT_SCHEMA_RETRIES)
+        break;
+      /* The reader hadn't seen a schema change made by the writer.
+         SQLite only reloads the schema when a table is looked up, so
+         a failing query not naming any would get SQLITE_SCHEMA again
+         instead of its real error. */
+      PYSQLITE_HELD_CALL(sqlite3_prepare_v2(db, "select 1 from sqlite_master", -1, &stmt, NULL));
+      PYSQLITE_HELD_CALL(sqlite3_finalize(stmt));
+      stmt=NULL;
+    }
+  if(res!=SQLITE_OK)
+    goto error;
+  while(tail && tail<q->sql+q->sqllen && strchr(" \t\r\n\f\v;", *tail))
+    tail++;
+  if(tail && tail<q->sql+q->sqllen)
+    {
+      q->problem=FANOUT_MULTIPLE;
+      goto finally;
+    }
+  if(!stmt)
+    goto finally;
+
+  PYSQLITE_HELD_CALL(readonly=sqlite3_stmt_readonly(stmt));
+  if(!readonly)
+    {
+      q->problem=FANOUT_NOTREADONLY;
+      goto finally;
+    }
+
+  q->nparams=sqlite3_bind_parameter_count(stmt);
+  if(q->nparams!=q->nbindings)
+    {
+      q->problem=FANOUT_BINDCOUNT;
+      goto finally;
+    }
+
+  b=q->bindings.data;
+  for(i=1; i<=q->nbindings; i++)
+    {
+      switch(fanoutbuffer_next(&b, &ival, &dval, &data, &len))
+        {
+        case SQLITE_INTEGER:
+          PYSQLITE_HELD_CALL(res=sqlite3_bind_int64(stmt, i, ival));
+          break;
+        case SQLITE_FLOAT:
+          PYSQLITE_HELD_CALL(res=sqlite3_bind_double(stmt, i, dval));
+          break;
+        case SQLITE_TEXT:
+          PYSQLITE_HELD_CALL(res=sqlite3_bind_text(stmt, i, (const char*)data, len, SQLITE_STATIC));
+          break;
+        case SQLITE_BLOB:
+          PYSQLITE_HELD_CALL(res=sqlite3_bind_blob(stmt, i, data, len, SQLITE_STATIC));
+          break;
+        default:
+          PYSQLITE_HELD_CALL(res=sqlite3_bind_null(stmt, i));
+          break;
+        }
+      if(res!=SQLITE_OK)
+        goto error;
+    }
+
+  q->ncolumns=sqlite3_column_count(stmt);
+  for(;;)
+    {
+      PYSQLITE_HELD_CALL(res=sqlite3_step(stmt));
+      if(res!=SQLITE_ROW)
+        break;
+      for(i=0; i<q->ncolumns; i++)
+        {
+          PYSQLITE_HELD_CALL(type=sqlite3_column_type(stmt, i));
+          switch(type)
+            {
+            case SQLITE_INTEGER:
+              PYSQLITE_HELD_CALL(ival=sqlite3_column_int64(stmt, i));
+              break;
+            case SQLITE_FLOAT:
+              PYSQLITE_HELD_CALL(dval=sqlite3_column_double(stmt, i));
+              break;
+            case SQLITE_TEXT:
+              PYSQLITE_HELD_CALL(data=sqlite3_column_text(stmt, i));
+              PYSQLITE_HELD_CALL(len=sqlite3_column_bytes(stmt, i));
+              break;
+            case SQLITE_BLOB:
+              PYSQLITE_HELD_CALL(data=sqlite3_column_blob(stmt, i));
+              PYSQLITE_HELD_CALL(len=sqlite3_column_bytes(stmt, i));
+              break;
+            }
+          if(fanoutbuffer_value(&q->rows, type, ival, dval, data, len)!=SQLITE_OK)
+            {
+              res=SQLITE_NOMEM;
+              PYSQLITE_HELD_CALL(q->errmsg=sqlite3_mprintf("out of memory"));
+              goto error;
+            }
+        }
+      q->nrows++;
+    }
+  if(res==SQLITE_DONE)
+    goto finally;
+
+ error:
+  q->res=res;
+  if(!q->errmsg)
+    PYSQLITE_HELD_CALL(q->errmsg=sqlite3_mprintf("%s", sqlite3_errmsg(db)));
+
+ finally:
+  PYSQLITE_HELD_CALL(sqlite3_finalize(stmt));
+}
+
+/* Worker thread (and the calling thread) taking queries until there
+   are none left.  The GIL is not held. */
+static void
+ConnectionPool_fanoutworker(void *arg)
+{
+  FanoutWorker *worker=(FanoutWorker*)arg;
+  FanoutState *state=worker->state;
+  int i, last;
+
+  PYSQLITE_HELD_CALL(sqlite3_mutex_enter(sqlite3_db_mutex(worker->db)));
+  for(;;)
+    {
+      PyThread_acquire_lock(state->mutex, WAIT_LOCK);
+      i=state->next++;
+      PyThread_release_lock(state->mutex);
+      if(i>=state->nqueries)
+        break;
+      ConnectionPool_fanoutquery(worker->db, state->queries+i);
+    }
+  PYSQLITE_HELD_CALL(sqlite3_mutex_leave(sqlite3_db_mutex(worker->db)));
+
+  PyThread_acquire_lock(state->mutex, WAIT_LOCK);
+  last=(--state->running==0);
+  PyThread_release_lock(state->mutex);
+  if(last)
+    PyThread_release_lock(state->finished);
+}
+
+/* Returns the rows of a query as a list of tuples, appending them to
+   list if it is not NULL */
+static PyObject *
+ConnectionPool_fanoutrows(FanoutQuery *q, PyObject *list)
+{
+  const unsigned char *p=q->rows.data, *data=NULL;
+  sqlite3_int64 ival=0;
+  double dval=0;
+  int len=0, col;
+  Py_ssize_t row;
+
+  if(list)
+    Py_INCREF(list);
+  else
+    {
+      list=PyList_New(0);
+      if(!list)
+        return NULL;
+    }
+
+  for(row=0; row<q->nrows; row++)
+    {
+      PyObject *tuple=PyTuple_New(q->ncolumns);
+      if(!tuple)
+        goto error;
+      for(col=0; col<q->ncolumns; col++)
+        {
+          PyObject *value;
+          switch(fanoutbuffer_next(&p, &ival, &dval, &data, &len))
+            {
+            case SQLITE_INTEGER:
+              value=PyLong_FromLongLong(ival);
+              break;
+            case SQLITE_FLOAT:
+              value=PyFloat_FromDouble(dval);
+              break;
+            case SQLITE_TEXT:
+              value=convertutf8stringsize((const char*)data, len);
+              break;
+            case SQLITE_BLOB:
+              value=converttobytes((const char*)data, len);
+              break;
+            default:
+              value=Py_None;
+              Py_INCREF(value);
+              break;
+            }
+          if(!value)
+            {
+              Py_DECREF(tuple);
+              goto error;
+            }
+          PyTuple_SET_ITEM(tuple, col, value);
+        }
+      if(PyList_Append(list, tuple))
+        {
+          Py_DECREF(tuple);
+          goto error;
+        }
+      Py_DECREF(tuple);
+    }
+  return list;
+
+ error:
+  Py_DECREF(list);
+  return NULL;
+}
+
+/* Raises the error for a query returning -1, or returns 0 if it
+   succeeded */
+static int
+ConnectionPool_fanouterror(FanoutQuery *q, int index, sqlite3 *db)
+{
+  switch(q->problem)
+    {
+    case FANOUT_NOTREADONLY:
+      PyErr_Format(PyExc_ValueError, "Query %d is not read only", index);
+      return -1;
+    case FANOUT_MULTIPLE:
+      PyErr_Format(PyExc_ValueError, "Query %d contains more than one statement", index);
+      return -1;
+    case FANOUT_BINDCOUNT:
+      PyErr_Format(ExcBindings, "Incorrect number of bindings supplied for query %d.  The statement uses %d and there are %d supplied.", index, q->nparams, q->nbindings);
+      return -1;
+    }
+  if(q->res!=SQLITE_OK)
+    {
+      apsw_set_errmsg(q->errmsg?q->errmsg:"error");
+      SET_EXC(q->res, db);
+      return -1;
+    }
+  return 0;
+}
+
+/** .. method:: fanout(queries, merge=True, timeout=-1) -> list
+
+  Runs read only queries concurrently, one per reader connection at
+  a time, and returns their rows.  This is useful for reports made of
+  independent pieces such as per partition aggregates or the parts of
+  a ``UNION ALL``::
+
+    rows=pool.fanout([("select sum(amount) from sales where region=?", (region,))
+                      for region in regions])
+
+  Idle reader connections (up to one per query) are used, creating
+  them if the pool isn't at its limit.  Each runs in its own native
+  thread taking the next query as it finishes the previous one.
+  SQLite's work happens without the GIL, and the values are copied
+  natively with Python objects only made once all the queries have
+  finished.  Statements are prepared directly rather than going
+  through the :ref:`statement cache <statementcache>`.
+
+  :param queries: A sequence where each item is either the SQL text
+    or a tuple of the SQL text and a sequence of bindings.  Each must
+    be a single read only statement.  Only sequence bindings of
+    ``None``, integers, floats, strings and bytes are supported.
+  :param merge: If true then the rows are returned as a single list
+    in query order (like ``UNION ALL``), otherwise there is a list of
+    rows for each query.
+  :param timeout: How long to wait for the first connection as for
+    :meth:`acquire`.  Further connections are only used if they are
+    available immediately.
+
+  If a query fails then the exception for the first failing query is
+  raised.  An exception raised in a user defined function may be
+  reported as :exc:`SQLError` since it happened in another thread.
+*/
+static PyObject *
+ConnectionPool_fanout(ConnectionPool *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[]={"queries", "merge", "timeout", NULL};
+  PyObject *queries=NULL, *seq=NULL, *connections=NULL, *retval=NULL, *acqargs=NULL;
+  int merge=1, nconnections=0, i, j, maxconnections;
+  double timeout=-1;
+  Py_ssize_t nqueries;
+  FanoutState state;
+  FanoutWorker *workers=NULL;
+  PyObject *busy=NULL;
+
+  CHECK_POOL_CLOSED(NULL);
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|id:fanout(queries, merge=True, timeout=-1)", kwlist, &queries, &merge, &timeout))
+    return NULL;
+
+  memset(&state, 0, sizeof(state));
+
+  seq=PySequence_Fast(queries, "queries must be a sequence");
+  if(!seq)
+    return NULL;
+  nqueries=PySequence_Fast_GET_SIZE(seq);
+  if(nqueries>APSW_INT32_MAX)
+    {
+      PyErr_Format(PyExc_ValueError, "Too many queries");
+      goto finally;
+    }
+  state.nqueries=(int)nqueries;
+
+  if(nqueries)
+    {
+      state.queries=PyMem_Malloc(sizeof(FanoutQuery)*nqueries);
+      if(!state.queries)
+        {
+          PyErr_NoMemory();
+          goto finally;
+        }
+      memset(state.queries, 0, sizeof(FanoutQuery)*nqueries);
+    }
+
+  for(i=0; i<state.nqueries; i++)
+    {
+      FanoutQuery *q=state.queries+i;
+      PyObject *item=PySequence_Fast_GET_ITEM(seq, i), *sql=item, *bindings=Py_None;
+
+      if(PyTuple_Check(item) || PyList_Check(item))
+        {
+          if(PySequence_Size(item)!=2)
+            {
+              PyErr_Format(PyExc_TypeError, "Query %d must be the SQL text or a tuple of the SQL text and bindings", i);
+              goto finally;
+            }
+          sql=PySequence_Fast_GET_ITEM(item, 0);
+          bindings=PySequence_Fast_GET_ITEM(item, 1);
+        }
+      if(!PyUnicode_Check(sql)
+#if PY_MAJOR_VERSION < 3
+         && !PyString_Check(sql)
+#endif
+         )
+        {
+          PyErr_Format(PyExc_TypeError, "Query %d must be the SQL text or a tuple of the SQL text and bindings", i);
+          goto finally;
+        }
+      q->utf8=getutf8string(sql);
+      if(!q->utf8)
+        goto finally;
+      if(PyBytes_GET_SIZE(q->utf8)>APSW_INT32_MAX)
+        {
+          SET_EXC(SQLITE_TOOBIG, NULL);
+          goto finally;
+        }
+      q->sql=PyBytes_AS_STRING(q->utf8);
+      q->sqllen=(int)PyBytes_GET_SIZE(q->utf8);
+
+      if(bindings!=Py_None)
+        {
+          PyObject *fast;
+
+          if(PyDict_Check(bindings))
+            {
+              PyErr_Format(PyExc_TypeError, "Query %d: fanout only supports sequence bindings", i);
+              goto finally;
+            }
+          fast=PySequence_Fast(bindings, "Bindings must be a sequence");
+          if(!fast)
+            goto finally;
+          if(PySequence_Fast_GET_SIZE(fast)>APSW_INT32_MAX)
+            {
+              Py_DECREF(fast);
+              PyErr_Format(PyExc_ValueError, "Too many bindings");
+              goto finally;
+            }
+          q->nbindings=(int)PySequence_Fast_GET_SIZE(fast);
+          for(j=0; j<q->nbindings; j++)
+            if(ConnectionPool_fanoutbinding(&q->bindings, PySequence_Fast_GET_ITEM(fast, j), j))
+              {
+                Py_DECREF(fast);
+                goto finally;
+              }
+          Py_DECREF(fast);
+        }
+    }
+
+  if(!state.nqueries)
+    {
+      retval=PyList_New(0);
+      goto finally;
+    }
+
+  /* the first connection waits, the others are only used if
+     available now */
+  maxconnections=self->maxreaders?self->maxreaders:1;
+  if(maxconnections>state.nqueries)
+    maxconnections=state.nqueries;
+  connections=PyList_New(0);
+  if(!connections)
+    goto finally;
+  for(i=0; exc_descriptors[i].name; i++)
+    if(exc_descriptors[i].code==SQLITE_BUSY)
+      busy=exc_descriptors[i].cls;
+  while(nconnections<maxconnections)
+    {
+      PyObject *connection;
+
+      acqargs=Py_BuildValue("(id)", 0, nconnections?0.0:timeout);
+      if(!acqargs)
+        goto finally;
+      connection=ConnectionPool_acquire(self, acqargs, NULL);
+      Py_CLEAR(acqargs);
+      if(!connection)
+        {
+          if(nconnections && PyErr_ExceptionMatches(busy))
+            {
+              PyErr_Clear();
+              break;
+            }
+          goto finally;
+        }
+      if(PyList_Append(connections, connection))
+        {
+          PyObject *etype, *evalue, *etb;
+          PyErr_Fetch(&etype, &evalue, &etb);
+          Py_XDECREF(ConnectionPool_release(self, connection));
+          PyErr_Restore(etype, evalue, etb);
+          Py_DECREF(connection);
+          goto finally;
+        }
+      Py_DECREF(connection);
+      nconnections++;
+      if(!((Connection*)connection)->db || ((Connection*)connection)->inuse)
+        {
+          PyErr_Format(ExcThreadingViolation, "A connection from the pool is closed or in use");
+          goto finally;
+        }
+    }
+
+  APSW_FAULT_INJECT(FanoutLockAllocFails,
+                    (state.mutex=PyThread_allocate_lock(), state.finished=PyThread_allocate_lock()),
+                    (state.mutex=state.finished=NULL));
+  workers=PyMem_Malloc(sizeof(FanoutWorker)*nconnections);
+  if(!state.mutex || !state.finished || !workers)
+    {
+      PyErr_NoMemory();
+      goto finally;
+    }
+  PyThread_acquire_lock(state.finished, WAIT_LOCK);
+
+  state.running=nconnections;
+  for(i=0; i<nconnections; i++)
+    {
+      Connection *connection=(Connection*)PyList_GET_ITEM(connections, i);
+      workers[i].state=&state;
+      workers[i].db=connection->db;
+      connection->inuse=1;
+    }
+
+  /* the calling thread is the first worker.  If a thread can't be
+     started the others do its share. */
+  for(i=1; i<nconnections; i++)
+    {
+      long thread;
+      APSW_FAULT_INJECT(FanoutThreadFails, thread=(long)PyThread_start_new_thread(ConnectionPool_fanoutworker, workers+i), thread=-1);
+      if(thread==-1)
+        {
+          PyThread_acquire_lock(state.mutex, WAIT_LOCK);
+          state.running--;
+          PyThread_release_lock(state.mutex);
+        }
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+    {
+      ConnectionPool_fanoutworker(workers);
+      PyThread_acquire_lock(state.finished, WAIT_LOCK);
+    }
+  Py_END_ALLOW_THREADS;
+  PyThread_release_lock(state.finished);
+
+  for(i=0; i<nconnections; i++)
+    ((Connection*)PyList_GET_ITEM(connections, i))->inuse=0;
+
+  /* an exception from a user defined function in this thread */
+  if(PyErr_Occurred())
+    goto finally;
+
+  for(i=0; i<state.nqueries; i++)
+    if(ConnectionPool_fanouterror(state.queries+i, i, workers[0].db))
+      goto finally;
+
+  retval=PyList_New(0);
+  for(i=0; retval && i<state.nqueries; i++)
+    {
+      PyObject *rows=ConnectionPool_fanoutrows(state.queries+i, merge?retval:NULL);
+      if(rows && !merge && PyList_Append(retval, rows))
+        Py_CLEAR(rows);
+      if(!rows)
+        Py_CLEAR(retval);
+      Py_XDECREF(rows);
+    }
+
+ finally:
+  if(connections)
+    {
+      for(i=0; i<PyList_GET_SIZE(connections); i++)
+        {
+          PyObject *res;
+          PyObject *etype, *evalue, *etb;
+
+          PyErr_Fetch(&etype, &evalue, &etb);
+          res=ConnectionPool_release(self, PyList_GET_ITEM(connections, i));
+          if(!res)
+            apsw_write_unraiseable(NULL);
+          Py_XDECREF(res);
+          PyErr_Restore(etype, evalue, etb);
+        }
+      Py_DECREF(connections);
+    }
+  if(state.mutex)
+    PyThread_free_lock(state.mutex);
+  if(state.finished)
+    PyThread_free_lock(state.finished);
+  PyMem_Free(workers);
+  for(i=0; state.queries && i<state.nqueries; i++)
+    {
+      FanoutQuery *q=state.queries+i;
+      Py_XDECREF(q->utf8);
+      sqlite3_free(q->bindings.data);
+      sqlite3_free(q->rows.data);
+      sqlite3_free(q->errmsg);
+    }
+  PyMem_Free(state.queries);
+  Py_XDECREF(acqargs);
+  Py_DECREF(seq);
+  return retval;
+}
+
+/** .. method:: stats() -> dict
+
+  Returns a dict describing the pool:
+
+    readers
+      Reader connections currently open
+    maxreaders
+      The *readers* parameter
+    idle
+      Reader connections not in use
+    inuse
+      Connections currently acquired including the writer
+    acquires
+      Successful calls to :meth:`acquire`
+    affinity
+      Times a thread got back the reader it last released
+    created
+      Connections opened
+    waits
+      Times :meth:`acquire` had to wait for a connection
+    discarded
+      Connections discarded on release because they were closed or
+      a transaction couldn't be rolled back
+*/
+static PyObject *
+ConnectionPool_stats(ConnectionPool *self)
+{
+  return Py_BuildValue("{s: i, s: i, s: i, s: n, s: L, s: L, s: L, s: L, s: L}",
+                       "readers", self->nreaders,
+                       "maxreaders", self->maxreaders,
+                       "idle", self->nidle,
+                       "inuse", (self->inuse?PyList_GET_SIZE(self->inuse):0)+self->writerinuse,
+                       "acquires", self->st_acquires,
+                       "affinity", self->st_affinity,
+                       "created", self->st_created,
+                       "waits", self->st_waits,
+                       "discarded", self->st_discarded);
+}
+
+static PyMethodDef ConnectionPool_methods[] = {
+  {"acquire", (PyCFunction)ConnectionPool_acquire, METH_VARARGS|METH_KEYWORDS,
+   "Returns a connection from the pool"},
+  {"release", (PyCFunction)ConnectionPool_release, METH_O,
+   "Returns a connection to the pool"},
+  {"close", (PyCFunction)ConnectionPool_close, METH_NOARGS,
+   "Closes the pool"},
+  {"stats", (PyCFunction)ConnectionPool_stats, METH_NOARGS,
+   "Returns pool statistics"},
+  {"fanout", (PyCFunction)ConnectionPool_fanout, METH_VARARGS|METH_KEYWORDS,
+   "Runs read only queries concurrently"},
+  {0,0,0,0}
+};
+
+static PyTypeObject ConnectionPoolType = {
+    APSW_PYTYPE_INIT
+    "apsw.ConnectionPool",     /*tp_name*/
+    sizeof(ConnectionPool),    /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)ConnectionPool_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "Connection pool",         /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    offsetof(ConnectionPool, weakreflist), /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    ConnectionPool_methods,    /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)ConnectionPool_init, /* tp_init */
+    0,                         /* tp_alloc */
+    ConnectionPool_new,        /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+};
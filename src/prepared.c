@@ -0,0 +1,234 @@
+/*
+  Prepared statement code
+
+  See the accompanying LICENSE file.
+*/
+
+/**
+
+.. _preparedstatements:
+
+Prepared Statements
+*******************
+
+Each time you :meth:`Cursor.execute` some SQL text it has to be found
+in the :ref:`statement cache <statementcache>` which involves
+converting the text to UTF-8, hashing it and looking it up.  If it
+isn't there (it was evicted to make space for other queries, or is
+too big to cache) then SQLite has to parse and compile it again.
+
+:meth:`Connection.prepare` does that work once, giving a
+:class:`PreparedStatement` that you use instead of the SQL text::
+
+  insert=connection.prepare("insert into log values(?,?,?)")
+  for row in source:
+      cursor.execute(insert, row)
+
+The statement belongs to the :class:`PreparedStatement` and is never
+evicted from the statement cache, no matter how many other queries are
+run.  If the same PreparedStatement is used again while it is already
+executing (for example by a nested cursor) then that execution uses
+the statement cache as though the SQL text had been supplied.
+
+When you prepare with *persistent* true, SQLite is told the statement
+will be retained and reused many times (`SQLITE_PREPARE_PERSISTENT
+<https://sqlite.org/c3ref/c_prepare_persistent.html>`__) so it
+allocates the memory from the heap rather than the lookaside.
+
+*/
+
+/** .. class:: PreparedStatement
+
+  This object is created by :meth:`Connection.prepare` and holds a
+  single compiled statement.  Supply it as the statements parameter
+  of :meth:`Cursor.execute` or :meth:`Cursor.executemany` on cursors
+  of the same connection.  At the C level it wraps a `sqlite3_stmt
+  <https://sqlite.org/c3ref/stmt.html>`_.
+*/
+
+struct APSWPrepared {
+  PyObject_HEAD
+  Connection *connection;
+  APSWStatement *statement;       /* pinned statement, NULL once closed */
+  unsigned inuse;                 /* track if we are in use preventing concurrent thread mangling */
+  PyObject *weakreflist;          /* weak reference tracking */
+};
+
+typedef struct APSWPrepared APSWPrepared;
+
+static PyTypeObject APSWPreparedType;
+
+#define CHECK_PREPARED_CLOSED(e)                                        \
+  do { if(!self->statement)                                             \
+      return PyErr_Format(PyExc_ValueError, "The PreparedStatement has been closed"); \
+  } while(0)
+
+static void
+APSWPrepared_init(APSWPrepared *self, Connection *connection, APSWStatement *statement)
+{
+  Py_INCREF(connection);
+  self->connection=connection;
+  self->statement=statement;
+  self->inuse=0;
+  self->weakreflist=NULL;
+}
+
+static void
+APSWPrepared_close_internal(APSWPrepared *self)
+{
+  /* a cursor currently executing the statement has its own
+     reference and finalizes it when done */
+  Py_CLEAR(self->statement);
+
+  /* Remove from connection dependents list.  Has to be done before we
+     decref self->connection otherwise connection could dealloc and
+     we'd still be in list */
+  if(self->connection)
+    Connection_remove_dependent(self->connection, (PyObject*)self);
+
+  Py_CLEAR(self->connection);
+}
+
+static void
+APSWPrepared_dealloc(APSWPrepared *self)
+{
+  APSW_CLEAR_WEAKREFS;
+
+  APSWPrepared_close_internal(self);
+
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Returns the statement to execute for query which may be a
+   PreparedStatement or SQL text.  The caller must use INUSE_CALL. */
+static APSWStatement *
+prepared_getstatement(Connection *connection, PyObject *query, int usepreparev2)
+{
+  if(Py_TYPE(query)==&APSWPreparedType)
+    {
+      APSWPrepared *prep=(APSWPrepared*)query;
+      APSWStatement *stmt=prep->statement;
+
+      if(!stmt)
+        {
+          PyErr_Format(PyExc_ValueError, "The PreparedStatement has been closed");
+          return NULL;
+        }
+      if(prep->connection!=connection)
+        {
+          PyErr_Format(PyExc_ValueError, "The PreparedStatement belongs to a different Connection");
+          return NULL;
+        }
+      if(stmt->inuse)
+        /* already executing so the cache provides another instance */
+        return statementcache_prepare(connection->stmtcache, stmt->utf8, usepreparev2); /* INUSE_CALL done by caller */
+
+      assert(stmt->pinned);
+      stmt->inuse=1;
+      _PYSQLITE_CALL_V(sqlite3_clear_bindings(stmt->vdbestatement));
+      Py_INCREF(stmt);
+      return stmt;
+    }
+
+  return statementcache_prepare(connection->stmtcache, query, usepreparev2); /* INUSE_CALL done by caller */
+}
+
+/** .. method:: close(force=False)
+
+  Releases the compiled statement.  Any further use of this object
+  will result in a :exc:`ValueError`.  It is automatically closed when
+  the :class:`Connection` is closed.  A cursor that is currently
+  executing the statement is not affected.
+
+  :param force: Ignored - present for consistency with other objects
+    closed by :meth:`Connection.close`.
+*/
+static PyObject *
+APSWPrepared_close(APSWPrepared *self, PyObject *args)
+{
+  int force=0;
+
+  CHECK_USE(NULL);
+
+  if(args && !PyArg_ParseTuple(args, "|i:close(force=False)", &force))
+    return NULL;
+
+  APSWPrepared_close_internal(self);
+
+  Py_RETURN_NONE;
+}
+
+/** .. attribute:: sql
+
+  The text of the statement.
+*/
+static PyObject *
+APSWPrepared_getsql(APSWPrepared *self)
+{
+  CHECK_USE(NULL);
+  CHECK_PREPARED_CLOSED(NULL);
+
+  return convertutf8buffersizetounicode(self->statement->utf8, self->statement->querylen);
+}
+
+static PyGetSetDef APSWPrepared_getset[] = {
+  /* name getter setter doc closure */
+  {"sql", (getter)APSWPrepared_getsql, NULL, "Text of the statement", NULL},
+  {0,0,0,0,0}
+};
+
+static PyMethodDef APSWPrepared_methods[] = {
+  {"close", (PyCFunction)APSWPrepared_close, METH_VARARGS,
+   "Releases the compiled statement"},
+  {0,0,0,0}
+};
+
+static PyTypeObject APSWPreparedType = {
+    APSW_PYTYPE_INIT
+    "apsw.PreparedStatement",  /*tp_name*/
+    sizeof(APSWPrepared),      /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)APSWPrepared_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "APSW prepared statement object", /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    offsetof(APSWPrepared, weakreflist), /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    APSWPrepared_methods,      /* tp_methods */
+    0,                         /* tp_members */
+    APSWPrepared_getset,       /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+};
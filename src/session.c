@@ -0,0 +1,485 @@
+/*
+  Session extension code
+
+  See the accompanying LICENSE file.
+*/
+
+/**
+
+.. _session:
+
+Sessions and changesets
+***********************
+
+The `session extension <https://sqlite.org/sessionintro.html>`__
+records the rows changed in a database so that only those changes
+need to be sent somewhere else, rather than copying the whole
+database.  A :class:`Session` made with :meth:`Connection.session`
+watches the tables it is attached to, and produces a *changeset* - a
+compact binary description of the inserts, updates and deletes made
+since it was created::
+
+  session=source.session()
+  session.attach()           # all tables
+
+  ... make changes on source ...
+
+  changeset=session.changeset()
+  # ship the bytes somewhere, then
+  replica.applychangeset(changeset)
+
+Changes are recorded by primary key, so only tables with a declared
+``PRIMARY KEY`` are tracked.  A row changed many times appears once
+with its original and final values.  A *patchset* from
+:meth:`Session.patchset` is smaller again as it leaves out the
+original values of updated and deleted rows, at the cost of less
+precise conflict detection when it is applied.
+
+:meth:`Connection.applychangeset` makes all the changes in a single
+transaction.  If a change can't be made as recorded (for example the
+row to be updated is missing, or has different values than it had
+originally) your *conflict* callable decides whether to skip the
+change, overwrite the row or abandon the whole changeset.
+:meth:`changeset_invert` gives the changeset that undoes another, and
+:meth:`changeset_concat` combines two into one.
+
+The extension is only available if SQLite was compiled with it, which
+you can ask for with ``--enable=session`` to :ref:`setup.py build
+<setup_build_flags>` (the preupdate hook it needs is enabled at the
+same time).  :class:`Session`, :meth:`Connection.session` and the other
+functions here are not present otherwise.  ``tools/sessionspeed.py``
+compares the size and time of changesets against dumping the whole
+database with the :ref:`shell <shell>`.
+
+*/
+
+/** .. method:: changeset_invert(changeset) -> bytes
+
+  Returns a changeset that undoes *changeset* - inserts become
+  deletes, deletes become inserts and updates swap their old and new
+  values.  Patchsets can't be inverted.
+*/
+
+/** .. method:: changeset_concat(first, second) -> bytes
+
+  Returns a single changeset with the same effect as applying *first*
+  followed by *second*.  Both must be changesets or both patchsets.
+*/
+
+/** .. class:: Session
+
+  This object is created by :meth:`Connection.session` and records
+  changes made to a database of the connection.  At the C level it
+  wraps a `sqlite3_session
+  <https://sqlite.org/session/session.html>`_.
+*/
+
+struct APSWSession {
+  PyObject_HEAD
+  Connection *connection;
+  sqlite3_session *session;       /* NULL once closed */
+  unsigned inuse;                 /* track if we are in use preventing concurrent thread mangling */
+  PyObject *weakreflist;          /* weak reference tracking */
+};
+
+typedef struct APSWSession APSWSession;
+
+static PyTypeObject APSWSessionType;
+
+#define CHECK_SESSION_CLOSED(e)                                         \
+  do { if(!self->session)                                               \
+      return PyErr_Format(PyExc_ValueError, "The Session has been closed"); \
+  } while(0)
+
+static void
+APSWSession_init(APSWSession *self, Connection *connection, sqlite3_session *session)
+{
+  Py_INCREF(connection);
+  self->connection=connection;
+  self->session=session;
+  self->inuse=0;
+  self->weakreflist=NULL;
+}
+
+static void
+APSWSession_close_internal(APSWSession *self)
+{
+  if(self->session)
+    {
+      PYSQLITE_VOID_CALL(sqlite3session_delete(self->session));
+      self->session=0;
+    }
+
+  /* Remove from connection dependents list.  Has to be done before we
+     decref self->connection otherwise connection could dealloc and
+     we'd still be in list */
+  if(self->connection)
+    Connection_remove_dependent(self->connection, (PyObject*)self);
+
+  Py_CLEAR(self->connection);
+}
+
+static void
+APSWSession_dealloc(APSWSession *self)
+{
+  APSW_CLEAR_WEAKREFS;
+
+  APSWSession_close_internal(self);
+
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Gets the buffer of a changeset argument, returning zero or -1 with
+   an exception set */
+static int
+session_getchangeset(PyObject *obj, const void **buffer, int *size)
+{
+  Py_ssize_t buflen;
+
+  if(!PyObject_CheckReadBuffer(obj) || PyUnicode_Check(obj))
+    {
+      PyErr_Format(PyExc_TypeError, "Changesets must be bytes not %s", Py_TYPE(obj)->tp_name);
+      return -1;
+    }
+  if(PyObject_AsReadBuffer(obj, buffer, &buflen))
+    return -1;
+  if(buflen>APSW_INT32_MAX)
+    {
+      SET_EXC(SQLITE_TOOBIG, NULL);
+      return -1;
+    }
+  *size=(int)buflen;
+  return 0;
+}
+
+/** .. method:: attach(table=None)
+
+  Starts recording changes to *table*, or to every table in the
+  database (including ones created later) if it is None.  Tables
+  without a declared primary key are ignored.
+*/
+static PyObject *
+APSWSession_attach(APSWSession *self, PyObject *args)
+{
+  PyObject *table=Py_None, *utf8=NULL;
+  const char *tablename=NULL;
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_SESSION_CLOSED(NULL);
+
+  if(!PyArg_ParseTuple(args, "|O:attach(table=None)", &table))
+    return NULL;
+
+  if(table!=Py_None)
+    {
+      utf8=getutf8string(table);
+      if(!utf8)
+        return NULL;
+      tablename=PyBytes_AS_STRING(utf8);
+    }
+
+  PYSQLITE_SESSION_CALL(res=sqlite3session_attach(self->session, tablename));
+  Py_XDECREF(utf8);
+  SET_EXC(res, self->connection->db);
+  if(res!=SQLITE_OK)
+    return NULL;
+
+  Py_RETURN_NONE;
+}
+
+/* Calls sqlite3session_changeset or sqlite3session_patchset returning
+   the bytes */
+static PyObject *
+APSWSession_output(APSWSession *self, int patchset)
+{
+  int res, size=0;
+  void *data=NULL;
+  PyObject *result;
+
+  if(patchset)
+    PYSQLITE_SESSION_CALL(res=sqlite3session_patchset(self->session, &size, &data));
+  else
+    APSW_FAULT_INJECT(SessionChangesetFails,
+                      PYSQLITE_SESSION_CALL(res=sqlite3session_changeset(self->session, &size, &data)),
+                      res=SQLITE_NOMEM);
+  SET_EXC(res, self->connection->db);
+  if(res!=SQLITE_OK)
+    {
+      assert(!data);
+      return NULL;
+    }
+
+  result=converttobytes(data, size);
+  sqlite3_free(data);
+  return result;
+}
+
+/** .. method:: changeset() -> bytes
+
+  Returns the changes recorded so far.  The session carries on
+  recording so calling this again returns those changes plus any made
+  since.
+*/
+static PyObject *
+APSWSession_changeset(APSWSession *self)
+{
+  CHECK_USE(NULL);
+  CHECK_SESSION_CLOSED(NULL);
+
+  return APSWSession_output(self, 0);
+}
+
+/** .. method:: patchset() -> bytes
+
+  Like :meth:`changeset` but only the primary key is included for
+  deleted rows, and only the primary key and new values for updated
+  rows.
+*/
+static PyObject *
+APSWSession_patchset(APSWSession *self)
+{
+  CHECK_USE(NULL);
+  CHECK_SESSION_CLOSED(NULL);
+
+  return APSWSession_output(self, 1);
+}
+
+/** .. method:: close(force=False)
+
+  Stops recording and releases the session.  Any further use of this
+  object will result in a :exc:`ValueError`.  It is automatically
+  closed when the :class:`Connection` is closed.
+
+  :param force: Ignored - present for consistency with other objects
+    closed by :meth:`Connection.close`.
+*/
+static PyObject *
+APSWSession_close(APSWSession *self, PyObject *args)
+{
+  int force=0;
+
+  CHECK_USE(NULL);
+
+  if(args && !PyArg_ParseTuple(args, "|i:close(force=False)", &force))
+    return NULL;
+
+  APSWSession_close_internal(self);
+
+  Py_RETURN_NONE;
+}
+
+/** .. attribute:: isempty
+
+  True if no changes have been recorded.
+*/
+static PyObject *
+APSWSession_getisempty(APSWSession *self)
+{
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_SESSION_CLOSED(NULL);
+
+  PYSQLITE_VOID_CALL(res=sqlite3session_isempty(self->session));
+  return PyBool_FromLong(res);
+}
+
+/** .. attribute:: enabled
+
+  Changes are only recorded while this is True (the default).  It can
+  be set to pause and resume recording.
+*/
+static PyObject *
+APSWSession_getenabled(APSWSession *self)
+{
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_SESSION_CLOSED(NULL);
+
+  PYSQLITE_VOID_CALL(res=sqlite3session_enable(self->session, -1));
+  return PyBool_FromLong(res);
+}
+
+static int
+APSWSession_setenabled(APSWSession *self, PyObject *value)
+{
+  int enable;
+
+  CHECK_USE(-1);
+  if(!self->session)
+    {
+      PyErr_Format(PyExc_ValueError, "The Session has been closed");
+      return -1;
+    }
+
+  if(!value)
+    {
+      PyErr_Format(PyExc_TypeError, "Can't delete enabled");
+      return -1;
+    }
+  enable=PyObject_IsTrue(value);
+  if(enable<0)
+    return -1;
+
+  PYSQLITE_VOID_CALL(sqlite3session_enable(self->session, enable));
+  return 0;
+}
+
+/** .. attribute:: indirect
+
+  Changes made while this is True are flagged as indirect in the
+  changeset, for example to distinguish changes made by triggers or
+  foreign key actions you run yourself.  The default is False.
+*/
+static PyObject *
+APSWSession_getindirect(APSWSession *self)
+{
+  int res;
+
+  CHECK_USE(NULL);
+  CHECK_SESSION_CLOSED(NULL);
+
+  PYSQLITE_VOID_CALL(res=sqlite3session_indirect(self->session, -1));
+  return PyBool_FromLong(res);
+}
+
+static int
+APSWSession_setindirect(APSWSession *self, PyObject *value)
+{
+  int indirect;
+
+  CHECK_USE(-1);
+  if(!self->session)
+    {
+      PyErr_Format(PyExc_ValueError, "The Session has been closed");
+      return -1;
+    }
+
+  if(!value)
+    {
+      PyErr_Format(PyExc_TypeError, "Can't delete indirect");
+      return -1;
+    }
+  indirect=PyObject_IsTrue(value);
+  if(indirect<0)
+    return -1;
+
+  PYSQLITE_VOID_CALL(sqlite3session_indirect(self->session, indirect));
+  return 0;
+}
+
+static PyGetSetDef APSWSession_getset[] = {
+  /* name getter setter doc closure */
+  {"isempty", (getter)APSWSession_getisempty, NULL, "If no changes have been recorded", NULL},
+  {"enabled", (getter)APSWSession_getenabled, (setter)APSWSession_setenabled, "If changes are being recorded", NULL},
+  {"indirect", (getter)APSWSession_getindirect, (setter)APSWSession_setindirect, "If changes are flagged as indirect", NULL},
+  {0,0,0,0,0}
+};
+
+static PyMethodDef APSWSession_methods[] = {
+  {"attach", (PyCFunction)APSWSession_attach, METH_VARARGS,
+   "Records changes to a table or all tables"},
+  {"changeset", (PyCFunction)APSWSession_changeset, METH_NOARGS,
+   "Returns the changes recorded"},
+  {"patchset", (PyCFunction)APSWSession_patchset, METH_NOARGS,
+   "Returns the changes recorded as a patchset"},
+  {"close", (PyCFunction)APSWSession_close, METH_VARARGS,
+   "Stops recording and releases the session"},
+  {0,0,0,0}
+};
+
+static PyTypeObject APSWSessionType = {
+    APSW_PYTYPE_INIT
+    "apsw.Session",            /*tp_name*/
+    sizeof(APSWSession),       /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)APSWSession_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VERSION_TAG, /*tp_flags*/
+    "Session object",          /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    offsetof(APSWSession, weakreflist), /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    APSWSession_methods,       /* tp_methods */
+    0,                         /* tp_members */
+    APSWSession_getset,        /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+    0,                         /* tp_free */
+    0,                         /* tp_is_gc */
+    0,                         /* tp_bases */
+    0,                         /* tp_mro */
+    0,                         /* tp_cache */
+    0,                         /* tp_subclasses */
+    0,                         /* tp_weaklist */
+    0                          /* tp_del */
+    APSW_PYTYPE_VERSION
+};
+
+static PyObject *
+changeset_invert(APSW_ARGUNUSED PyObject *self, PyObject *changeset)
+{
+  const void *buffer;
+  void *data=NULL;
+  int insize, size=0, res;
+  PyObject *result;
+
+  if(session_getchangeset(changeset, &buffer, &insize))
+    return NULL;
+
+  _PYSQLITE_CALL_V(res=sqlite3changeset_invert(insize, buffer, &size, &data));
+  SET_EXC(res, NULL);
+  if(res!=SQLITE_OK)
+    return NULL;
+
+  result=converttobytes(data, size);
+  sqlite3_free(data);
+  return result;
+}
+
+static PyObject *
+changeset_concat(APSW_ARGUNUSED PyObject *self, PyObject *args)
+{
+  PyObject *first, *second, *result;
+  const void *buffer1, *buffer2;
+  void *data=NULL;
+  int size1, size2, size=0, res;
+
+  if(!PyArg_ParseTuple(args, "OO:changeset_concat(first, second)", &first, &second))
+    return NULL;
+  if(session_getchangeset(first, &buffer1, &size1) || session_getchangeset(second, &buffer2, &size2))
+    return NULL;
+
+  _PYSQLITE_CALL_V(res=sqlite3changeset_concat(size1, (void*)buffer1, size2, (void*)buffer2, &size, &data));
+  SET_EXC(res, NULL);
+  if(res!=SQLITE_OK)
+    return NULL;
+
+  result=converttobytes(data, size);
+  sqlite3_free(data);
+  return result;
+}
@@ -27,11 +27,39 @@
    the interpreter gc intervals. */
 #define SC_NRECYCLE 32
 
-/* The maximum length of something in bytes that we would consider putting in the statement cache */
+/* The maximum length of something in bytes that we would consider putting in the statement cache.
+   When the cache is limited by memory then the memory limit is used instead. */
 #define SC_MAXSIZE 16384
 
-/* Define to do statement cache statistics */
-/* #define SC_STATS */
+/* When evicting because of memory, how many of the least recently
+   used entries are considered.  The one giving the least benefit for
+   its memory is evicted. */
+#define SC_EVICTSAMPLE 8
+
+/* How many instances of the same query can be cached.  Extra
+   instances are needed when a query is used again while already
+   executing such as nested cursors walking a tree. */
+#define SC_MAXINSTANCES 8
+
+/* The sqlite3_stmt_status counters accumulated for each statement and
+   reported by Connection.cache_profile */
+static const struct {
+  const char *name;
+  int op;
+} sc_profilecounters[]={
+  {"fullscan_step", SQLITE_STMTSTATUS_FULLSCAN_STEP},
+  {"sort", SQLITE_STMTSTATUS_SORT},
+  {"autoindex", SQLITE_STMTSTATUS_AUTOINDEX},
+#ifdef SQLITE_STMTSTATUS_VM_STEP
+  {"vm_step", SQLITE_STMTSTATUS_VM_STEP},
+#endif
+#ifdef SQLITE_STMTSTATUS_REPREPARE
+  {"reprepare", SQLITE_STMTSTATUS_REPREPARE},
+  {"run", SQLITE_STMTSTATUS_RUN},
+#endif
+};
+
+#define SC_NPROFILE (sizeof(sc_profilecounters)/sizeof(sc_profilecounters[0]))
 
 typedef struct APSWStatement {
   PyObject_HEAD
@@ -44,6 +72,21 @@ typedef struct APSWStatement {
   PyObject *origquery;              /* The original query object, also a key in the cache pointing to this same statement - could be NULL */
   struct APSWStatement *lru_prev;   /* previous item in lru list (ie more recently used than this one) */
   struct APSWStatement *lru_next;   /* next item in lru list (ie less recently used than this one) */
+  struct APSWStatement *samekey;    /* next cached instance of the same query.  Only the first is in the cache dict and each owns a reference to the next */
+  PyObject *colnames;               /* Tuple of interned column names for dict rows - made on first use */
+  PyObject *rowtype;                /* Named tuple type for named rows - made on first use */
+  int colnames_reprepare;           /* SQLITE_STMTSTATUS_REPREPARE when colnames was made */
+  PyObject *paramnames;             /* Tuple of interned parameter names (without the leading :@$) for dict bindings, None for unnamed ones.  NULL if there are no named parameters */
+  PyObject **boundobjs;             /* One slot per parameter holding a reference to objects bound with SQLITE_STATIC.  NULL if there are no parameters */
+  int nboundobjs;                   /* How many slots boundobjs has */
+  int nbound;                       /* How many slots are currently non-NULL */
+  unsigned pinned;                  /* owned by a PreparedStatement or the previous statement of a script and never put in the cache */
+  struct APSWStatement *chain;      /* the prepared statement for next, owned by this one so a repeated script reuses all its statements */
+  struct APSWStatement *head;       /* borrowed first statement of the script for a chain statement, cleared when it drops the chain */
+  sqlite3_int64 memused;            /* memory charged to the cache for this entry (including its chain) */
+  unsigned uses;                    /* how many times this entry was reused from the cache */
+  sqlite3_int64 profile[SC_NPROFILE]; /* sc_profilecounters totals, accumulated at each finalize */
+  int profile_reprepare;            /* SQLITE_STMTSTATUS_REPREPARE already in profile.  It isn't reset as colnames_reprepare depends on it */
 } APSWStatement;
 
 static PyTypeObject APSWStatementType;
@@ -55,19 +98,32 @@ typedef struct StatementCache {
   unsigned numentries;              /* how many APSWStatement entries
                                        we have in cache */
   unsigned maxentries;              /* maximum number of entries */
+  Py_ssize_t maxsize;               /* maximum utf8 length of a query to cache */
+  sqlite3_int64 maxmemory;          /* maximum memory used by cached statements, zero for no limit */
+  sqlite3_int64 memused;            /* memory currently charged for cached statements */
   APSWStatement *mru;               /* most recently used entry (head of the list) */
   APSWStatement *lru;               /* least recently used entry (tail of the list) */
-#ifdef SC_STATS
-  unsigned st_cachemiss;            /* entry was not in cache */
-  unsigned st_cachehit;             /* entry was in cache */
-  unsigned st_hitinuse;             /* was a hit but was inuse */
-#endif
+  /* statistics returned by Connection.cache_stats */
+  sqlite3_int64 st_hits;            /* entry was in cache and reused */
+  sqlite3_int64 st_misses;          /* entry was not in cache so was prepared */
+  sqlite3_int64 st_inuse;           /* entry was in cache but in use so another was prepared */
+  sqlite3_int64 st_evictions;       /* entries discarded to make space */
+  sqlite3_int64 st_recycled;        /* statement objects reused from the recycle list */
+  sqlite3_int64 st_reprepares;      /* entries reprepared due to SQLITE_SCHEMA */
+  sqlite3_int64 st_normalized;      /* queries executed with their literals turned into bindings */
+  unsigned nduplicates;             /* how many entries are extra instances (on a samekey list) */
 #if SC_NRECYCLE > 0
   APSWStatement* recyclelist[SC_NRECYCLE];   /* recycle these rather than go through repeated malloc/free */
   unsigned nrecycle;                /* index of last entry in recycle list */
 #endif
 } StatementCache;
 
+/* The process wide limit on memory used by all statement caches
+   (zero for no limit) and how much they are currently charged.
+   Protected by the GIL. */
+static sqlite3_int64 sc_memorylimit=0;
+static sqlite3_int64 sc_memoryused=0;
+
 #ifndef NDEBUG
 static void
 statementcache_sanity_check(StatementCache *sc)
@@ -202,6 +258,11 @@ statementcache_reprepare(StatementCache *sc, APSWStatement *statement)
 
   PYSQLITE_SC_CALL(sqlite3_finalize(statement->vdbestatement));
   statement->vdbestatement=newvdbe;
+  statement->profile_reprepare=0;
+  /* the schema change could have altered the result columns */
+  Py_CLEAR(statement->colnames);
+  Py_CLEAR(statement->rowtype);
+  sc->st_reprepares++;
   return SQLITE_OK;
 
  error:
@@ -216,24 +277,156 @@ statementcache_reprepare(StatementCache *sc, APSWStatement *statement)
   return res2;
 }
 
+/* Makes the parameter names used for dict bindings so they don't
+   have to be decoded and hashed on every execution.  Returns zero on
+   success. */
+static int
+statementcache_paramnames(APSWStatement *stmt)
+{
+  int nargs, arg, named=0;
+  PyObject *names;
+
+  assert(!stmt->paramnames);
+
+  nargs=sqlite3_bind_parameter_count(stmt->vdbestatement);
+  if(!nargs)
+    return 0;
+
+  names=PyTuple_New(nargs);
+  if(!names) return -1;
+
+  for(arg=1;arg<=nargs;arg++)
+    {
+      PyObject *keyo;
+      const char *key=sqlite3_bind_parameter_name(stmt->vdbestatement, arg);
+
+      if(!key)
+        {
+          Py_INCREF(Py_None);
+          PyTuple_SET_ITEM(names, arg-1, Py_None);
+          continue;
+        }
+
+      key++; /* first char is a colon, dollar, at or question mark which we skip */
+
+      APSW_FAULT_INJECT(ParamNamesDecodeFails,keyo=PyUnicode_DecodeUTF8(key, strlen(key), NULL),keyo=PyErr_NoMemory());
+      if(!keyo)
+        {
+          Py_DECREF(names);
+          return -1;
+        }
+#if PY_MAJOR_VERSION >= 3
+      PyUnicode_InternInPlace(&keyo);
+#endif
+      PyTuple_SET_ITEM(names, arg-1, keyo);
+      named=1;
+    }
+
+  if(named)
+    stmt->paramnames=names;
+  else
+    Py_DECREF(names);
+  return 0;
+}
+
+/* Bytes and strings are bound with SQLITE_STATIC so SQLite uses
+   their memory directly rather than making a copy.  The statement
+   keeps a reference to each such object until the binding is
+   replaced or cleared.  The slots are allocated once at prepare time
+   so binding can't fail for lack of memory.  Returns zero on
+   success. */
+static int
+statementcache_boundobjs(APSWStatement *stmt)
+{
+  int nargs;
+
+  assert(!stmt->boundobjs);
+  assert(!stmt->nbound);
+
+  nargs=sqlite3_bind_parameter_count(stmt->vdbestatement);
+  if(!nargs)
+    return 0;
+
+  APSW_FAULT_INJECT(BoundObjsAllocFails,stmt->boundobjs=PyMem_Malloc(sizeof(PyObject*)*nargs),stmt->boundobjs=NULL);
+  if(!stmt->boundobjs)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+  memset(stmt->boundobjs, 0, sizeof(PyObject*)*nargs);
+  stmt->nboundobjs=nargs;
+  return 0;
+}
+
+/* Remember (or forget if obj is NULL) the object bound to parameter
+   arg.  Must be called after SQLite has the new binding since the
+   previous object could be freed. */
+static void
+statementcache_setbound(APSWStatement *stmt, int arg, PyObject *obj)
+{
+  PyObject *old;
+
+  if(!stmt->boundobjs)
+    {
+      /* only happens for parameters that don't exist where SQLite
+         returns SQLITE_RANGE without using obj */
+      return;
+    }
+  assert(arg>=1 && arg<=stmt->nboundobjs);
+  if(arg<1 || arg>stmt->nboundobjs)
+    return;
+
+  old=stmt->boundobjs[arg-1];
+  if(old==obj)
+    return;
+  if(obj)
+    {
+      Py_INCREF(obj);
+      stmt->nbound++;
+    }
+  stmt->boundobjs[arg-1]=obj;
+  if(old)
+    {
+      stmt->nbound--;
+      Py_DECREF(old);
+    }
+}
+
+/* Releases all references from statementcache_setbound.  The caller
+   must already have cleared the bindings or finalized the
+   vdbestatement. */
+static void
+statementcache_releasebound(APSWStatement *stmt)
+{
+  int i;
+
+  for(i=0; stmt->nbound && i<stmt->nboundobjs; i++)
+    if(stmt->boundobjs[i])
+      {
+        PyObject *old=stmt->boundobjs[i];
+        stmt->boundobjs[i]=NULL;
+        stmt->nbound--;
+        Py_DECREF(old);
+      }
+  assert(stmt->nbound==0);
+}
+
+static APSWStatement *statementcache_preparenew(StatementCache *sc, PyObject *utf8, PyObject *query, int usepreparev2, unsigned prepflags);
+
 /* Internal prepare routine after doing utf8 conversion.  Returns a new reference. Must be reentrant */
 static APSWStatement*
 statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
 {
   APSWStatement *val=NULL;
-  const char *buffer;
-  const char *tail;
-  Py_ssize_t buflen;
-  int res;
   PyObject *utf8=NULL;
 
   if(!APSWBuffer_Check(query))
     {
       /* Check to see if query is already in cache.  The size checks are to
          avoid calculating hashes on long strings */
-      if( sc->cache && sc->numentries && ((PyUnicode_CheckExact(query) && PyUnicode_GET_DATA_SIZE(query) < SC_MAXSIZE)
+      if( sc->cache && sc->numentries && ((PyUnicode_CheckExact(query) && PyUnicode_GET_DATA_SIZE(query) < sc->maxsize)
 #if PY_MAJOR_VERSION < 3
-          || (PyString_CheckExact(query) && PyString_GET_SIZE(query) < SC_MAXSIZE)
+          || (PyString_CheckExact(query) && PyString_GET_SIZE(query) < sc->maxsize)
 #endif
                         ))
         {
@@ -269,7 +462,7 @@ statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
   assert(APSWBuffer_Check(utf8));
 
   /* if we have cache and utf8 is reasonable size? */
-  if(sc->cache && sc->numentries && APSWBuffer_GET_SIZE(utf8) < SC_MAXSIZE)
+  if(sc->cache && sc->numentries && APSWBuffer_GET_SIZE(utf8) < sc->maxsize)
     {
       /* then is it in the cache? */
       val=(APSWStatement*)PyDict_GetItem(sc->cache, utf8);
@@ -279,17 +472,25 @@ statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
  cachehit:
   assert(APSWBuffer_Check(utf8));
 
-#ifdef SC_STATS
   if(val)
     {
-      sc->st_cachehit++;
-      if(val->inuse)
-        sc->st_hitinuse++;
+      /* find an instance that isn't being used */
+      APSWStatement *first=val;
+      while(val && val->inuse)
+        val=val->samekey;
+      if(val)
+        {
+          sc->st_hits++;
+          val->uses++;
+        }
+      else
+        {
+          sc->st_inuse++;
+          val=first;
+        }
     }
   else
-    sc->st_cachemiss++;
-#endif
-
+    sc->st_misses++;
 
   if(val)
     {
@@ -325,13 +526,28 @@ statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
           return val;
         }
       /* someone else is using it so we can't */
-      val=NULL;
     }
 
+  return statementcache_preparenew(sc, utf8, query, usepreparev2, 0);
+}
+
+/* Makes a new statement that is not in the cache.  Consumes the
+   reference to utf8.  If prepflags is non-zero then
+   sqlite3_prepare_v3 is used with them. */
+static APSWStatement*
+statementcache_preparenew(StatementCache *sc, PyObject *utf8, PyObject *query, int usepreparev2, unsigned prepflags)
+{
+  APSWStatement *val=NULL;
+  const char *buffer;
+  const char *tail;
+  Py_ssize_t buflen;
+  int res;
+
 #if SC_NRECYCLE > 0
   if(sc->nrecycle)
     {
       val=sc->recyclelist[--sc->nrecycle];
+      sc->st_recycled++;
       assert(Py_REFCNT(val)==1);
       assert(!val->incache);
       assert(!val->inuse);
@@ -340,7 +556,21 @@ statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
       APSWBuffer_XDECREF_likely(val->utf8);
       APSWBuffer_XDECREF_unlikely(val->next);
       Py_XDECREF(val->origquery);
+      Py_CLEAR(val->colnames);
+      Py_CLEAR(val->rowtype);
+      Py_CLEAR(val->paramnames);
+      assert(!val->chain);
+      val->head=0;
+      statementcache_releasebound(val);
+      PyMem_Free(val->boundobjs);
+      val->boundobjs=0;
+      val->nboundobjs=0;
       val->lru_prev=val->lru_next=0;
+      val->memused=0;
+      val->uses=0;
+      memset(val->profile, 0, sizeof(val->profile));
+      val->profile_reprepare=0;
+      assert(!val->samekey);
       statementcache_sanity_check(sc);
     }
 #else
@@ -351,11 +581,28 @@ statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
     {
       /* have to make one */
       val=PyObject_New(APSWStatement, &APSWStatementType);
-      if(!val) goto error;
+      if(!val)
+        {
+          APSWBuffer_XDECREF_unlikely(utf8);
+          return NULL;
+        }
       /* zero it - other fields are set below */
       val->incache=0;
       val->lru_prev=0;
       val->lru_next=0;
+      val->samekey=0;
+      val->chain=0;
+      val->head=0;
+      val->memused=0;
+      val->uses=0;
+      memset(val->profile, 0, sizeof(val->profile));
+      val->profile_reprepare=0;
+      val->colnames=0;
+      val->rowtype=0;
+      val->paramnames=0;
+      val->boundobjs=0;
+      val->nboundobjs=0;
+      val->nbound=0;
     }
 
   statementcache_sanity_check(sc);
@@ -364,6 +611,7 @@ statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
   val->next=NULL;
   val->vdbestatement=NULL;
   val->inuse=1;
+  val->pinned=0;
   Py_XINCREF(query);
   val->origquery=query;
 
@@ -375,6 +623,11 @@ statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
      will always have had an extra zero on the end.  The assert is just to make
      sure */
   assert(buffer[buflen+1-1]==0);
+#ifdef SQLITE_PREPARE_PERSISTENT
+  if(prepflags)
+    PYSQLITE_SC_CALL(res=sqlite3_prepare_v3(sc->db, buffer, buflen+1, prepflags, &val->vdbestatement, &tail));
+  else
+#endif
   PYSQLITE_SC_CALL(res=(usepreparev2)?
 		   sqlite3_prepare_v2(sc->db, buffer, buflen+1, &val->vdbestatement, &tail):  /* PYSQLITE_SC_CALL */
 		   sqlite3_prepare(sc->db, buffer, buflen+1, &val->vdbestatement, &tail));    /* PYSQLITE_SC_CALL */
@@ -387,6 +640,9 @@ statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
       goto error;
     }
 
+  if(statementcache_paramnames(val) || statementcache_boundobjs(val))
+    goto error;
+
   val->querylen=tail-buffer;
   /* is there a next statement (ignore semicolons and white space) */
   while( (tail-buffer<buflen) && (*tail==' ' || *tail=='\t' || *tail==';' || *tail=='\r' || *tail=='\n') )
@@ -421,6 +677,115 @@ statementcache_prepare(StatementCache *sc, PyObject *query, int usepreparev2)
 }
 
 
+/* How much memory a statement and the rest of its script use */
+static sqlite3_int64
+statementcache_memused(StatementCache *sc, APSWStatement *stmt)
+{
+  sqlite3_int64 memused=0;
+#ifdef SQLITE_STMTSTATUS_MEMUSED
+  APSW_DB_MUTEX_ENTER(sc->db);
+  for(; stmt; stmt=stmt->chain)
+    PYSQLITE_HELD_CALL(memused+=sqlite3_stmt_status(stmt->vdbestatement, SQLITE_STMTSTATUS_MEMUSED, 0));
+  APSW_DB_MUTEX_LEAVE(sc->db);
+#endif
+  return memused;
+}
+
+/* Charges the cache again for a cached script whose chain has grown,
+   since statements after the second are prepared after the script was
+   put in the cache.  Any eviction happens the next time a statement is
+   returned to the cache. */
+static void
+statementcache_recharge(StatementCache *sc, APSWStatement *stmt)
+{
+  sqlite3_int64 memused=statementcache_memused(sc, stmt);
+
+  assert(stmt->incache);
+  sc->memused += memused-stmt->memused;
+  sc_memoryused += memused-stmt->memused;
+  stmt->memused=memused;
+}
+
+/* Releases the chain of a script's first statement.  The chain
+   statements can outlive it if a cursor is still using them. */
+static void
+statementcache_dropchain(APSWStatement *stmt)
+{
+  APSWStatement *item;
+
+  for(item=stmt->chain; item; item=item->chain)
+    item->head=NULL;
+  Py_CLEAR(stmt->chain);
+}
+
+/* Records the memory used by stmt returning true if it would use up
+   the whole budget so it shouldn't be cached */
+static int
+statementcache_toobig(StatementCache *sc, APSWStatement *stmt)
+{
+  stmt->memused=statementcache_memused(sc, stmt);
+  return (sc->maxmemory && stmt->memused > sc->maxmemory)
+    || (sc_memorylimit && stmt->memused > sc_memorylimit);
+}
+
+/* Is this cache or the process over the memory limit? */
+static int
+statementcache_overbudget(StatementCache *sc)
+{
+  return (sc->maxmemory && sc->memused > sc->maxmemory)
+    || (sc_memorylimit && sc_memoryused > sc_memorylimit);
+}
+
+/* Picks which entry to evict for memory.  Of the least recently used
+   entries, the one with the lowest reuse times prepare cost (estimated
+   by the length of its text) per byte of memory is chosen. */
+static APSWStatement *
+statementcache_memoryevictee(StatementCache *sc)
+{
+  APSWStatement *item, *evictee=sc->lru;
+  double score, lowest=-1;
+  int i;
+
+  for(i=0, item=sc->lru; item && i<SC_EVICTSAMPLE; i++, item=item->lru_prev)
+    {
+      score=(1.0+item->uses)*APSWBuffer_GET_SIZE(item->utf8)/(item->memused?item->memused:1);
+      if(lowest<0 || score<lowest)
+        {
+          lowest=score;
+          evictee=item;
+        }
+    }
+  return evictee;
+}
+
+/* Adds the counters from the execution that just finished to the
+   profile.  Called with the database mutex held. */
+static void
+statementcache_accumulate(APSWStatement *stmt)
+{
+  unsigned i;
+  int value;
+
+  /* empty statements */
+  if(!stmt->vdbestatement)
+    return;
+
+  for(i=0; i<SC_NPROFILE; i++)
+    {
+#ifdef SQLITE_STMTSTATUS_REPREPARE
+      if(sc_profilecounters[i].op==SQLITE_STMTSTATUS_REPREPARE)
+        {
+          PYSQLITE_HELD_CALL(value=sqlite3_stmt_status(stmt->vdbestatement, SQLITE_STMTSTATUS_REPREPARE, 0));
+          stmt->profile[i]+=value-stmt->profile_reprepare;
+          stmt->profile_reprepare=value;
+          continue;
+        }
+#endif
+      PYSQLITE_HELD_CALL(value=sqlite3_stmt_status(stmt->vdbestatement, sc_profilecounters[i].op, 1));
+      stmt->profile[i]+=value;
+    }
+}
+
 /* Consumes reference on stmt.  This routine must be reentrant.
    If reprepare_on_schema then if SQLITE_SCHEMA is the error, we reprepare
    the statement and don't finalize.
@@ -442,7 +807,7 @@ statementcache_finalize(StatementCache *sc, APSWStatement *stmt, int reprepare_o
      otherwise another thread could enter and reuse what we are in the
      middle of disposing of */
 
-  PYSQLITE_SC_CALL(res=sqlite3_reset(stmt->vdbestatement));
+  PYSQLITE_SC_CALL(res=sqlite3_reset(stmt->vdbestatement); statementcache_accumulate(stmt));
   if(res==SQLITE_SCHEMA && reprepare_on_schema)
     {
       res=statementcache_reprepare(sc, stmt);
@@ -450,13 +815,51 @@ statementcache_finalize(StatementCache *sc, APSWStatement *stmt, int reprepare_o
         return SQLITE_SCHEMA;
     }
 
+  /* SQLite must stop pointing at the memory of the bound objects
+     before we let go of them */
+  if(stmt->nbound)
+    {
+      PYSQLITE_SC_CALL(sqlite3_clear_bindings(stmt->vdbestatement));
+      statementcache_releasebound(stmt);
+    }
+
+  /* the PreparedStatement keeps it */
+  if(stmt->pinned)
+    {
+      stmt->inuse=0;
+      Py_DECREF(stmt);
+      return res;
+    }
+
   /* is it going to be put in cache? */
-  if(stmt->incache || (sc->cache && stmt->vdbestatement && APSWBuffer_GET_SIZE(stmt->utf8) < SC_MAXSIZE && !PyDict_Contains(sc->cache, stmt->utf8)))
+  if(!stmt->incache && sc->cache && stmt->vdbestatement && APSWBuffer_GET_SIZE(stmt->utf8) < sc->maxsize
+     && !statementcache_toobig(sc, stmt))
     {
-      /* add ourselves to cache */
-      if(!stmt->incache)
+      APSWStatement *first=(APSWStatement*)PyDict_GetItem(sc->cache, stmt->utf8);
+      if(first)
+        {
+          /* the query is already cached but that instance was in
+             use, so keep this one as well */
+          unsigned ninstances=1;
+          while(first->samekey)
+            {
+              first=first->samekey;
+              ninstances++;
+            }
+          if(ninstances<SC_MAXINSTANCES)
+            {
+              assert_not_in_dict(sc->cache, (PyObject*)stmt);
+              Py_INCREF(stmt);
+              first->samekey=stmt;
+              /* only the first instance is under the original query */
+              Py_CLEAR(stmt->origquery);
+              stmt->incache=1;
+              sc->numentries += 1;
+              sc->nduplicates += 1;
+            }
+        }
+      else
         {
-          assert(!PyDict_Contains(sc->cache, stmt->utf8));
           assert_not_in_dict(sc->cache, (PyObject*)stmt);
           PyDict_SetItem(sc->cache, stmt->utf8, (PyObject*)stmt);
           if(stmt->origquery)
@@ -468,60 +871,113 @@ statementcache_finalize(StatementCache *sc, APSWStatement *stmt, int reprepare_o
           stmt->incache=1;
           sc->numentries += 1;
         }
+      if(stmt->incache)
+        {
+          sc->memused += stmt->memused;
+          sc_memoryused += stmt->memused;
+        }
+    }
 
+  if(stmt->incache)
+    {
       assert(PyDict_Contains(sc->cache, stmt->utf8));
 
       /* do we need to do an evict? */
-      while(sc->numentries > sc->maxentries)
+      while(sc->numentries > sc->maxentries || statementcache_overbudget(sc))
         {
-          APSWStatement *evictee=sc->lru;
+          APSWStatement *evictee, *first;
           statementcache_sanity_check(sc);
-          assert(evictee!=stmt);      /* we were inuse and so should not be on evict list */
 
           /* no possibles to evict? */
           if(!sc->lru)
             break;
 
-          /* only entry? */
-          if(!evictee->lru_prev)
+          evictee=(sc->numentries > sc->maxentries)?sc->lru:statementcache_memoryevictee(sc);
+          assert(evictee!=stmt);      /* we were inuse and so should not be on evict list */
+
+          /* take it out of the lru list */
+          if(evictee->lru_prev)
             {
-              assert(sc->mru==evictee);   /* points to sole entry */
-              assert(sc->lru==evictee);   /* points to sole entry */
-              assert(!evictee->lru_prev); /* should be anyone before */
-              assert(!evictee->lru_next); /* or after */
-              sc->mru=NULL;
-              sc->lru=NULL;
-              goto delevictee;
+              assert(evictee->lru_prev->lru_next==evictee);
+              evictee->lru_prev->lru_next=evictee->lru_next;
             }
-          /* take out lru member */
-          sc->lru=evictee->lru_prev;
-          assert(sc->lru->lru_next==evictee);
-          sc->lru->lru_next=NULL;
+          else
+            {
+              assert(sc->mru==evictee);
+              sc->mru=evictee->lru_next;
+            }
+          if(evictee->lru_next)
+            {
+              assert(evictee->lru_next->lru_prev==evictee);
+              evictee->lru_next->lru_prev=evictee->lru_prev;
+            }
+          else
+            {
+              assert(sc->lru==evictee);
+              sc->lru=evictee->lru_prev;
+            }
+          evictee->lru_prev=evictee->lru_next=NULL;
 
-        delevictee:
           assert(!evictee->inuse);
           assert(evictee->incache);
           statementcache_sanity_check(sc);
 
-          /* only references should be the dict */
+          /* only references should be the dict or the previous
+             instance of the same query */
           assert(Py_REFCNT(evictee)==1+!!evictee->origquery);
 
 #if SC_NRECYCLE > 0
           /* we don't gc to run on object */
           Py_INCREF(evictee);
 #endif
-          if(evictee->origquery)
+          first=(APSWStatement*)PyDict_GetItem(sc->cache, evictee->utf8);
+          assert(first);
+          if(first!=evictee)
+            {
+              /* an extra instance - unlink it */
+              while(first->samekey!=evictee)
+                first=first->samekey;
+              first->samekey=evictee->samekey;
+              evictee->samekey=NULL;
+              sc->nduplicates -= 1;
+              Py_DECREF(evictee);
+            }
+          else
             {
-              assert(evictee==(APSWStatement*)PyDict_GetItem(sc->cache, evictee->origquery));
-              PyDict_DelItem(sc->cache, evictee->origquery);
-              Py_DECREF(evictee->origquery);
+              /* the next instance (if any) takes over in the dict */
+              APSWStatement *next=evictee->samekey;
+              PyObject *origquery=evictee->origquery;
+
+              evictee->samekey=NULL;
               evictee->origquery=NULL;
+              if(origquery)
+                {
+                  assert(evictee==(APSWStatement*)PyDict_GetItem(sc->cache, origquery));
+                  PyDict_DelItem(sc->cache, origquery);
+                }
+              PyDict_DelItem(sc->cache, evictee->utf8);
+              if(next)
+                {
+                  assert(!next->origquery);
+                  PyDict_SetItem(sc->cache, next->utf8, (PyObject*)next);
+                  if(origquery)
+                    PyDict_SetItem(sc->cache, origquery, (PyObject*)next);
+                  next->origquery=origquery;
+                  origquery=NULL;
+                  /* the dict now has the reference evictee had */
+                  Py_DECREF(next);
+                  sc->nduplicates -= 1;
+                }
+              Py_XDECREF(origquery);
             }
-          assert(evictee==(APSWStatement*)PyDict_GetItem(sc->cache, evictee->utf8));
-          PyDict_DelItem(sc->cache, evictee->utf8);
           assert_not_in_dict(sc->cache, (PyObject*)evictee);
           assert(!PyErr_Occurred());
 
+          statementcache_dropchain(evictee);
+          sc->memused -= evictee->memused;
+          sc_memoryused -= evictee->memused;
+          evictee->memused=0;
+
 #if SC_NRECYCLE > 0
           if(sc->nrecycle<SC_NRECYCLE)
             {
@@ -535,6 +991,7 @@ statementcache_finalize(StatementCache *sc, APSWStatement *stmt, int reprepare_o
             }
 #endif
           sc->numentries -= 1;
+          sc->st_evictions++;
           statementcache_sanity_check(sc);
         }
 
@@ -554,6 +1011,8 @@ statementcache_finalize(StatementCache *sc, APSWStatement *stmt, int reprepare_o
     }
 
   stmt->inuse=0;
+  if(!stmt->incache)
+    statementcache_dropchain(stmt);
 #if SC_NRECYCLE > 0
   if(!stmt->incache && sc->nrecycle<SC_NRECYCLE)
     {
@@ -569,30 +1028,105 @@ statementcache_finalize(StatementCache *sc, APSWStatement *stmt, int reprepare_o
 }
 
 
+/* Is stmt in the cache, or going to be put there when it is
+   finalized?  A chain is only worth keeping for a cached script as
+   otherwise nothing will ever reuse it.  A statement after the first
+   goes by whether the first is cached. */
+static int
+statementcache_cachingscript(StatementCache *sc, APSWStatement *stmt)
+{
+  APSWStatement *first;
+  unsigned ninstances=0;
+
+  if(stmt->head)
+    return stmt->head->incache;
+  if(stmt->incache)
+    return 1;
+  /* pinned without a head is a PreparedStatement or a chain whose
+     first statement has gone */
+  if(stmt->pinned || !sc->cache || !stmt->vdbestatement || APSWBuffer_GET_SIZE(stmt->utf8) >= sc->maxsize
+     || statementcache_toobig(sc, stmt))
+    return 0;
+  for(first=(APSWStatement*)PyDict_GetItem(sc->cache, stmt->utf8); first; first=first->samekey)
+    ninstances++;
+  return ninstances<SC_MAXINSTANCES;
+}
+
 /* returns SQLITE_OK on success.  ppstmt will be next statement on
    success else null on error.  reference will be consumed on ppstmt
-   passed in and new reference on one returned */
+   passed in and new reference on one returned.  The next statement is
+   kept as the chain of the current one so that when the current one is
+   cached, executing the same script again reuses all the statements. */
 static int
 statementcache_next(StatementCache *sc, APSWStatement **ppstmt, int usepreparev2)
 {
-  PyObject *next=(*ppstmt)->next;
+  APSWStatement *stmt=*ppstmt, *chain=NULL;
+  PyObject *next=stmt->next;
   int res;
 
   assert(next);
   Py_INCREF(next);
 
-  res=statementcache_finalize(sc, *ppstmt, 0); /* INUSE_CALL not needed here */
+  if(stmt->chain && !stmt->chain->inuse)
+    {
+      chain=stmt->chain;
+      assert(chain->pinned);
+      sc->st_hits++;
+      chain->inuse=1;
+      _PYSQLITE_CALL_V(sqlite3_clear_bindings(chain->vdbestatement));
+      Py_INCREF(chain);
+    }
+  else if(!stmt->chain && statementcache_cachingscript(sc, stmt))
+    {
+      sc->st_misses++;
+      Py_INCREF(next);
+      chain=statementcache_preparenew(sc, next, NULL, usepreparev2, 0);
+      if(!chain)
+        {
+          /* the current statement still has to be finalized */
+          PyObject *etype, *evalue, *etb;
+          PyErr_Fetch(&etype, &evalue, &etb);
+          statementcache_finalize(sc, stmt, 0); /* INUSE_CALL not needed here */
+          PyErr_Restore(etype, evalue, etb);
+          *ppstmt=NULL;
+          res=SQLITE_ERROR;
+          goto error;
+        }
+      chain->pinned=1;
+      Py_INCREF(chain);
+      stmt->chain=chain;
+      chain->head=stmt->head?stmt->head:stmt;
+      if(chain->head->incache)
+        statementcache_recharge(sc, chain->head);
+    }
+
+  res=statementcache_finalize(sc, stmt, 0); /* INUSE_CALL not needed here */
 
   /* defensive coding.  res will never be an error as errors would
      have been returned from earlier step call */
 
   assert(res==SQLITE_OK);
 
-  if(res!=SQLITE_OK) goto error;
+  if(res!=SQLITE_OK)
+    {
+      if(chain)
+        {
+          chain->inuse=0;
+          Py_DECREF(chain);
+        }
+      goto error;
+    }
 
-  /* statementcache_prepare already sets exception */
-  *ppstmt=statementcache_prepare(sc, next, usepreparev2);  /* INUSE_CALL not needed here */
-  res=(*ppstmt)?SQLITE_OK:SQLITE_ERROR;
+  if(chain)
+    *ppstmt=chain;
+  else
+    {
+      /* the chain is in use (nested execution of the same script)
+         or the script isn't cached.  statementcache_prepare already
+         sets exception */
+      *ppstmt=statementcache_prepare(sc, next, usepreparev2);  /* INUSE_CALL not needed here */
+      res=(*ppstmt)?SQLITE_OK:SQLITE_ERROR;
+    }
 
  error:
   APSWBuffer_XDECREF_unlikely(next);
@@ -600,10 +1134,426 @@ statementcache_next(StatementCache *sc, APSWStatement **ppstmt, int usepreparev2
   return res;
 }
 
+/* Makes a statement for a PreparedStatement.  It is never put in the
+   cache or recycled, and is returned not in use.  Only a single
+   statement is allowed. */
+static APSWStatement*
+statementcache_preparepinned(StatementCache *sc, PyObject *query, int persistent)
+{
+  APSWStatement *val;
+  PyObject *utf8, *tmp;
+  unsigned prepflags=0;
+
+  utf8=getutf8string(query);
+  if(!utf8)
+    return NULL;
+  tmp=APSWBuffer_FromObject(utf8, 0, PyBytes_GET_SIZE(utf8));
+  Py_DECREF(utf8);
+  if(!tmp)
+    return NULL;
+
+#ifdef SQLITE_PREPARE_PERSISTENT
+  if(persistent)
+    prepflags=SQLITE_PREPARE_PERSISTENT;
+#endif
+
+  val=statementcache_preparenew(sc, tmp, NULL, 1, prepflags);
+  if(!val)
+    return NULL;
+  val->pinned=1;
+
+  if(val->next)
+    {
+      statementcache_finalize(sc, val, 0); /* INUSE_CALL not needed here */
+      PyErr_Format(PyExc_ValueError, "A PreparedStatement can only contain one statement");
+      return NULL;
+    }
+
+  val->inuse=0;
+  return val;
+}
+
+/* Auto-parameterization (Connection.setautoparameterize).  The query
+   is tokenized with numeric and string literals replaced by ? and
+   whitespace and comments collapsed so that queries differing only in
+   their literals share one cache entry.  Literals are only lifted
+   where a parameter means the same thing, so not in result columns
+   (the column names would change), ORDER/GROUP BY terms (a number is
+   a column index), window definitions or statements other than
+   queries and DML.  It isn't
+   a full parser so anything unusual results in the query being used
+   as is. */
+
+/* how deeply nested parentheses can be */
+#define SC_NORM_MAXDEPTH 64
+
+#define SC_NORM_IDSTART(c) ( ((c)>='a' && (c)<='z') || ((c)>='A' && (c)<='Z') || (c)=='_' || ((c)&0x80) )
+#define SC_NORM_IDCHAR(c) ( SC_NORM_IDSTART(c) || ((c)>='0' && (c)<='9') || (c)=='$' )
+#define SC_NORM_DIGIT(c) ( (c)>='0' && (c)<='9' )
+
+/* case insensitive comparison of a token with a lower case keyword */
+static int
+sc_norm_keyword(const char *tok, Py_ssize_t len, const char *kw)
+{
+  Py_ssize_t i;
+  for(i=0;i<len;i++)
+    if(!kw[i] || (tok[i]|0x20)!=kw[i])
+      return 0;
+  return !kw[len];
+}
+
+/* Returns a new reference to an APSWBuffer of the normalized query
+   with the literal values in *values.  Returns NULL without an
+   exception if the query should be used as is. */
+static PyObject *
+statementcache_normalize(StatementCache *sc, PyObject *query, PyObject **values)
+{
+  PyObject *utf8=NULL, *vals=NULL, *res=NULL, *tmp;
+  const char *in;
+  char *out=NULL;
+  Py_ssize_t len, i, outlen=0;
+  int lift=0, byclause=0, afterby=0, sawordergroup=0, first=1, ended=0, pendingspace=0, depth=0;
+  unsigned long long liftstack=0;
+
+  *values=NULL;
+
+  if(!PyUnicode_CheckExact(query)
+#if PY_MAJOR_VERSION < 3
+     && !PyString_CheckExact(query)
+#endif
+     )
+    return NULL;
+
+  utf8=getutf8string(query);
+  if(!utf8)
+    return NULL;
+  in=PyBytes_AS_STRING(utf8);
+  len=PyBytes_GET_SIZE(utf8);
+  if(len>=sc->maxsize)
+    goto asis;
+
+  /* the result is never longer than the query */
+  out=PyMem_Malloc(len+1);
+  vals=PyList_New(0);
+  if(!out || !vals)
+    {
+      if(!out) PyErr_NoMemory();
+      goto error;
+    }
+
+  i=0;
+  while(i<len)
+    {
+      char c=in[i];
+      Py_ssize_t start=i;
+      int wasafterby=afterby;
+
+      if(c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\f')
+        {
+          pendingspace=1;
+          i++;
+          continue;
+        }
+      if(c=='-' && i+1<len && in[i+1]=='-')
+        {
+          while(i<len && in[i]!='\n')
+            i++;
+          pendingspace=1;
+          continue;
+        }
+      if(c=='/' && i+1<len && in[i+1]=='*')
+        {
+          i+=2;
+          while(i<len && !(in[i]=='*' && i+1<len && in[i+1]=='/'))
+            i++;
+          i+=2;
+          pendingspace=1;
+          continue;
+        }
+      if(c==';')
+        {
+          /* trailing semicolons are dropped */
+          ended=1;
+          i++;
+          continue;
+        }
+      /* only one statement is supported */
+      if(ended)
+        goto asis;
+
+      if(pendingspace && outlen)
+        out[outlen++]=' ';
+      pendingspace=0;
+      afterby=0;
+
+      if(c=='\'')
+        {
+          int doubled=0;
+          for(i++; i<len; i++)
+            {
+              if(in[i]=='\'')
+                {
+                  if(i+1<len && in[i+1]=='\'')
+                    {
+                      doubled=1;
+                      i++;
+                      continue;
+                    }
+                  break;
+                }
+            }
+          if(i>=len)
+            goto asis;
+          i++;
+          if(lift)
+            {
+              PyObject *value;
+              if(!doubled)
+                value=convertutf8stringsize(in+start+1, i-start-2);
+              else
+                {
+                  /* out has space for the unescaped string before
+                     we write ? over it */
+                  Py_ssize_t j, n=0;
+                  for(j=start+1; j<i-1; j++)
+                    {
+                      out[outlen+n++]=in[j];
+                      if(in[j]=='\'')
+                        j++;
+                    }
+                  value=convertutf8stringsize(out+outlen, n);
+                }
+              if(!value || PyList_Append(vals, value))
+                {
+                  Py_XDECREF(value);
+                  goto error;
+                }
+              Py_DECREF(value);
+              out[outlen++]='?';
+              continue;
+            }
+        }
+      else if(c=='"' || c=='`')
+        {
+          for(i++; i<len; i++)
+            {
+              if(in[i]==c)
+                {
+                  if(i+1<len && in[i+1]==c)
+                    {
+                      i++;
+                      continue;
+                    }
+                  break;
+                }
+            }
+          if(i>=len)
+            goto asis;
+          i++;
+        }
+      else if(c=='[')
+        {
+          while(i<len && in[i]!=']')
+            i++;
+          if(i>=len)
+            goto asis;
+          i++;
+        }
+      else if(SC_NORM_DIGIT(c) || (c=='.' && i+1<len && SC_NORM_DIGIT(in[i+1])))
+        {
+          int isreal=0;
+
+          if(c=='0' && i+1<len && (in[i+1]=='x' || in[i+1]=='X'))
+            {
+              /* hex is left alone */
+              for(i+=2; i<len && SC_NORM_IDCHAR(in[i]); i++);
+              memcpy(out+outlen, in+start, i-start);
+              outlen+=i-start;
+              continue;
+            }
+          while(i<len && SC_NORM_DIGIT(in[i]))
+            i++;
+          if(i<len && in[i]=='.')
+            {
+              isreal=1;
+              for(i++; i<len && SC_NORM_DIGIT(in[i]); i++);
+            }
+          if(i<len && (in[i]=='e' || in[i]=='E'))
+            {
+              isreal=1;
+              i++;
+              if(i<len && (in[i]=='+' || in[i]=='-'))
+                i++;
+              if(i>=len || !SC_NORM_DIGIT(in[i]))
+                goto asis;
+              while(i<len && SC_NORM_DIGIT(in[i]))
+                i++;
+            }
+          if(i<len && (SC_NORM_IDCHAR(in[i]) || in[i]=='.'))
+            goto asis;
+
+          /* a number on its own in ORDER/GROUP BY is a column index */
+          if(lift && !(byclause && wasafterby))
+            {
+              PyObject *value=NULL;
+              if(!isreal)
+                {
+                  sqlite3_uint64 v=0;
+                  Py_ssize_t j;
+                  for(j=start; j<i; j++)
+                    {
+                      int d=in[j]-'0';
+                      if(v>(0x7fffffffffffffffULL-d)/10)
+                        break;
+                      v=v*10+d;
+                    }
+                  /* too big numbers are left for SQLite to make real */
+                  if(j==i)
+                    {
+                      value=PyLong_FromLongLong((sqlite3_int64)v);
+                      if(!value) goto error;
+                    }
+                }
+#if PY_VERSION_HEX >= 0x02070000
+              else
+                {
+                  char *end;
+                  double d=PyOS_string_to_double(in+start, &end, NULL);
+                  if(d==-1.0 && PyErr_Occurred())
+                    goto error;
+                  if(end!=in+i)
+                    goto asis;
+                  value=PyFloat_FromDouble(d);
+                  if(!value) goto error;
+                }
+#endif
+              if(value)
+                {
+                  if(PyList_Append(vals, value))
+                    {
+                      Py_DECREF(value);
+                      goto error;
+                    }
+                  Py_DECREF(value);
+                  out[outlen++]='?';
+                  continue;
+                }
+            }
+        }
+      else if(SC_NORM_IDSTART(c))
+        {
+          Py_ssize_t toklen;
+          const char *tok=in+start;
+
+          while(i<len && SC_NORM_IDCHAR(in[i]))
+            i++;
+          toklen=i-start;
+
+          /* blob literals are left alone */
+          if(toklen==1 && (c=='x' || c=='X') && i<len && in[i]=='\'')
+            {
+              for(i++; i<len && in[i]!='\''; i++);
+              if(i>=len)
+                goto asis;
+              i++;
+            }
+          else if(first)
+            {
+              if(sc_norm_keyword(tok, toklen, "values"))
+                lift=1;
+              else if(!sc_norm_keyword(tok, toklen, "select") && !sc_norm_keyword(tok, toklen, "insert")
+                      && !sc_norm_keyword(tok, toklen, "update") && !sc_norm_keyword(tok, toklen, "delete")
+                      && !sc_norm_keyword(tok, toklen, "replace") && !sc_norm_keyword(tok, toklen, "with"))
+                goto asis;
+            }
+          else if(sc_norm_keyword(tok, toklen, "select") || sc_norm_keyword(tok, toklen, "returning"))
+            lift=byclause=0;
+          else if(sc_norm_keyword(tok, toklen, "from") || sc_norm_keyword(tok, toklen, "where")
+                  || sc_norm_keyword(tok, toklen, "set") || sc_norm_keyword(tok, toklen, "values")
+                  || sc_norm_keyword(tok, toklen, "on") || sc_norm_keyword(tok, toklen, "having")
+                  || sc_norm_keyword(tok, toklen, "limit"))
+            {
+              lift=1;
+              byclause=0;
+            }
+          else if(sc_norm_keyword(tok, toklen, "over") || sc_norm_keyword(tok, toklen, "window"))
+            /* frame boundaries have to be constants */
+            goto asis;
+          else if(sawordergroup && sc_norm_keyword(tok, toklen, "by"))
+            {
+              lift=byclause=afterby=1;
+            }
+          sawordergroup=sc_norm_keyword(tok, toklen, "order") || sc_norm_keyword(tok, toklen, "group");
+          first=0;
+        }
+      else if(c=='?' || c==':' || c=='@' || c=='$')
+        /* it already has parameters */
+        goto asis;
+      else if(c=='(')
+        {
+          if(depth>=SC_NORM_MAXDEPTH)
+            goto asis;
+          if(lift)
+            liftstack|=1ULL<<depth;
+          depth++;
+          i++;
+        }
+      else if(c==')')
+        {
+          if(!depth)
+            goto asis;
+          depth--;
+          lift=!!(liftstack & (1ULL<<depth));
+          liftstack&=~(1ULL<<depth);
+          i++;
+        }
+      else
+        {
+          afterby=(c==',');
+          i++;
+        }
+
+      if(first)
+        goto asis;
+      if(!SC_NORM_IDSTART(c))
+        sawordergroup=0;
+      memcpy(out+outlen, in+start, i-start);
+      outlen+=i-start;
+    }
+
+  if(first || depth)
+    goto asis;
+
+  /* nothing changed? */
+  if(!PyList_GET_SIZE(vals) && outlen==len && 0==memcmp(in, out, len))
+    goto asis;
+
+  tmp=PyBytes_FromStringAndSize(out, outlen);
+  if(!tmp) goto error;
+  res=APSWBuffer_FromObject(tmp, 0, outlen);
+  Py_DECREF(tmp);
+  if(!res) goto error;
+  *values=PyList_AsTuple(vals);
+  if(!*values)
+    {
+      APSWBuffer_XDECREF_unlikely(res);
+      res=NULL;
+    }
+  goto error;
+
+ asis:
+  assert(!PyErr_Occurred());
+ error:
+  Py_DECREF(utf8);
+  Py_XDECREF(vals);
+  PyMem_Free(out);
+  return res;
+}
+
 
 
 static StatementCache*
-statementcache_init(sqlite3 *db, unsigned nentries)
+statementcache_init(sqlite3 *db, unsigned nentries, sqlite3_int64 maxmemory)
 {
   StatementCache *sc=(StatementCache*)PyMem_Malloc(sizeof(StatementCache));
   if(!sc) return NULL;
@@ -623,6 +1573,14 @@ statementcache_init(sqlite3 *db, unsigned nentries)
         }
     }
   sc->maxentries=nentries;
+  sc->maxmemory=maxmemory;
+  sc->maxsize=SC_MAXSIZE;
+  if(maxmemory>SC_MAXSIZE)
+    sc->maxsize=(maxmemory<PY_SSIZE_T_MAX)?(Py_ssize_t)maxmemory:PY_SSIZE_T_MAX;
+  sc->memused=0;
+  sc->st_hits=sc->st_misses=sc->st_inuse=0;
+  sc->st_evictions=sc->st_recycled=sc->st_reprepares=sc->st_normalized=0;
+  sc->nduplicates=0;
   sc->mru=NULL;
   sc->lru=NULL;
 #if SC_NRECYCLE > 0
@@ -641,12 +1599,9 @@ statementcache_free(StatementCache *sc)
       Py_DECREF(o);
     }
 #endif
+  sc_memoryused -= sc->memused;
   Py_XDECREF(sc->cache);
   PyMem_Free(sc);
-
-#ifdef SC_STATS
-  fprintf(stderr, "SC Miss: %u Hit: %u HitButInuse: %u\n", sc->st_cachemiss, sc->st_cachehit, sc->st_hitinuse);
-#endif
 }
 
 static void
@@ -658,6 +1613,13 @@ APSWStatement_dealloc(APSWStatement *stmt)
   APSWBuffer_XDECREF_likely(stmt->utf8);
   APSWBuffer_XDECREF_likely(stmt->next);
   Py_XDECREF(stmt->origquery);
+  Py_XDECREF(stmt->samekey);
+  statementcache_dropchain(stmt);
+  Py_XDECREF(stmt->colnames);
+  Py_XDECREF(stmt->rowtype);
+  Py_XDECREF(stmt->paramnames);
+  statementcache_releasebound(stmt);
+  PyMem_Free(stmt->boundobjs);
   Py_TYPE(stmt)->tp_free((PyObject*)stmt);
 }
 
@@ -679,6 +1641,293 @@ convertutf8buffersizetounicode(PyObject *buffer, Py_ssize_t len)
   return convertutf8stringsize(APSWBuffer_AS_STRING(buffer), len);
 }
 
+/* Returns a dict of the statistics for Connection.cache_stats */
+static PyObject *
+statementcache_stats(StatementCache *sc)
+{
+  sqlite3_int64 memory=0;
+
+#ifdef SQLITE_STMTSTATUS_MEMUSED
+  if(sc->cache)
+    {
+      PyObject *key, *value;
+      Py_ssize_t pos=0;
+
+      /* includes entries currently in use.  Each statement is in the
+         dict under its utf8 and possibly also the original query */
+      APSW_DB_MUTEX_ENTER(sc->db);
+      while(PyDict_Next(sc->cache, &pos, &key, &value))
+        {
+          APSWStatement *item=(APSWStatement*)value;
+          if(item->utf8!=key)
+            continue;
+          for(; item; item=item->samekey)
+            {
+              APSWStatement *chain;
+              for(chain=item; chain; chain=chain->chain)
+                PYSQLITE_HELD_CALL(memory+=sqlite3_stmt_status(chain->vdbestatement, SQLITE_STMTSTATUS_MEMUSED, 0));
+            }
+        }
+      APSW_DB_MUTEX_LEAVE(sc->db);
+    }
+#endif
+
+  return Py_BuildValue("{s: I, s: I, s: I, s: L, s: L, s: L, s: L, s: L, s: L, s: L, s: L, s: L}",
+                       "size", sc->maxentries,
+                       "entries", sc->numentries,
+                       "duplicates", sc->nduplicates,
+                       "hits", sc->st_hits,
+                       "misses", sc->st_misses,
+                       "inuse", sc->st_inuse,
+                       "evictions", sc->st_evictions,
+                       "recycled", sc->st_recycled,
+                       "reprepares", sc->st_reprepares,
+                       "normalized", sc->st_normalized,
+                       "memory", memory,
+                       "memorylimit", sc->maxmemory);
+}
+
+static int
+statementcache_appendentry(PyObject *list, APSWStatement *item)
+{
+  int res;
+  PyObject *query=convertutf8buffertounicode(item->utf8);
+
+  if(!query) return -1;
+  res=PyList_Append(list, query);
+  Py_DECREF(query);
+  return res;
+}
+
+/* Returns a list of the cached queries least recently used first.
+   Entries currently executing aren't in the lru list and are added
+   at the end. */
+static PyObject *
+statementcache_entries(StatementCache *sc)
+{
+  APSWStatement *item;
+  PyObject *key, *value;
+  Py_ssize_t pos=0;
+  PyObject *res=PyList_New(0);
+
+  if(!res) return NULL;
+
+  for(item=sc->lru; item; item=item->lru_prev)
+    if(statementcache_appendentry(res, item))
+      goto error;
+
+  while(sc->cache && PyDict_Next(sc->cache, &pos, &key, &value))
+    {
+      item=(APSWStatement*)value;
+      if(item->utf8!=key)
+        continue;
+      for(; item; item=item->samekey)
+        if(item->inuse && statementcache_appendentry(res, item))
+          goto error;
+    }
+  return res;
+
+ error:
+  Py_DECREF(res);
+  return NULL;
+}
+
+/* Adds the counters for one statement to totals which is keyed by
+   the query text.  Instances of the same query are combined. */
+static int
+statementcache_profileentry(StatementCache *sc, PyObject *totals, PyObject *scan, APSWStatement *item)
+{
+  PyObject *query=NULL, *counts, *value=NULL, *sum;
+  unsigned i;
+
+  query=convertutf8buffersizetounicode(item->utf8, item->querylen);
+  if(!query) goto error;
+
+  counts=PyDict_GetItem(totals, query);
+  if(!counts)
+    {
+      counts=PyList_New(SC_NPROFILE);
+      if(!counts) goto error;
+      for(i=0; i<SC_NPROFILE; i++)
+        {
+          value=PyLong_FromLongLong(0);
+          if(!value)
+            {
+              Py_DECREF(counts);
+              goto error;
+            }
+          PyList_SET_ITEM(counts, i, value);
+        }
+      value=NULL;
+      i=PyDict_SetItem(totals, query, counts);
+      Py_DECREF(counts);
+      if(i) goto error;
+
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+      /* the loops of the first instance */
+      if(scan)
+        {
+          PyObject *loops=PyList_New(0), *loop;
+          int idx, res;
+          sqlite3_int64 nloop, nvisit;
+          double est;
+          const char *name, *explain;
+
+          if(!loops) goto error;
+          if(PyDict_SetItem(scan, query, loops))
+            {
+              Py_DECREF(loops);
+              goto error;
+            }
+          Py_DECREF(loops);
+          for(idx=0; ; idx++)
+            {
+              APSW_DB_MUTEX_ENTER(sc->db);
+              PYSQLITE_HELD_CALL(res=sqlite3_stmt_scanstatus(item->vdbestatement, idx, SQLITE_SCANSTAT_NLOOP, &nloop));
+              if(res==0)
+                {
+                  PYSQLITE_HELD_CALL(sqlite3_stmt_scanstatus(item->vdbestatement, idx, SQLITE_SCANSTAT_NVISIT, &nvisit));
+                  PYSQLITE_HELD_CALL(sqlite3_stmt_scanstatus(item->vdbestatement, idx, SQLITE_SCANSTAT_EST, &est));
+                  PYSQLITE_HELD_CALL(sqlite3_stmt_scanstatus(item->vdbestatement, idx, SQLITE_SCANSTAT_NAME, &name));
+                  PYSQLITE_HELD_CALL(sqlite3_stmt_scanstatus(item->vdbestatement, idx, SQLITE_SCANSTAT_EXPLAIN, &explain));
+                }
+              APSW_DB_MUTEX_LEAVE(sc->db);
+              if(res)
+                break;
+              loop=Py_BuildValue("{s: O&, s: O&, s: L, s: L, s: d}",
+                                 "name", convertutf8string, name,
+                                 "explain", convertutf8string, explain,
+                                 "loops", nloop,
+                                 "rows", nvisit,
+                                 "estimate", est);
+              if(!loop || PyList_Append(loops, loop))
+                {
+                  Py_XDECREF(loop);
+                  goto error;
+                }
+              Py_DECREF(loop);
+            }
+        }
+#else
+      (void)sc;
+      (void)scan;
+#endif
+    }
+
+  for(i=0; i<SC_NPROFILE; i++)
+    {
+      if(!item->profile[i])
+        continue;
+      value=PyLong_FromLongLong(item->profile[i]);
+      if(!value) goto error;
+      sum=PyNumber_Add(PyList_GET_ITEM(counts, i), value);
+      Py_CLEAR(value);
+      if(!sum) goto error;
+      PyList_SetItem(counts, i, sum);
+    }
+
+  Py_DECREF(query);
+  return 0;
+
+ error:
+  Py_XDECREF(query);
+  Py_XDECREF(value);
+  return -1;
+}
+
+/* Returns the top n queries for each counter for
+   Connection.cache_profile */
+static PyObject *
+statementcache_profile(StatementCache *sc, int n)
+{
+  PyObject *totals=NULL, *scan=NULL, *res=NULL, *ranked=NULL, *top=NULL, *key, *value;
+  Py_ssize_t pos;
+  unsigned i;
+
+  totals=PyDict_New();
+  res=PyDict_New();
+  if(!totals || !res) goto error;
+
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+  scan=PyDict_New();
+  if(!scan) goto error;
+#endif
+
+  pos=0;
+  while(sc->cache && PyDict_Next(sc->cache, &pos, &key, &value))
+    {
+      APSWStatement *item=(APSWStatement*)value;
+      if(item->utf8!=key)
+        continue;
+      for(; item; item=item->samekey)
+        {
+          APSWStatement *chain;
+          for(chain=item; chain; chain=chain->chain)
+            if(statementcache_profileentry(sc, totals, scan, chain))
+              goto error;
+        }
+    }
+
+  for(i=0; i<SC_NPROFILE; i++)
+    {
+      Py_ssize_t j;
+
+      ranked=PyList_New(0);
+      if(!ranked) goto error;
+      pos=0;
+      while(PyDict_Next(totals, &pos, &key, &value))
+        {
+          PyObject *count=PyList_GET_ITEM(value, i), *pair;
+          int zero=PyObject_Not(count);
+          if(zero<0) goto error;
+          if(zero)
+            continue;
+          pair=PyTuple_Pack(2, count, key);
+          if(!pair || PyList_Append(ranked, pair))
+            {
+              Py_XDECREF(pair);
+              goto error;
+            }
+          Py_DECREF(pair);
+        }
+      if(PyList_Sort(ranked) || PyList_Reverse(ranked))
+        goto error;
+
+      top=PyList_New(0);
+      if(!top) goto error;
+      for(j=0; j<PyList_GET_SIZE(ranked) && j<n; j++)
+        {
+          PyObject *pair=PyList_GET_ITEM(ranked, j);
+          pair=PyTuple_Pack(2, PyTuple_GET_ITEM(pair, 1), PyTuple_GET_ITEM(pair, 0));
+          if(!pair || PyList_Append(top, pair))
+            {
+              Py_XDECREF(pair);
+              goto error;
+            }
+          Py_DECREF(pair);
+        }
+      if(PyDict_SetItemString(res, sc_profilecounters[i].name, top))
+        goto error;
+      Py_CLEAR(top);
+      Py_CLEAR(ranked);
+    }
+
+  if(scan && PyDict_SetItemString(res, "scanstatus", scan))
+    goto error;
+
+  Py_DECREF(totals);
+  Py_XDECREF(scan);
+  return res;
+
+ error:
+  Py_XDECREF(totals);
+  Py_XDECREF(scan);
+  Py_XDECREF(res);
+  Py_XDECREF(ranked);
+  Py_XDECREF(top);
+  return NULL;
+}
+
 
 static PyTypeObject APSWStatementType =
   {
@@ -48,6 +48,23 @@ do {                                                \
   Py_END_ALLOW_THREADS;                             \
  } while(0)
 
+/* Call where the caller has already acquired the database mutex using
+   APSW_DB_MUTEX_ENTER.  SQLite's mutexes are recursive so the call is
+   made directly with the GIL held rather than releasing and
+   reacquiring it (and the mutex) around every call. */
+#define PYSQLITE_HELD_CALL(x) \
+  do { x; } while(0)
+
+/* Acquire and release the database mutex for a sequence of
+   PYSQLITE_HELD_CALLs.  The GIL is released while waiting for the
+   mutex so the lock order is the same as callbacks from SQLite (db
+   mutex then GIL) and deadlock can't happen. */
+#define APSW_DB_MUTEX_ENTER(db) \
+  _PYSQLITE_CALL_V(sqlite3_mutex_enter(sqlite3_db_mutex(db)))
+
+#define APSW_DB_MUTEX_LEAVE(db) \
+  PYSQLITE_HELD_CALL(sqlite3_mutex_leave(sqlite3_db_mutex(db)))
+
 #define INUSE_CALL(x)                               \
   do {                                              \
        assert(self->inuse==0); self->inuse=1;       \
@@ -73,6 +90,9 @@ do {                                                \
 /* call from backup code */
 #define PYSQLITE_BACKUP_CALL(y) INUSE_CALL(_PYSQLITE_CALL_E(self->dest->db, y))
 
+/* call from session code - same as blob */
+#define PYSQLITE_SESSION_CALL PYSQLITE_BLOB_CALL
+
 #ifdef __GNUC__
 #define APSW_ARGUNUSED __attribute__ ((unused))
 #else
@@ -248,13 +268,15 @@ convert_value_to_pyobject(sqlite3_value *value)
 
 /* Converts column to PyObject.  Returns a new reference. Almost identical to above 
    but we cannot just use sqlite3_column_value and then call the above function as 
-   SQLite doesn't allow that ("unprotected values") */
+   SQLite doesn't allow that ("unprotected values").  The caller must
+   hold the database mutex (APSW_DB_MUTEX_ENTER) so that a whole row
+   can be converted without releasing the GIL for each value. */
 static PyObject *
 convert_column_to_pyobject(sqlite3_stmt *stmt, int col)
 {
   int coltype;
 
-  _PYSQLITE_CALL_V(coltype=sqlite3_column_type(stmt, col));
+  PYSQLITE_HELD_CALL(coltype=sqlite3_column_type(stmt, col));
 
   APSW_FAULT_INJECT(UnknownColumnType,,coltype=12348);
 
@@ -263,7 +285,7 @@ convert_column_to_pyobject(sqlite3_stmt *stmt, int col)
     case SQLITE_INTEGER:
       {
         sqlite3_int64 val;
-        _PYSQLITE_CALL_V(val=sqlite3_column_int64(stmt, col));
+        PYSQLITE_HELD_CALL(val=sqlite3_column_int64(stmt, col));
 #if PY_MAJOR_VERSION<3
         if (val>=LONG_MIN && val<=LONG_MAX)
           return PyInt_FromLong((long)val);
@@ -274,14 +296,14 @@ convert_column_to_pyobject(sqlite3_stmt *stmt, int col)
     case SQLITE_FLOAT:
       { 
         double d;
-        _PYSQLITE_CALL_V(d=sqlite3_column_double(stmt, col));
+        PYSQLITE_HELD_CALL(d=sqlite3_column_double(stmt, col));
         return PyFloat_FromDouble(d);
       }
     case SQLITE_TEXT:
       {
         const char *data;
         size_t len;
-        _PYSQLITE_CALL_V( (data=(const char*)sqlite3_column_text(stmt, col), len=sqlite3_column_bytes(stmt, col)) );
+        PYSQLITE_HELD_CALL( (data=(const char*)sqlite3_column_text(stmt, col), len=sqlite3_column_bytes(stmt, col)) );
         return convertutf8stringsize(data, len);
       }
 
@@ -292,7 +314,7 @@ convert_column_to_pyobject(sqlite3_stmt *stmt, int col)
       {
         const void *data;
         size_t len;
-        _PYSQLITE_CALL_V( (data=sqlite3_column_blob(stmt, col), len=sqlite3_column_bytes(stmt, col)) );
+        PYSQLITE_HELD_CALL( (data=sqlite3_column_blob(stmt, col), len=sqlite3_column_bytes(stmt, col)) );
         return converttobytes(data, len);
       }
 
@@ -352,3 +374,21 @@ static size_t apsw_strnlen(const char *s, size_t maxlen)
       }
     return res;
 }
+
+/* Monotonic nanoseconds for measuring intervals.  SQLite's own
+   timing uses the VFS clock which usually only has millisecond
+   resolution. */
+static sqlite3_int64
+apsw_now_ns(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (sqlite3_int64)(counter.QuadPart*(1e9/frequency.QuadPart));
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64)ts.tv_sec*1000000000+ts.tv_nsec;
+#endif
+}
@@ -295,6 +295,7 @@ class APSW(unittest.TestCase):
         'createcollation': 2,
         'createscalarfunction': 3,
         'collationneeded': 1,
+        'prepare': 1,
         'setauthorizer': 1,
         'setbusyhandler': 1,
         'setbusytimeout': 1,
@@ -308,6 +309,9 @@ class APSW(unittest.TestCase):
         'filecontrol': 3,
         'setexectrace': 1,
         'setrowtrace': 1,
+        'setrowfactory': 1,
+        'setautoparameterize': 1,
+        'setlatencyprofile': 1,
         '__enter__': 0,
         '__exit__': 3,
         'backup': 3,
@@ -321,8 +325,11 @@ class APSW(unittest.TestCase):
     cursor_nargs={
         'execute': 1,
         'executemany': 2,
+        'executecolumns': 2,
         'setexectrace': 1,
         'setrowtrace': 1,
+        'fetchmany': 1,
+        'setrowfactory': 1,
         }
 
     blob_nargs={
@@ -553,6 +560,20 @@ class APSW(unittest.TestCase):
         self.assertEqual((1,None,3), next(c.execute("select * from foo")))
         c.execute("delete from foo")
 
+        # parameter names are reused across executions, executemany
+        # and multiple statements
+        for i in range(3):
+            c.executemany("insert into foo values(@a, :b, $c); insert into foo values(:c, @b, 7)",
+                          [{'a': i, 'b': i*2, 'c': i*3} for i in range(10)])
+        self.assertEqual(60, next(c.execute("select count(*) from foo"))[0])
+        self.assertEqual(3*(sum(range(10))+sum(range(0,30,3))), next(c.execute("select sum(x) from foo"))[0])
+        c.execute("delete from foo")
+        # mixing named and unnamed
+        c.execute("insert into foo values(?, :b, ?)", (1, 2, 3))
+        self.assertRaises(apsw.BindingsError, c.execute, "insert into foo values(?, :b, ?)", {'b': 2})
+        self.assertEqual((1,2,3), next(c.execute("select * from foo")))
+        c.execute("delete from foo")
+
         # these ones should cause errors
         vals=(
             (apsw.BindingsError, "(?,?,?)", (1,2)), # too few
@@ -637,6 +658,26 @@ class APSW(unittest.TestCase):
         c.executemany("select * from foo; select ?", ( (1,), (2,) )) # we don't read
         self.assertRaises(apsw.IncompleteExecutionError, c.executemany, "begin")
 
+        # bytes and strings are bound without copying.  Make sure the
+        # values are right and the statement doesn't hang on to them
+        c.execute("create table zerocopy(x)")
+        vals=[(b(r"\x00\x01")*i,) for i in range(1, 50)]+[(u(r"\u1234\u0041")*i,) for i in range(1, 50)]+[("abc"*i,) for i in range(1,50)]
+        counts=[sys.getrefcount(v[0]) for v in vals]
+        c.executemany("insert into zerocopy values(?)", vals)
+        self.assertEqual(counts, [sys.getrefcount(v[0]) for v in vals])
+        self.assertEqual([v[0] for v in vals], [v[0] for v in c.execute("select x from zerocopy order by rowid")])
+        big=u(r"\u1234")*100000
+        count=sys.getrefcount(big)
+        for row in c.execute("select ?, length(?)", (big, big)):
+            self.assertEqual(row, (big, 100000))
+        self.assertEqual(count, sys.getrefcount(big))
+        # missing dict keys must not see a previous execution's value
+        c.execute("insert into zerocopy values(:x)", {"x": big})
+        del big
+        c.execute("insert into zerocopy values(:x)", {})
+        self.assertEqual(None, next(c.execute("select x from zerocopy order by rowid desc"))[0])
+        c.execute("delete from zerocopy")
+
         # set type (pysqlite error with this)
         if sys.version_info>=(2, 4, 0):
             c.execute("create table xxset(x,y,z)")
@@ -735,6 +776,279 @@ class APSW(unittest.TestCase):
         self.assertEqual(c.fetchall(), [])
         self.assertEqual(c.execute("select 3; select 4").fetchall(), [(3,), (4,)] )
 
+    def testFetchMany(self):
+        "Check batched fetching of rows"
+        c=self.db.cursor()
+        c.execute("create table foo(x,y); begin")
+        vals=[(i, u("row %d") % (i,)) for i in range(1000)]
+        c.executemany("insert into foo values(?,?)", vals)
+        c.execute("commit")
+        self.assertRaises(TypeError, c.fetchmany)
+        self.assertRaises(TypeError, c.fetchmany, "three")
+        self.assertRaises(ValueError, c.fetchmany, -1)
+        # no outstanding execution
+        self.assertEqual([], c.fetchmany(10))
+        self.assertEqual([], c.fetchall())
+        for size in (0, 1, 7, 999, 1000, 1001):
+            c.execute("select x,y from foo order by x")
+            if size==0:
+                self.assertEqual([], c.fetchmany(0))
+                self.assertEqual(vals, c.fetchall())
+                continue
+            res=[]
+            while True:
+                rows=c.fetchmany(size)
+                self.assertTrue(len(rows)<=size)
+                if not rows:
+                    break
+                res.extend(rows)
+            self.assertEqual(vals, res)
+            self.assertEqual([], c.fetchmany(size))
+        # mixing with other ways of getting rows
+        c.execute("select x,y from foo order by x")
+        self.assertEqual(vals[0], c.fetchone())
+        self.assertEqual(vals[1:11], c.fetchmany(10))
+        self.assertEqual(vals[11], next(c))
+        self.assertEqual(vals[12:], c.fetchall())
+        # multiple statements and types
+        self.assertEqual(c.execute("select 3; select 4.5, null; select x'aabb'").fetchmany(10),
+                         [(3,), (4.5,None), (b(r"\xaa\xbb"),)])
+        # row tracer sees every row and can drop them
+        c.setrowtrace(lambda cur, row: row if row[0]%2 else None)
+        self.assertEqual([v for v in vals if v[0]%2][:5], c.execute("select * from foo order by x").fetchmany(5))
+        self.assertEqual([v for v in vals if v[0]%2], c.execute("select * from foo order by x").fetchall())
+        c.setrowtrace(None)
+        # executemany
+        self.assertEqual([(i,) for i in range(20)],
+                         c.executemany("select ?", [(i,) for i in range(20)]).fetchmany(100))
+        # errors part way through
+        def fail(x):
+            if x==500:
+                1/0
+            return x
+        self.db.createscalarfunction("fail", fail)
+        c.execute("select fail(x) from foo")
+        self.assertEqual(list(range(100)), [r[0] for r in c.fetchmany(100)])
+        self.assertRaises(ZeroDivisionError, c.fetchmany, 1000)
+        self.assertRaises(ZeroDivisionError, c.execute("select fail(x) from foo").fetchall)
+        self.assertEqual([], c.fetchall())
+
+    def testFetchColumns(self):
+        "Check columnar fetching of rows"
+        c=self.db.cursor()
+        if not hasattr(c, "fetchcolumns"):
+            return
+        self.assertEqual([], c.fetchcolumns())
+        c.execute("create table foo(i,f,t,b,n,m); begin")
+        vals=[]
+        for i in range(1000):
+            vals.append( (i*1000000007, i/3.0, u("r\N{BLACK STAR}%d") % (i,), b(r"\xff\x00")*(i%5),
+                          None, [None, 3, 4.5][i%3]) )
+        c.executemany("insert into foo values(?,?,?,?,?,?)", vals)
+        c.execute("commit")
+        cols=c.execute("select * from foo order by rowid").fetchcolumns()
+        self.assertEqual([], c.fetchcolumns())
+        self.assertEqual(["i", "f", "t", "b", "n", "m"], [col.name for col in cols])
+        self.assertEqual(["int", "float", "text", "blob", "null", "float"], [col.kind for col in cols])
+        for i,col in enumerate(cols):
+            self.assertEqual(1000, len(col))
+            self.assertEqual([v[i] for v in vals], col.tolist())
+        self.assertEqual([0, 0, 0, 0, 1000, 334], [col.nullcount for col in cols])
+        # buffers
+        if py3:
+            mv=memoryview(cols[0])
+            self.assertEqual((1000,), mv.shape)
+            self.assertEqual("q", mv.format)
+            self.assertEqual([v[0] for v in vals], mv.tolist())
+            mv=memoryview(cols[1])
+            self.assertEqual("d", mv.format)
+            self.assertEqual([v[1] for v in vals], mv.tolist())
+            data=memoryview(cols[2]).tobytes()
+            offsets=memoryview(cols[2].offsets).tolist()
+            self.assertEqual(1001, len(offsets))
+            self.assertEqual([v[2] for v in vals], [data[offsets[i]:offsets[i+1]].decode("utf8") for i in range(1000)])
+            self.assertEqual(0, len(memoryview(cols[4])))
+            self.assertEqual([0, 3, 4.5, 0, 3, 4.5, 0], memoryview(cols[5]).tolist()[:7])
+            try:
+                memoryview(cols[0])[0]=3
+                self.fail("Should be read only")
+            except TypeError:
+                pass
+        self.assertEqual(None, cols[0].offsets)
+        nulls=cols[5].nulls
+        self.assertEqual(125, len(nulls))
+        self.assertEqual([i%3==0 for i in range(1000)], [bool(ord(nulls[i//8:i//8+1]) & (1<<(i%8))) for i in range(1000)])
+        self.assertEqual(b(r"\0")*125, cols[0].nulls)
+        # only current statement is consumed
+        c.execute("select 1 union all select 2; select 'three'; select x'aa'")
+        self.assertEqual([1, 2], c.fetchcolumns()[0].tolist())
+        self.assertEqual(["three"], c.fetchcolumns()[0].tolist())
+        self.assertEqual([(b(r"\xaa"),)], list(c))
+        self.assertEqual([], c.fetchcolumns())
+        c.executemany("select ?", [(1,), (2,), (3,)])
+        self.assertEqual([1], c.fetchcolumns()[0].tolist())
+        self.assertEqual([(2,), (3,)], c.fetchall())
+        # promotion and conversion
+        self.assertEqual([1.0, 2.5, None, 3.0], c.execute("select 1 union all select 2.5 union all select null union all select 3").fetchcolumns()[0].tolist())
+        self.assertEqual(["a", "3", "4.5"], c.execute("select 'a' union all select 3 union all select 4.5").fetchcolumns()[0].tolist())
+        self.assertEqual([b(r"a"), b(r"3")], c.execute("select x'61' union all select 3").fetchcolumns()[0].tolist())
+        self.assertEqual("null", c.execute("select null").fetchcolumns()[0].kind)
+        # mismatches
+        for sql in ("select 1 union all select 'a'", "select 2.2 union all select x'aa'", "select 'a' union all select x'aa'"):
+            self.assertRaises(TypeError, c.execute(sql).fetchcolumns)
+        # errors part way through
+        def fail(x):
+            if x==500:
+                1/0
+            return x
+        self.db.createscalarfunction("fail", fail)
+        self.assertRaises(ZeroDivisionError, c.execute("select fail(rowid) from foo").fetchcolumns)
+        # rows left unread by iteration are returned
+        c.execute("select i from foo order by rowid")
+        next(c)
+        self.assertEqual(999, len(c.fetchcolumns()[0]))
+
+    def testExecuteColumns(self):
+        "Check executing with bindings from columns"
+        c=self.db.cursor()
+        if not hasattr(c, "executecolumns") or not py3:
+            return
+        import array
+        c.execute("create table foo(i,f,t,b,n); begin")
+        ints=array.array("q", [i*1000000007 for i in range(1000)])
+        floats=array.array("d", [i/3.0 for i in range(1000)])
+        texts=[u("r\N{BLACK STAR}%d") % (i,) for i in range(1000)]
+        offsets=array.array("q", [0])
+        for t in texts:
+            offsets.append(offsets[-1]+len(t.encode("utf8")))
+        blobs=b("").join([b(r"\xff\x00")*(i%5) for i in range(1000)])
+        boffsets=array.array("q", [0])
+        for i in range(1000):
+            boffsets.append(boffsets[-1]+2*(i%5))
+        nulls=bytearray(125)
+        for i in range(0, 1000, 3):
+            nulls[i//8]|=1<<(i%8)
+        self.assertTrue(c is c.executecolumns("insert into foo values(?,?,?,?,?)",
+                                              (ints, floats, (offsets, u("").join(texts).encode("utf8")), (boffsets, blobs, "blob"), None),
+                                              (None, bytes(nulls), None, None, None)))
+        c.execute("commit")
+        rows=c.execute("select * from foo order by rowid").fetchall()
+        self.assertEqual(1000, len(rows))
+        for i,row in enumerate(rows):
+            self.assertEqual((ints[i], None if i%3==0 else floats[i], texts[i], b(r"\xff\x00")*(i%5), None), row)
+        # round trip through fetchcolumns
+        cols=c.execute("select * from foo order by rowid").fetchcolumns()
+        c.execute("create table bar(i,f,t,b,n)")
+        c.executecolumns("insert into bar values(?,?,?,?,?)", cols)
+        self.assertEqual(rows, c.execute("select * from bar order by rowid").fetchall())
+        # memoryview and the statement returning rows
+        c.executecolumns("select ?", (memoryview(ints),))
+        self.assertEqual([], c.fetchall())
+        # exec tracer
+        traced=[]
+        def et(cur, sql, bindings):
+            traced.append((sql, bindings))
+            return True
+        c.setexectrace(et)
+        c.executecolumns("insert into bar(i) values(?)", (ints,))
+        self.assertEqual([("insert into bar(i) values(?)", (ints,))], traced)
+        c.setexectrace(lambda *args: False)
+        self.assertRaises(apsw.ExecTraceAbort, c.executecolumns, "insert into bar(i) values(?)", (ints,))
+        c.setexectrace(None)
+        # errors
+        self.assertRaises(TypeError, c.executecolumns, "select ?")
+        self.assertRaises(TypeError, c.executecolumns, "select ?", 3)
+        self.assertRaises(TypeError, c.executecolumns, "select ?", (ints,), 3)
+        self.assertRaises(ValueError, c.executecolumns, "select ?", (ints,), (None, None))
+        self.assertRaises(apsw.SQLError, c.executecolumns, "syntax error ?", (ints,))
+        self.assertRaises(ValueError, c.executecolumns, "select ?; select ?", (ints,))
+        self.assertRaises(apsw.BindingsError, c.executecolumns, "select ?, ?", (ints,))
+        self.assertRaises(ValueError, c.executecolumns, "select ?, ?", (ints, floats[:10]))
+        self.assertRaises(ValueError, c.executecolumns, "select ?", (None,))
+        self.assertRaises(TypeError, c.executecolumns, "select ?", (b("abc"),))
+        self.assertRaises(TypeError, c.executecolumns, "select ?", (array.array("i", [1, 2]),))
+        self.assertRaises(TypeError, c.executecolumns, "select ?", ((floats, b("abc")),))
+        self.assertRaises(TypeError, c.executecolumns, "select ?", ((offsets,),))
+        self.assertRaises(ValueError, c.executecolumns, "select ?", ((offsets, b("abc"), "foo"),))
+        self.assertRaises(ValueError, c.executecolumns, "select ?", ((offsets, b("abc")),))
+        self.assertRaises(ValueError, c.executecolumns, "select ?", ((array.array("q", [0, 2, 1]), b("abc")),))
+        self.assertRaises(ValueError, c.executecolumns, "select ?", ((array.array("q"), b("abc")),))
+        self.assertRaises(ValueError, c.executecolumns, "select ?", (ints,), (b("abc"),))
+        # error part way through leaves earlier rows
+        c.execute("create table uniq(x unique)")
+        self.assertRaises(apsw.ConstraintError, c.executecolumns, "insert into uniq values(?)", (array.array("q", [1, 2, 2, 3]),))
+        self.assertEqual([(1,), (2,)], c.execute("select * from uniq order by x").fetchall())
+        def fail(x):
+            if x==500:
+                1/0
+            return x
+        self.db.createscalarfunction("fail", fail)
+        self.assertRaises(ZeroDivisionError, c.executecolumns, "insert into uniq values(fail(?))", (array.array("q", range(10, 1000)),))
+        # cursor is usable afterwards
+        self.assertEqual([(3,)], c.execute("select 3").fetchall())
+
+    def testRowFactory(self):
+        "Check native row factories"
+        c=self.db.cursor()
+        self.assertEqual("tuple", self.db.getrowfactory())
+        self.assertEqual("tuple", c.getrowfactory())
+        self.assertRaises(TypeError, self.db.setrowfactory)
+        self.assertRaises(TypeError, self.db.setrowfactory, None)
+        self.assertRaises(ValueError, self.db.setrowfactory, "list")
+        self.assertRaises(TypeError, c.setrowfactory, 3)
+        self.assertRaises(ValueError, c.setrowfactory, "list")
+        c.execute("create table foo(x, y, [a b], w)")
+        c.execute("insert into foo values(1, 'two', 3.0, 4)")
+        sql="select x, y, x+1 as z from foo"
+        self.assertEqual([(1, "two", 2)], c.execute(sql).fetchall())
+        # dict
+        self.db.setrowfactory("dict")
+        self.assertEqual("dict", self.db.getrowfactory())
+        self.assertEqual("dict", c.getrowfactory())
+        for i in range(3):
+            self.assertEqual([{"x": 1, "y": "two", "z": 2}], c.execute(sql).fetchall())
+            self.assertEqual([{"x": 1, "y": "two", "z": 2}], list(c.execute(sql)))
+        # duplicate names - last wins
+        self.assertEqual({"x": 4, "y": "two", "a b": 3.0}, c.execute("select x, y, [a b], w as x from foo").fetchone())
+        # cursor setting overrides connection
+        c.setrowfactory("tuple")
+        self.assertEqual("tuple", c.getrowfactory())
+        self.assertEqual((1, "two", 2), c.execute(sql).fetchone())
+        self.assertEqual({"x": 1, "y": "two", "z": 2}, self.db.cursor().execute(sql).fetchone())
+        c.setrowfactory(None)
+        self.assertEqual("dict", c.getrowfactory())
+        self.assertEqual({"x": 1, "y": "two", "z": 2}, c.execute(sql).fetchone())
+        # named
+        if sys.version_info>=(2,7):
+            self.db.setrowfactory("named")
+            for i in range(3):
+                row=c.execute(sql).fetchone()
+                self.assertEqual((1, "two", 2), row)
+                self.assertEqual((1, "two", 2), (row.x, row.y, row.z))
+                self.assertEqual(2, row[2])
+            # the type is reused
+            self.assertTrue(type(row) is type(c.execute(sql).fetchmany(1)[0]))
+            self.assertEqual(("x", "y", "z"), type(row)._fields)
+            row=c.execute("select x, y, [a b], w as x from foo").fetchone()
+            self.assertEqual((1, "two", 3.0, 4), row)
+            self.assertEqual(("x", "y", "_2", "_3"), type(row)._fields)
+            # different statements get different types
+            rows=c.execute("select 1 as one; select 2 as two").fetchall()
+            self.assertEqual((1, 2), (rows[0].one, rows[1].two))
+            # row tracer gets the named row
+            c.setrowtrace(lambda cur, row: row.y)
+            self.assertEqual(["two"], list(c.execute(sql)))
+            c.setrowtrace(None)
+            # schema changes are noticed
+            self.assertEqual("two", c.execute("select * from foo").fetchone().y)
+            c.execute("alter table foo rename column y to yy")
+            self.assertEqual("two", c.execute("select * from foo").fetchone().yy)
+            c.execute("alter table foo rename column yy to y")
+        else:
+            self.assertRaises(ValueError, self.db.setrowfactory, "named")
+        self.db.setrowfactory("tuple")
+        self.assertEqual((1, "two", 2), c.execute(sql).fetchone())
+
     def testTypes(self):
         "Check type information is maintained"
         c=self.db.cursor()
@@ -1672,6 +1986,145 @@ class APSW(unittest.TestCase):
         self.assertEqual(1, next(cur2.execute("select count(*) from test where x=123"))[0])
         con2.close()
 
+    def testBusyBackoff(self):
+        "Verify native busy handler with backoff"
+        self.assertRaises(TypeError, self.db.setbusybackoff)
+        self.assertRaises(TypeError, self.db.setbusybackoff, "1")
+        self.assertRaises(ValueError, self.db.setbusybackoff, -1)
+        self.assertRaises(ValueError, self.db.setbusybackoff, float("nan"))
+        self.assertRaises(ValueError, self.db.setbusybackoff, 1, initial=0)
+        self.assertRaises(ValueError, self.db.setbusybackoff, 1, initial=0.5, maximum=0.1)
+        self.assertRaises(ValueError, self.db.setbusybackoff, 1, maximum=3600)
+        self.db.setbusybackoff(1, maximum=2000)
+        self.assertRaises(ValueError, self.db.setbusybackoff, 1, jitter=1.5)
+        self.assertEqual({"busy": 0, "retries": 0, "timeouts": 0, "waited": 0}, self.db.busystats())
+        self.db.cursor().execute("create table foo(x)")
+        db2=apsw.Connection(TESTFILEPREFIX+"testdb")
+        db2.cursor().execute("begin exclusive")
+        # gives up after the timeout
+        self.db.setbusybackoff(0.25, initial=0.001, maximum=0.05)
+        b4=time.time()
+        self.assertRaises(apsw.BusyError, self.db.cursor().execute, "insert into foo values(1)")
+        self.assertTrue(0.2<time.time()-b4<5)
+        stats=self.db.busystats()
+        self.assertEqual(1, stats["busy"])
+        self.assertEqual(1, stats["timeouts"])
+        # 1, 2, 4, 8, 16, 32, then 50ms sleeps less jitter
+        self.assertTrue(stats["retries"]>=7)
+        self.assertTrue(0.2e9<stats["waited"]<5e9)
+        self.assertEqual(stats, self.db.busystats(True))
+        self.assertEqual({"busy": 0, "retries": 0, "timeouts": 0, "waited": 0}, self.db.busystats())
+        # succeeds once the lock is released
+        self.db.setbusybackoff(30, maximum=0.01, jitter=0)
+        t=threading.Timer(0.2, lambda: db2.cursor().execute("commit"))
+        t.start()
+        self.db.cursor().execute("insert into foo values(1)")
+        t.join()
+        stats=self.db.busystats()
+        self.assertEqual(1, stats["busy"])
+        self.assertEqual(0, stats["timeouts"])
+        self.assertTrue(stats["retries"]>=10)
+        # zero and the other busy handling methods remove it
+        for remove in (lambda: self.db.setbusybackoff(0), lambda: self.db.setbusytimeout(0), lambda: self.db.setbusyhandler(None)):
+            self.db.setbusybackoff(30)
+            remove()
+            db2.cursor().execute("begin exclusive")
+            self.assertRaises(apsw.BusyError, self.db.cursor().execute, "insert into foo values(2)")
+            db2.cursor().execute("commit")
+        self.assertEqual(stats, self.db.busystats())
+        db2.close()
+
+    def testQueryCancellation(self):
+        "Verify query deadlines and cancellation"
+        c=self.db.cursor()
+        forever="with recursive n(x) as (select 0 union all select x+1 from n) select count(*) from n"
+        rows="with recursive n(x) as (select 0 union all select x+1 from n) select x from n"
+        self.assertTrue(issubclass(apsw.QueryCancelledError, apsw.InterruptError))
+        self.assertRaises(TypeError, c.execute, "select 3", timeout="3")
+        self.assertRaises(ValueError, c.execute, "select 3", timeout=-1)
+        self.assertRaises(ValueError, c.execute, "select 3", timeout=float("nan"))
+        self.assertRaises(TypeError, c.execute, "select 3", cancel=3)
+        self.assertRaises(TypeError, c.execute, "select 3", timeout=1, deadline=3)
+        self.assertRaises(TypeError, c.executemany, "select ?", [(1,)], cancel=threading.Event())
+        self.assertEqual([(3,)], c.execute("select 3", timeout=None, cancel=None).fetchall())
+        # timeout during execute
+        b4=time.time()
+        try:
+            c.execute(forever, timeout=0.2)
+            self.fail("Expected QueryCancelledError")
+        except apsw.QueryCancelledError as e:
+            self.assertTrue("timeout" in str(e))
+            self.assertEqual(apsw.SQLITE_INTERRUPT, e.result)
+        self.assertTrue(0.15<time.time()-b4<5)
+        # and while getting the rows later
+        c.execute(rows, timeout=0.2)
+        self.assertRaises(apsw.QueryCancelledError, c.fetchall)
+        c.execute(rows, timeout=0.2)
+        self.assertRaises(apsw.QueryCancelledError, lambda: [r for r in c])
+        c.execute(rows, timeout=0.2)
+        self.assertRaises(apsw.QueryCancelledError, c.fetchcolumns)
+        # another cursor isn't affected by the deadline of one
+        c.execute(rows, timeout=0.2)
+        c2=self.db.cursor()
+        time.sleep(0.3)
+        self.assertEqual([(5000,)], c2.execute("select count(*) from (%s limit 5000)" % (rows,)).fetchall())
+        self.assertRaises(apsw.QueryCancelledError, c.fetchall)
+        # or by cursors stepping in other threads
+        errors=[]
+        def other():
+            try:
+                cur=self.db.cursor()
+                for i in range(10):
+                    for row in cur.execute("select x from (%s limit 20000)" % (rows,)):
+                        pass
+            except Exception as e:
+                errors.append(e)
+        threads=[threading.Thread(target=other) for i in range(2)]
+        for t in threads:
+            t.start()
+        for i in range(3):
+            b4=time.time()
+            self.assertRaises(apsw.QueryCancelledError, c.execute, forever, timeout=0.1)
+            self.assertTrue(time.time()-b4<5)
+        for t in threads:
+            t.join()
+        self.assertEqual([], errors)
+        # cancellation from another thread
+        token=apsw.CancellationToken()
+        self.assertFalse(token.cancelled)
+        t=threading.Timer(0.2, token.cancel)
+        t.start()
+        try:
+            c.execute(forever, cancel=token)
+            self.fail("Expected QueryCancelledError")
+        except apsw.QueryCancelledError as e:
+            self.assertTrue("token" in str(e))
+        t.join()
+        self.assertTrue(token.cancelled)
+        # a cancelled token stops queries before they start
+        self.assertRaises(apsw.QueryCancelledError, c.execute, "select 3", cancel=token)
+        self.assertRaises(apsw.QueryCancelledError, c.executemany, "select ?", [(1,)], cancel=token)
+        token.reset()
+        self.assertFalse(token.cancelled)
+        self.assertEqual([(1,), (2,)], c.executemany("select ?", [(1,), (2,)], cancel=token, timeout=5).fetchall())
+        # changes of the stopped statement are undone
+        c.execute("create table foo(x)")
+        self.assertRaises(apsw.QueryCancelledError, c.execute, "insert into foo %s" % (rows,), timeout=0.1)
+        self.assertEqual([(0,)], c.execute("select count(*) from foo").fetchall())
+        # a Python progress handler is still called at its own interval
+        calls=[0]
+        def ph():
+            calls[0]+=1
+            return calls[0]>=5
+        self.db.setprogresshandler(ph, 50000)
+        self.assertRaises(apsw.InterruptError, c.execute, forever, timeout=100)
+        self.assertEqual(5, calls[0])
+        calls[0]=-1000000
+        self.assertRaises(apsw.QueryCancelledError, c.execute, forever, timeout=0.1)
+        self.assertTrue(calls[0]>-1000000)
+        self.db.setprogresshandler(None)
+        self.assertRaises(apsw.QueryCancelledError, c.execute, forever, timeout=0.1)
+
     def testInterruptHandling(self):
         "Verify interrupt function"
         # this is tested by having a user defined function make the interrupt
@@ -2037,6 +2490,113 @@ class APSW(unittest.TestCase):
         l=self.db.cursor().execute("""select json_extract('{"a":2,"c":[4,5,{"f":7}]}', '$.c[2].f')""").fetchall()[0][0]
         self.assertEqual(l, 7)
 
+    def testSession(self):
+        "Verify session extension changesets"
+        if not hasattr(self.db, "session"):
+            self.assertTrue("APSW_TEST_SESSION" not in os.environ)
+            return
+        c=self.db.cursor()
+        c.execute("create table foo(x integer primary key, y); create table bar(x primary key, y); create table nokey(x)")
+        replica=apsw.Connection(":memory:")
+        replica.cursor().execute("create table foo(x integer primary key, y); create table bar(x primary key, y); create table nokey(x)")
+        self.assertRaises(TypeError, self.db.session, 3)
+        self.assertRaises(TypeError, self.db.session().attach, 3)
+        session=self.db.session()
+        self.assertEqual((True, True, False), (session.isempty, session.enabled, session.indirect))
+        session.attach("foo")
+        session.attach()
+        c.execute("insert into foo values(1, 'one'), (2, 'two'), (3, 'three'); insert into nokey values(1); insert into bar values('a', 1)")
+        c.execute("update foo set y='TWO' where x=2; delete from foo where x=3; update foo set y=y||'!' where x=1")
+        session.enabled=False
+        c.execute("insert into foo values(4, 'not recorded')")
+        session.enabled=True
+        self.assertFalse(session.isempty)
+        changeset=session.changeset()
+        self.assertTrue(len(session.patchset())<=len(changeset))
+        replica.applychangeset(changeset)
+        self.assertEqual([(1, 'one!'), (2, 'TWO')], replica.cursor().execute("select * from foo").fetchall())
+        self.assertEqual([('a', 1)], replica.cursor().execute("select * from bar").fetchall())
+        self.assertEqual([], replica.cursor().execute("select * from nokey").fetchall())
+        # filter only sees tables in the changeset
+        tables=[]
+        def filter(table):
+            tables.append(table)
+            return table=="bar"
+        replica.cursor().execute("delete from foo; delete from bar")
+        replica.applychangeset(changeset, filter=filter)
+        self.assertEqual(["foo", "bar"], tables)
+        self.assertEqual([], replica.cursor().execute("select * from foo").fetchall())
+        self.assertEqual([('a', 1)], replica.cursor().execute("select * from bar").fetchall())
+        # conflicts abort by default
+        self.assertRaises(apsw.AbortError, replica.applychangeset, changeset)
+        self.assertEqual([], replica.cursor().execute("select * from foo").fetchall())
+        calls=[]
+        def conflict(*args):
+            calls.append(args)
+            return apsw.SQLITE_CHANGESET_OMIT
+        replica.applychangeset(changeset, conflict)
+        self.assertEqual([(apsw.SQLITE_CHANGESET_CONFLICT, "bar", apsw.SQLITE_INSERT, None, ('a', 1), ('a', 1))], calls)
+        def conflict(reason, table, op, old, new, conflicting):
+            return apsw.SQLITE_CHANGESET_REPLACE
+        replica.cursor().execute("update bar set y=99")
+        replica.applychangeset(changeset, conflict)
+        self.assertEqual([('a', 1)], replica.cursor().execute("select * from bar").fetchall())
+        # updates and deletes of rows that have changed
+        session2=self.db.session()
+        session2.attach("foo")
+        c.execute("update foo set y='changed' where x=1; delete from foo where x=2")
+        changeset2=session2.changeset()
+        replica.cursor().execute("update foo set y='different' where x=1")
+        calls=[]
+        def conflict(*args):
+            calls.append(args)
+            return apsw.SQLITE_CHANGESET_OMIT
+        replica.applychangeset(changeset2, conflict)
+        self.assertEqual([(apsw.SQLITE_CHANGESET_DATA, "foo", apsw.SQLITE_UPDATE, (1, 'one!'), (None, 'changed'), (1, 'different'))], calls)
+        self.assertEqual([(1, 'different')], replica.cursor().execute("select * from foo").fetchall())
+        # errors in callbacks abandon the changeset
+        def conflict(*args):
+            1/0
+        replica.cursor().execute("delete from foo")
+        self.assertRaises(ZeroDivisionError, replica.applychangeset, changeset2, conflict)
+        def filter(table):
+            1/0
+        self.assertRaises(ZeroDivisionError, replica.applychangeset, changeset, filter=filter)
+        for retval in ("omit", 99):
+            self.assertRaises((TypeError, ValueError), replica.applychangeset, changeset2, lambda *args: retval)
+        self.assertRaises(TypeError, replica.applychangeset)
+        self.assertRaises(TypeError, replica.applychangeset, u"text")
+        self.assertRaises(TypeError, replica.applychangeset, changeset, 3)
+        self.assertRaises(TypeError, replica.applychangeset, changeset, filter=3)
+        self.assertRaises(apsw.CorruptError, replica.applychangeset, b"garbage")
+        # invert and concat
+        db=apsw.Connection(":memory:")
+        db.cursor().execute("create table foo(x integer primary key, y)")
+        db.applychangeset(changeset)
+        db.applychangeset(apsw.changeset_invert(changeset))
+        self.assertEqual([], db.cursor().execute("select * from foo").fetchall())
+        both=apsw.changeset_concat(changeset, changeset2)
+        db.applychangeset(both)
+        self.assertEqual([(1, 'changed')], db.cursor().execute("select * from foo").fetchall())
+        self.assertRaises(TypeError, apsw.changeset_invert, 3)
+        self.assertRaises(TypeError, apsw.changeset_concat, changeset)
+        self.assertRaises(apsw.CorruptError, apsw.changeset_invert, session.patchset())
+        self.assertEqual(b"", apsw.changeset_invert(b""))
+        # indirect changes
+        session2.indirect=True
+        self.assertTrue(session2.indirect)
+        # closing
+        session2.close()
+        session2.close()
+        self.assertRaises(ValueError, session2.changeset)
+        self.assertRaises(ValueError, session2.attach)
+        self.assertRaises(ValueError, getattr, session2, "enabled")
+        self.assertRaises(ValueError, setattr, session2, "indirect", True)
+        self.assertRaises(TypeError, delattr, session, "enabled")
+        self.db.close()
+        self.assertRaises(ValueError, session.patchset)
+        self.assertRaises(apsw.ConnectionClosedError, self.db.session)
+
     def testTracebacks(self):
         "Verify augmented tracebacks"
         return
@@ -2873,7 +3433,9 @@ class APSW(unittest.TestCase):
             except ValueError: # we issue ValueError to be consistent with file objects
                 pass
 
+        prep=self.db.prepare("select 3")
         self.db.close()
+        self.assertRaises(ValueError, getattr, prep, "sql")
         nargs=self.connection_nargs
         tested=0
         for func in [x for x in dir(self.db) if x in nargs or (not x.startswith("__") and not x in ("close",))]:
@@ -3475,6 +4037,1104 @@ class APSW(unittest.TestCase):
         self.db=apsw.Connection(TESTFILEPREFIX+"testdb", statementcachesize=-1)
         self.testStatementCache(-1)
 
+    def testStatementCacheStats(self):
+        "Verify statement cache statistics and entries"
+        keys=set(("size", "entries", "duplicates", "hits", "misses", "inuse", "evictions", "recycled", "reprepares", "normalized", "memory", "memorylimit"))
+        db=apsw.Connection(":memory:", statementcachesize=3)
+        stats=db.cache_stats()
+        self.assertEqual(keys, set(stats.keys()))
+        self.assertEqual(3, stats["size"])
+        self.assertEqual(0, sum(stats[k] for k in keys if k!="size"))
+        self.assertEqual([], db.cache_entries())
+        self.assertRaises(TypeError, db.cache_stats, 3)
+        self.assertRaises(TypeError, db.cache_entries, 3)
+        c=db.cursor()
+        c.execute("select 1")
+        c.execute("select 1")
+        stats=db.cache_stats()
+        self.assertEqual((1, 1, 1), (stats["entries"], stats["hits"], stats["misses"]))
+        self.assertTrue(stats["memory"]>0)
+        # in use on another cursor
+        c.execute("select 2").fetchall()
+        for row in c.execute("select 2"):
+            db.cursor().execute("select 2").fetchall()
+        self.assertEqual(1, db.cache_stats()["inuse"])
+        # lru order and evictions
+        for i in range(5):
+            c.execute("select %d" % (i+10,))
+        c.execute("select 12")
+        self.assertEqual(["select 13", "select 14", "select 12"], db.cache_entries())
+        stats=db.cache_stats()
+        self.assertEqual(3, stats["entries"])
+        self.assertTrue(stats["evictions"]>=4)
+        self.assertTrue(stats["recycled"]>0)
+        # multiple instances of the same query for nested use
+        db=apsw.Connection(":memory:", statementcachesize=20)
+        db.cursor().execute("create table tree(id, parent); insert into tree values(1, null)")
+        # a binary tree six levels deep so six cursors run the query at once
+        db.cursor().executemany("insert into tree values(?,?)", [(i, i//2) for i in range(2, 64)])
+        def walk(parent, depth=0):
+            count=1
+            for child, in db.cursor().execute("select id from tree where parent=?", (parent,)):
+                count+=walk(child, depth+1)
+            return count
+        self.assertEqual(63, walk(1))
+        stats=db.cache_stats()
+        self.assertEqual(5, stats["duplicates"])
+        before=stats["inuse"]
+        self.assertEqual(63, walk(1))
+        stats=db.cache_stats()
+        self.assertEqual(before, stats["inuse"])
+        self.assertEqual(5, stats["duplicates"])
+        self.assertEqual(6, db.cache_entries().count("select id from tree where parent=?"))
+        # evicting instances, including the one in the dict, keeps things working
+        for i in range(40):
+            db.cursor().execute("select %d" % (i,)).fetchall()
+        stats=db.cache_stats()
+        self.assertEqual(0, stats["duplicates"])
+        self.assertEqual(20, stats["entries"])
+        self.assertEqual(63, walk(1))
+        for i in range(17):
+            db.cursor().execute("select %d" % (i,)).fetchall()
+        self.assertTrue(0<db.cache_stats()["duplicates"]<5)
+        self.assertEqual(63, walk(1))
+        # the first instance is evicted and the second takes its place
+        db=apsw.Connection(":memory:", statementcachesize=5)
+        q="select 1 union all select 2"
+        db.cursor().execute(q).fetchall()
+        c1=db.cursor().execute(q)
+        c2=db.cursor().execute(q)
+        c1.fetchall()
+        c2.fetchall()
+        self.assertEqual(1, db.cache_stats()["duplicates"])
+        for i in range(4):
+            db.cursor().execute("select %d" % (i,)).fetchall()
+        self.assertEqual([q, "select 0", "select 1", "select 2", "select 3"], db.cache_entries())
+        self.assertEqual(0, db.cache_stats()["duplicates"])
+        hits=db.cache_stats()["hits"]
+        self.assertEqual([(1,), (2,)], db.cursor().execute(q).fetchall())
+        self.assertEqual(hits+1, db.cache_stats()["hits"])
+        # the depth is limited
+        db=apsw.Connection(":memory:")
+        cursors=[db.cursor().execute("select 1 union all select 2") for i in range(20)]
+        del cursors
+        gc.collect()
+        self.assertEqual(7, db.cache_stats()["duplicates"])
+
+        # disabled cache
+        db=apsw.Connection(":memory:", statementcachesize=0)
+        db.cursor().execute("select 1; select 1").fetchall()
+        stats=db.cache_stats()
+        self.assertEqual((0, 0, 0, 2), (stats["size"], stats["entries"], stats["hits"], stats["misses"]))
+        self.assertEqual([], db.cache_entries())
+
+    def testStatementCacheScripts(self):
+        "Verify all the statements of a script are cached together"
+        db=apsw.Connection(":memory:")
+        c=db.cursor()
+        c.execute("create table foo(x)")
+        script="insert into foo values(?); insert into foo values(?) ; select count(*) from foo; delete from foo"
+        self.assertEqual([(2,)], c.execute(script, (1, 2)).fetchall())
+        stats=db.cache_stats()
+        for i in range(10):
+            self.assertEqual([(2,)], c.execute(script, (1, 2)).fetchall())
+        self.assertEqual(stats["misses"], db.cache_stats()["misses"])
+        self.assertEqual(stats["hits"]+40, db.cache_stats()["hits"])
+        # only the whole script is an entry
+        self.assertEqual(["create table foo(x)", script], db.cache_entries())
+        # executemany goes round the chain for each binding
+        c.executemany("insert into foo values(?); insert into foo values(?)", [(i, i) for i in range(5)])
+        self.assertEqual([(10,)], c.execute("select count(*) from foo").fetchall())
+        # nested use of the same script
+        walk="select 0 where 0; select x from foo where x<?"
+        def nested(level):
+            res=0
+            for x, in db.cursor().execute(walk, (level,)):
+                res+=1+nested(x)
+            return res
+        c.execute("delete from foo")
+        c.executemany("insert into foo values(?)", [(i,) for i in range(4)])
+        self.assertEqual(15, nested(4))
+        # the script is evicted while still executing
+        db2=apsw.Connection(":memory:", statementcachesize=2)
+        c2=db2.cursor()
+        c2.execute("select 1; select 2 union all select 3")
+        self.assertEqual([1, 2], [next(c2)[0], next(c2)[0]])
+        for i in range(5):
+            db2.cursor().execute("select %d" % (i,)).fetchall()
+        self.assertEqual([(3,)], c2.fetchall())
+        self.assertEqual([(1,), (2,), (3,)], c2.execute("select 1; select 2 union all select 3").fetchall())
+        # schema changes within the script
+        self.assertEqual([(3,)], c.execute("drop table if exists bar; create table bar(y); insert into bar values(3); select * from bar").fetchall())
+        self.assertEqual([(3,)], c.execute("drop table if exists bar; create table bar(y); insert into bar values(3); select * from bar").fetchall())
+        # an error in a later statement
+        for i in range(2):
+            self.assertRaises(apsw.SQLError, lambda: c.execute("select 1; select nonsense from").fetchall())
+        # a first statement too big to cache still lets the rest be cached
+        big="select 1 /* %s */; select 2; select 3" % ("x"*20000,)
+        self.assertEqual([(1,), (2,), (3,)], c.execute(big).fetchall())
+        stats=db.cache_stats()
+        self.assertEqual([(1,), (2,), (3,)], c.execute(big).fetchall())
+        self.assertEqual(stats["misses"]+1, db.cache_stats()["misses"])
+        self.assertEqual(stats["hits"]+2, db.cache_stats()["hits"])
+        self.assertTrue("select 2; select 3" in db.cache_entries())
+        db2.close()
+        db.close()
+
+    def testStatementCacheMemory(self):
+        "Verify the statement cache limited by memory"
+        self.assertRaises(TypeError, apsw.Connection, ":memory:", statementcachememory="three")
+        self.assertEqual(0, self.db.cache_stats()["memorylimit"])
+        db=apsw.Connection(":memory:", statementcachesize=1000, statementcachememory=20000)
+        self.assertEqual(20000, db.cache_stats()["memorylimit"])
+        c=db.cursor()
+        for i in range(50):
+            c.execute("select %d, ?" % (i,), (i,)).fetchall()
+            # frequently used so it should survive despite being least recently used
+            if i<5:
+                for j in range(10):
+                    c.execute("select 0, ?", (j,)).fetchall()
+        stats=db.cache_stats()
+        self.assertTrue(stats["memory"]<=20000)
+        self.assertTrue(stats["evictions"]>0)
+        self.assertTrue(stats["entries"]<50)
+        self.assertTrue("select 0, ?" in db.cache_entries())
+        # all the statements of a script are charged, not just the first two
+        db=apsw.Connection(":memory:", statementcachesize=1000, statementcachememory=20000)
+        c=db.cursor()
+        for i in range(50):
+            c.execute("select %d, ?; select 2; select 3; select 4; select 5" % (i,), (i,)).fetchall()
+        stats=db.cache_stats()
+        self.assertTrue(stats["memory"]<=20000)
+        self.assertTrue(stats["evictions"]>0)
+        # queries longer than SC_MAXSIZE are cached when there is a memory limit
+        db=apsw.Connection(":memory:", statementcachememory=1000000)
+        longq="select 1 "+" "*20000
+        for i in range(3):
+            db.cursor().execute(longq).fetchall()
+        self.assertEqual([longq], db.cache_entries())
+        self.assertEqual(2, db.cache_stats()["hits"])
+        # too big for the limit
+        db=apsw.Connection(":memory:", statementcachememory=10)
+        for i in range(3):
+            db.cursor().execute("select 3").fetchall()
+        self.assertEqual((0, 3), (db.cache_stats()["entries"], db.cache_stats()["misses"]))
+        # process wide limit
+        self.assertRaises(TypeError, apsw.statementcachelimit)
+        self.assertRaises(TypeError, apsw.statementcachelimit, "three")
+        self.assertRaises(ValueError, apsw.statementcachelimit, -1)
+        self.assertEqual(0, apsw.statementcachelimit(0))
+        dbs=[apsw.Connection(":memory:") for i in range(3)]
+        self.assertEqual(0, apsw.statementcachelimit(30000))
+        try:
+            for d in dbs:
+                for i in range(40):
+                    d.cursor().execute("select %d, ?" % (i,), (i,)).fetchall()
+            total=sum(d.cache_stats()["memory"] for d in dbs)
+            self.assertTrue(total<=30000)
+            self.assertTrue(all(d.cache_stats()["evictions"] for d in dbs))
+            for d in dbs:
+                d.close()
+            del d
+            # closed connections no longer count
+            db=apsw.Connection(":memory:")
+            for i in range(5):
+                db.cursor().execute("select %d, ?" % (i,), (i,)).fetchall()
+            self.assertEqual(5, db.cache_stats()["entries"])
+        finally:
+            self.assertEqual(30000, apsw.statementcachelimit(0))
+
+    def testPreparedStatement(self):
+        "Verify prepared statements"
+        c=self.db.cursor()
+        c.execute("create table foo(x,y)")
+        self.assertRaises(TypeError, self.db.prepare)
+        self.assertRaises(TypeError, self.db.prepare, 3)
+        self.assertRaises(TypeError, self.db.prepare, "select 3", "not an int")
+        self.assertRaises(apsw.SQLError, self.db.prepare, "select nonsense from")
+        self.assertRaises(ValueError, self.db.prepare, "select 3; select 4")
+        for persistent in (False, True):
+            ins=self.db.prepare("insert into foo values(:x,:y) ; ", persistent)
+            self.assertEqual("insert into foo values(:x,:y) ;", ins.sql)
+            c.execute(ins, (1, 2))
+            c.executemany(ins, [(i, i*2) for i in range(10)])
+            c.execute(ins, {'x': 3, 'y': 4})
+            ins.close()
+            ins.close()
+            self.assertRaises(ValueError, getattr, ins, "sql")
+            self.assertRaises(ValueError, c.execute, ins, (1, 2))
+        self.assertEqual(24, c.execute("select count(*) from foo").fetchall()[0][0])
+        # not evicted by other queries
+        db=apsw.Connection(":memory:", statementcachesize=2)
+        sel=db.prepare(u(r"select ?, 'caf\u00e9' "))
+        misses=db.cache_stats()["misses"]
+        for i in range(5):
+            db.cursor().execute("select %d" % (i,)).fetchall()
+            self.assertEqual([(i, u(r"caf\u00e9"))], db.cursor().execute(sel, (i,)).fetchall())
+        self.assertEqual(misses+5, db.cache_stats()["misses"])
+        self.assertTrue("select ?" not in " ".join(db.cache_entries()))
+        # nested use falls back to the cache
+        tree=self.db.prepare("select x from foo where y=?")
+        c.execute("delete from foo")
+        c.executemany("insert into foo values(?,?)", [(1, 0), (2, 1), (3, 1), (4, 2)])
+        def walk(node):
+            return [(n, walk(n)) for n, in self.db.cursor().execute(tree, (node,))]
+        self.assertEqual([(1, [(2, [(4, [])]), (3, [])])], walk(0))
+        # works with executecolumns and tracers
+        if py3:
+            import array
+            c.execute("delete from foo")
+            c.executecolumns(self.db.prepare("insert into foo values(?,?)"), (array.array("q", [1, 2]), array.array("d", [3, 4])))
+            self.assertEqual([(1, 3.0), (2, 4.0)], c.execute("select * from foo").fetchall())
+        traced=[]
+        c.setexectrace(lambda cur, sql, bindings: traced.append(sql) or True)
+        c.execute(tree, (1,)).fetchall()
+        self.assertEqual(["select x from foo where y=?"], traced)
+        c.setexectrace(None)
+        # must be used on the same connection
+        self.assertRaises(ValueError, db.cursor().execute, tree, (1,))
+        # the connection closes it
+        db.close()
+        self.assertRaises(ValueError, getattr, sel, "sql")
+
+    def testCacheProfile(self):
+        "Verify statement profile from the statement cache"
+        self.assertRaises(TypeError, self.db.cache_profile, "3")
+        self.assertRaises(ValueError, self.db.cache_profile, -1)
+        c=self.db.cursor()
+        c.execute("create table foo(x,y); create table bar(x,y)")
+        c.executemany("insert into foo values(?,?)", [(i, i%10) for i in range(200)])
+        c.executemany("insert into bar values(?,?)", [(i, i%10) for i in range(20)])
+        for i in range(3):
+            c.execute("select * from foo where y=3 order by x desc").fetchall()
+            c.execute("select * from foo, bar where foo.y=bar.x").fetchall()
+            c.execute("select 3").fetchall()
+        prof=self.db.cache_profile()
+        for k in "fullscan_step", "sort", "autoindex":
+            self.assertTrue(k in prof)
+            for query, count in prof[k]:
+                self.assertTrue(count>0)
+        self.assertEqual([("select * from foo where y=3 order by x desc", 3)], prof["sort"])
+        self.assertEqual("select * from foo, bar where foo.y=bar.x", prof["autoindex"][0][0])
+        fullscans=dict(prof["fullscan_step"])
+        self.assertTrue(fullscans["select * from foo where y=3 order by x desc"]>=3*199)
+        self.assertTrue("select 3" not in fullscans)
+        if "run" in prof:
+            self.assertEqual(("insert into foo values(?,?)", 200), prof["run"][0])
+            self.assertEqual(2, len(self.db.cache_profile(2)["run"]))
+            self.assertEqual(0, len(self.db.cache_profile(0)["run"]))
+        if "scanstatus" in prof:
+            loops=prof["scanstatus"]["select * from foo where y=3 order by x desc"]
+            self.assertTrue(loops)
+            for loop in loops:
+                for k in "name", "explain", "loops", "rows", "estimate":
+                    self.assertTrue(k in loop)
+        # script statements are listed separately
+        for i in range(2):
+            c.execute("select * from foo order by y; select * from bar order by y").fetchall()
+        sorts=dict(self.db.cache_profile()["sort"])
+        self.assertEqual(2, sorts["select * from foo order by y;"])
+        self.assertEqual(2, sorts["select * from bar order by y"])
+        # evicted statements are forgotten
+        db=apsw.Connection(":memory:", statementcachesize=0)
+        db.cursor().execute("create table foo(x); select * from foo order by x").fetchall()
+        self.assertEqual([], db.cache_profile()["sort"])
+
+    def testLatencyProfile(self):
+        "Verify native statement latency histograms"
+        self.assertEqual(False, self.db.getlatencyprofile())
+        self.assertEqual({}, self.db.latencyprofile())
+        self.assertRaises(TypeError, self.db.setlatencyprofile)
+        self.assertRaises(TypeError, self.db.setlatencyprofile, "yes")
+        self.assertRaises(TypeError, self.db.latencyprofile, "yes")
+        c=self.db.cursor()
+        c.execute("create table foo(x,y); create table log(x); create trigger footrig after insert on foo begin insert into log values(new.x); end")
+        self.db.setlatencyprofile(True)
+        self.assertEqual(True, self.db.getlatencyprofile())
+        c.executemany("insert into foo values(?,?)", [(i, i%5) for i in range(500)])
+        for i in range(20):
+            c.execute("select * from foo where y=?", (i%5,)).fetchall()
+        # nested statements have their rows counted separately
+        for x, in c.execute("select x from foo where x<4"):
+            self.db.cursor().execute("select * from log where x=?", (x,)).fetchall()
+        # only partly read
+        next(c.execute("select x from foo"))
+        c.execute("select 3").fetchall()
+        prof=self.db.latencyprofile()
+        keys=("count", "rows", "total", "p50", "p90", "p99", "max")
+        for v in prof.values():
+            self.assertEqual(set(keys), set(v.keys()))
+            self.assertTrue(v["p50"]<=v["p90"]<=v["p99"]<=v["max"]<=v["total"])
+        self.assertEqual(500, prof["insert into foo values(?,?)"]["count"])
+        self.assertEqual(0, prof["insert into foo values(?,?)"]["rows"])
+        self.assertEqual(20, prof["select * from foo where y=?"]["count"])
+        self.assertEqual(2000, prof["select * from foo where y=?"]["rows"])
+        self.assertEqual(4, prof["select x from foo where x<4"]["rows"])
+        self.assertEqual((4, 4), (prof["select * from log where x=?"]["count"], prof["select * from log where x=?"]["rows"]))
+        self.assertEqual(1, prof["select x from foo"]["rows"])
+        self.assertTrue(prof["select * from foo where y=?"]["total"]>0)
+        # trigger statements aren't separate
+        self.assertTrue("insert into log values(new.x)" not in prof)
+        # reset
+        self.assertEqual(prof.keys(), self.db.latencyprofile(True).keys())
+        self.assertEqual({}, self.db.latencyprofile())
+        # disabling keeps values
+        c.execute("select 4").fetchall()
+        self.db.setlatencyprofile(False)
+        self.assertEqual(False, self.db.getlatencyprofile())
+        c.execute("select 5").fetchall()
+        self.assertEqual(["select 4"], list(self.db.latencyprofile().keys()))
+        # too many different queries
+        self.db.setlatencyprofile(True)
+        for i in range(600):
+            c.execute("select %d" % (i,)).fetchall()
+        prof=self.db.latencyprofile(True)
+        self.assertEqual(513, len(prof))
+        self.assertEqual(600-512, prof[None]["count"])
+        # setprofile replaces it
+        if hasattr(self.db, "setprofile"):
+            profiled=[]
+            self.db.setprofile(lambda sql, ns: profiled.append(sql))
+            self.assertEqual(False, self.db.getlatencyprofile())
+            c.execute("select 6").fetchall()
+            self.assertEqual(["select 6"], profiled)
+            self.db.setlatencyprofile(True)
+            c.execute("select 7").fetchall()
+            self.assertEqual(["select 6"], profiled)
+            self.assertEqual(["select 7"], list(self.db.latencyprofile().keys()))
+            self.db.setprofile(None)
+
+    def testResultCache(self):
+        "Verify the query result cache"
+        self.assertEqual(0, self.db.getresultcache())
+        self.assertRaises(TypeError, self.db.setresultcache)
+        self.assertRaises(TypeError, self.db.setresultcache, "yes")
+        self.assertRaises(ValueError, self.db.setresultcache, -1)
+        self.assertRaises(TypeError, self.db.cachedquery)
+        # disabled just runs the query
+        self.assertEqual([(1,)], self.db.cachedquery("select 1"))
+        self.assertEqual(0, self.db.resultcache_stats()["misses"])
+        c=self.db.cursor()
+        c.execute("create table foo(x); create table bar(y); create table wr(k primary key, v) without rowid; create view v as select * from foo")
+        c.execute("insert into foo values(1); insert into bar values(2); insert into wr values(3, 4)")
+        updates=[]
+        self.db.setupdatehook(lambda *args: updates.append(args[2]))
+        self.db.setresultcache(10)
+        self.assertEqual(10, self.db.getresultcache())
+        q=self.db.cachedquery
+
+        def stats(*keys):
+            s=self.db.resultcache_stats()
+            return tuple(s[k] for k in keys)
+
+        self.assertEqual([(1,)], q("select * from foo"))
+        self.assertEqual([(1,)], q("select * from foo"))
+        self.assertEqual([(1,)], q("select count(*) from v"))
+        self.assertEqual([(2,)], q("select * from bar"))
+        self.assertEqual((1, 3, 3), stats("hits", "misses", "entries"))
+        # returned lists can be modified
+        q("select * from foo").append(7)
+        self.assertEqual([(1,)], q("select * from foo"))
+        # only results that read a changed table are invalidated
+        c.execute("insert into foo values(5)")
+        self.assertEqual(["foo"], updates)
+        self.assertEqual([(2,)], q("select * from bar"))
+        self.assertEqual([(1,), (5,)], q("select * from foo"))
+        self.assertEqual([(2,)], q("select count(*) from v"))
+        self.assertEqual((2, 3), stats("invalidations", "entries"))
+        # changes by another connection
+        db2=apsw.Connection(TESTFILEPREFIX+"testdb")
+        db2.cursor().execute("insert into bar values(6)")
+        self.assertEqual([(2,), (6,)], q("select * from bar"))
+        # changes the update hook doesn't report
+        self.assertEqual([(3, 4)], q("select * from wr"))
+        c.execute("update wr set v=8")
+        self.assertEqual([(3, 8)], q("select * from wr"))
+        q("select * from bar")
+        c.execute("delete from bar")
+        self.assertEqual([], q("select * from bar"))
+        # bindings are part of the key, including their type
+        self.assertEqual([(1,)], q("select ?", (1,)))
+        self.assertEqual([(1.0,)], q("select ?", (1.0,)))
+        self.assertEqual([(3,)], q("select :a", {"a": 3}))
+        self.assertEqual([(4,)], q("select :a", {"a": 4}))
+        self.assertEqual([(1,)], q("select x from foo where x=?", [1]))
+        before=stats("hits")[0]
+        self.assertEqual([(1.0,)], q("select ?", (1.0,)))
+        self.assertEqual(before+1, stats("hits")[0])
+        # not cached
+        before=stats("uncached")[0]
+        self.assertNotEqual(q("select random()"), q("select random()"))
+        self.assertEqual([(b(r"\x01"),)], q("select ?", (bytearray(b(r"\x01")),)))
+        c.execute("begin")
+        q("select * from foo where x>1")
+        q("select * from foo where x>1")
+        c.execute("insert into foo values(9)")
+        self.assertEqual([(5,), (9,)], q("select * from foo where x>1"))
+        c.execute("rollback")
+        self.assertEqual([(5,)], q("select * from foo where x>1"))
+        self.assertEqual(before+6, stats("uncached")[0])
+        # schema changes discard everything
+        self.assertTrue(stats("entries")[0]>0)
+        c.execute("create temp table foo(z)")
+        self.assertEqual([], q("select * from foo"))
+        c.execute("drop table temp.foo")
+        self.assertEqual([(1,), (5,)], q("select * from foo"))
+        # errors
+        self.assertRaises(ValueError, q, "insert into foo values(1)")
+        self.assertRaises(ValueError, q, "select 1; select 2")
+        self.assertRaises(apsw.SQLError, q, "select nosuchcolumn")
+        self.assertRaises(apsw.BindingsError, q, "select ?", (1, 2))
+        self.assertRaises(TypeError, q, "select ?", 3)
+        self.assertRaises(TypeError, q, 3)
+        # row factory
+        self.db.setrowfactory("dict")
+        self.assertEqual([{"x": 1}, {"x": 5}], q("select * from foo"))
+        self.db.setrowfactory("tuple")
+        self.assertEqual([(1,), (5,)], q("select * from foo"))
+        # the user's authorizer is still called
+        authed=[]
+        def auth(*args):
+            authed.append(args[0])
+            return apsw.SQLITE_OK
+        self.db.setauthorizer(auth)
+        q("select x+1 from foo")
+        self.assertTrue(apsw.SQLITE_READ in authed)
+        self.db.setauthorizer(None)
+        # eviction
+        self.db.setresultcache(3)
+        for i in range(10):
+            q("select %d" % (i,))
+        self.assertEqual((3, 3), stats("size", "entries"))
+        self.assertTrue(stats("evictions")[0]>=7)
+        # hits make an entry the most recently used
+        q("select 7")
+        q("select 10")
+        hits=stats("hits")[0]
+        q("select 7")
+        self.assertEqual(hits+1, stats("hits")[0])
+        q("select 8")
+        self.assertEqual(hits+1, stats("hits")[0])
+        # disabling keeps the user's hooks
+        self.db.setresultcache(0)
+        self.assertEqual((0, 0, 0), stats("size", "entries", "hits"))
+        del updates[:]
+        c.execute("insert into foo values(2)")
+        self.assertEqual(["foo"], updates)
+        db2.close()
+        self.db.close()
+        self.assertRaises(apsw.ConnectionClosedError, self.db.cachedquery, "select 3")
+        self.assertRaises(apsw.ConnectionClosedError, self.db.setresultcache, 3)
+
+    def testChangeCapture(self):
+        "Verify native change capture"
+        self.assertRaises(TypeError, self.db.setchangecapture)
+        self.assertRaises(ValueError, self.db.setchangecapture, -1)
+        self.assertRaises(TypeError, self.db.setchangecapture, 10, 3)
+        self.assertRaises(TypeError, self.db.drainchanges, "3")
+        self.assertEqual([], self.db.drainchanges())
+        self.assertEqual(0, self.db.changecapture_stats()["size"])
+        c=self.db.cursor()
+        c.execute("create table foo(x); create table bar(y)")
+        self.db.setchangecapture(10)
+        c.execute("insert into foo values(1); insert into bar values(2); update foo set x=3; delete from bar where y=2")
+        self.assertEqual([(apsw.SQLITE_INSERT, "main", "foo", 1), (apsw.SQLITE_INSERT, "main", "bar", 1)], self.db.drainchanges(2))
+        self.assertEqual([(apsw.SQLITE_UPDATE, "main", "foo", 1), (apsw.SQLITE_DELETE, "main", "bar", 1)], self.db.drainchanges())
+        self.assertEqual([], self.db.drainchanges())
+        # only committed records are drained
+        c.execute("begin; insert into foo values(4)")
+        self.assertEqual([], self.db.drainchanges())
+        self.assertEqual(1, self.db.changecapture_stats()["uncommitted"])
+        c.execute("commit")
+        self.assertEqual([(apsw.SQLITE_INSERT, "main", "foo", 2)], self.db.drainchanges())
+        c.execute("begin; insert into foo values(5); insert into foo values(6); rollback")
+        self.assertEqual([], self.db.drainchanges())
+        self.assertEqual({"size": 10, "captured": 7, "lost": 0, "rolledback": 2, "pending": 0, "uncommitted": 0}, self.db.changecapture_stats())
+        # the oldest are overwritten when full
+        c.execute("insert into bar select x from foo, (select 1 union select 2 union select 3 union select 4 union select 5 union select 6)")
+        stats=self.db.changecapture_stats()
+        self.assertEqual((12, 2, 10), (stats["captured"]-7, stats["lost"], stats["pending"]))
+        self.assertEqual([(apsw.SQLITE_INSERT, "main", "bar", i) for i in range(3, 13)], self.db.drainchanges())
+        # works alongside the Python hooks
+        updates=[]
+        commits=[]
+        rollbacks=[]
+        self.db.setupdatehook(lambda *args: updates.append(args))
+        self.db.setcommithook(lambda: commits.append(1) and False)
+        self.db.setrollbackhook(lambda: rollbacks.append(1))
+        c.execute("insert into foo values(7)")
+        c.execute("begin; insert into foo values(8); rollback")
+        self.assertEqual([(apsw.SQLITE_INSERT, "main", "foo", 3), (apsw.SQLITE_INSERT, "main", "foo", 4)], updates)
+        self.assertEqual(([1], [1]), (commits, rollbacks))
+        self.assertEqual([(apsw.SQLITE_INSERT, "main", "foo", 3)], self.db.drainchanges())
+        self.db.setupdatehook(None)
+        self.db.setcommithook(None)
+        self.db.setrollbackhook(None)
+        c.execute("insert into foo values(9); begin; insert into foo values(10); rollback")
+        self.assertEqual([(apsw.SQLITE_INSERT, "main", "foo", 4)], self.db.drainchanges())
+        # delivered after each commit
+        got=[]
+        self.db.setchangecapture(100, got.append)
+        c.execute("insert into foo values(11); begin; insert into foo values(12); insert into bar values(13); commit")
+        self.assertEqual([[(apsw.SQLITE_INSERT, "main", "foo", 5)], [(apsw.SQLITE_INSERT, "main", "foo", 6), (apsw.SQLITE_INSERT, "main", "bar", 13)]], got)
+        self.assertEqual([], self.db.drainchanges())
+        # only called once the commit has completed
+        db2=apsw.Connection(TESTFILEPREFIX+"testdb")
+        def check(changes):
+            got.append((db2.cursor().execute("select count(*) from foo where x=20").fetchall(), changes))
+        del got[:]
+        self.db.setchangecapture(100, check)
+        c.execute("begin; insert into foo values(20); commit")
+        self.assertEqual([([(1,)], [(apsw.SQLITE_INSERT, "main", "foo", 7)])], got)
+        self.db.setchangecapture(10)
+        db2.close()
+        c.execute("delete from foo where x=20")
+        self.db.drainchanges()
+        # rows of a failing statement are discarded
+        import array
+        c.execute("create table uniq(x unique, y)")
+        c.execute("begin; insert into uniq values(1, 'z')")
+        self.assertRaises(apsw.ConstraintError, c.execute, "insert into uniq values(2,'a'),(3,'b'),(1,'a')")
+        c.execute("commit")
+        self.assertEqual([(apsw.SQLITE_INSERT, "main", "uniq", 1)], self.db.drainchanges())
+        c.execute("begin")
+        self.assertRaises(apsw.ConstraintError, c.executemany, "insert into uniq values(?, 'a')", [(4,), (5,), (1,)])
+        self.assertRaises(apsw.ConstraintError, c.executecolumns, "insert into uniq values(?, 'a'), (?, 'b')",
+                          (array.array("q", [8, 9]), array.array("q", [10, 1])))
+        c.execute("commit")
+        self.assertEqual([(10,)], c.execute("select max(x) from uniq").fetchall())
+        self.assertEqual([(apsw.SQLITE_INSERT, "main", "uniq", i) for i in (2, 3, 4, 5)], self.db.drainchanges())
+        self.assertEqual(3, self.db.changecapture_stats()["rolledback"])
+        c.execute("drop table uniq")
+        def bad(changes):
+            self.db.setchangecapture(0)
+        self.db.setchangecapture(100, bad)
+        self.assertRaisesUnraisable(apsw.ThreadingViolationError, c.execute, "insert into foo values(14)")
+        self.assertEqual([(7,)], c.execute("select count(*) from foo").fetchall())
+        self.db.setchangecapture(100, lambda changes: 1/0)
+        self.assertRaisesUnraisable(ZeroDivisionError, c.execute, "insert into foo values(15)")
+        self.assertEqual([(8,)], c.execute("select count(*) from foo").fetchall())
+        self.db.setchangecapture(0)
+        c.execute("insert into foo values(16)")
+        self.assertEqual([], self.db.drainchanges())
+
+    def testConnectionPool(self):
+        "Verify the native connection pool"
+        fname=TESTFILEPREFIX+"testdb2"
+        self.assertRaises(TypeError, apsw.ConnectionPool)
+        self.assertRaises(ValueError, apsw.ConnectionPool, fname, readers=-1)
+        self.assertRaises(ValueError, apsw.ConnectionPool, ":memory:")
+        self.assertRaises(apsw.CantOpenError, apsw.ConnectionPool, fname, flags=apsw.SQLITE_OPEN_READWRITE)
+        opened=[]
+        apsw.connection_hooks=apsw.connection_hooks+[lambda c: opened.append(c)]
+        pool=apsw.ConnectionPool(fname, readers=2)
+        self.assertEqual(1, len(opened))
+        self.assertRaises(TypeError, pool.acquire, "yes", "no")
+        self.assertRaises(TypeError, pool.release)
+        w=pool.acquire(True)
+        self.assertEqual([("wal",)], w.cursor().execute("pragma journal_mode").fetchall())
+        w.cursor().execute("create table foo(x); insert into foo values(1)")
+        # only one writer
+        self.assertRaises(apsw.BusyError, pool.acquire, True, 0)
+        pool.release(w)
+        self.assertRaises(ValueError, pool.release, w)
+        self.assertRaises(ValueError, pool.release, self.db)
+        self.assertRaises(ValueError, pool.release, 3)
+        # readers are read only
+        r1=pool.acquire()
+        self.assertTrue(r1 is not w)
+        self.assertEqual([(1,)], r1.cursor().execute("select * from foo").fetchall())
+        self.assertRaises(apsw.ReadOnlyError, r1.cursor().execute, "insert into foo values(2)")
+        r2=pool.acquire()
+        self.assertRaises(apsw.BusyError, pool.acquire, False, 0)
+        if sys.version_info>=(3,2):
+            self.assertRaises(apsw.BusyError, pool.acquire, False, 0.05)
+        self.assertEqual(3, len(opened))
+        # this thread gets the same reader back
+        pool.release(r2)
+        pool.release(r1)
+        self.assertTrue(r1 is pool.acquire())
+        pool.release(r1)
+        s=pool.stats()
+        self.assertEqual(2, s["readers"])
+        self.assertEqual(2, s["maxreaders"])
+        self.assertEqual(2, s["idle"])
+        self.assertEqual(0, s["inuse"])
+        self.assertEqual(4, s["acquires"])
+        self.assertEqual(1, s["affinity"])
+        self.assertEqual(3, s["created"])
+        self.assertEqual(0, s["discarded"])
+        # open transactions are rolled back
+        w=pool.acquire(True)
+        w.cursor().execute("begin; insert into foo values(2)")
+        pool.release(w)
+        w=pool.acquire(True)
+        self.assertEqual(True, w.getautocommit())
+        self.assertEqual([(1,)], w.cursor().execute("select count(*) from foo").fetchall())
+        # closed connections are discarded
+        w.close()
+        pool.release(w)
+        r1=pool.acquire()
+        r1.close()
+        pool.release(r1)
+        self.assertEqual(2, pool.stats()["discarded"])
+        self.assertEqual(1, pool.stats()["readers"])
+        w=pool.acquire(True)
+        self.assertEqual([(1,)], w.cursor().execute("select count(*) from foo").fetchall())
+        pool.release(w)
+        # waiting threads
+        counts=[]
+        def worker():
+            for i in range(50):
+                con=pool.acquire(i%10==0)
+                con.cursor().execute("select * from foo").fetchall()
+                pool.release(con)
+            counts.append(i)
+        threads=[ThreadRunner(worker) for i in range(6)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.go()
+        self.assertEqual(6, len(counts))
+        s=pool.stats()
+        self.assertTrue(s["readers"]<=2)
+        self.assertEqual(0, s["inuse"])
+        self.assertEqual(s["readers"]+1+s["discarded"], s["created"])
+        self.assertEqual(s["created"], len(opened))
+        # readers=0 shares the writer
+        pool2=apsw.ConnectionPool(fname, readers=0, wal=False)
+        c=pool2.acquire()
+        self.assertRaises(apsw.BusyError, pool2.acquire, True, 0)
+        pool2.release(c)
+        pool2.close()
+        # closing
+        r1=pool.acquire()
+        pool.close()
+        pool.close()
+        self.assertRaises(apsw.ConnectionClosedError, pool.acquire)
+        self.assertEqual(0, pool.stats()["idle"])
+        self.assertEqual([(1,)], r1.cursor().execute("select count(*) from foo").fetchall())
+        pool.release(r1)
+        self.assertRaises(apsw.ConnectionClosedError, r1.cursor)
+        # subclassing and weak references
+        class P(apsw.ConnectionPool):
+            pass
+        p=P(fname, readers=1)
+        import weakref
+        ref=weakref.ref(p)
+        del p
+        gc.collect()
+        self.assertEqual(None, ref())
+
+    def testConnectionPoolFanout(self):
+        "Verify running read only queries across pool readers"
+        fname=TESTFILEPREFIX+"testdb2"
+        pool=apsw.ConnectionPool(fname, readers=3)
+        w=pool.acquire(True)
+        w.cursor().execute("create table foo(p, x, s, b); begin")
+        w.cursor().executemany("insert into foo values(?,?,?,?)", [(i%5, i*1.5, "s%d" % (i,), b(r"\x01\x02")) for i in range(1000)])
+        w.cursor().execute("commit")
+        query="select p, count(*), sum(x), max(s), min(b), null from foo where p=? group by p"
+        queries=[(query, (p,)) for p in range(5)]
+        expected=[w.cursor().execute(q, b).fetchall()[0] for q, b in queries]
+        pool.release(w)
+        self.assertEqual(expected, pool.fanout(queries))
+        self.assertEqual([[row] for row in expected], pool.fanout(queries, merge=False))
+        self.assertEqual(expected, pool.fanout(queries, True, 5))
+        s=pool.stats()
+        self.assertEqual(3, s["readers"])
+        self.assertEqual(0, s["inuse"])
+        # various forms and values
+        self.assertEqual([], pool.fanout([]))
+        self.assertEqual([], pool.fanout(["select 1 where 0", ""]))
+        self.assertEqual([(1,), (u("ሴ"), 2**40, 2.5, None, b(r"\x00a"))],
+                         pool.fanout(["select 1;  ", ["select ?, ?, ?, ?, ?", (u("ሴ"), 2**40, 2.5, None, b(r"\x00a"))]]))
+        self.assertEqual([(3,)], pool.fanout([("select 3", None)]))
+        # errors
+        self.assertRaises(TypeError, pool.fanout)
+        self.assertRaises(TypeError, pool.fanout, 3)
+        self.assertRaises(TypeError, pool.fanout, [3])
+        self.assertRaises(TypeError, pool.fanout, [("select 3",)])
+        self.assertRaises(TypeError, pool.fanout, [("select ?", {"a": 1})])
+        self.assertRaises(TypeError, pool.fanout, [("select ?", (object(),))])
+        self.assertRaises(TypeError, pool.fanout, [("select ?", 3)])
+        self.assertRaises(OverflowError, pool.fanout, [("select ?", (2**70,))])
+        self.assertRaises(ValueError, pool.fanout, ["insert into foo values(1,2,3,4)"])
+        self.assertRaises(ValueError, pool.fanout, ["select 1; select 2"])
+        self.assertRaises(apsw.BindingsError, pool.fanout, [("select ?", ())])
+        self.assertRaises(apsw.BindingsError, pool.fanout, [("select 3", (1,))])
+        self.assertRaises(apsw.SQLError, pool.fanout, ["select 3", "select nosuchcolumn"])
+        # readers that haven't seen a schema change yet still report the real error
+        for i in range(10):
+            w=pool.acquire(True)
+            w.cursor().execute("create table fanout%d(x)" % (i,))
+            pool.release(w)
+            self.assertRaises(apsw.SQLError, pool.fanout, ["select nosuchcolumn"]*3)
+        # the first failing query is reported
+        try:
+            pool.fanout(["select 3", "select nosuchcolumn", "insert into foo values(1,2,3,4)"])
+        except apsw.SQLError:
+            pass
+        self.assertEqual(0, pool.stats()["inuse"])
+        # connections in use
+        r=[pool.acquire() for i in range(3)]
+        self.assertRaises(apsw.BusyError, pool.fanout, ["select 3"], True, 0)
+        pool.release(r.pop())
+        self.assertEqual(expected, pool.fanout(queries))
+        for c in r:
+            pool.release(c)
+        # readers=0 uses the writer
+        pool2=apsw.ConnectionPool(fname, readers=0)
+        self.assertEqual(expected, pool2.fanout(queries))
+        pool2.close()
+        pool.close()
+        self.assertRaises(apsw.ConnectionClosedError, pool.fanout, queries)
+
+    def testAsync(self):
+        "Verify asyncio integration"
+        if not hasattr(apsw, "AsyncConnection"):
+            return
+        import asyncio
+        self.assertRaises(TypeError, apsw.AsyncConnection)
+        self.assertRaises(TypeError, apsw.AsyncConnection, 3)
+        loop=asyncio.new_event_loop()
+        c=self.db.cursor()
+        c.execute("create table foo(x,y)")
+        c.executemany("insert into foo values(?,?)", [(i, str(i)) for i in range(100)])
+        acon=apsw.AsyncConnection(self.db, loop)
+        self.assertTrue(acon.connection is self.db)
+        results={}
+        code="""
+async def asynctest():
+    acur=acon.cursor()
+    results["connection"]=acur.connection
+    results["execute"]=await acur.execute("select x from foo where x<?", (50,))
+    results["rows"]=[row async for row in acur]
+    # iteration is done in batches
+    acur.batchsize=7
+    await acur.execute("select x from foo")
+    results["partial"]=[await acur.__anext__() for i in range(3)]
+    # buffered rows come first
+    results["fetchmany"]=await acur.fetchmany(10)
+    results["fetchmany2"]=await acur.fetchmany(2)
+    results["fetchall"]=len(await acur.fetchall())
+    results["fetchallend"]=await acur.fetchall()
+    # executing again discards rows of the previous query
+    await acur.execute("select x from foo")
+    await acur.__anext__()
+    await acur.execute("select 'a' union all select 'b'")
+    results["reexecute"]=[row async for row in acur]
+    await acur.executemany("insert into foo values(?,?)", ((i, i) for i in range(10)))
+    results["changes"]=await acon.run(self.db.totalchanges)
+    results["thread"]=await acon.run(threading.current_thread)
+    try:
+        await acur.execute("select nosuchcolumn")
+    except apsw.SQLError:
+        results["sqlerror"]=True
+    try:
+        await acon.run(int, "not a number")
+    except ValueError:
+        results["valueerror"]=True
+    # cancelled results are ignored
+    f=acon.run(time.sleep, 0.05)
+    f.cancel()
+    results["aftercancel"]=await acon.run(int, "3")
+    await acur.close()
+    try:
+        await acur.execute("select 3")
+    except apsw.CursorClosedError:
+        results["closed"]=True
+"""
+        namespace=dict(globals())
+        namespace.update({"acon": acon, "results": results, "self": self})
+        exec(code, namespace)
+        loop.run_until_complete(namespace["asynctest"]())
+        self.assertTrue(results["connection"] is acon)
+        self.assertEqual(apsw.AsyncConnection, type(results["connection"]))
+        self.assertEqual([(i,) for i in range(50)], results["rows"])
+        self.assertEqual([(0,), (1,), (2,)], results["partial"])
+        self.assertEqual([(i,) for i in range(3, 13)], results["fetchmany"])
+        self.assertEqual([(13,), (14,)], results["fetchmany2"])
+        self.assertEqual(100-15, results["fetchall"])
+        self.assertEqual([], results["fetchallend"])
+        self.assertEqual([("a",), ("b",)], results["reexecute"])
+        self.assertEqual(110, results["changes"])
+        self.assertTrue(results["thread"] is not threading.current_thread())
+        for k in "sqlerror", "valueerror", "closed":
+            self.assertTrue(results[k])
+        self.assertEqual(3, results["aftercancel"])
+        acur=acon.cursor()
+        self.assertEqual(7, setattr(acur, "batchsize", 7) or acur.batchsize)
+        self.assertRaises(ValueError, setattr, acur, "batchsize", 0)
+        self.assertRaises(TypeError, setattr, acur, "batchsize", "three")
+        self.assertRaises(TypeError, delattr, acur, "batchsize")
+        self.assertRaises(TypeError, acon.run)
+        self.assertRaises(TypeError, acon.run, 3)
+        self.assertRaises(ValueError, acur.fetchmany, -1)
+        acon.close()
+        acon.close()
+        self.assertRaises(apsw.ConnectionClosedError, acon.cursor)
+        self.assertRaises(apsw.ConnectionClosedError, acon.run, int)
+        self.assertRaises(apsw.ConnectionClosedError, acur.execute, "select 3")
+        # the connection can be used directly again
+        self.assertEqual([(110,)], self.db.cursor().execute("select count(*) from foo").fetchall())
+        loop.close()
+
+    def testGroupCommit(self):
+        "Verify group commit"
+        if not hasattr(apsw, "GroupCommit"):
+            return
+        self.assertRaises(TypeError, apsw.GroupCommit)
+        self.assertRaises(TypeError, apsw.GroupCommit, 3)
+        self.assertRaises(ValueError, apsw.GroupCommit, self.db, maxdelay=-1)
+        self.assertRaises(ValueError, apsw.GroupCommit, self.db, maxbatch=0)
+        self.db.cursor().execute("create table foo(x unique, y)")
+        gc=apsw.GroupCommit(self.db, maxdelay=0.5, maxbatch=20)
+        self.assertTrue(gc.connection is self.db)
+        self.assertRaises(RuntimeError, gc.__init__, self.db)
+        self.assertRaises(TypeError, gc.submit)
+        self.assertRaises(TypeError, gc.submitmany, "select 3")
+        # many threads submitting share commits
+        def submitter(start):
+            for i in range(start, start+10):
+                futures.append(gc.submit("insert into foo values(?,?)", (i, threading.current_thread().name)))
+        futures=[]
+        threads=[threading.Thread(target=submitter, args=(i*10,)) for i in range(10)]
+        for t in threads: t.start()
+        for t in threads: t.join()
+        for f in futures:
+            self.assertEqual(None, f.result())
+        stats=gc.stats()
+        self.assertEqual(100, stats["changes"])
+        self.assertEqual(0, stats["failed"])
+        self.assertEqual(0, stats["queued"])
+        self.assertTrue(stats["batches"]<=10)
+        self.assertEqual(20, stats["largest"])
+        self.assertEqual([(100,)], self.db.cursor().execute("select count(*) from foo").fetchall())
+        # a failing change doesn't affect the others in the batch
+        gc2=apsw.GroupCommit(self.db, maxdelay=10, maxbatch=4)
+        f1=gc2.submit("insert into foo values(1000, 'a')")
+        f2=gc2.submit("insert into foo values(1001, 'b'); insert into foo values(3, 'dup')")
+        f3=gc2.submitmany("insert into foo values(?, 'c')", [(1002,), (1003,)])
+        f4=gc2.submit("insert into foo values(?, ?)", (1004, {}))
+        self.assertEqual(None, f1.result())
+        self.assertEqual(None, f3.result())
+        self.assertRaises(apsw.ConstraintError, f2.result)
+        self.assertRaises(TypeError, f4.result)
+        self.assertEqual([(1000,), (1002,), (1003,)], self.db.cursor().execute("select x from foo where x>=1000 order by x").fetchall())
+        self.assertEqual({"batches": 1, "changes": 2, "failed": 2, "largest": 2, "queued": 0}, gc2.stats())
+        # cancelled futures are not run, and closing commits what is queued
+        f5=gc2.submit("insert into foo values(2000, 'a')")
+        f6=gc2.submit("insert into foo values(2001, 'b')")
+        self.assertTrue(f5.cancel())
+        gc2.close()
+        self.assertTrue(f5.cancelled())
+        self.assertTrue(f6.done())
+        self.assertEqual([(2001,)], self.db.cursor().execute("select x from foo where x>=2000").fetchall())
+        # statements returning rows and transaction control
+        self.assertEqual(None, gc.submit("select * from foo").result())
+        self.assertRaises(apsw.AuthError, gc.submit("commit").result)
+        # which doesn't end the transaction of the rest of the batch
+        gc3=apsw.GroupCommit(self.db, maxdelay=10, maxbatch=7)
+        f1=gc3.submit("insert into foo values(2500, 'a')")
+        fails=[gc3.submit(sql) for sql in ("commit", "end", "rollback", "savepoint x", "insert into foo values(2501, 'b'); commit")]
+        f2=gc3.submit("insert into foo values(2502, 'c')")
+        self.assertEqual(None, f1.result())
+        self.assertEqual(None, f2.result())
+        for f in fails:
+            self.assertRaises(apsw.AuthError, f.result)
+        self.assertEqual({"batches": 1, "changes": 2, "failed": 5, "largest": 2, "queued": 0}, gc3.stats())
+        gc3.close()
+        self.assertEqual([(2500,), (2502,)], self.db.cursor().execute("select x from foo where x>=2500 and x<3000").fetchall())
+        self.assertEqual(None, gc.submit("insert into foo values(3000, 'x')").result())
+        # close from a done callback on the worker thread
+        f=gc.submit("insert into foo values(3001, 'y')")
+        f.add_done_callback(lambda f: gc.close())
+        self.assertEqual(None, f.result())
+        gc.close()
+        gc.close()
+        self.assertRaises(apsw.ConnectionClosedError, gc.submit, "select 3")
+        self.assertRaises(apsw.ConnectionClosedError, gc.submitmany, "select ?", [(3,)])
+        self.assertEqual([(3000,), (3001,)], self.db.cursor().execute("select x from foo where x>=3000").fetchall())
+        self.assertTrue(self.db.getautocommit())
+
+    def testCheckpointer(self):
+        "Verify background wal checkpointing"
+        if not hasattr(apsw, "Checkpointer"):
+            return
+        def waitfor(cond):
+            end=time.time()+10
+            while not cond() and time.time()<end:
+                time.sleep(0.01)
+            return cond()
+        def fill(db, n):
+            for i in range(n):
+                db.cursor().execute("insert into foo values(randomblob(3000))")
+        self.assertRaises(TypeError, apsw.Checkpointer)
+        self.assertRaises(TypeError, apsw.Checkpointer, 3)
+        self.assertRaises(ValueError, apsw.Checkpointer, self.db, pages=0)
+        self.assertRaises(ValueError, apsw.Checkpointer, self.db, age=-1)
+        self.assertRaises(ValueError, apsw.Checkpointer, self.db, truncate=-1)
+        self.assertRaises(ValueError, apsw.Checkpointer, apsw.Connection(":memory:"))
+        self.assertEqual("wal", self.db.cursor().execute("pragma journal_mode=wal").fetchall()[0][0])
+        self.db.cursor().execute("create table foo(x)")
+
+        # frames committed since the last checkpoint
+        ck=apsw.Checkpointer(self.db, pages=20, age=0)
+        self.assertTrue(ck.source is self.db)
+        self.assertRaises(RuntimeError, ck.__init__, self.db)
+        self.assertRaises(ValueError, apsw.Checkpointer, self.db)
+        self.assertEqual(0, ck.stats()["passive"])
+        fill(self.db, 50)
+        self.assertTrue(waitfor(lambda: ck.stats()["frames"]>=20))
+        stats=ck.stats()
+        self.assertTrue(stats["wal"]>=50)
+        self.assertEqual((0, 0, 0, 0), (stats["restart"], stats["truncate"], stats["busy"], stats["errors"]))
+        # wal hooks still work alongside
+        calls=[]
+        def hook(*args):
+            calls.append(args)
+            return apsw.SQLITE_OK
+        self.db.setwalhook(hook)
+        fill(self.db, 1)
+        self.db.setwalhook(None)
+        self.assertEqual(1, len(calls))
+        passive=ck.stats()["passive"]
+        fill(self.db, 50)
+        self.assertTrue(waitfor(lambda: ck.stats()["passive"]>passive))
+        ck.close()
+        ck.close()
+        stats=ck.stats()
+        fill(self.db, 50)
+        time.sleep(0.2)
+        self.assertEqual(stats, ck.stats())
+
+        # age and truncating
+        ck=apsw.Checkpointer(self.db, pages=100000, age=0.05, truncate=1)
+        fill(self.db, 1)
+        self.assertTrue(waitfor(lambda: ck.stats()["truncate"]>0))
+        self.assertEqual(0, ck.stats()["wal"])
+        self.assertEqual(0, os.path.getsize(TESTFILEPREFIX+"testdb-wal"))
+        ck.close()
+
+        # restarting is busy while a reader uses the log
+        ck=apsw.Checkpointer(self.db, pages=5, age=0, restart=1)
+        reader=apsw.Connection(TESTFILEPREFIX+"testdb")
+        reader.cursor().execute("begin; select count(*) from foo").fetchall()
+        fill(self.db, 20)
+        self.assertTrue(waitfor(lambda: ck.stats()["busy"]>0))
+        reader.cursor().execute("commit")
+        self.assertTrue(waitfor(lambda: ck.stats()["wal"]==0))
+        self.assertTrue(ck.stats()["restart"]>ck.stats()["busy"])
+        ck.close()
+
+        # pools track the writer
+        pool=apsw.ConnectionPool(TESTFILEPREFIX+"testdb", readers=1)
+        ck=apsw.Checkpointer(pool, pages=5, age=0)
+        self.assertTrue(ck.source is pool)
+        self.assertRaises(ValueError, apsw.Checkpointer, pool)
+        con=pool.acquire(write=True)
+        fill(con, 20)
+        pool.release(con)
+        self.assertTrue(waitfor(lambda: ck.stats()["frames"]>0))
+        ck.close()
+        pool.close()
+        self.assertRaises(apsw.ConnectionClosedError, apsw.Checkpointer, pool)
+        reader.close()
+        self.assertRaises(apsw.ConnectionClosedError, apsw.Checkpointer, reader)
+
+        # closing the source stops the worker, which is then no longer
+        # keeping the checkpointer alive
+        import weakref
+        db=apsw.Connection(TESTFILEPREFIX+"testdb")
+        ck=apsw.Checkpointer(db, pages=5, age=0)
+        db.close()
+        self.assertTrue(ck.source is db)
+        ref=weakref.ref(ck)
+        del ck
+        gc.collect()
+        self.assertEqual(None, ref())
+        # a pool's writer being closed only detaches as a new writer is opened
+        pool=apsw.ConnectionPool(TESTFILEPREFIX+"testdb")
+        ck=apsw.Checkpointer(pool, pages=5, age=0)
+        con=pool.acquire(write=True)
+        con.close()
+        pool.release(con)
+        con=pool.acquire(write=True)
+        fill(con, 20)
+        pool.release(con)
+        self.assertTrue(waitfor(lambda: ck.stats()["frames"]>0))
+        pool.close()
+        ref=weakref.ref(ck)
+        del ck
+        gc.collect()
+        self.assertEqual(None, ref())
+
+    def testAutoParameterize(self):
+        "Verify literals are turned into bindings"
+        self.assertEqual(False, self.db.getautoparameterize())
+        self.assertRaises(TypeError, self.db.setautoparameterize)
+        self.assertRaises(TypeError, self.db.setautoparameterize, "yes")
+        c=self.db.cursor()
+        c.execute("create table foo(x,y)")
+        traced=[]
+        c.setexectrace(lambda cur, sql, bindings: traced.append((sql, bindings)) or True)
+        # disabled by default
+        c.execute("insert into foo values(1,2)")
+        self.assertEqual([("insert into foo values(1,2)", None)], traced)
+        self.db.setautoparameterize(True)
+        self.assertEqual(True, self.db.getautoparameterize())
+        for sql, expected, bindings in (
+            ("insert into foo values(3, 'it''s')", "insert into foo values(?, ?)", (3, "it's")),
+            ("INSERT into foo  values ( -2.5, 'x' ) ; ", "INSERT into foo values ( -?, ? )", (2.5, "x")),
+            ("insert into foo /* comment */ values(1e3, x'aa') -- more\n", "insert into foo values(?, x'aa')", (1000.0,)),
+            ("update foo set y='z' where x=3", "update foo set y=? where x=?", ("z", 3)),
+            # result columns and order by are left alone
+            ("select x, 'lit', 7 from foo where y<>'q' order by 1 desc, 2", "select x, 'lit', 7 from foo where y<>? order by 1 desc, 2", ("q",)),
+            ("select x from foo where x in (select 3 union select 4) group by 1 having count(*)>0 limit 10",
+             "select x from foo where x in (select 3 union select 4) group by 1 having count(*)>? limit ?", (0, 10)),
+            ):
+            traced=[]
+            c.execute(sql).fetchall()
+            self.assertEqual([(expected, bindings)], traced)
+        # used as is
+        for sql in ("select 1; select 2", "select x from foo where x=?", "pragma user_version=3",
+                    "select x from foo where x=99999999999999999999", "select x from 'foo' where x=3",
+                    "select sum(x) over (rows 1 preceding) from foo where x>3", "select x from foo where y='unterminated"):
+            traced=[]
+            try:
+                c.execute(sql, (1,) if "?" in sql else None).fetchall()
+            except apsw.SQLError:
+                pass
+            for tsql, tbindings in traced:
+                self.assertTrue(tsql in sql)
+        self.assertEqual([(3, "z")], c.execute("select * from foo where x=3").fetchall())
+        # queries differing only in literals share a cache entry
+        c.setexectrace(None)
+        stats=self.db.cache_stats()
+        for i in range(20):
+            self.assertEqual([(i,)], c.execute("select x from (select %d as x) where x=%d" % (i, i)).fetchall())
+        for i in range(20):
+            c.execute("select y from foo where x=%d" % (i,)).fetchall()
+        self.assertEqual(stats["normalized"]+40, self.db.cache_stats()["normalized"])
+        self.assertEqual(stats["misses"]+21, self.db.cache_stats()["misses"])
+        # only SQLite parse errors are retried with the original text
+        calls=[]
+        def auth(*args):
+            calls.append(args)
+            1/0
+        self.db.setauthorizer(auth)
+        stats=self.db.cache_stats()
+        self.assertRaises(ZeroDivisionError, c.execute, "select y, x from foo where y=12345")
+        self.assertEqual(1, len(calls))
+        self.assertEqual(stats["misses"]+1, self.db.cache_stats()["misses"])
+        self.db.setauthorizer(None)
+        c.setexectrace(lambda cur, sql, bindings: traced.append((sql, bindings)) or True)
+        self.db.setautoparameterize(False)
+        traced=[]
+        c.execute("select x from foo where x=3").fetchall()
+        self.assertEqual([("select x from foo where x=3", None)], traced)
+
     def testWikipedia(self):
         "Use front page of wikipedia to check unicode handling"
         # the text also includes characters that can't be represented in 16 bits
@@ -3501,7 +5161,7 @@ class APSW(unittest.TestCase):
         'sqlite3api': { # items of interest - sqlite3 calls
                         'match': re.compile(r"(sqlite3_[A-Za-z0-9_]+)\s*\("),
                         # what must also be on same or preceding line
-                        'needs': re.compile("PYSQLITE(_|_BLOB_|_CON_|_CUR_|_SC_|_VOID_|_BACKUP_)CALL"),
+                        'needs': re.compile("PYSQLITE(_|_BLOB_|_CON_|_CUR_|_SC_|_VOID_|_BACKUP_|_SESSION_|_HELD_)CALL"),
 
            # except if match.group(1) matches this - these don't
            # acquire db mutex so no need to wrap (determined by
@@ -3512,7 +5172,7 @@ class APSW(unittest.TestCase):
            # is already held by enclosing sqlite3_step and the
            # methods will only be called from that same thread so it
            # isn't a problem.
-                        'skipcalls': re.compile("^sqlite3_(blob_bytes|column_count|bind_parameter_count|data_count|vfs_.+|changes|total_changes|get_autocommit|last_insert_rowid|complete|interrupt|limit|free|threadsafe|value_.+|libversion|enable_shared_cache|initialize|shutdown|config|memory_.+|soft_heap_limit(64)?|randomness|db_readonly|db_filename|release_memory|status64|result_.+|user_data|mprintf|aggregate_context|declare_vtab|backup_remaining|backup_pagecount|sourceid|uri_.+)$"),
+                        'skipcalls': re.compile("^sqlite3_(blob_bytes|column_count|bind_parameter_count|bind_parameter_name|data_count|vfs_.+|changes|total_changes|get_autocommit|last_insert_rowid|complete|interrupt|limit|free|threadsafe|value_.+|libversion|enable_shared_cache|initialize|shutdown|config|memory_.+|soft_heap_limit(64)?|randomness|db_readonly|db_filename|release_memory|status64|result_.+|user_data|mprintf|aggregate_context|declare_vtab|backup_remaining|backup_pagecount|sourceid|uri_.+)$"),
                         # also ignore this file
                         'skipfiles': re.compile(r"[/\\]apsw.c$"),
                         # error message
@@ -3542,13 +5202,13 @@ class APSW(unittest.TestCase):
 
     def sourceCheckFunction(self, filename, name, lines):
         # not further checked
-        if name.split("_")[0] in ("ZeroBlobBind", "APSWVFS", "APSWVFSFile", "APSWBuffer", "FunctionCBInfo", "apswurifilename") :
+        if name.split("_")[0] in ("ZeroBlobBind", "APSWVFS", "APSWVFSFile", "APSWBuffer", "FunctionCBInfo", "apswurifilename", "ColumnBuffer", "AsyncCursor", "AsyncValue", "CancellationToken") :
                 return
 
         checks={
             "APSWCursor":
                 {
-                  "skip": ("dealloc", "init", "dobinding", "dobindings", "doexectrace", "dorowtrace", "step", "close", "close_internal"),
+                  "skip": ("dealloc", "init", "dobinding", "dobindings", "doexectrace", "dorowtrace", "step", "dostep", "makerow", "rowfactoryprep", "fetchrows", "limits", "close", "close_internal"),
                   "req":
                       {
                          "use": "CHECK_USE",
@@ -3578,6 +5238,58 @@ class APSW(unittest.TestCase):
                       },
                   "order": ("use", "closed")
                },
+            "APSWPrepared":
+               {
+                  "skip": ("dealloc", "init", "close", "close_internal"),
+                  "req":
+                      {
+                        "use":  "CHECK_USE",
+                        "closed": "CHECK_PREPARED_CLOSED"
+                      },
+                  "order": ("use", "closed")
+               },
+            "APSWSession":
+               {
+                  "skip": ("dealloc", "init", "close", "close_internal", "output", "setenabled", "setindirect"),
+                  "req":
+                      {
+                        "use":  "CHECK_USE",
+                        "closed": "CHECK_SESSION_CLOSED"
+                      },
+                  "order": ("use", "closed")
+               },
+            "ConnectionPool":
+               {
+                  "skip": ("new", "init", "dealloc", "signal", "wait", "open", "discard", "healthy", "release", "close", "stats"),
+                  "req":
+                      {
+                        "closed": "CHECK_POOL_CLOSED"
+                      },
+                  "order": ("closed",)
+               },
+            "AsyncConnection":
+               {
+                  "skip": ("new", "init", "dealloc", "dojob", "submit", "close", "getconnection"),
+                  "req":
+                      {
+                        "closed": "CHECK_ASYNC_CLOSED"
+                      },
+                  "order": ("closed",)
+               },
+            "GroupCommit":
+               {
+                  "skip": ("new", "init", "dealloc", "exec", "change", "batch", "signal", "submit", "close", "stats", "getconnection"),
+                  "req":
+                      {
+                        "closed": "CHECK_GROUPCOMMIT_CLOSED"
+                      },
+                  "order": ("closed",)
+               },
+            "Checkpointer":
+               {
+                  "skip": ("new", "init", "dealloc", "signal", "walnotify", "attach", "detach", "checkpoint", "worker", "close", "sourceclosed", "stats", "getsource"),
+                  "req": {},
+               },
             "APSWBackup":
                {
                   "skip": ("dealloc", "init", "close_internal",
@@ -5671,6 +7383,75 @@ class APSW(unittest.TestCase):
         self.assertRaises(apsw.BusyError, b.__exit__, None, None, None)
         b.__exit__(None, None, None)
 
+    def testSerialize(self):
+        "Verify serializing and deserializing databases"
+        if not hasattr(self.db, "serialize"):
+            return
+        self.assertRaises(TypeError, self.db.serialize, 3)
+        self.assertRaises(apsw.SQLError, self.db.serialize, "nosuchdb")
+        self.assertEqual(b"", apsw.Connection(":memory:").serialize())
+        c=self.db.cursor()
+        c.execute("create table foo(x,y); insert into foo values(1, 'one'); insert into foo values(2, x'aabbcc')")
+        data=self.db.serialize()
+        self.assertTrue(isinstance(data, bytes))
+        self.assertEqual(b"SQLite format 3\0", data[:16])
+        self.assertEqual(data, self.db.serialize("main"))
+        rows=c.execute("select * from foo").fetchall()
+
+        # copies are writable and independent
+        db2=apsw.Connection(":memory:")
+        db2.deserialize("main", data)
+        self.assertEqual(rows, db2.cursor().execute("select * from foo").fetchall())
+        db2.cursor().execute("insert into foo values(3, 3)")
+        self.assertEqual(rows, c.execute("select * from foo").fetchall())
+        self.assertEqual(3, len(db2.cursor().execute("select * from foo").fetchall()))
+        db2.deserialize("main", bytearray(data))
+        self.assertEqual(rows, db2.cursor().execute("select * from foo").fetchall())
+        db2.deserialize("main", b"")
+        db2.cursor().execute("create table bar(x)")
+
+        # readonly bytes are shared in place by many connections
+        copies=[apsw.Connection(":memory:") for i in range(3)]
+        for db in copies:
+            db.deserialize("main", data, readonly=True)
+        del data
+        gc.collect()
+        for db in copies:
+            self.assertEqual(rows, db.cursor().execute("select * from foo").fetchall())
+            self.assertRaises(apsw.ReadOnlyError, db.cursor().execute, "insert into foo values(3,3)")
+        self.assertEqual(copies[0].serialize(), copies[1].serialize())
+        copies[0].deserialize("main", bytearray(copies[0].serialize()), readonly=True)
+        self.assertRaises(apsw.ReadOnlyError, copies[0].cursor().execute, "delete from foo")
+        for db in copies:
+            db.close()
+
+        # attached databases
+        c.execute("attach ':memory:' as other")
+        self.db.deserialize("other", self.db.serialize())
+        self.assertEqual(rows, c.execute("select * from other.foo").fetchall())
+
+        # the database can't change under a running statement or transaction
+        db2=apsw.Connection(":memory:")
+        db2.deserialize("main", self.db.serialize())
+        c2=db2.cursor()
+        c2.execute("select * from foo")
+        self.assertRaises(apsw.BusyError, db2.deserialize, "main", b"")
+        c2.close()
+        db2.cursor().execute("begin")
+        self.assertRaises(apsw.BusyError, db2.deserialize, "main", b"")
+        db2.cursor().execute("commit")
+        db2.deserialize("main", b"")
+        self.assertEqual([], db2.cursor().execute("select * from sqlite_master").fetchall())
+
+        self.assertRaises(TypeError, self.db.deserialize)
+        self.assertRaises(TypeError, self.db.deserialize, "main")
+        self.assertRaises(TypeError, self.db.deserialize, "main", u"text")
+        self.assertRaises(TypeError, self.db.deserialize, "main", 3)
+        self.assertRaises(apsw.SQLError, self.db.deserialize, "nosuchdb", b"")
+        db2.close()
+        self.assertRaises(apsw.ConnectionClosedError, db2.serialize)
+        self.assertRaises(apsw.ConnectionClosedError, db2.deserialize, "main", b"")
+
     def testLog(self):
         "Verifies logging functions"
         self.assertRaises(TypeError, apsw.log)
@@ -7515,6 +9296,11 @@ shell.write(shell.stdout, "hello world\\n")
         except apsw.IOError:
             pass
 
+        ## SetBusyBackoffFail
+        apsw.faultdict["SetBusyBackoffFail"]=True
+        db=apsw.Connection(":memory:")
+        self.assertRaises(apsw.IOError, db.setbusybackoff, 5)
+
         ## UnknownValueType
         apsw.faultdict["UnknownValueType"]=True
         try:
@@ -7527,6 +9313,172 @@ shell.write(shell.stdout, "hello world\\n")
             self.assertTrue(klass is apsw.Error)
             self.assertTrue("123456" in str(value))
 
+        ## UnknownColumnBufferType
+        apsw.faultdict["UnknownColumnBufferType"]=True
+        try:
+            db=apsw.Connection(":memory:")
+            db.cursor().execute("select 3").fetchcolumns()
+            1/0
+        except:
+            klass,value=sys.exc_info()[:2]
+            self.assertTrue(klass is apsw.Error)
+            self.assertTrue("12348" in str(value))
+
+        ## ColumnBufferReallocFails
+        apsw.faultdict["ColumnBufferReallocFails"]=True
+        db=apsw.Connection(":memory:")
+        self.assertRaises(MemoryError, db.cursor().execute("select 3").fetchcolumns)
+
+        ## ExecuteColumnsAllocFails
+        if py3:
+            import array
+            apsw.faultdict["ExecuteColumnsAllocFails"]=True
+            db=apsw.Connection(":memory:")
+            self.assertRaises(MemoryError, db.cursor().executecolumns, "select ?", (array.array("q", [1]),))
+
+        ## LatencyProfileAllocFails
+        apsw.faultdict["LatencyProfileAllocFails"]=True
+        db=apsw.Connection(":memory:")
+        self.assertRaises(MemoryError, db.setlatencyprofile, True)
+        self.assertEqual(False, db.getlatencyprofile())
+        db.setlatencyprofile(True)
+
+        ## ChangeCaptureAllocFails
+        apsw.faultdict["ChangeCaptureAllocFails"]=True
+        db=apsw.Connection(":memory:")
+        self.assertRaises(MemoryError, db.setchangecapture, 10)
+        self.assertRaises(MemoryError, db.setchangecapture, sys.maxsize)
+        db.setchangecapture(10)
+        db.cursor().execute("create table foo(x); insert into foo values(1)")
+        self.assertEqual([(apsw.SQLITE_INSERT, "main", "foo", 1)], db.drainchanges())
+
+        ## ResultCacheAllocFails
+        apsw.faultdict["ResultCacheAllocFails"]=True
+        db=apsw.Connection(":memory:")
+        self.assertRaises(MemoryError, db.setresultcache, 10)
+        self.assertEqual(0, db.getresultcache())
+        db.setresultcache(10)
+        self.assertEqual([(1,)], db.cachedquery("select 1"))
+
+        ## PoolLockAllocFails
+        apsw.faultdict["PoolLockAllocFails"]=True
+        self.assertRaises(MemoryError, apsw.ConnectionPool, TESTFILEPREFIX+"testdb2")
+
+        ## PoolWALFails
+        apsw.faultdict["PoolWALFails"]=True
+        self.assertRaises(apsw.IOError, apsw.ConnectionPool, TESTFILEPREFIX+"testdb2")
+
+        ## PoolRollbackFails
+        apsw.faultdict["PoolRollbackFails"]=True
+        pool=apsw.ConnectionPool(TESTFILEPREFIX+"testdb2")
+        w=pool.acquire(True)
+        w.cursor().execute("begin")
+        pool.release(w)
+        self.assertEqual(1, pool.stats()["discarded"])
+        self.assertTrue(pool.acquire(True) is not w)
+        pool.close()
+
+        pool=apsw.ConnectionPool(TESTFILEPREFIX+"testdb2", readers=3)
+        queries=["select %d" % (i,) for i in range(10)]
+        ## FanoutLockAllocFails
+        apsw.faultdict["FanoutLockAllocFails"]=True
+        self.assertRaises(MemoryError, pool.fanout, queries)
+
+        ## FanoutThreadFails
+        apsw.faultdict["FanoutThreadFails"]=True
+        self.assertEqual([(i,) for i in range(10)], pool.fanout(queries))
+
+        ## FanoutBufferAllocFails
+        apsw.faultdict["FanoutBufferAllocFails"]=True
+        self.assertRaises(apsw.NoMemError, pool.fanout, queries)
+        apsw.faultdict["FanoutBufferAllocFails"]=True
+        self.assertRaises(MemoryError, pool.fanout, [("select ?", (1,))])
+        self.assertEqual(0, pool.stats()["inuse"])
+        pool.close()
+
+        if hasattr(apsw, "AsyncConnection"):
+            import asyncio
+            loop=asyncio.new_event_loop()
+            ## AsyncLockAllocFails
+            apsw.faultdict["AsyncLockAllocFails"]=True
+            self.assertRaises(MemoryError, apsw.AsyncConnection, self.db, loop)
+
+            ## AsyncThreadFails
+            apsw.faultdict["AsyncThreadFails"]=True
+            self.assertRaises(RuntimeError, apsw.AsyncConnection, self.db, loop)
+            apsw.AsyncConnection(self.db, loop).close()
+            loop.close()
+
+        if hasattr(apsw, "GroupCommit"):
+            ## GroupCommitLockAllocFails
+            apsw.faultdict["GroupCommitLockAllocFails"]=True
+            self.assertRaises(MemoryError, apsw.GroupCommit, self.db)
+
+            ## GroupCommitThreadFails
+            apsw.faultdict["GroupCommitThreadFails"]=True
+            self.assertRaises(RuntimeError, apsw.GroupCommit, self.db)
+
+            ## GroupCommitCommitFails
+            self.db.cursor().execute("create table gcfault(x)")
+            gcom=apsw.GroupCommit(self.db, maxdelay=0)
+            apsw.faultdict["GroupCommitCommitFails"]=True
+            self.assertRaises(MemoryError, gcom.submit("insert into gcfault values(1)").result)
+            self.assertEqual(None, gcom.submit("insert into gcfault values(2)").result())
+            self.assertEqual({"batches": 2, "changes": 1, "failed": 1, "largest": 1, "queued": 0}, gcom.stats())
+            gcom.close()
+            self.assertEqual([(2,)], self.db.cursor().execute("select * from gcfault").fetchall())
+
+        if hasattr(self.db, "session"):
+            ## SessionCreateFails
+            apsw.faultdict["SessionCreateFails"]=True
+            self.assertRaises(apsw.NoMemError, self.db.session)
+
+            ## SessionChangesetFails
+            session=self.db.session()
+            session.attach()
+            self.db.cursor().execute("create table sessfault(x primary key); insert into sessfault values(1)")
+            apsw.faultdict["SessionChangesetFails"]=True
+            self.assertRaises(apsw.NoMemError, session.changeset)
+            self.assertTrue(len(session.changeset())>0)
+            session.close()
+
+        if hasattr(apsw, "Checkpointer"):
+            fname=TESTFILEPREFIX+"testdb2"
+            ## CheckpointerLockAllocFails
+            apsw.faultdict["CheckpointerLockAllocFails"]=True
+            self.assertRaises(MemoryError, apsw.Checkpointer, apsw.Connection(fname))
+
+            ## CheckpointerThreadFails
+            apsw.faultdict["CheckpointerThreadFails"]=True
+            self.assertRaises(RuntimeError, apsw.Checkpointer, apsw.Connection(fname))
+            apsw.Checkpointer(apsw.Connection(fname)).close()
+
+        if hasattr(self.db, "deserialize"):
+            ## DeserializeAllocFails
+            apsw.faultdict["DeserializeAllocFails"]=True
+            db=apsw.Connection(":memory:")
+            db.cursor().execute("create table foo(x)")
+            data=db.serialize()
+            self.assertRaises(MemoryError, db.deserialize, "main", data)
+            db.deserialize("main", data)
+            db.close()
+
+        ## PreparedAllocFails
+        apsw.faultdict["PreparedAllocFails"]=True
+        db=apsw.Connection(":memory:")
+        self.assertRaises(MemoryError, db.prepare, "select 3")
+        self.assertEqual([(3,)], db.cursor().execute("select 3").fetchall())
+
+        ## ParamNamesDecodeFails
+        apsw.faultdict["ParamNamesDecodeFails"]=True
+        db=apsw.Connection(":memory:")
+        self.assertRaises(MemoryError, db.cursor().execute, "select :a", {'a': 1})
+
+        ## BoundObjsAllocFails
+        apsw.faultdict["BoundObjsAllocFails"]=True
+        db=apsw.Connection(":memory:")
+        self.assertRaises(MemoryError, db.cursor().execute, "select ?", (1,))
+
         ## UnknownColumnType
         apsw.faultdict["UnknownColumnType"]=True
         try:
@@ -7781,7 +9733,8 @@ shell.write(shell.stdout, "hello world\\n")
         apsw.faultdict["DoBindingAsReadBufferFails"]=True
         try:
             db=apsw.Connection(":memory:")
-            db.cursor().execute("select ?", (b("abcd"),))
+            # bytes are bound directly so use something else with the buffer interface
+            db.cursor().execute("select ?", (bytearray(b("abcd")) if py3 else b("abcd"),))
             1/0
         except MemoryError:
             pass
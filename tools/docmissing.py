@@ -5,7 +5,7 @@
 # Find things that haven't been documented and should be or have been
 # but don't exist.
 
-import glob, sys
+import glob, sys, os, tempfile
 
 import apsw
 
@@ -39,6 +39,27 @@ blob=con.blobopen("main", "x", "y", con.last_insert_rowid(), 0)
 vfs=apsw.VFS("aname", "")
 vfsfile=apsw.VFSFile("", ":memory:", [apsw.SQLITE_OPEN_MAIN_DB|apsw.SQLITE_OPEN_CREATE|apsw.SQLITE_OPEN_READWRITE, 0])
 
+# asyncio integration is only present for Python 3.5 onwards
+asyncobjs=()
+if hasattr(apsw, "AsyncConnection"):
+    acon=apsw.AsyncConnection(apsw.Connection(":memory:"))
+    asyncobjs=(('AsyncConnection', acon), ('AsyncCursor', acon.cursor()))
+
+# group commit is only present for Python 3.2 onwards
+groupcommitobjs=()
+if hasattr(apsw, "GroupCommit"):
+    groupcommitobjs=(('GroupCommit', apsw.GroupCommit(apsw.Connection(":memory:"))),)
+
+# so is background checkpointing, which needs a database file
+checkpointerobjs=()
+if hasattr(apsw, "Checkpointer"):
+    checkpointerobjs=(('Checkpointer', apsw.Checkpointer(apsw.Connection(os.path.join(tempfile.mkdtemp(), "checkpointer.db")))),)
+
+# sessions are only present if SQLite has the session extension
+sessionobjs=()
+if hasattr(con, "session"):
+    sessionobjs=(('Session', con.session()),)
+
 # virtual tables aren't real - just check their size hasn't changed
 assert len(classes['VTModule'])==2
 del classes['VTModule']
@@ -52,8 +73,12 @@ for name, obj in ( ('Connection', con),
                    ('blob', blob),
                    ('VFS', vfs),
                    ('VFSFile', vfsfile),
+                   ('ColumnBuffer', con.cursor().execute("select 1").fetchcolumns()[0]),
+                   ('PreparedStatement', con.prepare("select 1")),
+                   ('ConnectionPool', apsw.ConnectionPool(":memory:", readers=0)),
+                   ('CancellationToken', apsw.CancellationToken()),
                    ('apsw', apsw),
-                   ):
+                   )+asyncobjs+groupcommitobjs+checkpointerobjs+sessionobjs:
     if name not in classes:
         retval=1
         print "class", name,"not found"
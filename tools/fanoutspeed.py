@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+#
+# See the accompanying LICENSE file.
+#
+# Measures ConnectionPool.fanout running per partition aggregate
+# queries against running them one after another on a single
+# connection, for increasing numbers of reader connections.  The
+# speedup is limited by the number of CPU cores.
+
+import sys
+import os
+import time
+import optparse
+import multiprocessing
+
+import apsw
+
+write=sys.stdout.write
+
+def fill(options):
+    for suffix in "", "-wal", "-shm":
+        if os.path.exists(options.database+suffix):
+            os.remove(options.database+suffix)
+    con=apsw.Connection(options.database)
+    con.cursor().execute("pragma journal_mode=wal")
+    con.cursor().execute("""create table sales(region, amount, item);
+        insert into sales
+          with recursive n(x) as (select 0 union all select x+1 from n where x<%d)
+          select x%%%d, x*1.5, 'item '||(x%%1000) from n""" % (options.rows-1, options.partitions))
+    con.close()
+
+def queries(options):
+    return [("select region, count(*), sum(amount), avg(amount), count(distinct item) from sales where region=?", (p,))
+            for p in range(options.partitions)]
+
+def serial(options):
+    con=apsw.Connection(options.database, flags=apsw.SQLITE_OPEN_READONLY)
+    qs=queries(options)
+    best=None
+    for i in range(options.iterations):
+        b4=time.time()
+        rows=[]
+        for sql, bindings in qs:
+            rows.extend(con.cursor().execute(sql, bindings).fetchall())
+        elapsed=time.time()-b4
+        best=elapsed if best is None else min(best, elapsed)
+    con.close()
+    return best, rows
+
+def fanout(options, readers):
+    pool=apsw.ConnectionPool(options.database, readers=readers)
+    qs=queries(options)
+    # open the connections and warm their caches
+    pool.fanout(qs)
+    best=None
+    for i in range(options.iterations):
+        b4=time.time()
+        rows=pool.fanout(qs)
+        elapsed=time.time()-b4
+        best=elapsed if best is None else min(best, elapsed)
+    pool.close()
+    return best, rows
+
+def doit(options):
+    write("         Python %s %s\n" % (sys.executable, str(sys.version_info)))
+    write("           APSW %s %s\n" % (apsw.apswversion(), apsw.__file__))
+    write("         SQLite %s\n" % (apsw.sqlitelibversion(),))
+    write("      CPU cores %d\n" % (multiprocessing.cpu_count(),))
+    write("           Rows %d\n" % (options.rows,))
+    write("     Partitions %d\n" % (options.partitions,))
+    write("     Iterations %d (best is shown)\n\n" % (options.iterations,))
+
+    fill(options)
+    base, expected=serial(options)
+    write("%-20s %8.3f\n" % ("serial", base))
+    for readers in options.readers:
+        elapsed, rows=fanout(options, readers)
+        assert rows==expected
+        write("%-20s %8.3f  speedup %.2fx\n" % ("readers=%d" % (readers,), elapsed, base/elapsed))
+
+    for suffix in "", "-wal", "-shm":
+        if os.path.exists(options.database+suffix):
+            os.remove(options.database+suffix)
+
+parser=optparse.OptionParser()
+parser.add_option("--database", dest="database", default="fanoutspeed.db",
+                  help="The database file to create [Default %default]")
+parser.add_option("--rows", dest="rows", type="int", default=2000000,
+                  help="How many rows to put in the table [Default %default]")
+parser.add_option("--partitions", dest="partitions", type="int", default=16,
+                  help="How many queries to run [Default %default]")
+parser.add_option("--iterations", dest="iterations", type="int", default=3,
+                  help="How many times to run each measurement [Default %default]")
+parser.add_option("--readers", dest="readers", default=None,
+                  help="Comma separated reader connection counts [Default 1, 2, 4 ... up to the number of cores]")
+
+if __name__=="__main__":
+    options,args=parser.parse_args()
+
+    if len(args):
+        parser.error("Unexpected arguments "+str(args))
+
+    if options.readers:
+        options.readers=[int(r) for r in options.readers.split(",")]
+    else:
+        options.readers=[1]
+        while options.readers[-1]*2<=multiprocessing.cpu_count():
+            options.readers.append(options.readers[-1]*2)
+        if options.readers[-1]!=multiprocessing.cpu_count():
+            options.readers.append(multiprocessing.cpu_count())
+
+    doit(options)
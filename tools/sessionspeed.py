@@ -0,0 +1,119 @@
+#!/usr/bin/env python
+#
+# See the accompanying LICENSE file.
+#
+# Measures replicating changes with session extension changesets
+# against copying the whole database as a shell .dump, comparing the
+# bytes that have to be shipped and the time taken to produce and
+# apply them.  APSW must have been built with --enable=session.
+
+import sys
+import time
+import optparse
+
+try:
+    from StringIO import StringIO
+except ImportError:
+    from io import StringIO
+
+import apsw
+
+write=sys.stdout.write
+
+schema="create table items(id integer primary key, name, price, stock)"
+
+def fill(con, options):
+    con.cursor().execute(schema)
+    con.cursor().execute("""insert into items
+          with recursive n(x) as (select 1 union all select x+1 from n where x<%d)
+          select x, 'item number '||x, x*1.25, x%%97 from n""" % (options.rows,))
+
+def change(con, options):
+    # a mix of updates, inserts and deletes spread over the table
+    step=max(1, options.rows//options.changes)
+    c=con.cursor()
+    with con:
+        for i in range(options.changes):
+            rowid=1+i*step
+            if i%3==0:
+                c.execute("update items set stock=stock+1, price=price*1.1 where id=?", (rowid,))
+            elif i%3==1:
+                c.execute("delete from items where id=?", (rowid,))
+            else:
+                c.execute("insert into items values(null, ?, 1, 1)", ("new item %d" % (i,),))
+
+def contents(con):
+    return con.cursor().execute("select * from items order by id").fetchall()
+
+def bysession(options):
+    source=apsw.Connection(":memory:")
+    replica=apsw.Connection(":memory:")
+    fill(source, options)
+    fill(replica, options)
+    session=source.session()
+    session.attach("items")
+    change(source, options)
+
+    b4=time.time()
+    changeset=session.changeset()
+    produced=time.time()-b4
+
+    b4=time.time()
+    replica.applychangeset(changeset)
+    applied=time.time()-b4
+
+    assert contents(source)==contents(replica)
+    return len(changeset), produced, applied
+
+def bydump(options):
+    source=apsw.Connection(":memory:")
+    fill(source, options)
+    change(source, options)
+
+    b4=time.time()
+    out=StringIO()
+    shell=apsw.Shell(stdout=out, db=source)
+    shell.command_dump([])
+    dump=out.getvalue()
+    produced=time.time()-b4
+
+    b4=time.time()
+    replica=apsw.Connection(":memory:")
+    replica.cursor().execute(dump)
+    applied=time.time()-b4
+
+    assert contents(source)==contents(replica)
+    return len(dump.encode("utf8")), produced, applied
+
+def doit(options):
+    write("         Python %s %s\n" % (sys.executable, str(sys.version_info)))
+    write("           APSW %s %s\n" % (apsw.apswversion(), apsw.__file__))
+    write("         SQLite %s\n" % (apsw.sqlitelibversion(),))
+    write("           Rows %d\n" % (options.rows,))
+    write("        Changes %d\n\n" % (options.changes,))
+
+    write("%-12s %12s %10s %10s\n" % ("", "bytes", "produce", "apply"))
+    ssize, sproduced, sapplied=bysession(options)
+    write("%-12s %12d %10.3f %10.3f\n" % ("changeset", ssize, sproduced, sapplied))
+    dsize, dproduced, dapplied=bydump(options)
+    write("%-12s %12d %10.3f %10.3f\n" % (".dump", dsize, dproduced, dapplied))
+    write("\nThe changeset is %.1fx smaller and %.1fx faster overall\n" % (float(dsize)/ssize, (dproduced+dapplied)/(sproduced+sapplied)))
+
+parser=optparse.OptionParser()
+parser.add_option("--rows", dest="rows", type="int", default=200000,
+                  help="How many rows to put in the table [Default %default]")
+parser.add_option("--changes", dest="changes", type="int", default=1000,
+                  help="How many rows to change after the copy [Default %default]")
+
+if __name__=="__main__":
+    options,args=parser.parse_args()
+
+    if len(args):
+        parser.error("Unexpected arguments "+str(args))
+
+    if not hasattr(apsw.Connection, "session"):
+        parser.error("APSW was not built with the session extension")
+    if options.changes<1 or options.changes>options.rows:
+        parser.error("--changes must be between 1 and --rows")
+
+    doit(options)
@@ -21,6 +21,9 @@ if sys.version_info>=(3,):
     xrange=range
     unichr=chr
 
+# time.clock was removed in Python 3.8
+cputime=getattr(time, "process_time", None) or time.clock
+
 # Sigh
 try:
     maxuni=0x10ffff
@@ -398,6 +401,100 @@ def doit():
         "pysqlite individual statements without bindings"
         return pysqlite_statements(con, withoutbindings)
 
+    # The fetch tests fill a table in a single statement and then
+    # measure getting the rows back out
+    def fetch_fill(con):
+        cursor=con.cursor()
+        cursor.execute("create table fetchtest(i, r, t, b)")
+        cursor.execute("""insert into fetchtest
+               with recursive n(x) as (select 1 union all select x+1 from n where x<%d)
+               select x, x*1.5, 'row '||x, zeroblob(x%%17) from n""" % (options.scale*20000,))
+
+    def apsw_fetchrows(con):
+        "APSW rows one at a time"
+        fetch_fill(con)
+        for i in range(5):
+            for row in con.cursor().execute("select * from fetchtest"): pass
+
+    def pysqlite_fetchrows(con):
+        "pysqlite rows one at a time"
+        fetch_fill(con)
+        for i in range(5):
+            for row in con.cursor().execute("select * from fetchtest"): pass
+
+    def apsw_fetchmany(con):
+        "APSW rows using fetchmany"
+        fetch_fill(con)
+        for i in range(5):
+            cursor=con.cursor().execute("select * from fetchtest")
+            while cursor.fetchmany(1000): pass
+
+    def pysqlite_fetchmany(con):
+        "pysqlite rows using fetchmany"
+        fetch_fill(con)
+        for i in range(5):
+            cursor=con.cursor().execute("select * from fetchtest")
+            while cursor.fetchmany(1000): pass
+
+    # Inserts using named parameters with a dict per row
+    def namedparams_rows():
+        for i in xrange(options.scale*20000):
+            yield {"id": i, "name": "row %d" % (i,), "price": i*1.5, "qty": i%100}
+
+    def apsw_namedparams(con):
+        "APSW executemany with dict bindings"
+        cursor=con.cursor()
+        cursor.execute("create table named(id, name, price, qty); begin")
+        cursor.executemany("insert into named values(:id, :name, :price, :qty)", namedparams_rows())
+        cursor.execute("commit")
+
+    def pysqlite_namedparams(con):
+        "pysqlite executemany with dict bindings"
+        cursor=con.cursor()
+        cursor.execute("create table named(id, name, price, qty)")
+        cursor.executemany("insert into named values(:id, :name, :price, :qty)", namedparams_rows())
+        con.commit()
+
+    # Bulk loading.  The data is made before timing in both row
+    # (tuple per row) and column (array per parameter) forms
+    if "bulkload" in options.tests or "bulkload_rows" in options.tests:
+        import array
+        n=options.scale*20000
+        bulkrows=[(i, i*1.5, "row %d" % (i,)) for i in xrange(n)]
+        bulktext=[r[2].encode("utf8") for r in bulkrows]
+        bulkoffsets=array.array("q", [0])
+        for t in bulktext:
+            bulkoffsets.append(bulkoffsets[-1]+len(t))
+        bulkcolumns=(array.array("q", [r[0] for r in bulkrows]),
+                     array.array("d", [r[1] for r in bulkrows]),
+                     (bulkoffsets, "".encode("utf8").join(bulktext)))
+        del bulktext
+
+    def apsw_bulkload(con):
+        "APSW executecolumns from arrays"
+        cursor=con.cursor()
+        cursor.execute("create table bulk(id, price, name); begin")
+        cursor.executecolumns("insert into bulk values(?,?,?)", bulkcolumns)
+        cursor.execute("commit")
+
+    def pysqlite_bulkload(con):
+        "pysqlite executemany of tuples"
+        cursor=con.cursor()
+        cursor.execute("create table bulk(id, price, name)")
+        cursor.executemany("insert into bulk values(?,?,?)", bulkrows)
+        con.commit()
+
+    def apsw_bulkload_rows(con):
+        "APSW executemany of tuples"
+        cursor=con.cursor()
+        cursor.execute("create table bulk(id, price, name); begin")
+        cursor.executemany("insert into bulk values(?,?,?)", bulkrows)
+        cursor.execute("commit")
+
+    def pysqlite_bulkload_rows(con):
+        "pysqlite executemany of tuples"
+        return pysqlite_bulkload(con)
+
     # Do the work
     write("\nRunning tests - elapsed, CPU (results in seconds, lower is better)\n")
 
@@ -419,13 +516,13 @@ def doit():
                     sys.stdout.flush()
                     con=locals().get(driver+"_setup")(options.database)
                     gc.collect(2)
-                    b4cpu=time.clock()
+                    b4cpu=cputime()
                     b4=time.time()
                     func(con)
                     con.close() # see note above as to why we include this in the timing
                     gc.collect(2)
                     after=time.time()
-                    aftercpu=time.clock()
+                    aftercpu=cputime()
                     write("%0.3f %0.3f\n" % (after-b4, aftercpu-b4cpu))
 
     # Cleanup if using valgrind
@@ -495,6 +592,38 @@ statements_nobindings:
   In theory all the tests above should run in almost identical time
   as well as when using the SQLite command line shell.  This tool
   shows you what happens in practise.
+
+namedparams:
+
+  Inserts 20,000 rows per unit of scale using executemany where each
+  row is a dict supplying named parameters.  eg::
+
+    cursor.executemany("insert into named values(:id, :name, :price, :qty)",
+                       ({"id": 1, "name": "row 1", ...}, ...))
+
+bulkload:
+
+  Inserts 20,000 rows per unit of scale of an integer, float and text.
+  APSW uses executecolumns with the values in arrays (one per
+  parameter) while pysqlite uses executemany with a tuple per row.
+  Compare with bulkload_rows which uses executemany for both.
+
+bulkload_rows:
+
+  The same as bulkload but APSW also uses executemany with a tuple per
+  row.
+
+fetchrows:
+
+  Fills a table with 20,000 rows per unit of scale of integers,
+  floats, text and blobs and then reads it all back five times,
+  iterating over the cursor one row at a time.
+
+fetchmany:
+
+  The same as fetchrows but gets the rows using fetchmany(1000).  APSW
+  steps and converts each batch of rows in one native loop, so the
+  difference from fetchrows is the per row overhead.
     \n"""
 
 if __name__=="__main__":